@@ -48,6 +48,17 @@ type StoredAlert struct {
 	Read      bool      `json:"read"`
 }
 
+// StoredPatternRule is a directory, extension or wildcard path rule. Kind
+// is "prefix", "suffix" or "glob"; the highest-priority match wins, and only
+// a priority above 0x8000 overrides a known app's own rule.
+type StoredPatternRule struct {
+	ID       int64  `json:"id"`
+	Kind     string `json:"kind"`
+	Pattern  string `json:"pattern"`
+	Allowed  bool   `json:"allowed"`
+	Priority uint16 `json:"priority"`
+}
+
 type TrafficHistory struct {
 	Timestamp time.Time `json:"timestamp"`
 	Download  uint64    `json:"download"`
@@ -137,6 +148,8 @@ func createTables() error {
 		// Add bytes columns to connection_log if they don't exist
 		`ALTER TABLE connection_log ADD COLUMN bytes_sent INTEGER DEFAULT 0`,
 		`ALTER TABLE connection_log ADD COLUMN bytes_received INTEGER DEFAULT 0`,
+		// Per-app driver rate limit, bytes per second each way
+		`ALTER TABLE known_apps ADD COLUMN rate_limit INTEGER DEFAULT 0`,
 	}
 
 	for _, migration := range migrations {
@@ -193,7 +206,16 @@ func createTables() error {
 		process_path TEXT PRIMARY KEY,
 		process_name TEXT,
 		allowed INTEGER,
-		first_seen DATETIME
+		first_seen DATETIME,
+		rate_limit INTEGER DEFAULT 0
+	);
+
+	CREATE TABLE IF NOT EXISTS pattern_rules (
+		id INTEGER PRIMARY KEY AUTOINCREMENT,
+		kind TEXT,
+		pattern TEXT,
+		allowed INTEGER,
+		priority INTEGER DEFAULT 0
 	);
 
 	CREATE TABLE IF NOT EXISTS connection_log (
@@ -478,6 +500,52 @@ func updateAppUsage(processName, processPath string, bytesSent, bytesReceived ui
 	}
 }
 
+// updateAppUsageBatch adds a set of per-app deltas in one transaction;
+// Connections is added as given rather than counted per call
+func updateAppUsageBatch(usage []AppUsage) {
+	if len(usage) == 0 {
+		return
+	}
+
+	dbMutex.Lock()
+	defer dbMutex.Unlock()
+
+	today := time.Now().Format("2006-01-02")
+
+	tx, err := db.Begin()
+	if err != nil {
+		log.Printf("Error updating app usage: %v", err)
+		return
+	}
+
+	stmt, err := tx.Prepare(`
+		INSERT INTO app_usage (date, process_name, process_path, bytes_sent, bytes_received, connections)
+		VALUES (?, ?, ?, ?, ?, ?)
+		ON CONFLICT(date, process_path) DO UPDATE SET
+			bytes_sent = bytes_sent + excluded.bytes_sent,
+			bytes_received = bytes_received + excluded.bytes_received,
+			connections = connections + excluded.connections
+	`)
+	if err != nil {
+		tx.Rollback()
+		log.Printf("Error updating app usage: %v", err)
+		return
+	}
+	defer stmt.Close()
+
+	for _, app := range usage {
+		if _, err := stmt.Exec(today, app.ProcessName, app.ProcessPath, app.BytesSent, app.BytesReceived, app.Connections); err != nil {
+			tx.Rollback()
+			log.Printf("Error updating app usage: %v", err)
+			return
+		}
+	}
+
+	if err := tx.Commit(); err != nil {
+		log.Printf("Error updating app usage: %v", err)
+	}
+}
+
 func getAppUsage(timeRange string) []AppUsage {
 	dbMutex.RLock()
 	defer dbMutex.RUnlock()
@@ -623,12 +691,84 @@ func addKnownApp(processPath, processName string, allowed bool) {
 		allowedInt = 1
 	}
 
+	// Upsert rather than replace, so the app keeps its rate limit
 	db.Exec(`
-		INSERT OR REPLACE INTO known_apps (process_path, process_name, allowed, first_seen)
+		INSERT INTO known_apps (process_path, process_name, allowed, first_seen)
 		VALUES (?, ?, ?, datetime('now'))
+		ON CONFLICT(process_path) DO UPDATE SET
+			process_name = excluded.process_name,
+			allowed = excluded.allowed,
+			first_seen = excluded.first_seen
 	`, processPath, processName, allowedInt)
 }
 
+// setKnownAppRateLimit stores an app's rate limit in bytes per second, 0
+// for none. The app must already be known.
+func setKnownAppRateLimit(processPath string, bytesPerSecond uint32) bool {
+	dbMutex.Lock()
+	defer dbMutex.Unlock()
+
+	result, err := db.Exec("UPDATE known_apps SET rate_limit = ? WHERE process_path = ?", bytesPerSecond, processPath)
+	if err != nil {
+		return false
+	}
+	rows, _ := result.RowsAffected()
+	return rows > 0
+}
+
+// getKnownAppRateLimits returns the remembered apps that have a rate limit,
+// as processPath -> bytes per second
+func getKnownAppRateLimits() map[string]uint32 {
+	dbMutex.RLock()
+	defer dbMutex.RUnlock()
+
+	limits := make(map[string]uint32)
+	rows, err := db.Query("SELECT process_path, rate_limit FROM known_apps WHERE rate_limit > 0")
+	if err != nil {
+		return limits
+	}
+	defer rows.Close()
+
+	for rows.Next() {
+		var path string
+		var limit int64
+		if err := rows.Scan(&path, &limit); err == nil {
+			limits[path] = uint32(limit)
+		}
+	}
+	return limits
+}
+
+// removeKnownApp forgets an app, so it is treated as new again
+func removeKnownApp(processPath string) {
+	dbMutex.Lock()
+	defer dbMutex.Unlock()
+
+	db.Exec("DELETE FROM known_apps WHERE process_path = ?", processPath)
+}
+
+// getKnownApps returns every remembered app as processPath -> allowed
+func getKnownApps() map[string]bool {
+	dbMutex.RLock()
+	defer dbMutex.RUnlock()
+
+	apps := make(map[string]bool)
+	rows, err := db.Query("SELECT process_path, allowed FROM known_apps")
+	if err != nil {
+		return apps
+	}
+	defer rows.Close()
+
+	for rows.Next() {
+		var path string
+		var allowed int
+		if err := rows.Scan(&path, &allowed); err == nil {
+			apps[path] = allowed == 1
+		}
+	}
+	return apps
+}
+
 func clearKnownApps() bool {
 	dbMutex.Lock()
 	defer dbMutex.Unlock()
@@ -637,6 +777,58 @@ func clearKnownApps() bool {
 	return err == nil
 }
 
+// Pattern rules functions
+func addPatternRule(rule StoredPatternRule) (int64, error) {
+	dbMutex.Lock()
+	defer dbMutex.Unlock()
+
+	allowedInt := 0
+	if rule.Allowed {
+		allowedInt = 1
+	}
+
+	result, err := db.Exec("INSERT INTO pattern_rules (kind, pattern, allowed, priority) VALUES (?, ?, ?, ?)",
+		rule.Kind, rule.Pattern, allowedInt, rule.Priority)
+	if err != nil {
+		return 0, err
+	}
+	return result.LastInsertId()
+}
+
+func removePatternRule(id int64) bool {
+	dbMutex.Lock()
+	defer dbMutex.Unlock()
+
+	result, err := db.Exec("DELETE FROM pattern_rules WHERE id = ?", id)
+	if err != nil {
+		return false
+	}
+	rows, _ := result.RowsAffected()
+	return rows > 0
+}
+
+func getPatternRules() []StoredPatternRule {
+	dbMutex.RLock()
+	defer dbMutex.RUnlock()
+
+	rules := []StoredPatternRule{}
+	rows, err := db.Query("SELECT id, kind, pattern, allowed, priority FROM pattern_rules ORDER BY id")
+	if err != nil {
+		return rules
+	}
+	defer rows.Close()
+
+	for rows.Next() {
+		var r StoredPatternRule
+		var allowed int
+		if err := rows.Scan(&r.ID, &r.Kind, &r.Pattern, &allowed, &r.Priority); err == nil {
+			r.Allowed = allowed == 1
+			rules = append(rules, r)
+		}
+	}
+	return rules
+}
+
 // Connection logging
 func logConnection(conn NetworkConnection) {
 	dbMutex.Lock()
@@ -0,0 +1,656 @@
+//go:build windows
+// +build windows
+
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"log"
+	"path/filepath"
+	"strconv"
+	"sync"
+	"time"
+	"unsafe"
+
+	"golang.org/x/sys/windows"
+)
+
+// Overlapped client for the driver's pending connection, response and rule
+// IOCTLs. A few GET_PENDING requests are kept outstanding on an I/O
+// completion port; the driver completes one as soon as a connection is held
+// for the user, so nothing here polls. Responses and remembered decisions
+// are queued and sent in batches.
+
+var (
+	ioctlGetPending    = ctlCode(0x800, fileReadData)
+	ioctlRespond       = ctlCode(0x801, fileWriteData)
+	ioctlRemoveAllowed = ctlCode(0x803, fileWriteData)
+	ioctlEnable        = ctlCode(0x804, fileWriteData)
+	ioctlSetRules      = ctlCode(0x807, fileWriteData)
+	ioctlSavePolicy    = ctlCode(0x80D, fileWriteData)
+
+	ioctlSetPatternRules = ctlCode(0x80E, fileWriteData)
+)
+
+// GET_PENDING / RESPOND / SET_RULES layouts (packed, see netguard_wfp.c)
+const (
+	pendingRecordVersion = 3
+	pendingQuerySize     = 14 // version, cursor, afterId
+	pendingHeaderSize    = 13 // version, recordCount, totalLength, nextCursor, moreData
+	pendingRecordSize    = 30 // recordLength ... pathLength, hostLength
+	pendingRemoteSize    = 18 // remoteAddress (IPv4-mapped for IPv4), remotePort
+	pendingResponseSize  = 9
+
+	ruleSetVersion    = 2
+	ruleSetHeaderSize = 8
+	ruleSetEntrySize  = 9
+	rulePathMaxChars  = 511
+	rateLimitKeep     = 0xFFFFFFFF // RATE_LIMIT_KEEP: a merge leaves the rule's limit as it is
+	allowedAppSize    = 1026       // ALLOWED_APP: 512 WCHARs, blocked, padding
+
+	enableRequestSize       = 4   // ENABLE_REQUEST: flags
+	enableFlagPermitUnknown = 0x1 // Enforce rules only; let unknown apps through
+
+	pendingRequestCount = 4
+	pendingBufferSize   = 16 * 1024
+
+	// The driver's default pending timeout; entries older than this have
+	// already been given the timeout verdict
+	driverPendingTimeout = 30 * time.Second
+)
+
+// pendingRequest is one outstanding GET_PENDING. The kernel writes to both
+// fields until the request completes, so requests are never freed or reused
+// while posted.
+type pendingRequest struct {
+	overlapped windows.Overlapped // First, so a completion maps back to its request
+	buf        []byte
+	afterID    uint64 // afterId the request was posted with
+}
+
+type driverRule struct {
+	path      string // NT device path
+	blocked   bool
+	rateLimit uint32 // Bytes per second each way, 0 = none, or rateLimitKeep
+}
+
+// driverUpdate is a queued response or rule; the flusher batches them
+type driverUpdate struct {
+	response *PendingConnection
+	allowed  bool
+	rule     *driverRule
+}
+
+type driverClient struct {
+	device   windows.Handle
+	port     windows.Handle
+	requests []*pendingRequest
+	updates  chan driverUpdate
+
+	mu      sync.Mutex
+	pending map[uint64]*PendingConnection
+	lastID  uint64 // Highest connectionId seen, passed back as afterId
+	enabled bool
+	ask     bool // Unknown apps are pended for the user, not permitted
+	synced  bool // enabled and ask match the driver; its boot policy may differ
+}
+
+// driver is the driver client, nil when the driver is not loaded
+var driver *driverClient
+
+// openDriverClient opens the driver for overlapped I/O and starts the
+// completion and flush goroutines
+func openDriverClient() (*driverClient, error) {
+	path, err := windows.UTF16PtrFromString(driverDevicePath)
+	if err != nil {
+		return nil, err
+	}
+
+	device, err := windows.CreateFile(path, windows.GENERIC_READ|windows.GENERIC_WRITE, 0, nil,
+		windows.OPEN_EXISTING, windows.FILE_ATTRIBUTE_NORMAL|windows.FILE_FLAG_OVERLAPPED, 0)
+	if err != nil {
+		return nil, fmt.Errorf("open driver: %w", err)
+	}
+
+	port, err := windows.CreateIoCompletionPort(device, 0, 0, 1)
+	if err != nil {
+		windows.CloseHandle(device)
+		return nil, fmt.Errorf("create completion port: %w", err)
+	}
+
+	c := &driverClient{
+		device:  device,
+		port:    port,
+		updates: make(chan driverUpdate, 256),
+		pending: make(map[uint64]*PendingConnection),
+	}
+	for i := 0; i < pendingRequestCount; i++ {
+		c.requests = append(c.requests, &pendingRequest{buf: make([]byte, pendingBufferSize)})
+	}
+
+	go c.run()
+	go c.flush()
+
+	for _, req := range c.requests {
+		if err := c.post(req); err != nil {
+			log.Printf("Driver GET_PENDING failed: %v", err)
+		}
+	}
+	return c, nil
+}
+
+// pendingQuery builds a PENDING_QUERY
+func pendingQuery(cursor uint32, afterID uint64) []byte {
+	query := make([]byte, pendingQuerySize)
+	binary.LittleEndian.PutUint16(query[0:], pendingRecordVersion)
+	binary.LittleEndian.PutUint32(query[2:], cursor)
+	binary.LittleEndian.PutUint64(query[6:], afterID)
+	return query
+}
+
+// post issues a GET_PENDING on the completion port. It only reports (and
+// only waits for) connections newer than any seen so far.
+func (c *driverClient) post(req *pendingRequest) error {
+	c.mu.Lock()
+	req.afterID = c.lastID
+	c.mu.Unlock()
+
+	query := pendingQuery(0, req.afterID)
+	req.overlapped = windows.Overlapped{}
+	err := windows.DeviceIoControl(c.device, ioctlGetPending, &query[0], uint32(len(query)),
+		&req.buf[0], uint32(len(req.buf)), nil, &req.overlapped)
+	if err != nil && err != windows.ERROR_IO_PENDING {
+		return err
+	}
+	return nil
+}
+
+// run handles GET_PENDING completions and re-posts each request
+func (c *driverClient) run() {
+	for {
+		var n uint32
+		var key uintptr
+		var ov *windows.Overlapped
+
+		err := windows.GetQueuedCompletionStatus(c.port, &n, &key, &ov, windows.INFINITE)
+		if ov == nil {
+			log.Printf("Driver completion port closed: %v", err)
+			return
+		}
+
+		req := (*pendingRequest)(unsafe.Pointer(ov))
+		if err != nil {
+			// Cancelled or failed; don't spin if the driver keeps failing
+			log.Printf("Driver GET_PENDING completed with error: %v", err)
+			time.Sleep(time.Second)
+		} else {
+			c.handleBatch(req.buf[:n], req.afterID)
+		}
+
+		if err := c.post(req); err != nil {
+			log.Printf("Driver GET_PENDING failed: %v", err)
+		}
+	}
+}
+
+// handleBatch records the connections in one GET_PENDING batch, reading the
+// rest of it when the driver says there is more. The rest is read with the
+// same afterId, as records are not in connectionId order.
+func (c *driverClient) handleBatch(buf []byte, afterID uint64) {
+	for {
+		cursor, more, err := c.parseBatch(buf)
+		if err != nil {
+			log.Printf("Driver pending batch: %v", err)
+			return
+		}
+		if !more {
+			return
+		}
+
+		query := pendingQuery(cursor, afterID)
+		out := make([]byte, pendingBufferSize)
+		n, err := c.ioctl(ioctlGetPending, query, out)
+		if err != nil {
+			log.Printf("Driver GET_PENDING failed: %v", err)
+			return
+		}
+		buf = out[:n]
+	}
+}
+
+// parseBatch decodes a PENDING_BATCH_HEADER and its records
+func (c *driverClient) parseBatch(buf []byte) (nextCursor uint32, moreData bool, err error) {
+	if len(buf) < pendingHeaderSize || binary.LittleEndian.Uint16(buf[0:]) != pendingRecordVersion {
+		return 0, false, errors.New("unsupported pending record version")
+	}
+
+	count := int(binary.LittleEndian.Uint16(buf[2:]))
+	total := int(binary.LittleEndian.Uint32(buf[4:]))
+	nextCursor = binary.LittleEndian.Uint32(buf[8:])
+	moreData = buf[12] != 0
+	if total > len(buf) {
+		return 0, false, errors.New("truncated pending batch")
+	}
+
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	offset := pendingHeaderSize
+	for i := 0; i < count && offset+pendingRecordSize <= total; i++ {
+		rec := buf[offset:]
+		recordLength := int(binary.LittleEndian.Uint16(rec[0:]))
+		id := binary.LittleEndian.Uint64(rec[2:])
+		pid := binary.LittleEndian.Uint32(rec[10:])
+		timestamp := int64(binary.LittleEndian.Uint64(rec[14:]))
+		connections := binary.LittleEndian.Uint32(rec[22:])
+		endpoints := int(rec[26])
+		pathLength := int(binary.LittleEndian.Uint16(rec[27:]))
+		hostLength := int(rec[29])
+
+		if recordLength < pendingRecordSize+endpoints*pendingRemoteSize+pathLength*2+hostLength ||
+			offset+recordLength > total {
+			return 0, false, errors.New("malformed pending record")
+		}
+
+		remoteAddress, remotePort := "", 0
+		if endpoints > 0 {
+			remote := rec[pendingRecordSize:]
+			remoteAddress = driverAddressToString(remote[0:16])
+			remotePort = int(binary.LittleEndian.Uint16(remote[16:]))
+		}
+
+		pathStart := pendingRecordSize + endpoints*pendingRemoteSize
+		path := make([]uint16, pathLength)
+		for j := range path {
+			path[j] = binary.LittleEndian.Uint16(rec[pathStart+j*2:])
+		}
+		ntPath := windows.UTF16ToString(path)
+		dosPath := ntPathToDosPath(ntPath)
+
+		// The name the app looked up, from the driver's DNS cache
+		hostStart := pathStart + pathLength*2
+		remoteHost := string(rec[hostStart : hostStart+hostLength])
+
+		c.pending[id] = &PendingConnection{
+			ID:              strconv.FormatUint(id, 10),
+			ProcessName:     filepath.Base(dosPath),
+			ProcessPath:     dosPath,
+			ProcessID:       int(pid),
+			RemoteAddress:   remoteAddress,
+			RemotePort:      remotePort,
+			RemoteHost:      remoteHost,
+			ConnectionCount: int(connections),
+			Timestamp:       fileTimeToTime(timestamp),
+			driverID:        id,
+			ntPath:          ntPath,
+		}
+		if id > c.lastID {
+			c.lastID = id
+		}
+
+		offset += recordLength
+	}
+
+	return nextCursor, moreData, nil
+}
+
+// fileTimeToTime converts a KeQuerySystemTime value
+func fileTimeToTime(t int64) time.Time {
+	ft := windows.Filetime{LowDateTime: uint32(t), HighDateTime: uint32(t >> 32)}
+	return time.Unix(0, ft.Nanoseconds())
+}
+
+// ioctl sends one request and waits for it. The low bit on the event keeps
+// the completion off the port, which only carries GET_PENDING. The
+// OVERLAPPED is on the heap: the kernel writes to it on completion, and a
+// goroutine's stack can move while the request is in flight.
+func (c *driverClient) ioctl(code uint32, in, out []byte) (uint32, error) {
+	event, err := windows.CreateEvent(nil, 1, 0, nil)
+	if err != nil {
+		return 0, err
+	}
+	defer windows.CloseHandle(event)
+
+	var inPtr, outPtr *byte
+	if len(in) > 0 {
+		inPtr = &in[0]
+	}
+	if len(out) > 0 {
+		outPtr = &out[0]
+	}
+
+	ov := new(windows.Overlapped)
+	ov.HEvent = event | 1
+	var n uint32
+	err = windows.DeviceIoControl(c.device, code, inPtr, uint32(len(in)), outPtr, uint32(len(out)), &n, ov)
+	if err == windows.ERROR_IO_PENDING {
+		err = windows.GetOverlappedResult(c.device, ov, &n, true)
+	}
+	return n, err
+}
+
+// flush sends queued updates, everything queued so far in one go: the
+// remembered rules in one SET_RULES merge, then the verdicts in one RESPOND
+func (c *driverClient) flush() {
+	for update := range c.updates {
+		batch := []driverUpdate{update}
+		for more := true; more; {
+			select {
+			case update := <-c.updates:
+				batch = append(batch, update)
+			default:
+				more = false
+			}
+		}
+
+		var rules []driverRule
+		var responses []byte
+		for _, update := range batch {
+			if update.rule != nil {
+				rules = append(rules, *update.rule)
+			}
+			if update.response != nil {
+				entry := make([]byte, pendingResponseSize)
+				binary.LittleEndian.PutUint64(entry, update.response.driverID)
+				if update.allowed {
+					entry[8] = 1
+				}
+				responses = append(responses, entry...)
+			}
+		}
+
+		if len(rules) > 0 {
+			if err := c.setRules(rules, false); err != nil {
+				log.Printf("Driver SET_RULES failed: %v", err)
+			} else {
+				c.savePolicy()
+			}
+		}
+		if len(responses) > 0 {
+			if _, err := c.ioctl(ioctlRespond, responses, nil); err != nil {
+				log.Printf("Driver RESPOND failed: %v", err)
+			}
+		}
+	}
+}
+
+// setRules sends rules in one SET_RULES request, replacing the driver's
+// rules when replace is set. The driver applies a request in one swap, so a
+// replace never leaves it with only part of the set.
+func (c *driverClient) setRules(rules []driverRule, replace bool) error {
+	buf := make([]byte, ruleSetHeaderSize)
+	binary.LittleEndian.PutUint16(buf[0:], ruleSetVersion)
+	if replace {
+		binary.LittleEndian.PutUint16(buf[2:], 1) // RULE_SET_FLAG_REPLACE
+	}
+
+	count := 0
+	for _, rule := range rules {
+		path, err := windows.UTF16FromString(rule.path)
+		if err != nil {
+			continue
+		}
+		path = path[:len(path)-1]
+		if len(path) == 0 || len(path) > rulePathMaxChars {
+			continue
+		}
+
+		entry := make([]byte, ruleSetEntrySize+len(path)*2)
+		binary.LittleEndian.PutUint16(entry[0:], uint16(len(entry)))
+		if rule.blocked {
+			entry[2] = 1
+		}
+		binary.LittleEndian.PutUint16(entry[3:], uint16(len(path)))
+		binary.LittleEndian.PutUint32(entry[5:], rule.rateLimit)
+		for i, ch := range path {
+			binary.LittleEndian.PutUint16(entry[ruleSetEntrySize+i*2:], ch)
+		}
+		buf = append(buf, entry...)
+		count++
+	}
+	binary.LittleEndian.PutUint32(buf[4:], uint32(count))
+
+	_, err := c.ioctl(ioctlSetRules, buf, nil)
+	return err
+}
+
+// setAppRule allows or blocks an app in the driver's rule table, keeping
+// any rate limit it already has. processPath is a drive letter path; false
+// means the driver can't take it.
+func (c *driverClient) setAppRule(processPath string, blocked bool) (bool, error) {
+	ntPath, ok := dosPathToNtPath(processPath)
+	if !ok {
+		return false, nil
+	}
+	rule := driverRule{path: ntPath, blocked: blocked, rateLimit: rateLimitKeep}
+	return true, c.setRules([]driverRule{rule}, false)
+}
+
+// setAppRateLimit sets an app's rule along with a limit on its throughput in
+// bytes per second, applied to sends and receives separately. Zero removes
+// the limit.
+func (c *driverClient) setAppRateLimit(processPath string, blocked bool, bytesPerSecond uint32) (bool, error) {
+	ntPath, ok := dosPathToNtPath(processPath)
+	if !ok {
+		return false, nil
+	}
+	rule := driverRule{path: ntPath, blocked: blocked, rateLimit: bytesPerSecond}
+	return true, c.setRules([]driverRule{rule}, false)
+}
+
+// removeAppRule drops an app's rule from the driver, so its next connect is
+// treated as unknown. A path the driver has no rule for is not an error.
+func (c *driverClient) removeAppRule(processPath string) (bool, error) {
+	ntPath, ok := dosPathToNtPath(processPath)
+	if !ok {
+		return false, nil
+	}
+	path, err := windows.UTF16FromString(ntPath)
+	if err != nil || len(path) > rulePathMaxChars+1 {
+		return false, nil
+	}
+
+	buf := make([]byte, allowedAppSize)
+	for i, ch := range path {
+		binary.LittleEndian.PutUint16(buf[i*2:], ch)
+	}
+	if _, err := c.ioctl(ioctlRemoveAllowed, buf, nil); err != nil && err != windows.ERROR_NOT_FOUND {
+		return true, err
+	}
+	return true, nil
+}
+
+// enforcing reports whether the driver's rules are in force, which they are
+// once setMode has succeeded
+func (c *driverClient) enforcing() bool {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.enabled
+}
+
+// syncKnownApps replaces the driver's rules with the remembered apps and
+// their rate limits. The driver starts from the policy saved last time,
+// which may be out of date, so this runs on every connect.
+func (c *driverClient) syncKnownApps() error {
+	var rules []driverRule
+	limits := getKnownAppRateLimits()
+	for path, allowed := range getKnownApps() {
+		if ntPath, ok := dosPathToNtPath(path); ok {
+			rules = append(rules, driverRule{path: ntPath, blocked: !allowed, rateLimit: limits[path]})
+		}
+	}
+	if err := c.setRules(rules, true); err != nil {
+		return err
+	}
+	c.savePolicy()
+	return nil
+}
+
+// syncPatternRules replaces the driver's prefix, suffix and wildcard path
+// rules with the stored ones, compiled into one matcher. Like
+// syncKnownApps it runs on every connect, and again after each change.
+func (c *driverClient) syncPatternRules() error {
+	var patterns []pathPattern
+	for _, rule := range getPatternRules() {
+		p, ok := patternToNtPath(rule)
+		if !ok {
+			log.Printf("Skipping pattern rule %d: %s is not on a lettered drive", rule.ID, rule.Pattern)
+			continue
+		}
+		patterns = append(patterns, p)
+	}
+
+	buf, err := compilePatternRules(patterns)
+	if err != nil {
+		return err
+	}
+	if _, err := c.ioctl(ioctlSetPatternRules, buf, nil); err != nil {
+		return err
+	}
+	c.savePolicy()
+	return nil
+}
+
+// patternToNtPath converts a stored pattern rule to the NT device path form
+// the driver matches. Prefix rules and globs that start with a drive letter
+// name that drive; suffix rules and other globs match any path as written.
+func patternToNtPath(rule StoredPatternRule) (pathPattern, bool) {
+	p := pathPattern{
+		kind:     patternKinds[rule.Kind],
+		pattern:  rule.Pattern,
+		blocked:  !rule.Allowed,
+		priority: rule.Priority,
+	}
+	if p.kind == patternPrefix || (p.kind == patternGlob && len(p.pattern) >= 2 && p.pattern[1] == ':') {
+		ntPath, ok := dosPathToNtPath(p.pattern)
+		if !ok {
+			return p, false
+		}
+		p.pattern = ntPath
+	}
+	return p, true
+}
+
+// savePolicy has the driver store its current rules and settings, so it
+// enforces them from boot without waiting for this service
+func (c *driverClient) savePolicy() {
+	if _, err := c.ioctl(ioctlSavePolicy, nil, nil); err != nil {
+		log.Printf("Driver SAVE_POLICY failed: %v", err)
+	}
+}
+
+// setMode turns driver filtering on, pending unknown apps for the user when
+// ask is set and permitting them otherwise. Known apps are enforced either
+// way. Permitting unknown apps releases every pended connection, so the list
+// is dropped too. The first call always reaches the driver, whose boot
+// policy may have left it in another mode.
+func (c *driverClient) setMode(ask bool) error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if c.synced && c.enabled && ask == c.ask {
+		return nil
+	}
+
+	in := make([]byte, enableRequestSize)
+	if !ask {
+		binary.LittleEndian.PutUint32(in, enableFlagPermitUnknown)
+	}
+	if _, err := c.ioctl(ioctlEnable, in, nil); err != nil {
+		return err
+	}
+
+	c.enabled = true
+	c.ask = ask
+	c.synced = true
+	if !ask {
+		c.pending = make(map[uint64]*PendingConnection)
+	}
+	c.savePolicy()
+	return nil
+}
+
+// pendingConnections lists the connections the driver is holding, dropping
+// the ones it has already timed out
+func (c *driverClient) pendingConnections() []*PendingConnection {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	result := make([]*PendingConnection, 0, len(c.pending))
+	for id, conn := range c.pending {
+		if time.Since(conn.Timestamp) > driverPendingTimeout {
+			delete(c.pending, id)
+			continue
+		}
+		result = append(result, conn)
+	}
+	return result
+}
+
+// respond queues the user's verdict for a held connection. With remember
+// the verdict also becomes a driver rule for the app.
+func (c *driverClient) respond(id string, allowed bool, remember bool) (*PendingConnection, error) {
+	driverID, err := strconv.ParseUint(id, 10, 64)
+	if err != nil {
+		return nil, fmt.Errorf("pending connection not found: %s", id)
+	}
+
+	c.mu.Lock()
+	conn, exists := c.pending[driverID]
+	if exists {
+		delete(c.pending, driverID)
+	}
+	c.mu.Unlock()
+
+	if !exists {
+		return nil, fmt.Errorf("pending connection not found: %s", id)
+	}
+
+	if remember {
+		c.updates <- driverUpdate{rule: &driverRule{path: conn.ntPath, blocked: !allowed, rateLimit: rateLimitKeep}}
+	}
+	c.updates <- driverUpdate{response: conn, allowed: allowed}
+	return conn, nil
+}
+
+// startDriverClient connects to the driver if it is loaded and applies the
+// Ask to Connect setting
+func startDriverClient() {
+	c, err := openDriverClient()
+	if err != nil {
+		log.Printf("Driver client unavailable (%v), using firewall rules only", err)
+		return
+	}
+
+	driver = c
+	log.Println("Connected to the NetGuard driver")
+	if err := c.syncKnownApps(); err != nil {
+		log.Printf("Failed to load known apps into the driver: %v", err)
+	}
+	if err := c.syncPatternRules(); err != nil {
+		log.Printf("Failed to load pattern rules into the driver: %v", err)
+	}
+	syncDriverMode()
+	if !c.enforcing() {
+		// The firewall keeps enforcing blocks, as it does without a driver
+		syncFirewallBlocks(false)
+	}
+}
+
+// syncDriverMode has the driver enforce known apps whenever it is loaded,
+// asking about unknown ones while Ask to Connect is on. Blocks move between
+// the driver and firewall rules only when that enforcement starts or stops.
+func syncDriverMode() {
+	if driver == nil {
+		return
+	}
+	wasEnforcing := driver.enforcing()
+	if err := driver.setMode(getSettings().AskToConnect); err != nil {
+		log.Printf("Failed to update driver filtering: %v", err)
+	}
+	if enforcing := driver.enforcing(); enforcing != wasEnforcing {
+		syncFirewallBlocks(enforcing)
+	}
+}
@@ -0,0 +1,686 @@
+//go:build windows
+// +build windows
+
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"log"
+	"net"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"golang.org/x/sys/windows"
+)
+
+// Client side of the NetGuard WFP driver (driver/netguard_wfp.c). The layouts
+// below must match the structures declared there.
+
+const (
+	driverDevicePath = `\\.\NetGuardWFP`
+
+	fileDeviceUnknown = 0x22
+	methodBuffered    = 0
+	fileReadData      = 1
+	fileWriteData     = 2
+)
+
+func ctlCode(function, access uint32) uint32 {
+	return fileDeviceUnknown<<16 | access<<14 | function<<2 | methodBuffered
+}
+
+var (
+	ioctlMapEvents      = ctlCode(0x809, fileReadData)
+	ioctlGetTraffic     = ctlCode(0x80A, fileReadData)
+	ioctlSetEventFilter = ctlCode(0x80F, fileReadData)
+)
+
+// Event ring layout (EVENT_SECTION_HEADER / EVENT_RING / NETGUARD_EVENT)
+const (
+	eventSectionVersion = 7
+	eventFilterVersion  = 1
+	eventFilterRanges   = 8 // EVENT_FILTER_MAX_PORT_RANGES
+
+	eventTypeConnect = 1
+	eventTypeClose   = 2
+	eventTypeBlock   = 3
+	eventTypeListen  = 4
+	eventTypeAccept  = 5
+
+	ringHeadOffset    = 0
+	ringDroppedOffset = 4
+	ringTailOffset    = 64
+	ringRecordsOffset = 128
+)
+
+type eventSectionHeader struct {
+	Version         uint32
+	RingCount       uint32
+	RingCapacity    uint32
+	RecordSize      uint32
+	RingOffset      uint32
+	RingStride      uint32
+	ConsumerWaiting int32
+}
+
+type driverEvent struct {
+	Type      uint8
+	Protocol  uint8
+	Direction uint8
+	Verdict   uint8 // Accept: flowVerdict*
+	ProcessID uint32
+	FlowID    uint64
+	Timestamp int64
+	// Network byte order, IPv4 as IPv4-mapped IPv6; the ports are host order
+	LocalAddress  [16]byte
+	RemoteAddress [16]byte
+	LocalPort     uint16
+	RemotePort    uint16
+	Suppressed    uint32 // Block: identical blocks since the last record
+	// Flow totals, set on close only
+	BytesSent     uint64
+	BytesReceived uint64
+	PathHash      uint64    // Driver's hash of the process path, 0 if unknown
+	HostName      [104]byte // NUL-terminated DNS name of RemoteAddress, if the driver saw it resolved
+}
+
+type eventMapRequest struct {
+	EventHandle uint64
+}
+
+type eventMapResult struct {
+	BaseAddress uint64
+	Length      uint32
+	_           uint32
+}
+
+// FLOW_VERDICT_* in an accept event
+const (
+	flowVerdictUnknown = 0 // Pended for the user
+	flowVerdictAllow   = 1
+	flowVerdictBlock   = 2
+)
+
+// eventPortRange is EVENT_PORT_RANGE, inclusive
+type eventPortRange struct {
+	low, high uint16
+}
+
+// eventFilter builds a SET_EVENT_FILTER input: a type mask and port ranges,
+// no paths
+func eventFilter(typeMask uint16, ranges []eventPortRange) []byte {
+	buf := make([]byte, 8+len(ranges)*4)
+	binary.LittleEndian.PutUint16(buf[0:], eventFilterVersion)
+	binary.LittleEndian.PutUint16(buf[2:], typeMask)
+	binary.LittleEndian.PutUint16(buf[4:], uint16(len(ranges)))
+	for i, r := range ranges {
+		binary.LittleEndian.PutUint16(buf[8+i*4:], r.low)
+		binary.LittleEndian.PutUint16(buf[10+i*4:], r.high)
+	}
+	return buf
+}
+
+// driverEventReader consumes the per-CPU connection event rings the driver
+// maps into this process. Reading events costs no syscalls; the reader only
+// blocks on its event object when every ring is empty.
+type driverEventReader struct {
+	device      windows.Handle
+	event       windows.Handle
+	base        uintptr
+	header      *eventSectionHeader
+	lastDropped []uint32
+}
+
+// openDriverEvents opens the driver, maps its event rings and subscribes
+// them to filter
+func openDriverEvents(filter []byte) (*driverEventReader, error) {
+	path, err := windows.UTF16PtrFromString(driverDevicePath)
+	if err != nil {
+		return nil, err
+	}
+
+	device, err := windows.CreateFile(path, windows.GENERIC_READ|windows.GENERIC_WRITE, 0, nil,
+		windows.OPEN_EXISTING, windows.FILE_ATTRIBUTE_NORMAL, 0)
+	if err != nil {
+		return nil, fmt.Errorf("open driver: %w", err)
+	}
+
+	event, err := windows.CreateEvent(nil, 0, 0, nil)
+	if err != nil {
+		windows.CloseHandle(device)
+		return nil, err
+	}
+
+	req := eventMapRequest{EventHandle: uint64(event)}
+	var res eventMapResult
+	var returned uint32
+	err = windows.DeviceIoControl(device, ioctlMapEvents,
+		(*byte)(unsafe.Pointer(&req)), uint32(unsafe.Sizeof(req)),
+		(*byte)(unsafe.Pointer(&res)), uint32(unsafe.Sizeof(res)), &returned, nil)
+	if err != nil {
+		windows.CloseHandle(event)
+		windows.CloseHandle(device)
+		return nil, fmt.Errorf("map event rings: %w", err)
+	}
+
+	r := &driverEventReader{
+		device: device,
+		event:  event,
+		base:   uintptr(res.BaseAddress),
+		header: (*eventSectionHeader)(unsafe.Pointer(uintptr(res.BaseAddress))),
+	}
+
+	if r.header.Version != eventSectionVersion ||
+		r.header.RecordSize != uint32(unsafe.Sizeof(driverEvent{})) {
+		r.close()
+		return nil, errors.New("unsupported event ring version")
+	}
+
+	err = windows.DeviceIoControl(device, ioctlSetEventFilter,
+		&filter[0], uint32(len(filter)), nil, 0, &returned, nil)
+	if err != nil {
+		r.close()
+		return nil, fmt.Errorf("set event filter: %w", err)
+	}
+
+	r.lastDropped = make([]uint32, r.header.RingCount)
+	return r, nil
+}
+
+// close unmaps the rings (the driver does so when the handle goes away)
+func (r *driverEventReader) close() {
+	windows.CloseHandle(r.device)
+	windows.CloseHandle(r.event)
+}
+
+func (r *driverEventReader) ring(i uint32) uintptr {
+	return r.base + uintptr(r.header.RingOffset) + uintptr(i)*uintptr(r.header.RingStride)
+}
+
+func ringWord(ring uintptr, offset uintptr) *int32 {
+	return (*int32)(unsafe.Pointer(ring + offset))
+}
+
+// drain hands every queued event to handle and returns how many there were
+func (r *driverEventReader) drain(handle func(*driverEvent)) int {
+	count := 0
+	mask := r.header.RingCapacity - 1
+
+	for i := uint32(0); i < r.header.RingCount; i++ {
+		ring := r.ring(i)
+		head := atomic.LoadInt32(ringWord(ring, ringHeadOffset))
+		tail := atomic.LoadInt32(ringWord(ring, ringTailOffset))
+
+		for ; tail != head; tail++ {
+			record := (*driverEvent)(unsafe.Pointer(ring + ringRecordsOffset +
+				uintptr(uint32(tail)&mask)*unsafe.Sizeof(driverEvent{})))
+			ev := *record
+			handle(&ev)
+			count++
+		}
+		atomic.StoreInt32(ringWord(ring, ringTailOffset), tail)
+
+		dropped := uint32(atomic.LoadInt32(ringWord(ring, ringDroppedOffset)))
+		if dropped != r.lastDropped[i] {
+			log.Printf("Driver event ring %d dropped %d events", i, dropped-r.lastDropped[i])
+			r.lastDropped[i] = dropped
+		}
+	}
+
+	return count
+}
+
+// run consumes events forever
+func (r *driverEventReader) run(handle func(*driverEvent)) {
+	for {
+		if r.drain(handle) > 0 {
+			continue
+		}
+
+		// Ask to be woken, then look once more so an event published
+		// before the flag was set is not left waiting for the timeout
+		atomic.StoreInt32(&r.header.ConsumerWaiting, 1)
+		if r.drain(handle) > 0 {
+			atomic.StoreInt32(&r.header.ConsumerWaiting, 0)
+			continue
+		}
+		windows.WaitForSingleObject(r.event, 1000)
+	}
+}
+
+// connectionTracker maintains the connection list from driver events,
+// replacing the once-a-second TCP table poll
+type connectionTracker struct {
+	mu     sync.Mutex
+	flows  map[uint64]NetworkConnection
+	closed []NetworkConnection // Closed since the last snapshot
+
+	// Connect and close of one flow can sit in different CPU rings, so a
+	// close may be read first. Such closes are remembered for two snapshots.
+	earlyClose     map[uint64]struct{}
+	earlyClosePrev map[uint64]struct{}
+
+	reader *driverEventReader
+}
+
+func newConnectionTracker() *connectionTracker {
+	return &connectionTracker{
+		flows:          make(map[uint64]NetworkConnection),
+		earlyClose:     make(map[uint64]struct{}),
+		earlyClosePrev: make(map[uint64]struct{}),
+	}
+}
+
+// driverAddressToString formats a driver address: 16 bytes, IPv4 in its
+// IPv4-mapped form, which prints as plain dotted IPv4
+func driverAddressToString(address []byte) string {
+	return net.IP(address).String()
+}
+
+func protocolToString(protocol uint8) string {
+	switch protocol {
+	case 6:
+		return "TCP"
+	case 17:
+		return "UDP"
+	default:
+		return fmt.Sprintf("IP%d", protocol)
+	}
+}
+
+// handle applies one driver event
+func (t *connectionTracker) handle(ev *driverEvent) {
+	switch ev.Type {
+	case eventTypeConnect:
+		localAddr := driverAddressToString(ev.LocalAddress[:])
+		remoteAddr := driverAddressToString(ev.RemoteAddress[:])
+
+		// Skip loopback connections (127.0.0.0/8 and ::1)
+		if net.IP(ev.LocalAddress[:]).IsLoopback() && net.IP(ev.RemoteAddress[:]).IsLoopback() {
+			return
+		}
+
+		name, path := getProcessName(ev.ProcessID)
+		conn := NetworkConnection{
+			ID:            fmt.Sprintf("%s:%d-%s:%d", localAddr, ev.LocalPort, remoteAddr, ev.RemotePort),
+			ProcessName:   name,
+			ProcessPath:   path,
+			ProcessID:     int(ev.ProcessID),
+			LocalAddress:  localAddr,
+			LocalPort:     int(ev.LocalPort),
+			RemoteAddress: remoteAddr,
+			RemotePort:    int(ev.RemotePort),
+			RemoteHost:    windows.ByteSliceToString(ev.HostName[:]),
+			Protocol:      protocolToString(ev.Protocol),
+			State:         "Established",
+		}
+
+		t.mu.Lock()
+		if t.takeEarlyClose(ev.FlowID) {
+			conn.State = "Closed"
+			t.closed = append(t.closed, conn)
+		} else {
+			t.flows[ev.FlowID] = conn
+		}
+		t.mu.Unlock()
+
+	case eventTypeClose:
+		t.mu.Lock()
+		if conn, ok := t.flows[ev.FlowID]; ok {
+			delete(t.flows, ev.FlowID)
+			conn.State = "Closed"
+			conn.BytesSent = ev.BytesSent
+			conn.BytesReceived = ev.BytesReceived
+			t.closed = append(t.closed, conn)
+		} else {
+			t.earlyClose[ev.FlowID] = struct{}{}
+		}
+		t.mu.Unlock()
+	}
+}
+
+// takeEarlyClose reports (and forgets) a close read before its connect.
+// Caller holds t.mu.
+func (t *connectionTracker) takeEarlyClose(flowID uint64) bool {
+	if _, ok := t.earlyClose[flowID]; ok {
+		delete(t.earlyClose, flowID)
+		return true
+	}
+	if _, ok := t.earlyClosePrev[flowID]; ok {
+		delete(t.earlyClosePrev, flowID)
+		return true
+	}
+	return false
+}
+
+// snapshot returns the current connections, plus once each the connections
+// that closed since the previous snapshot so short-lived ones are not missed
+func (t *connectionTracker) snapshot() []NetworkConnection {
+	t.mu.Lock()
+	conns := make([]NetworkConnection, 0, len(t.flows)+len(t.closed))
+	for _, conn := range t.flows {
+		conns = append(conns, conn)
+	}
+	open := len(conns)
+	conns = append(conns, t.closed...)
+	t.closed = t.closed[:0]
+	t.earlyClosePrev, t.earlyClose = t.earlyClose, make(map[uint64]struct{})
+	t.mu.Unlock()
+
+	// Closed flows carry their byte counts from the driver
+	for i := range conns {
+		if i < open {
+			conns[i].BytesReceived, conns[i].BytesSent = getProcessIO(uint32(conns[i].ProcessID))
+		}
+		enrichConnection(&conns[i])
+	}
+	return conns
+}
+
+// startConnectionEvents switches connection monitoring to driver events.
+// Returns nil when the driver is not available.
+func startConnectionEvents() *connectionTracker {
+	// The tracker only follows flows; other events stay out of its rings
+	reader, err := openDriverEvents(eventFilter(1<<eventTypeConnect|1<<eventTypeClose, nil))
+	if err != nil {
+		log.Printf("Driver connection events unavailable (%v), polling the TCP table", err)
+		return nil
+	}
+
+	tracker := newConnectionTracker()
+	tracker.reader = reader
+	go reader.run(tracker.handle)
+	log.Println("Using driver connection events")
+	return tracker
+}
+
+const (
+	rdpPort = 3389
+
+	// Repeats of one listener or accept alert are held back this long, so
+	// a busy service doesn't flood the alerts
+	listenerAlertInterval = time.Minute
+)
+
+// listenerWatcher raises alerts from the driver's LISTEN and ACCEPT events
+// on the watched ports: the moment a process starts listening on one, or an
+// inbound connection reaches it. It replaces polling the RDP sessions.
+type listenerWatcher struct {
+	watched map[uint16]bool
+
+	mu        sync.Mutex
+	lastAlert map[string]time.Time
+}
+
+// watchedPortRanges covers ports with at most max ranges for the event
+// filter, merging the closest ports first. The ranges may take in ports
+// that are not watched.
+func watchedPortRanges(ports []int, max int) []eventPortRange {
+	sorted := append([]int(nil), ports...)
+	sort.Ints(sorted)
+
+	var ranges []eventPortRange
+	for _, port := range sorted {
+		if n := len(ranges); n > 0 && int(ranges[n-1].high)+1 >= port {
+			ranges[n-1].high = uint16(port) // Adjacent or repeated
+			continue
+		}
+		ranges = append(ranges, eventPortRange{uint16(port), uint16(port)})
+	}
+	for len(ranges) > max {
+		best := 0
+		for i := 1; i < len(ranges)-1; i++ {
+			if ranges[i+1].low-ranges[i].high < ranges[best+1].low-ranges[best].high {
+				best = i
+			}
+		}
+		ranges[best].high = ranges[best+1].high
+		ranges = append(ranges[:best+1], ranges[best+2:]...)
+	}
+	return ranges
+}
+
+// shouldAlert reports whether an alert for key is due, and if so marks it
+// sent
+func (w *listenerWatcher) shouldAlert(key string) bool {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	now := time.Now()
+	if last, ok := w.lastAlert[key]; ok && now.Sub(last) < listenerAlertInterval {
+		return false
+	}
+	for k, last := range w.lastAlert {
+		if now.Sub(last) >= listenerAlertInterval {
+			delete(w.lastAlert, k)
+		}
+	}
+	w.lastAlert[key] = now
+	return true
+}
+
+// handle turns one driver event into an alert
+func (w *listenerWatcher) handle(ev *driverEvent) {
+	// An accept can pass the filter on its remote port instead
+	if !w.watched[ev.LocalPort] {
+		return
+	}
+
+	name, path := getProcessName(ev.ProcessID)
+	port := int(ev.LocalPort)
+	service := getServiceName(port)
+	data := map[string]interface{}{
+		"processName":  name,
+		"processPath":  path,
+		"processId":    ev.ProcessID,
+		"localAddress": driverAddressToString(ev.LocalAddress[:]),
+		"localPort":    port,
+		"service":      service,
+	}
+
+	var alert Alert
+	switch ev.Type {
+	case eventTypeListen:
+		if !w.shouldAlert(fmt.Sprintf("listen|%s|%d", path, port)) {
+			return
+		}
+		alert = Alert{
+			Type:    "listener",
+			Title:   "New Listening Service",
+			Message: fmt.Sprintf("%s is listening for %s connections on port %d", name, service, port),
+		}
+
+	case eventTypeAccept:
+		remoteAddr := driverAddressToString(ev.RemoteAddress[:])
+		if !w.shouldAlert(fmt.Sprintf("accept|%d|%s", port, remoteAddr)) {
+			return
+		}
+
+		verdict := "allowed"
+		switch ev.Verdict {
+		case flowVerdictBlock:
+			verdict = "blocked"
+		case flowVerdictUnknown:
+			verdict = "waiting for approval"
+		}
+		data["remoteAddress"] = remoteAddr
+		data["remotePort"] = int(ev.RemotePort)
+		data["verdict"] = verdict
+
+		alert = Alert{
+			Type:    "inbound_connection",
+			Title:   "Inbound Connection",
+			Message: fmt.Sprintf("%s connection from %s to %s (%s)", service, remoteAddr, name, verdict),
+		}
+		if port == rdpPort {
+			alert.Type = "rdp_connection"
+			alert.Title = "Inbound RDP Connection"
+		}
+
+	default:
+		return
+	}
+
+	alert.Data = data
+	alert.Timestamp = time.Now()
+	select {
+	case alertChan <- alert:
+		log.Printf("Listener alert: %s", alert.Message)
+	default:
+		log.Println("Alert channel full, dropping alert")
+	}
+}
+
+// startListenerEvents subscribes to the driver's LISTEN and ACCEPT events
+// for RDP and the other service ports the device scanner knows. Returns
+// false when the driver is not available.
+func startListenerEvents() bool {
+	filter := eventFilter(1<<eventTypeListen|1<<eventTypeAccept, watchedPortRanges(commonPorts, eventFilterRanges))
+	reader, err := openDriverEvents(filter)
+	if err != nil {
+		log.Printf("Driver listener events unavailable (%v), polling RDP sessions", err)
+		return false
+	}
+
+	w := &listenerWatcher{
+		watched:   make(map[uint16]bool),
+		lastAlert: make(map[string]time.Time),
+	}
+	for _, port := range commonPorts {
+		w.watched[uint16(port)] = true
+	}
+
+	go reader.run(w.handle)
+	log.Printf("Using driver listener events for %d ports", len(w.watched))
+	return true
+}
+
+// GET_TRAFFIC layout (TRAFFIC_BATCH_HEADER / TRAFFIC_RECORD, packed)
+const (
+	trafficRecordVersion = 1
+
+	trafficHeaderSize = 9  // version, recordCount, totalLength, moreData
+	trafficRecordSize = 24 // recordLength, bytesSent, bytesReceived, flows, pathLength
+	trafficBufferSize = 64 * 1024
+)
+
+// readTraffic fetches the per-app traffic the driver counted since the last
+// call; Connections is the number of flows established in that time
+func (r *driverEventReader) readTraffic() ([]AppUsage, error) {
+	buf := make([]byte, trafficBufferSize)
+	var apps []AppUsage
+
+	for {
+		var returned uint32
+		err := windows.DeviceIoControl(r.device, ioctlGetTraffic, nil, 0,
+			&buf[0], uint32(len(buf)), &returned, nil)
+		if err != nil {
+			return apps, err
+		}
+		if returned < trafficHeaderSize || binary.LittleEndian.Uint16(buf[0:]) != trafficRecordVersion {
+			return apps, errors.New("unsupported traffic record version")
+		}
+
+		count := int(binary.LittleEndian.Uint16(buf[2:]))
+		total := int(binary.LittleEndian.Uint32(buf[4:]))
+		moreData := buf[8] != 0
+		if total > int(returned) {
+			return apps, errors.New("truncated traffic batch")
+		}
+
+		offset := trafficHeaderSize
+		for i := 0; i < count && offset+trafficRecordSize <= total; i++ {
+			rec := buf[offset:]
+			recordLength := int(binary.LittleEndian.Uint16(rec[0:]))
+			pathLength := int(binary.LittleEndian.Uint16(rec[22:]))
+			if recordLength < trafficRecordSize+pathLength*2 || offset+recordLength > total {
+				return apps, errors.New("malformed traffic record")
+			}
+
+			path := make([]uint16, pathLength)
+			for j := range path {
+				path[j] = binary.LittleEndian.Uint16(rec[trafficRecordSize+j*2:])
+			}
+			dosPath := ntPathToDosPath(windows.UTF16ToString(path))
+
+			apps = append(apps, AppUsage{
+				ProcessName:   filepath.Base(dosPath),
+				ProcessPath:   dosPath,
+				BytesSent:     binary.LittleEndian.Uint64(rec[2:]),
+				BytesReceived: binary.LittleEndian.Uint64(rec[10:]),
+				Connections:   int(binary.LittleEndian.Uint32(rec[18:])),
+			})
+			offset += recordLength
+		}
+
+		if !moreData {
+			return apps, nil
+		}
+	}
+}
+
+// appTraffic returns the driver's per-app traffic since the previous call
+func (t *connectionTracker) appTraffic() ([]AppUsage, error) {
+	return t.reader.readTraffic()
+}
+
+var (
+	dosDevicesOnce sync.Once
+	dosDevices     map[string]string // \Device\HarddiskVolumeN -> C:
+)
+
+// loadDosDevices maps each drive letter to its device, once
+func loadDosDevices() {
+	dosDevicesOnce.Do(func() {
+		dosDevices = make(map[string]string)
+		target := make([]uint16, windows.MAX_PATH)
+		for letter := 'A'; letter <= 'Z'; letter++ {
+			drive := string(letter) + ":"
+			name, err := windows.UTF16PtrFromString(drive)
+			if err != nil {
+				continue
+			}
+			if _, err := windows.QueryDosDevice(name, &target[0], uint32(len(target))); err == nil {
+				dosDevices[strings.ToLower(windows.UTF16ToString(target))] = drive
+			}
+		}
+	})
+}
+
+// ntPathToDosPath turns the NT device path the driver reports into the
+// drive letter form used everywhere else in the service
+func ntPathToDosPath(path string) string {
+	loadDosDevices()
+
+	lower := strings.ToLower(path)
+	for device, drive := range dosDevices {
+		if strings.HasPrefix(lower, device+`\`) {
+			return drive + path[len(device):]
+		}
+	}
+	return path
+}
+
+// dosPathToNtPath is the reverse, for handing paths to the driver. It
+// returns false for paths not on a lettered drive.
+func dosPathToNtPath(path string) (string, bool) {
+	loadDosDevices()
+
+	if len(path) < 3 || path[1] != ':' || path[2] != '\\' {
+		return "", false
+	}
+	drive := strings.ToUpper(path[:2])
+	for device, letter := range dosDevices {
+		if letter == drive {
+			return device + path[2:], true
+		}
+	}
+	return "", false
+}
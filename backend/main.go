@@ -129,6 +129,9 @@ func main() {
 	}
 	defer closeDatabase()
 
+	// Hold connections from unknown apps in the driver when it is loaded
+	startDriverClient()
+
 	// Start background monitors
 	go monitorConnections()
 	go monitorTraffic()
@@ -176,6 +179,9 @@ func main() {
 	http.HandleFunc("/api/pending-connections/respond", handleRespondToPendingConnection)
 	http.HandleFunc("/api/app/block", handleBlockApp)
 	http.HandleFunc("/api/app/unblock", handleUnblockApp)
+	http.HandleFunc("/api/app/rate-limit", handleAppRateLimit)
+	http.HandleFunc("/api/pattern-rules", handlePatternRules)
+	http.HandleFunc("/api/pattern-rules/remove", handleRemovePatternRule)
 
 	// Start background device scanning
 	startBackgroundDeviceScanning()
@@ -523,10 +529,18 @@ func monitorConnections() {
 	logTicker := time.NewTicker(30 * time.Second) // Log connections every 30 seconds
 	cleanupTicker := time.NewTicker(5 * time.Minute) // Cleanup old seen connections
 
+	// Prefer the driver's connection events; poll the TCP table without it
+	tracker := startConnectionEvents()
+
 	for {
 		select {
 		case <-ticker.C:
-			conns := getTCPConnections()
+			var conns []NetworkConnection
+			if tracker != nil {
+				conns = tracker.snapshot()
+			} else {
+				conns = getTCPConnections()
+			}
 
 			// Check for new apps (Ask to Connect feature)
 			settings := getSettings()
@@ -569,8 +583,8 @@ func monitorConnections() {
 						seenConnections[connKey] = true
 						seenConnectionsMux.Unlock()
 
-						// Also update app usage stats
-						if conn.BytesSent > 0 || conn.BytesReceived > 0 {
+						// Also update app usage stats, unless the driver counts them
+						if tracker == nil && (conn.BytesSent > 0 || conn.BytesReceived > 0) {
 							updateAppUsage(conn.ProcessName, conn.ProcessPath, conn.BytesSent, conn.BytesReceived)
 						}
 					}
@@ -578,6 +592,15 @@ func monitorConnections() {
 			}
 			connectionsMux.RUnlock()
 
+			// Per-app traffic counted by the driver, in one batch
+			if tracker != nil {
+				usage, err := tracker.appTraffic()
+				if err != nil {
+					log.Printf("Error reading driver traffic: %v", err)
+				}
+				updateAppUsageBatch(usage)
+			}
+
 		case <-cleanupTicker.C:
 			// Cleanup old seen connections to allow re-logging
 			seenConnectionsMux.Lock()
@@ -590,7 +613,8 @@ func monitorConnections() {
 // checkNewApps checks for new applications making network connections
 func checkNewApps(conns []NetworkConnection) {
 	for _, conn := range conns {
-		if conn.ProcessPath == "" || conn.State != "Established" {
+		// Closed connections only show up for short-lived ones the driver reported
+		if conn.ProcessPath == "" || (conn.State != "Established" && conn.State != "Closed") {
 			continue
 		}
 
@@ -726,6 +750,11 @@ func monitorWiFi() {
 }
 
 func monitorRDP() {
+	// The driver reports RDP connections as they arrive; poll without it
+	if startListenerEvents() {
+		return
+	}
+
 	ticker := time.NewTicker(10 * time.Second)
 	for range ticker.C {
 		getRDPSessions()
@@ -854,6 +883,7 @@ func handleSettings(w http.ResponseWriter, r *http.Request) {
 			json.NewEncoder(w).Encode(APIResponse{Success: false, Error: err.Error()})
 			return
 		}
+		syncDriverMode()
 
 		json.NewEncoder(w).Encode(APIResponse{Success: true, Data: getSettings()})
 		return
@@ -1025,6 +1055,13 @@ func handleClearKnownApps(w http.ResponseWriter, r *http.Request) {
 		seenApps = make(map[string]bool)
 		seenAppsMux.Unlock()
 
+		// And the driver's copy of them
+		if driver != nil {
+			if err := driver.syncKnownApps(); err != nil {
+				log.Printf("Failed to clear driver rules: %v", err)
+			}
+		}
+
 		log.Println("Known apps cleared - Ask to Connect will now prompt for all apps")
 		json.NewEncoder(w).Encode(APIResponse{Success: true})
 	} else {
@@ -1167,3 +1204,88 @@ func handleUnblockApp(w http.ResponseWriter, r *http.Request) {
 
 	json.NewEncoder(w).Encode(APIResponse{Success: true})
 }
+
+// handleAppRateLimit sets or clears a known application's rate limit
+func handleAppRateLimit(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "application/json")
+	w.Header().Set("Access-Control-Allow-Origin", "*")
+
+	if r.Method != "POST" {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Method not allowed"})
+		return
+	}
+
+	var req struct {
+		ProcessPath    string `json:"processPath"`
+		BytesPerSecond uint32 `json:"bytesPerSecond"` // 0 removes the limit
+	}
+	if err := json.NewDecoder(r.Body).Decode(&req); err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Invalid request"})
+		return
+	}
+
+	if err := setApplicationRateLimit(req.ProcessPath, req.BytesPerSecond); err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: err.Error()})
+		return
+	}
+
+	json.NewEncoder(w).Encode(APIResponse{Success: true})
+}
+
+// handlePatternRules lists the directory, extension and wildcard path rules
+// (GET) or adds one (POST)
+func handlePatternRules(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "application/json")
+	w.Header().Set("Access-Control-Allow-Origin", "*")
+
+	if r.Method == "GET" {
+		json.NewEncoder(w).Encode(APIResponse{Success: true, Data: getPatternRules()})
+		return
+	}
+
+	if r.Method != "POST" {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Method not allowed"})
+		return
+	}
+
+	var rule StoredPatternRule
+	if err := json.NewDecoder(r.Body).Decode(&rule); err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Invalid request"})
+		return
+	}
+
+	id, err := addApplicationPatternRule(rule)
+	if err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: err.Error()})
+		return
+	}
+
+	rule.ID = id
+	json.NewEncoder(w).Encode(APIResponse{Success: true, Data: rule})
+}
+
+// handleRemovePatternRule removes a pattern rule by ID
+func handleRemovePatternRule(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "application/json")
+	w.Header().Set("Access-Control-Allow-Origin", "*")
+
+	if r.Method != "POST" {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Method not allowed"})
+		return
+	}
+
+	var req struct {
+		ID int64 `json:"id"`
+	}
+	if err := json.NewDecoder(r.Body).Decode(&req); err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: "Invalid request"})
+		return
+	}
+
+	if err := removeApplicationPatternRule(req.ID); err != nil {
+		json.NewEncoder(w).Encode(APIResponse{Success: false, Error: err.Error()})
+		return
+	}
+
+	json.NewEncoder(w).Encode(APIResponse{Success: true})
+}
@@ -694,35 +694,45 @@ func getTCPConnections() []NetworkConnection {
 			BytesReceived: bytesRecv,
 		}
 
-		// Add hostname from cache (non-blocking)
+		enrichConnection(&conn)
+		connections = append(connections, conn)
+	}
+
+	return connections
+}
+
+// enrichConnection fills in hostname and GeoIP data from the caches and
+// queues background lookups for anything not cached yet. A hostname the
+// driver already took from the DNS answer is kept.
+func enrichConnection(conn *NetworkConnection) {
+	remoteAddr := conn.RemoteAddress
+
+	// Add hostname from cache (non-blocking)
+	if conn.RemoteHost == "" {
 		hostnameCacheMux.RLock()
 		if hostname, ok := hostnameCache[remoteAddr]; ok && hostname != "" {
 			conn.RemoteHost = hostname
 		}
 		hostnameCacheMux.RUnlock()
+	}
 
-		// Queue hostname lookup if not cached
-		if conn.RemoteHost == "" && remoteAddr != "0.0.0.0" && !isLocalhost(remoteAddr) {
-			queueHostnameLookup(remoteAddr)
-		}
-
-		// Add GeoIP data if available (from cache)
-		geoIPCacheMux.RLock()
-		if geoInfo, ok := geoIPCache[remoteAddr]; ok && geoInfo != nil {
-			conn.Country = geoInfo.Country
-			conn.City = geoInfo.City
-			conn.Lat = geoInfo.Lat
-			conn.Lon = geoInfo.Lon
-		}
-		geoIPCacheMux.RUnlock()
-
-		// Queue for background GeoIP lookup if not cached
-		queueGeoIPLookup(remoteAddr)
+	// Queue hostname lookup if not cached
+	if conn.RemoteHost == "" && remoteAddr != "0.0.0.0" && !isLocalhost(remoteAddr) {
+		queueHostnameLookup(remoteAddr)
+	}
 
-		connections = append(connections, conn)
+	// Add GeoIP data if available (from cache)
+	geoIPCacheMux.RLock()
+	if geoInfo, ok := geoIPCache[remoteAddr]; ok && geoInfo != nil {
+		conn.Country = geoInfo.Country
+		conn.City = geoInfo.City
+		conn.Lat = geoInfo.Lat
+		conn.Lon = geoInfo.Lon
 	}
+	geoIPCacheMux.RUnlock()
 
-	return connections
+	// Queue for background GeoIP lookup if not cached
+	queueGeoIPLookup(remoteAddr)
 }
 
 // Debug flag for traffic monitoring
@@ -2172,31 +2182,57 @@ var (
 
 // PendingConnection represents a connection waiting for user approval
 type PendingConnection struct {
-	ID            string    `json:"id"`
-	ProcessName   string    `json:"processName"`
-	ProcessPath   string    `json:"processPath"`
-	RemoteAddress string    `json:"remoteAddress"`
-	RemotePort    int       `json:"remotePort"`
-	Timestamp     time.Time `json:"timestamp"`
-}
-
-// blockApplicationWFP blocks an application using Windows Firewall
+	ID              string    `json:"id"`
+	ProcessName     string    `json:"processName"`
+	ProcessPath     string    `json:"processPath"`
+	ProcessID       int       `json:"processId,omitempty"`
+	RemoteAddress   string    `json:"remoteAddress"`
+	RemotePort      int       `json:"remotePort"`
+	RemoteHost      string    `json:"remoteHost,omitempty"`      // Name the app resolved, when the driver saw the DNS answer
+	ConnectionCount int       `json:"connectionCount,omitempty"` // Connects the driver is holding for the app
+	Timestamp       time.Time `json:"timestamp"`
+
+	driverID uint64 // Driver connectionId, 0 when not held by the driver
+	ntPath   string // Process path as the driver reports it
+}
+
+// blockApplicationWFP blocks an application, in the driver's rule table
+// while the driver enforces its rules and with Windows Firewall rules
+// otherwise. Either way the app is remembered as blocked.
 func blockApplicationWFP(processPath string) error {
 	log.Printf("WFP: Blocking application: %s", processPath)
 
-	// Extract filename for rule name
 	parts := strings.Split(processPath, "\\")
 	displayName := parts[len(parts)-1]
-	ruleName := fmt.Sprintf("NetGuard Block - %s", displayName)
 
-	// Create both inbound and outbound block rules
-	errOut := createFirewallRule(ruleName+" (Out)", processPath, "", 0, NET_FW_RULE_DIR_OUT, NET_FW_ACTION_BLOCK)
-	errIn := createFirewallRule(ruleName+" (In)", processPath, "", 0, NET_FW_RULE_DIR_IN, NET_FW_ACTION_BLOCK)
+	if driver != nil && driver.enforcing() {
+		if ok, err := driver.setAppRule(processPath, true); ok {
+			if err != nil {
+				return fmt.Errorf("failed to set driver rule: %w", err)
+			}
+			// The driver enforces it now; drop firewall rules from before
+			removeFirewallBlockRules(displayName)
+			addKnownApp(processPath, displayName, false)
+
+			blockedAppsMux.Lock()
+			blockedApps[processPath] = true
+			blockedAppsMux.Unlock()
+			return nil
+		}
+	}
 
-	if errOut != nil && errIn != nil {
-		return fmt.Errorf("failed to create firewall rules: out=%v, in=%v", errOut, errIn)
+	if err := createFirewallBlockRules(processPath, displayName); err != nil {
+		return err
 	}
 
+	// Also give the driver the rule, so it takes over once it enforces
+	if driver != nil {
+		if _, err := driver.setAppRule(processPath, true); err != nil {
+			log.Printf("Failed to set driver rule: %v", err)
+		}
+	}
+	addKnownApp(processPath, displayName, false)
+
 	// Track blocked app
 	blockedAppsMux.Lock()
 	blockedApps[processPath] = true
@@ -2205,19 +2241,23 @@ func blockApplicationWFP(processPath string) error {
 	return nil
 }
 
-// unblockApplicationWFP removes block rules for an application
+// unblockApplicationWFP removes an application's block wherever it is held:
+// the driver rule, any firewall rules, and the remembered verdict, so the
+// app is unknown again rather than allowed
 func unblockApplicationWFP(processPath string) error {
 	log.Printf("WFP: Unblocking application: %s", processPath)
 
-	// Extract filename for rule name
 	parts := strings.Split(processPath, "\\")
 	displayName := parts[len(parts)-1]
-	ruleNameOut := fmt.Sprintf("NetGuard Block - %s (Out)", displayName)
-	ruleNameIn := fmt.Sprintf("NetGuard Block - %s (In)", displayName)
 
-	// Remove both rules
-	removeFirewallRule(ruleNameOut)
-	removeFirewallRule(ruleNameIn)
+	if driver != nil {
+		if _, err := driver.removeAppRule(processPath); err != nil {
+			return fmt.Errorf("failed to remove driver rule: %w", err)
+		}
+	}
+
+	removeFirewallBlockRules(displayName)
+	removeKnownApp(processPath)
 
 	// Update tracking
 	blockedAppsMux.Lock()
@@ -2227,6 +2267,119 @@ func unblockApplicationWFP(processPath string) error {
 	return nil
 }
 
+// setApplicationRateLimit caps a remembered app's throughput at
+// bytesPerSecond each way; 0 removes the cap. The limit is stored with the
+// app, so syncKnownApps restores it whenever the driver reconnects.
+func setApplicationRateLimit(processPath string, bytesPerSecond uint32) error {
+	allowed := isAppAllowed(processPath)
+	if allowed == nil {
+		return fmt.Errorf("application is not known: %s", processPath)
+	}
+	if !setKnownAppRateLimit(processPath, bytesPerSecond) {
+		return fmt.Errorf("failed to store rate limit")
+	}
+
+	if driver != nil {
+		if _, err := driver.setAppRateLimit(processPath, !*allowed, bytesPerSecond); err != nil {
+			return fmt.Errorf("failed to set driver rate limit: %w", err)
+		}
+	}
+	return nil
+}
+
+// addApplicationPatternRule stores a directory, extension or wildcard path
+// rule and reloads the driver's pattern rules. Only the driver enforces
+// pattern rules; the firewall fallback has no equivalent.
+func addApplicationPatternRule(rule StoredPatternRule) (int64, error) {
+	if _, ok := patternKinds[rule.Kind]; !ok {
+		return 0, fmt.Errorf("unknown pattern rule kind: %s", rule.Kind)
+	}
+	p, ok := patternToNtPath(rule)
+	if !ok {
+		return 0, fmt.Errorf("pattern is not on a lettered drive: %s", rule.Pattern)
+	}
+
+	// Refuse a rule the driver could not load along with the stored ones
+	patterns := []pathPattern{p}
+	for _, stored := range getPatternRules() {
+		if p, ok := patternToNtPath(stored); ok {
+			patterns = append(patterns, p)
+		}
+	}
+	if _, err := compilePatternRules(patterns); err != nil {
+		return 0, err
+	}
+
+	id, err := addPatternRule(rule)
+	if err != nil {
+		return 0, fmt.Errorf("failed to store pattern rule: %w", err)
+	}
+	if driver != nil {
+		if err := driver.syncPatternRules(); err != nil {
+			return id, fmt.Errorf("failed to load pattern rules into the driver: %w", err)
+		}
+	}
+	return id, nil
+}
+
+// removeApplicationPatternRule forgets a pattern rule and reloads the
+// driver's pattern rules
+func removeApplicationPatternRule(id int64) error {
+	if !removePatternRule(id) {
+		return fmt.Errorf("pattern rule not found: %d", id)
+	}
+	if driver != nil {
+		if err := driver.syncPatternRules(); err != nil {
+			return fmt.Errorf("failed to load pattern rules into the driver: %w", err)
+		}
+	}
+	return nil
+}
+
+// createFirewallBlockRules blocks an application in both directions with
+// Windows Firewall rules, replacing any it already has
+func createFirewallBlockRules(processPath, displayName string) error {
+	ruleName := fmt.Sprintf("NetGuard Block - %s", displayName)
+	removeFirewallBlockRules(displayName)
+
+	// Create both inbound and outbound block rules
+	errOut := createFirewallRule(ruleName+" (Out)", processPath, "", 0, NET_FW_RULE_DIR_OUT, NET_FW_ACTION_BLOCK)
+	errIn := createFirewallRule(ruleName+" (In)", processPath, "", 0, NET_FW_RULE_DIR_IN, NET_FW_ACTION_BLOCK)
+
+	if errOut != nil && errIn != nil {
+		return fmt.Errorf("failed to create firewall rules: out=%v, in=%v", errOut, errIn)
+	}
+	return nil
+}
+
+// removeFirewallBlockRules removes the rules createFirewallBlockRules made,
+// if there are any
+func removeFirewallBlockRules(displayName string) {
+	removeFirewallRule(fmt.Sprintf("NetGuard Block - %s (Out)", displayName))
+	removeFirewallRule(fmt.Sprintf("NetGuard Block - %s (In)", displayName))
+}
+
+// syncFirewallBlocks moves the remembered blocks to whoever enforces rules
+// now: the driver while it filters, so its apps' firewall rules are removed,
+// and Windows Firewall otherwise, so they stay blocked while it doesn't
+func syncFirewallBlocks(viaDriver bool) {
+	for path, allowed := range getKnownApps() {
+		if allowed {
+			continue
+		}
+		parts := strings.Split(path, "\\")
+		displayName := parts[len(parts)-1]
+
+		if _, ok := dosPathToNtPath(path); viaDriver && ok {
+			removeFirewallBlockRules(displayName)
+		} else if !viaDriver {
+			if err := createFirewallBlockRules(path, displayName); err != nil {
+				log.Printf("Failed to block %s with firewall rules: %v", path, err)
+			}
+		}
+	}
+}
+
 // isAppBlocked checks if an application is currently blocked
 func isAppBlocked(processPath string) bool {
 	blockedAppsMux.RLock()
@@ -2284,6 +2437,10 @@ func addPendingConnection(conn NetworkConnection) {
 
 // getPendingConnections returns all pending connections
 func getPendingConnections() []*PendingConnection {
+	if driver != nil {
+		return driver.pendingConnections()
+	}
+
 	pendingConnectionsMux.RLock()
 	defer pendingConnectionsMux.RUnlock()
 
@@ -2296,6 +2453,18 @@ func getPendingConnections() []*PendingConnection {
 
 // respondToPendingConnection handles user response to a pending connection
 func respondToPendingConnection(id string, allowed bool, remember bool) error {
+	if driver != nil {
+		// The driver applies the verdict and, with remember, the app rule
+		conn, err := driver.respond(id, allowed, remember)
+		if err != nil {
+			return err
+		}
+		if remember {
+			addKnownApp(conn.ProcessPath, conn.ProcessName, allowed)
+		}
+		return nil
+	}
+
 	pendingConnectionsMux.Lock()
 	conn, exists := pendingConnections[id]
 	if exists {
@@ -0,0 +1,292 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"sort"
+	"strconv"
+	"strings"
+	"unicode"
+	"unicode/utf16"
+)
+
+// Compiler for the driver's pattern rules. Directory (prefix), extension
+// (suffix) and wildcard path rules are turned into one DFA over case-folded
+// UTF-16 path characters, so the driver decides any number of them in a single
+// pass over the path. The output is the SET_PATTERN_RULES layout from
+// netguard.h.
+
+const (
+	patternSetVersion    = 1
+	patternSetHeaderSize = 16 // version, classCount, stateCount, wideCount, reserved
+	patternMaxClasses    = 256
+	patternMaxStates     = 65535
+	patternMaxSize       = 4 * 1024 * 1024
+
+	// Exact rules rank here; a pattern must rank higher to override one
+	patternPriorityExact = 0x8000
+
+	patternVerdictNone  = 0
+	patternVerdictAllow = 1
+	patternVerdictBlock = 2
+	patternStateFinal   = 0x1
+)
+
+type patternKind int
+
+const (
+	patternPrefix patternKind = iota // The path starts with pattern, e.g. a directory
+	patternSuffix                    // The path ends with pattern, e.g. an extension
+	patternGlob                      // '*' matches any run of characters, '?' any one
+)
+
+// patternKinds are the kind names the database and the API use
+var patternKinds = map[string]patternKind{
+	"prefix": patternPrefix,
+	"suffix": patternSuffix,
+	"glob":   patternGlob,
+}
+
+type pathPattern struct {
+	kind     patternKind
+	pattern  string // NT device path form, like driverRule.path
+	blocked  bool
+	priority uint16 // The highest-priority match wins, block breaking ties
+}
+
+// patternToken is a literal UTF-16 unit, or one of the wildcards below
+type patternToken int32
+
+const (
+	tokenAnyOne patternToken = -1
+	tokenAnyRun patternToken = -2
+)
+
+// patternPosition is how far into one pattern's tokens a path has matched
+type patternPosition struct {
+	pattern int
+	index   int
+}
+
+// foldPatternUnit folds a UTF-16 unit the way the driver does
+func foldPatternUnit(unit uint16) uint16 {
+	if unit >= 0xD800 && unit <= 0xDFFF {
+		return unit // Surrogates fold to themselves
+	}
+	folded := uint16(unicode.ToLower(rune(unit)))
+	if unit >= 0x80 && folded < 0x80 {
+		return unit // The driver never folds into ASCII
+	}
+	return folded
+}
+
+// patternTokens turns a pattern into case-folded tokens, prefix and suffix
+// rules becoming globs with a trailing or leading '*'
+func patternTokens(p pathPattern) ([]patternToken, error) {
+	if p.pattern == "" {
+		return nil, errors.New("empty path pattern")
+	}
+
+	var tokens []patternToken
+	if p.kind == patternSuffix {
+		tokens = append(tokens, tokenAnyRun)
+	}
+	for _, unit := range utf16.Encode([]rune(p.pattern)) {
+		switch {
+		case p.kind == patternGlob && unit == '*':
+			if len(tokens) == 0 || tokens[len(tokens)-1] != tokenAnyRun {
+				tokens = append(tokens, tokenAnyRun)
+			}
+		case p.kind == patternGlob && unit == '?':
+			tokens = append(tokens, tokenAnyOne)
+		default:
+			tokens = append(tokens, patternToken(foldPatternUnit(unit)))
+		}
+	}
+	if p.kind == patternPrefix {
+		tokens = append(tokens, tokenAnyRun)
+	}
+	return tokens, nil
+}
+
+// compilePatternRules builds the SET_PATTERN_RULES input for a set of
+// patterns by subset construction. No patterns gives the input that removes
+// the driver's pattern rules.
+func compilePatternRules(patterns []pathPattern) ([]byte, error) {
+	if len(patterns) == 0 {
+		buf := make([]byte, patternSetHeaderSize)
+		binary.LittleEndian.PutUint16(buf[0:], patternSetVersion)
+		return buf, nil
+	}
+
+	tokens := make([][]patternToken, len(patterns))
+	for i, p := range patterns {
+		t, err := patternTokens(p)
+		if err != nil {
+			return nil, err
+		}
+		tokens[i] = t
+	}
+
+	// One class per literal character the patterns use; class 0 is the rest
+	classOf := map[uint16]int{}
+	classChar := []int32{-1}
+	for _, t := range tokens {
+		for _, token := range t {
+			if token >= 0 {
+				if _, ok := classOf[uint16(token)]; !ok {
+					classOf[uint16(token)] = len(classChar)
+					classChar = append(classChar, int32(token))
+				}
+			}
+		}
+	}
+	classCount := len(classChar)
+	if classCount > patternMaxClasses {
+		return nil, errors.New("path patterns use too many distinct characters")
+	}
+
+	// closure adds the positions a '*' can skip over without consuming
+	closure := func(set []patternPosition) []patternPosition {
+		seen := map[patternPosition]bool{}
+		var out []patternPosition
+		for len(set) > 0 {
+			pos := set[len(set)-1]
+			set = set[:len(set)-1]
+			if seen[pos] {
+				continue
+			}
+			seen[pos] = true
+			out = append(out, pos)
+			if pos.index < len(tokens[pos.pattern]) && tokens[pos.pattern][pos.index] == tokenAnyRun {
+				set = append(set, patternPosition{pos.pattern, pos.index + 1})
+			}
+		}
+		sort.Slice(out, func(a, b int) bool {
+			if out[a].pattern != out[b].pattern {
+				return out[a].pattern < out[b].pattern
+			}
+			return out[a].index < out[b].index
+		})
+		return out
+	}
+	key := func(set []patternPosition) string {
+		var b strings.Builder
+		for _, pos := range set {
+			b.WriteString(strconv.Itoa(pos.pattern))
+			b.WriteByte(':')
+			b.WriteString(strconv.Itoa(pos.index))
+			b.WriteByte(',')
+		}
+		return b.String()
+	}
+
+	var start []patternPosition
+	for i := range patterns {
+		start = append(start, patternPosition{i, 0})
+	}
+	sets := [][]patternPosition{closure(start)}
+	stateOf := map[string]int{key(sets[0]): 0}
+	var next []uint16
+
+	for state := 0; state < len(sets); state++ {
+		for class := 0; class < classCount; class++ {
+			var moved []patternPosition
+			for _, pos := range sets[state] {
+				if pos.index == len(tokens[pos.pattern]) {
+					continue
+				}
+				switch token := tokens[pos.pattern][pos.index]; {
+				case token == tokenAnyRun:
+					moved = append(moved, pos)
+				case token == tokenAnyOne || int32(token) == classChar[class]:
+					moved = append(moved, patternPosition{pos.pattern, pos.index + 1})
+				}
+			}
+
+			set := closure(moved)
+			target, ok := stateOf[key(set)]
+			if !ok {
+				if len(sets) == patternMaxStates {
+					return nil, errors.New("path patterns compile to too many states")
+				}
+				target = len(sets)
+				stateOf[key(set)] = target
+				sets = append(sets, set)
+			}
+			next = append(next, uint16(target))
+		}
+	}
+
+	var wide []uint16
+	for ch := range classOf {
+		if ch >= 0x80 {
+			wide = append(wide, ch)
+		}
+	}
+	sort.Slice(wide, func(a, b int) bool { return wide[a] < wide[b] })
+
+	size := patternSetHeaderSize + 128 + len(wide)*4 + len(sets)*4 + len(next)*2
+	if size > patternMaxSize {
+		return nil, errors.New("path patterns compile to too large a matcher")
+	}
+
+	buf := make([]byte, size)
+	binary.LittleEndian.PutUint16(buf[0:], patternSetVersion)
+	binary.LittleEndian.PutUint16(buf[2:], uint16(classCount))
+	binary.LittleEndian.PutUint32(buf[4:], uint32(len(sets)))
+	binary.LittleEndian.PutUint32(buf[8:], uint32(len(wide)))
+
+	off := patternSetHeaderSize
+	for ch, class := range classOf {
+		if ch < 0x80 {
+			buf[off+int(ch)] = byte(class)
+		}
+	}
+	off += 128
+	for _, ch := range wide {
+		binary.LittleEndian.PutUint16(buf[off:], ch)
+		binary.LittleEndian.PutUint16(buf[off+2:], uint16(classOf[ch]))
+		off += 4
+	}
+
+	for state, set := range sets {
+		verdict := byte(patternVerdictNone)
+		var priority uint16
+		for _, pos := range set {
+			if pos.index != len(tokens[pos.pattern]) {
+				continue
+			}
+			p := patterns[pos.pattern]
+			if verdict == patternVerdictNone || p.priority > priority ||
+				(p.priority == priority && p.blocked) {
+				verdict = patternVerdictAllow
+				if p.blocked {
+					verdict = patternVerdictBlock
+				}
+				priority = p.priority
+			}
+		}
+
+		final := true
+		for _, target := range next[state*classCount : (state+1)*classCount] {
+			if int(target) != state {
+				final = false
+				break
+			}
+		}
+
+		buf[off] = verdict
+		if final {
+			buf[off+1] = patternStateFinal
+		}
+		binary.LittleEndian.PutUint16(buf[off+2:], priority)
+		off += 4
+	}
+
+	for _, target := range next {
+		binary.LittleEndian.PutUint16(buf[off:], target)
+		off += 2
+	}
+	return buf, nil
+}
@@ -0,0 +1,178 @@
+package main
+
+import (
+	"encoding/binary"
+	"strings"
+	"testing"
+	"unicode/utf16"
+)
+
+// walkPatternSet matches path against a compiled set the way the driver's
+// MatchPattern does, returning the verdict and priority of the end state
+func walkPatternSet(t *testing.T, set []byte, path string) (byte, uint16) {
+	t.Helper()
+
+	classCount := int(binary.LittleEndian.Uint16(set[2:]))
+	stateCount := int(binary.LittleEndian.Uint32(set[4:]))
+	wideCount := int(binary.LittleEndian.Uint32(set[8:]))
+	ascii := set[patternSetHeaderSize : patternSetHeaderSize+128]
+	wide := set[patternSetHeaderSize+128:]
+	states := wide[wideCount*4:]
+	next := states[stateCount*4:]
+	if len(next) != stateCount*classCount*2 {
+		t.Fatalf("set is %d bytes, want %d of transitions", len(next), stateCount*classCount*2)
+	}
+
+	state := 0
+	for _, unit := range utf16.Encode([]rune(path)) {
+		if states[state*4+1]&patternStateFinal != 0 {
+			break
+		}
+		class := 0
+		if unit < 0x80 {
+			if unit >= 'A' && unit <= 'Z' {
+				unit += 'a' - 'A'
+			}
+			class = int(ascii[unit])
+		} else {
+			folded := foldPatternUnit(unit)
+			for i := 0; i < wideCount; i++ {
+				if binary.LittleEndian.Uint16(wide[i*4:]) == folded {
+					class = int(binary.LittleEndian.Uint16(wide[i*4+2:]))
+				}
+			}
+		}
+		state = int(binary.LittleEndian.Uint16(next[(state*classCount+class)*2:]))
+	}
+	return states[state*4], binary.LittleEndian.Uint16(states[state*4+2:])
+}
+
+func TestCompilePatternRulesMatches(t *testing.T) {
+	patterns := []pathPattern{
+		{kind: patternPrefix, pattern: `\Device\HarddiskVolume3\Program Files\Vendor\`, priority: 10},
+		{kind: patternSuffix, pattern: `.scr`, blocked: true, priority: 10},
+		{kind: patternGlob, pattern: `*\Temp\*.exe`, blocked: true, priority: 20},
+		{kind: patternGlob, pattern: `*\Cache\a?c.dll`, priority: 5},
+		{kind: patternPrefix, pattern: `\Device\HarddiskVolume3\Tools\Ünïcode\`, priority: 5},
+	}
+	set, err := compilePatternRules(patterns)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	tests := []struct {
+		path     string
+		verdict  byte
+		priority uint16
+	}{
+		{`\Device\HarddiskVolume3\Program Files\Vendor\app.exe`, patternVerdictAllow, 10},
+		{`\device\harddiskvolume3\PROGRAM FILES\vendor\sub\app.exe`, patternVerdictAllow, 10},
+		{`\Device\HarddiskVolume3\Program Files\Vendor`, patternVerdictNone, 0},
+		{`\Device\HarddiskVolume3\Program Files\Other\app.exe`, patternVerdictNone, 0},
+		{`\Device\HarddiskVolume3\Users\me\saver.SCR`, patternVerdictBlock, 10},
+		{`\Device\HarddiskVolume3\Users\me\saver.scr.txt`, patternVerdictNone, 0},
+		{`\Device\HarddiskVolume3\Users\me\AppData\Local\Temp\x\setup.exe`, patternVerdictBlock, 20},
+		{`\Device\HarddiskVolume3\Program Files\Vendor\Temp\setup.exe`, patternVerdictBlock, 20},
+		{`\Device\HarddiskVolume3\Temp.exe`, patternVerdictNone, 0},
+		{`\Device\HarddiskVolume3\Cache\abc.dll`, patternVerdictAllow, 5},
+		{`\Device\HarddiskVolume3\Cache\ac.dll`, patternVerdictNone, 0},
+		{`\Device\HarddiskVolume3\Tools\üNÏCODE\run.exe`, patternVerdictAllow, 5},
+		{``, patternVerdictNone, 0},
+	}
+	for _, test := range tests {
+		verdict, priority := walkPatternSet(t, set, test.path)
+		if verdict != test.verdict || (verdict != patternVerdictNone && priority != test.priority) {
+			t.Errorf("%s: got verdict %d priority %d, want %d %d", test.path, verdict, priority, test.verdict, test.priority)
+		}
+	}
+}
+
+func TestCompilePatternRulesPriority(t *testing.T) {
+	dir := `\Device\HarddiskVolume3\Apps\`
+	tests := []struct {
+		name     string
+		patterns []pathPattern
+		verdict  byte
+		priority uint16
+	}{
+		{"higher priority wins", []pathPattern{
+			{kind: patternPrefix, pattern: dir, blocked: true, priority: 1},
+			{kind: patternSuffix, pattern: `.exe`, priority: 2},
+		}, patternVerdictAllow, 2},
+		{"block breaks a tie", []pathPattern{
+			{kind: patternSuffix, pattern: `.exe`, priority: 3},
+			{kind: patternPrefix, pattern: dir, blocked: true, priority: 3},
+		}, patternVerdictBlock, 3},
+		{"outranks exact rules", []pathPattern{
+			{kind: patternPrefix, pattern: dir, blocked: true, priority: patternPriorityExact + 1},
+		}, patternVerdictBlock, patternPriorityExact + 1},
+	}
+	for _, test := range tests {
+		set, err := compilePatternRules(test.patterns)
+		if err != nil {
+			t.Fatalf("%s: %v", test.name, err)
+		}
+		verdict, priority := walkPatternSet(t, set, dir+`tool.exe`)
+		if verdict != test.verdict || priority != test.priority {
+			t.Errorf("%s: got verdict %d priority %d, want %d %d", test.name, verdict, priority, test.verdict, test.priority)
+		}
+	}
+}
+
+func TestCompilePatternRulesFinalStates(t *testing.T) {
+	set, err := compilePatternRules([]pathPattern{{kind: patternPrefix, pattern: `\a\`}})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// Once "\a\" has matched every transition must loop, so the driver may
+	// stop walking; the state it stops in has to be flagged final
+	classCount := int(binary.LittleEndian.Uint16(set[2:]))
+	stateCount := int(binary.LittleEndian.Uint32(set[4:]))
+	states := set[patternSetHeaderSize+128:]
+	next := states[stateCount*4:]
+	finals := 0
+	for state := 0; state < stateCount; state++ {
+		loops := true
+		for class := 0; class < classCount; class++ {
+			if int(binary.LittleEndian.Uint16(next[(state*classCount+class)*2:])) != state {
+				loops = false
+			}
+		}
+		if final := states[state*4+1]&patternStateFinal != 0; final != loops {
+			t.Errorf("state %d: final %v, loops on every class %v", state, final, loops)
+		}
+		if loops {
+			finals++
+		}
+	}
+	if finals == 0 {
+		t.Error("no final state")
+	}
+}
+
+func TestCompilePatternRulesEmpty(t *testing.T) {
+	set, err := compilePatternRules(nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(set) != patternSetHeaderSize || binary.LittleEndian.Uint16(set) != patternSetVersion ||
+		binary.LittleEndian.Uint32(set[4:]) != 0 {
+		t.Errorf("empty set is % x, want a header with no states", set)
+	}
+}
+
+func TestCompilePatternRulesErrors(t *testing.T) {
+	if _, err := compilePatternRules([]pathPattern{{kind: patternGlob}}); err == nil {
+		t.Error("empty pattern compiled")
+	}
+
+	// Every distinct folded character is a class, plus class 0 for the rest
+	var b strings.Builder
+	for r := rune(0x4E00); r < 0x4E00+patternMaxClasses; r++ {
+		b.WriteRune(r)
+	}
+	if _, err := compilePatternRules([]pathPattern{{kind: patternSuffix, pattern: b.String()}}); err == nil {
+		t.Errorf("%d distinct characters compiled", patternMaxClasses)
+	}
+}
@@ -0,0 +1,355 @@
+/*
+ * NetGuard classify micro-benchmark
+ *
+ * Runs the driver's rule table, pending queue and connect classify code
+ * (netguard_rules.c, netguard_pending.c, netguard_classify.c) in user mode
+ * against the shim in bench/shim, so hot-path changes can be measured
+ * without loading a driver.
+ *
+ * For each rule table size it reports the cost of the individual lookups,
+ * then ns per NetGuardClassifyFn call for several hit/miss mixes across
+ * 1, 2, 4, ... threads. A hit is a connect from an app with a rule (half
+ * the rules block); a miss is a connect from one of a few unknown apps,
+ * which goes through the pending queue and coalesces into its entry.
+ *
+ * Usage: netguard_bench [-t maxThreads] [-n iterationsPerThread] [-p]
+ *   -p  enable the process verdict cache (off by default, so every hit
+ *       exercises the path hash and rule lookup)
+ */
+
+#include "netguard.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+_Thread_local ULONG ShimProcessorIndex;
+
+NETGUARD_CONTEXT g_Context;
+
+#define BENCH_UNKNOWN_APPS 64
+#define BENCH_REQUESTS 4096 // Per thread, replayed round robin
+
+#define BENCH_MAX_RULES 100000
+static const UINT32 RuleCounts[] = { 10, 1000, BENCH_MAX_RULES };
+static const UINT32 HitPercents[] = { 100, 90, 50, 0 };
+
+// One prepared connect: everything NetGuardClassifyFn reads
+typedef struct _BENCH_REQUEST {
+    FWPS_INCOMING_VALUE0 values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_MAX];
+    FWPS_INCOMING_VALUES0 fixedValues;
+    FWPS_INCOMING_METADATA_VALUES0 metaValues;
+    FWP_BYTE_BLOB pathBlob;
+} BENCH_REQUEST, *PBENCH_REQUEST;
+
+typedef struct _BENCH_THREAD {
+    pthread_t thread;
+    ULONG index;
+    UINT32 ruleCount;
+    UINT32 hitPercent;
+    UINT64 iterations;
+    pthread_barrier_t* barrier;
+    PBENCH_REQUEST requests;
+    double seconds;
+} BENCH_THREAD, *PBENCH_THREAD;
+
+// Rule paths, then the unknown apps, each MAX_PATH_LENGTH WCHARs
+static WCHAR* g_Paths;
+
+// Helper: Path of rule app i, or of unknown app i - ruleCount
+static WCHAR* BenchPath(UINT32 i) {
+    return &g_Paths[(SIZE_T)i * MAX_PATH_LENGTH];
+}
+
+static void FormatPath(WCHAR* path, const char* kind, UINT32 i) {
+    char ascii[MAX_PATH_LENGTH];
+    int length = snprintf(ascii, sizeof(ascii),
+        "\\device\\harddiskvolume3\\program files\\vendor %u\\%s%06u\\bin\\%s%06u.exe",
+        i % 97, kind, i, kind, i);
+    for (int c = 0; c <= length; c++) {
+        path[c] = (WCHAR)ascii[c];
+    }
+}
+
+static double Now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Helper: Small deterministic generator, so runs are comparable
+static UINT32 NextRandom(UINT64* state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (UINT32)(*state >> 33);
+}
+
+// Helper: Replace the rules with ruleCount apps through the same
+// standby/publish sequence the SET_RULES IOCTL uses
+static BOOLEAN LoadRules(UINT32 ruleCount) {
+    AcquireRuleLock();
+
+    for (int copy = 0; copy < 2; copy++) {
+        PRULE_TABLE table = StandbyRules();
+        ClearRuleTable(table);
+
+        for (UINT32 i = 0; i < ruleCount; i++) {
+            WCHAR* path = BenchPath(i);
+            SIZE_T length = wcsnlen(path, MAX_PATH_LENGTH);
+            if (!NT_SUCCESS(UpsertAllowedApp(table, path, length, (i & 1) != 0, 0,
+                                             HashProcessPath(path, length)))) {
+                ReleaseRuleLock();
+                return FALSE;
+            }
+        }
+        PublishRules(table);
+    }
+
+    ReleaseRuleLock();
+    return TRUE;
+}
+
+static void PrepareRequest(PBENCH_REQUEST request, UINT32 app, UINT32 remoteIp, UINT16 localPort) {
+    WCHAR* path = BenchPath(app);
+
+    memset(request, 0, sizeof(*request));
+    request->values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_PROTOCOL].value.uint8 = 6; // TCP
+    request->values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_ADDRESS].value.uint32 = 0x0A000002;
+    request->values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_PORT].value.uint16 = localPort;
+    request->values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_ADDRESS].value.uint32 = remoteIp;
+    request->values[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT].value.uint16 = 443;
+    request->fixedValues.valueCount = FWPS_FIELD_ALE_AUTH_CONNECT_V4_MAX;
+    request->fixedValues.incomingValue = request->values;
+
+    request->pathBlob.size = (UINT32)((wcsnlen(path, MAX_PATH_LENGTH) + 1) * sizeof(WCHAR));
+    request->pathBlob.data = (UINT8*)path;
+    request->metaValues.currentMetadataValues = FWPS_METADATA_FIELD_PROCESS_ID | FWPS_METADATA_FIELD_PROCESS_PATH;
+    request->metaValues.processId = 1000 + (UINT64)app * 4;
+    request->metaValues.processPath = &request->pathBlob;
+}
+
+static void* ClassifyThread(void* argument) {
+    PBENCH_THREAD context = (PBENCH_THREAD)argument;
+    FWPS_CLASSIFY_OUT0 classifyOut;
+
+    ShimProcessorIndex = context->index;
+
+    pthread_barrier_wait(context->barrier);
+    double start = Now();
+
+    for (UINT64 i = 0; i < context->iterations; i++) {
+        PBENCH_REQUEST request = &context->requests[i & (BENCH_REQUESTS - 1)];
+        memset(&classifyOut, 0, sizeof(classifyOut));
+        classifyOut.rights = FWPS_RIGHT_ACTION_WRITE;
+        NetGuardClassifyFn(&request->fixedValues, &request->metaValues, NULL, NULL, NULL, 0, &classifyOut);
+    }
+
+    context->seconds = Now() - start;
+    return NULL;
+}
+
+// Helper: Prepared connects for one thread, hitPercent of them from apps
+// with a rule
+static PBENCH_REQUEST PrepareRequests(UINT32 ruleCount, UINT32 hitPercent, ULONG thread) {
+    PBENCH_REQUEST requests = (PBENCH_REQUEST)malloc(BENCH_REQUESTS * sizeof(BENCH_REQUEST));
+    UINT64 random = 0x9E3779B97F4A7C15ULL ^ ((UINT64)thread << 32) ^ ruleCount ^ hitPercent;
+
+    if (!requests) {
+        return NULL;
+    }
+
+    for (UINT32 i = 0; i < BENCH_REQUESTS; i++) {
+        UINT32 app;
+        if (NextRandom(&random) % 100 < hitPercent) {
+            app = NextRandom(&random) % ruleCount;
+        } else {
+            app = ruleCount + NextRandom(&random) % BENCH_UNKNOWN_APPS;
+        }
+        PrepareRequest(&requests[i], app, 0x5DB8D822 + (NextRandom(&random) & 0xFF),
+                       (UINT16)(49152 + (i & 0x3FFF)));
+    }
+    return requests;
+}
+
+// Helper: Aggregate classify throughput of threadCount threads, in calls/s
+static double RunClassify(UINT32 ruleCount, UINT32 hitPercent, ULONG threadCount,
+                          UINT64 iterations, double* nsPerCall) {
+    BENCH_THREAD threads[SHIM_MAX_PROCESSORS];
+    pthread_barrier_t barrier;
+    double throughput = 0;
+    double totalSeconds = 0;
+
+    // Start every run with an empty queue, as if the user answered nothing
+    CompleteAllPending();
+
+    pthread_barrier_init(&barrier, NULL, threadCount);
+    for (ULONG t = 0; t < threadCount; t++) {
+        threads[t].index = t;
+        threads[t].ruleCount = ruleCount;
+        threads[t].hitPercent = hitPercent;
+        threads[t].iterations = iterations;
+        threads[t].barrier = &barrier;
+        threads[t].requests = PrepareRequests(ruleCount, hitPercent, t);
+        if (!threads[t].requests) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    for (ULONG t = 0; t < threadCount; t++) {
+        pthread_create(&threads[t].thread, NULL, ClassifyThread, &threads[t]);
+    }
+    for (ULONG t = 0; t < threadCount; t++) {
+        pthread_join(threads[t].thread, NULL);
+        throughput += (double)iterations / threads[t].seconds;
+        totalSeconds += threads[t].seconds;
+        free(threads[t].requests);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    *nsPerCall = totalSeconds * 1e9 / ((double)iterations * threadCount);
+    return throughput;
+}
+
+// Helper: Single-threaded cost of the lookups classify is built from
+static void RunComponents(UINT32 ruleCount, UINT64 iterations) {
+    volatile UINT64 sink = 0;
+    BOOLEAN isBlocked;
+    double start;
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH];
+
+    MapAddress4(0x5DB8D822, remoteAddress);
+    UINT64 hashes[BENCH_UNKNOWN_APPS];
+    SIZE_T lengths[BENCH_UNKNOWN_APPS];
+    for (UINT32 i = 0; i < BENCH_UNKNOWN_APPS; i++) {
+        lengths[i] = wcsnlen(BenchPath(ruleCount + i), MAX_PATH_LENGTH);
+        hashes[i] = HashProcessPath(BenchPath(ruleCount + i), lengths[i]);
+    }
+
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        WCHAR* path = BenchPath((UINT32)(i % ruleCount));
+        sink += HashProcessPath(path, MAX_PATH_LENGTH);
+    }
+    printf("  HashProcessPath               %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        WCHAR* path = BenchPath((UINT32)(i * 7919 % ruleCount));
+        SIZE_T length = wcsnlen(path, MAX_PATH_LENGTH);
+        sink += IsAppInList(path, length, HashProcessPath(path, length), &isBlocked);
+    }
+    printf("  IsAppInList (hit, with hash)  %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        UINT32 app = (UINT32)(i % BENCH_UNKNOWN_APPS);
+        sink += IsAppInList(BenchPath(ruleCount + app), lengths[app], hashes[app], &isBlocked);
+    }
+    printf("  IsAppInList (miss, hashed)    %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+
+    CompleteAllPending();
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        UINT32 app = (UINT32)(i % BENCH_UNKNOWN_APPS);
+        sink += QueuePendingConnection(1000 + app * 4, BenchPath(ruleCount + app), lengths[app], hashes[app],
+                                       remoteAddress, 443, (UINT16)(49152 + (i & 0x3FFF)), FALSE, NULL);
+    }
+    printf("  QueuePendingConnection        %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+
+    StoreEndpointVerdict(hashes[0], remoteAddress, 53, IPPROTO_UDP, EndpointMemoGeneration(), ENDPOINT_MEMO_UNKNOWN);
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        sink += LookupEndpointVerdict(hashes[0], remoteAddress, 53, IPPROTO_UDP, EndpointMemoGeneration());
+    }
+    printf("  LookupEndpointVerdict (hit)   %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+
+    start = Now();
+    for (UINT64 i = 0; i < iterations; i++) {
+        ExpireStalePending();
+    }
+    printf("  ExpireStalePending            %8.1f ns\n", (Now() - start) * 1e9 / (double)iterations);
+    CompleteAllPending();
+
+    (void)sink;
+}
+
+// Events go nowhere, as when the service has not mapped the rings
+void PublishEvent(PNETGUARD_EVENT event) {
+    UNREFERENCED_PARAMETER(event);
+}
+
+int main(int argc, char** argv) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    ULONG maxThreads = (ULONG)min(max(online, 1), SHIM_MAX_PROCESSORS);
+    UINT64 iterations = 1000000;
+    BOOLEAN pidCache = FALSE;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            int requested = atoi(argv[++i]);
+            maxThreads = (ULONG)min(max(requested, 1), SHIM_MAX_PROCESSORS);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            pidCache = TRUE;
+        } else {
+            fprintf(stderr, "usage: %s [-t maxThreads] [-n iterationsPerThread] [-p]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // The same set-up DriverEntry does for these parts
+    RtlZeroMemory(&g_Context, sizeof(g_Context));
+    g_Context.CpuStatsCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    g_Context.CpuStats = (PCPU_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        g_Context.CpuStatsCount * sizeof(CPU_STATS), NETGUARD_POOL_TAG);
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    g_Context.LatencyFrequency = frequency.QuadPart;
+    g_Context.LatencyNsPerTick = (1000000000ULL << 32) / (ULONG64)frequency.QuadPart;
+    g_Paths = (WCHAR*)malloc((SIZE_T)(BENCH_MAX_RULES + BENCH_UNKNOWN_APPS) * MAX_PATH_LENGTH * sizeof(WCHAR));
+    if (!NT_SUCCESS(InitializePendingQueue()) || !NT_SUCCESS(InitializeRuleTables()) ||
+        !g_Context.CpuStats || !g_Paths) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    g_Context.Enabled = TRUE;
+    g_Context.PidCacheEnabled = pidCache;
+
+    printf("NetGuard classify benchmark: %llu iterations per thread, "
+           "process verdict cache %s\n", (unsigned long long)iterations,
+           pidCache ? "on" : "off");
+
+    for (SIZE_T r = 0; r < RTL_NUMBER_OF(RuleCounts); r++) {
+        UINT32 ruleCount = RuleCounts[r];
+        for (UINT32 i = 0; i < ruleCount; i++) {
+            FormatPath(BenchPath(i), "app", i);
+        }
+        for (UINT32 i = 0; i < BENCH_UNKNOWN_APPS; i++) {
+            FormatPath(BenchPath(ruleCount + i), "unknown", i);
+        }
+        if (!LoadRules(ruleCount)) {
+            printf("\n%u rules: failed to load\n", ruleCount);
+            continue;
+        }
+
+        PRULE_TABLE rules = g_Context.ActiveRules;
+        printf("\n%u rules (%u index slots, %zu path bytes in %zu arena bytes)\n", ruleCount,
+               rules->SlotCount, rules->PathBytes, rules->ArenaBytes);
+        RunComponents(ruleCount, iterations);
+
+        printf("  %-5s %-8s %12s %14s %8s\n", "hit%", "threads", "ns/classify", "Mclassify/s", "scaling");
+        for (SIZE_T h = 0; h < RTL_NUMBER_OF(HitPercents); h++) {
+            double single = 0;
+            for (ULONG threads = 1; threads <= maxThreads; threads *= 2) {
+                double nsPerCall;
+                double throughput = RunClassify(ruleCount, HitPercents[h], threads, iterations, &nsPerCall);
+                if (threads == 1) {
+                    single = throughput;
+                }
+                printf("  %-5u %-8lu %12.1f %14.2f %7.2fx\n", HitPercents[h], (unsigned long)threads,
+                       nsPerCall, throughput / 1e6, throughput / single);
+            }
+        }
+    }
+
+    return 0;
+}
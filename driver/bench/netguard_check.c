@@ -0,0 +1,806 @@
+/*
+ * NetGuard parser and validator checks
+ *
+ * Runs the driver code that parses untrusted input in user mode against the
+ * shim in bench/shim: inbound DNS answers (ParseDnsResponse and the
+ * ReadDnsName it uses), pattern sets from the service (BuildPatternTable)
+ * and the boot policy read back from the registry (ValidatePolicy, through
+ * LoadBootPolicy). Well-formed input must be accepted exactly; malformed,
+ * truncated and hostile input must be rejected without reading past it.
+ * The registry is one in-memory value.
+ *
+ * Usage: netguard_check
+ * Prints each failed check and exits non-zero if there was one.
+ */
+
+#include "netguard.h"
+
+#include <stdio.h>
+
+_Thread_local ULONG ShimProcessorIndex;
+
+NETGUARD_CONTEXT g_Context;
+
+// netguard_dns.c's, where the question name starts
+#define DNS_HEADER_SIZE 12
+
+static int g_Failures;
+
+#define CHECK(condition, what) \
+    do { \
+        if (!(condition)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, (what)); \
+            g_Failures++; \
+        } \
+    } while (0)
+
+//
+// Registry shim: the Policy value under the Parameters key
+//
+
+#define CHECK_REGISTRY_MAX 8192
+
+static UCHAR g_RegistryValue[CHECK_REGISTRY_MAX];
+static ULONG g_RegistryLength;
+static ULONG g_RegistryType;
+static BOOLEAN g_RegistryPresent;
+
+NTSTATUS ZwOpenKey(PHANDLE key, ACCESS_MASK access, POBJECT_ATTRIBUTES attributes) {
+    (void)access; (void)attributes;
+    *key = (HANDLE)&g_RegistryValue;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwCreateKey(PHANDLE key, ACCESS_MASK access, POBJECT_ATTRIBUTES attributes, ULONG titleIndex,
+                     PUNICODE_STRING keyClass, ULONG createOptions, PULONG disposition) {
+    (void)titleIndex; (void)keyClass; (void)createOptions; (void)disposition;
+    return ZwOpenKey(key, access, attributes);
+}
+
+NTSTATUS ZwQueryValueKey(HANDLE key, PUNICODE_STRING valueName, KEY_VALUE_INFORMATION_CLASS infoClass,
+                         PVOID information, ULONG length, PULONG resultLength) {
+    (void)key; (void)valueName;
+    if (!g_RegistryPresent || infoClass != KeyValuePartialInformation) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    ULONG needed = FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + g_RegistryLength;
+    *resultLength = needed;
+    if (length < needed) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    PKEY_VALUE_PARTIAL_INFORMATION value = (PKEY_VALUE_PARTIAL_INFORMATION)information;
+    value->TitleIndex = 0;
+    value->Type = g_RegistryType;
+    value->DataLength = g_RegistryLength;
+    RtlCopyMemory(value->Data, g_RegistryValue, g_RegistryLength);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwSetValueKey(HANDLE key, PUNICODE_STRING valueName, ULONG titleIndex, ULONG type,
+                       PVOID data, ULONG size) {
+    (void)key; (void)valueName; (void)titleIndex;
+    if (size > CHECK_REGISTRY_MAX) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlCopyMemory(g_RegistryValue, data, size);
+    g_RegistryLength = size;
+    g_RegistryType = type;
+    g_RegistryPresent = TRUE;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwClose(HANDLE handle) {
+    (void)handle;
+    return STATUS_SUCCESS;
+}
+
+// Events go nowhere; netguard_classify.c is linked but never called
+void PublishEvent(PNETGUARD_EVENT event) {
+    UNREFERENCED_PARAMETER(event);
+}
+
+//
+// DNS responses
+//
+
+typedef struct _DNS_MESSAGE {
+    UCHAR data[2 * DNS_MAX_MESSAGE];
+    ULONG length;
+} DNS_MESSAGE, *PDNS_MESSAGE;
+
+static void Put8(PDNS_MESSAGE message, UINT32 value) {
+    if (message->length < sizeof(message->data)) {
+        message->data[message->length++] = (UCHAR)value;
+    }
+}
+
+static void Put16(PDNS_MESSAGE message, UINT32 value) {
+    Put8(message, value >> 8);
+    Put8(message, value);
+}
+
+static void Put32(PDNS_MESSAGE message, UINT32 value) {
+    Put16(message, value >> 16);
+    Put16(message, value);
+}
+
+// Helper: Append a dotted name as uncompressed labels
+static void PutName(PDNS_MESSAGE message, const char* name) {
+    while (*name) {
+        const char* dot = strchr(name, '.');
+        SIZE_T label = dot ? (SIZE_T)(dot - name) : strlen(name);
+        Put8(message, (UINT32)label);
+        for (SIZE_T i = 0; i < label; i++) {
+            Put8(message, (UCHAR)name[i]);
+        }
+        name += label + (dot ? 1 : 0);
+    }
+    Put8(message, 0);
+}
+
+static void PutHeader(PDNS_MESSAGE message, UINT32 flags, UINT32 questions, UINT32 answers) {
+    message->length = 0;
+    Put16(message, 0x1234); // ID
+    Put16(message, flags);
+    Put16(message, questions);
+    Put16(message, answers);
+    Put16(message, 0);
+    Put16(message, 0);
+}
+
+// Helper: An answer record whose name points back at the question
+static void PutRecord(PDNS_MESSAGE message, UINT32 type, UINT32 recordClass, UINT32 ttl,
+                      const UCHAR* data, UINT32 dataLength) {
+    Put16(message, 0xC00C);
+    Put16(message, type);
+    Put16(message, recordClass);
+    Put32(message, ttl);
+    Put16(message, dataLength);
+    for (UINT32 i = 0; i < dataLength; i++) {
+        Put8(message, data[i]);
+    }
+}
+
+static void PutRecordA(PDNS_MESSAGE message, UINT32 address, UINT32 ttl) {
+    UCHAR data[4] = { (UCHAR)(address >> 24), (UCHAR)(address >> 16), (UCHAR)(address >> 8), (UCHAR)address };
+    PutRecord(message, 1, 1, ttl, data, sizeof(data));
+}
+
+// Helper: A standard response for name with a single A record
+static void BuildResponseA(PDNS_MESSAGE message, const char* name, UINT32 address) {
+    PutHeader(message, 0x8180, 1, 1);
+    PutName(message, name);
+    Put16(message, 1);
+    Put16(message, 1);
+    PutRecordA(message, address, 3600);
+}
+
+static void ResetDnsCache(void) {
+    RtlZeroMemory(g_Context.DnsCache, DNS_CACHE_BUCKETS * DNS_CACHE_WAYS * sizeof(DNS_CACHE_ENTRY));
+}
+
+// Helper: Cached name of an IPv4 address as a terminated string, "" if none
+static const char* LookupName4(UINT32 address4) {
+    static CHAR name[DNS_MAX_NAME_LENGTH + 1];
+    UINT8 address[NETGUARD_ADDRESS_LENGTH];
+
+    MapAddress4(address4, address);
+    UINT32 length = LookupDnsName(address, name);
+    name[length] = '\0';
+    return name;
+}
+
+// Helper: Whether parsing message caches nothing for address4
+static BOOLEAN ParsesToNothing(PDNS_MESSAGE message, UINT32 address4) {
+    ResetDnsCache();
+    ParseDnsResponse(message->data, message->length);
+    return LookupName4(address4)[0] == '\0';
+}
+
+static void CheckDnsValid(void) {
+    DNS_MESSAGE message;
+
+    ResetDnsCache();
+    BuildResponseA(&message, "WWW.Example.COM", 0x5DB8D822);
+    ParseDnsResponse(message.data, message.length);
+    CHECK(strcmp(LookupName4(0x5DB8D822), "www.example.com") == 0, "A record cached under the folded question name");
+    CHECK(LookupName4(0x5DB8D823)[0] == '\0', "other address has no name");
+
+    // A CNAME first, then A and AAAA records; a TTL of 0 is raised to the minimum
+    static const UCHAR cname[] = { 3, 'c', 'd', 'n', 0xC0, 0x0C };
+    static const UCHAR address6[NETGUARD_ADDRESS_LENGTH] = {
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+    ResetDnsCache();
+    PutHeader(&message, 0x8180, 1, 3);
+    PutName(&message, "example.com");
+    Put16(&message, 1);
+    Put16(&message, 1);
+    PutRecord(&message, 5, 1, 60, cname, sizeof(cname));
+    PutRecordA(&message, 0x0A000001, 0);
+    PutRecord(&message, 28, 1, 60, address6, sizeof(address6));
+    ParseDnsResponse(message.data, message.length);
+    CHECK(strcmp(LookupName4(0x0A000001), "example.com") == 0, "A record after a CNAME cached");
+
+    CHAR name[DNS_MAX_NAME_LENGTH];
+    UINT32 length = LookupDnsName(address6, name);
+    CHECK(length == 11 && memcmp(name, "example.com", 11) == 0, "AAAA record cached");
+
+    // Records of another class or with the wrong data length are skipped
+    static const UCHAR short6[4] = { 0x0A, 0, 0, 2 };
+    ResetDnsCache();
+    PutHeader(&message, 0x8180, 1, 2);
+    PutName(&message, "example.com");
+    Put16(&message, 1);
+    Put16(&message, 1);
+    PutRecord(&message, 1, 3, 60, short6, sizeof(short6));
+    PutRecord(&message, 28, 1, 60, short6, sizeof(short6));
+    ParseDnsResponse(message.data, message.length);
+    CHECK(LookupName4(0x0A000002)[0] == '\0', "CH class and short AAAA records ignored");
+}
+
+static void CheckDnsHeader(void) {
+    DNS_MESSAGE message;
+
+    BuildResponseA(&message, "example.com", 0x0A000003);
+    message.data[2] = 0x01; // A query, not a response
+    CHECK(ParsesToNothing(&message, 0x0A000003), "query ignored");
+
+    BuildResponseA(&message, "example.com", 0x0A000003);
+    message.data[3] = 0x83; // NXDOMAIN
+    CHECK(ParsesToNothing(&message, 0x0A000003), "error response ignored");
+
+    BuildResponseA(&message, "example.com", 0x0A000003);
+    message.data[5] = 2; // Two questions
+    CHECK(ParsesToNothing(&message, 0x0A000003), "response to several questions ignored");
+
+    BuildResponseA(&message, "example.com", 0x0A000003);
+    message.data[7] = 0; // No answers
+    CHECK(ParsesToNothing(&message, 0x0A000003), "response without answers ignored");
+
+    BuildResponseA(&message, "example.com", 0x0A000003);
+    message.data[7] = 2; // An answer count past the records present
+    ResetDnsCache();
+    ParseDnsResponse(message.data, message.length);
+    CHECK(strcmp(LookupName4(0x0A000003), "example.com") == 0, "records before a missing one still cached");
+}
+
+static void CheckDnsTruncated(void) {
+    DNS_MESSAGE message;
+    BOOLEAN clean = TRUE;
+
+    // Every prefix of a one-record response cuts that record
+    BuildResponseA(&message, "truncated.example.com", 0x0A000004);
+    ULONG full = message.length;
+    for (ULONG length = 0; length < full; length++) {
+        message.length = length;
+        if (!ParsesToNothing(&message, 0x0A000004)) {
+            printf("  truncated to %u bytes\n", length);
+            clean = FALSE;
+        }
+    }
+    CHECK(clean, "truncated response ignored");
+
+    message.length = full;
+    CHECK(!ParsesToNothing(&message, 0x0A000004), "untruncated response cached");
+
+    // Record data running past the end
+    BuildResponseA(&message, "example.com", 0x0A000004);
+    message.data[message.length - 5] = 8;
+    CHECK(ParsesToNothing(&message, 0x0A000004), "record data past the end ignored");
+}
+
+static void CheckDnsPointers(void) {
+    DNS_MESSAGE message;
+
+    // Question name pointing at itself
+    PutHeader(&message, 0x8180, 1, 1);
+    Put16(&message, 0xC00C);
+    Put16(&message, 1);
+    Put16(&message, 1);
+    PutRecordA(&message, 0x0A000005, 60);
+    CHECK(ParsesToNothing(&message, 0x0A000005), "self-referencing question name rejected");
+
+    // Two labels pointing at each other
+    PutHeader(&message, 0x8180, 1, 1);
+    Put8(&message, 1);
+    Put8(&message, 'a');
+    Put16(&message, 0xC010); // To "b", which points back at "a"
+    Put8(&message, 1);
+    Put8(&message, 'b');
+    Put16(&message, 0xC00C);
+    Put16(&message, 1);
+    Put16(&message, 1);
+    PutRecordA(&message, 0x0A000005, 60);
+    CHECK(ParsesToNothing(&message, 0x0A000005), "pointer loop between labels rejected");
+
+    // An answer name pointing at itself
+    PutHeader(&message, 0x8180, 1, 1);
+    PutName(&message, "example.com");
+    Put16(&message, 1);
+    Put16(&message, 1);
+    ULONG answer = message.length;
+    PutRecordA(&message, 0x0A000005, 60);
+    message.data[answer] = 0xC0 | (UCHAR)(answer >> 8);
+    message.data[answer + 1] = (UCHAR)answer;
+    CHECK(ParsesToNothing(&message, 0x0A000005), "self-referencing answer name rejected");
+
+    // Pointers past the end, and one cut in half
+    BuildResponseA(&message, "example.com", 0x0A000005);
+    message.data[message.length - 16] = 0xFF;
+    message.data[message.length - 15] = 0xFF;
+    CHECK(ParsesToNothing(&message, 0x0A000005), "pointer past the end rejected");
+
+    PutHeader(&message, 0x8180, 1, 1);
+    Put8(&message, 0xC0);
+    CHECK(ParsesToNothing(&message, 0x0A000005), "pointer cut short rejected");
+
+    // A chain of DNS_MAX_POINTERS pointers is followed, one more is not: the
+    // question name points into a chain after the answer, which ends at a
+    // name the answer points at directly
+    for (int pointers = 16; pointers <= 17; pointers++) {
+        ULONG chain = DNS_HEADER_SIZE + 2 + 4 + 16;
+        PutHeader(&message, 0x8180, 1, 1);
+        Put16(&message, 0xC000 | chain);
+        Put16(&message, 1);
+        Put16(&message, 1);
+        ULONG answer = message.length;
+        PutRecordA(&message, 0x0A000006, 60);
+        ULONG target = chain + 2 * (pointers - 1);
+        message.data[answer] = 0xC0 | (UCHAR)(target >> 8);
+        message.data[answer + 1] = (UCHAR)target;
+        for (int i = 1; i < pointers; i++) {
+            Put16(&message, 0xC000 | (message.length + 2));
+        }
+        PutName(&message, "chain");
+        ResetDnsCache();
+        ParseDnsResponse(message.data, message.length);
+        if (pointers == 16) {
+            CHECK(strcmp(LookupName4(0x0A000006), "chain") == 0, "16 pointers followed");
+        } else {
+            CHECK(LookupName4(0x0A000006)[0] == '\0', "17 pointers rejected");
+        }
+    }
+}
+
+static void CheckDnsNames(void) {
+    DNS_MESSAGE message;
+    CHAR name[DNS_MAX_NAME_LENGTH + 2];
+
+    // 63 + 63 + 63 + 61 characters and three dots: the longest name
+    memset(name, 'a', sizeof(name));
+    name[63] = name[127] = name[191] = '.';
+    name[DNS_MAX_NAME_LENGTH] = '\0';
+    BuildResponseA(&message, name, 0x0A000007);
+    ResetDnsCache();
+    ParseDnsResponse(message.data, message.length);
+    CHECK(strcmp(LookupName4(0x0A000007), name) == 0, "253-character name cached");
+
+    name[DNS_MAX_NAME_LENGTH] = 'a';
+    name[DNS_MAX_NAME_LENGTH + 1] = '\0';
+    BuildResponseA(&message, name, 0x0A000007);
+    CHECK(ParsesToNothing(&message, 0x0A000007), "254-character name rejected");
+
+    // Four full labels overflow the name buffer
+    PutHeader(&message, 0x8180, 1, 1);
+    for (int label = 0; label < 4; label++) {
+        Put8(&message, 63);
+        for (int i = 0; i < 63; i++) {
+            Put8(&message, 'a');
+        }
+    }
+    Put8(&message, 0);
+    Put16(&message, 1);
+    Put16(&message, 1);
+    PutRecordA(&message, 0x0A000007, 60);
+    CHECK(ParsesToNothing(&message, 0x0A000007), "four 63-character labels rejected");
+
+    // Reserved label types (0x40, 0x80)
+    for (UINT32 type = 0x40; type <= 0x80; type += 0x40) {
+        BuildResponseA(&message, "example.com", 0x0A000008);
+        message.data[DNS_HEADER_SIZE] = (UCHAR)(type | 7);
+        CHECK(ParsesToNothing(&message, 0x0A000008), "reserved label type rejected");
+    }
+
+    // Label running past the end
+    PutHeader(&message, 0x8180, 1, 1);
+    Put8(&message, 20);
+    Put8(&message, 'a');
+    CHECK(ParsesToNothing(&message, 0x0A000008), "label past the end rejected");
+
+    // Characters outside printable ASCII
+    static const UCHAR bad[] = { ' ', 0x01, 0x7F, 0x80, 0xFF };
+    for (SIZE_T i = 0; i < RTL_NUMBER_OF(bad); i++) {
+        BuildResponseA(&message, "example.com", 0x0A000009);
+        message.data[DNS_HEADER_SIZE + 3] = bad[i];
+        CHECK(ParsesToNothing(&message, 0x0A000009), "unprintable name character rejected");
+    }
+
+    // The root name
+    BuildResponseA(&message, "", 0x0A00000A);
+    CHECK(ParsesToNothing(&message, 0x0A00000A), "empty question name ignored");
+}
+
+//
+// Pattern sets
+//
+
+// Two classes ('x' and U+4E00, anything else) and two states: state 0 stays
+// put until an 'x', state 1 is a final blocking state. Matches any path
+// containing an 'x'.
+typedef struct _CHECK_PATTERN_SET {
+    PATTERN_SET_HEADER header;
+    UINT8 asciiClass[128];
+    PATTERN_WIDE_CLASS wide[1];
+    PATTERN_STATE states[2];
+    UINT16 next[2][2];
+} CHECK_PATTERN_SET;
+
+static void BuildPatternSet(CHECK_PATTERN_SET* set) {
+    RtlZeroMemory(set, sizeof(*set));
+    set->header.version = PATTERN_SET_VERSION;
+    set->header.classCount = 2;
+    set->header.stateCount = 2;
+    set->header.wideCount = 1;
+    set->asciiClass['x'] = 1;
+    set->wide[0].character = 0x4E00;
+    set->wide[0].classIndex = 1;
+    set->states[1].verdict = PATTERN_VERDICT_BLOCK;
+    set->states[1].flags = PATTERN_STATE_FINAL;
+    set->states[1].priority = 5;
+    set->next[0][0] = 0;
+    set->next[0][1] = 1;
+    set->next[1][0] = 1;
+    set->next[1][1] = 1;
+}
+
+// Helper: Status of building a table from data; a built table is freed
+static NTSTATUS BuildStatus(const void* data, ULONG length) {
+    PPATTERN_TABLE table = NULL;
+    NTSTATUS status = BuildPatternTable((const UCHAR*)data, length, &table);
+
+    CHECK(NT_SUCCESS(status) || !table, "failed build returned a table");
+    if (table) {
+        ExFreePoolWithTag(table, NETGUARD_POOL_TAG);
+    }
+    return status;
+}
+
+static BOOLEAN PathBlocked(const WCHAR* path) {
+    SIZE_T length = wcsnlen(path, MAX_PATH_LENGTH);
+    BOOLEAN blocked = FALSE;
+    return IsAppInList(path, length, HashProcessPath(path, length), &blocked) && blocked;
+}
+
+static void CheckPatternValid(void) {
+    CHECK_PATTERN_SET set;
+    PPATTERN_TABLE table;
+
+    BuildPatternSet(&set);
+    CHECK(NT_SUCCESS(BuildPatternTable((const UCHAR*)&set, sizeof(set), &table)) && table, "valid set built");
+    if (!table) {
+        return;
+    }
+    CHECK(table->MaxPriority == 5 && table->ClassCount == 2 && table->SourceLength == sizeof(set),
+          "table describes the set");
+
+    static const WCHAR wide[] = { L'\\', L'a', 0x4E00, L'.', L'e', L'x', L'e', 0 };
+    g_Context.ActivePatterns = table;
+    CHECK(PathBlocked(L"\\device\\x"), "path with an x blocked");
+    CHECK(PathBlocked(L"\\DEVICE\\X"), "pattern match folds case");
+    CHECK(PathBlocked(wide), "wide class matched");
+    CHECK(!PathBlocked(L"\\device\\abc.dll"), "path without an x not matched");
+    g_Context.ActivePatterns = NULL;
+    ExFreePoolWithTag(table, NETGUARD_POOL_TAG);
+
+    // No states removes the pattern rules
+    BuildPatternSet(&set);
+    set.header.stateCount = 0;
+    CHECK(NT_SUCCESS(BuildPatternTable((const UCHAR*)&set, sizeof(PATTERN_SET_HEADER), &table)) && !table,
+          "empty set builds no table");
+}
+
+static void CheckPatternInvalid(void) {
+    CHECK_PATTERN_SET set;
+
+    BuildPatternSet(&set);
+    CHECK(BuildStatus(&set, sizeof(PATTERN_SET_HEADER) - 1) == STATUS_BUFFER_TOO_SMALL, "short header rejected");
+    CHECK(BuildStatus(&set, sizeof(set) - 1) == STATUS_INVALID_PARAMETER, "short set rejected");
+
+    UCHAR longer[sizeof(set) + 2];
+    RtlCopyMemory(longer, &set, sizeof(set));
+    CHECK(BuildStatus(longer, sizeof(longer)) == STATUS_INVALID_PARAMETER, "trailing bytes rejected");
+
+    set.header.version = PATTERN_SET_VERSION + 1;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_REVISION_MISMATCH, "unknown version rejected");
+
+    BuildPatternSet(&set);
+    set.header.classCount = 0;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "no classes rejected");
+
+    BuildPatternSet(&set);
+    set.header.classCount = PATTERN_MAX_CLASSES + 1;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "too many classes rejected");
+
+    BuildPatternSet(&set);
+    set.header.stateCount = PATTERN_MAX_STATES + 1;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "too many states rejected");
+
+    // Counts whose sizes wrap in 32 bits still have to add up
+    BuildPatternSet(&set);
+    set.header.wideCount = 0x40000001;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "wrapping wide count rejected");
+
+    BuildPatternSet(&set);
+    set.asciiClass['y'] = 2;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "ASCII class out of range rejected");
+
+    BuildPatternSet(&set);
+    set.wide[0].character = L'x';
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "ASCII wide character rejected");
+
+    BuildPatternSet(&set);
+    set.wide[0].classIndex = 2;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "wide class out of range rejected");
+
+    BuildPatternSet(&set);
+    set.next[0][1] = 2;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "next state out of range rejected");
+
+    BuildPatternSet(&set);
+    set.next[1][0] = 0;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "final state that can be left rejected");
+
+    BuildPatternSet(&set);
+    set.states[1].verdict = PATTERN_VERDICT_BLOCK + 1;
+    CHECK(BuildStatus(&set, sizeof(set)) == STATUS_INVALID_PARAMETER, "unknown verdict rejected");
+}
+
+//
+// Boot policy
+//
+
+static const WCHAR* const PolicyPaths[] = {
+    L"\\device\\harddiskvolume3\\program files\\vendor\\app.exe",
+    L"\\device\\harddiskvolume3\\tools\\blocked.exe",
+};
+
+static UNICODE_STRING g_ServiceKey;
+
+// Helper: Forget the loaded policy, as a fresh DriverEntry would start
+static void ResetPolicyState(void) {
+    FreeBootPolicy();
+    ClearRuleTable(g_Context.RuleTables[0]);
+    ClearRuleTable(g_Context.RuleTables[1]);
+    if (g_Context.ActivePatterns) {
+        ExFreePoolWithTag(g_Context.ActivePatterns, NETGUARD_POOL_TAG);
+        g_Context.ActivePatterns = NULL;
+    }
+    g_Context.Enabled = FALSE;
+    g_Context.PermitUnknown = FALSE;
+    g_Context.PendingTimeoutAllow = FALSE;
+}
+
+// Helper: Load a policy blob from the registry shim into a reset driver.
+// Returns the status and whether anything at all was loaded.
+static NTSTATUS LoadPolicy(const UCHAR* data, ULONG length, ULONG type, PBOOLEAN loaded) {
+    ResetPolicyState();
+    RtlCopyMemory(g_RegistryValue, data, length);
+    g_RegistryLength = length;
+    g_RegistryType = type;
+    g_RegistryPresent = TRUE;
+
+    NTSTATUS status = LoadBootPolicy(&g_ServiceKey);
+    *loaded = g_Context.Enabled || g_Context.ActivePatterns || g_Context.RuleTables[0]->Count ||
+              g_Context.RuleTables[1]->Count;
+    return status;
+}
+
+// Helper: Save the two PolicyPaths rules, the pattern set and the filtering
+// settings through SaveBootPolicy, leaving the blob in the registry shim
+static BOOLEAN SavePolicy(void) {
+    CHECK_PATTERN_SET set;
+    PPATTERN_TABLE patterns;
+
+    // DriverEntry loads (here: finds no policy) before anything can be saved
+    ResetPolicyState();
+    g_RegistryPresent = FALSE;
+    LoadBootPolicy(&g_ServiceKey);
+
+    AcquireRuleLock();
+    for (int copy = 0; copy < 2; copy++) {
+        PRULE_TABLE table = StandbyRules();
+        for (SIZE_T i = 0; i < RTL_NUMBER_OF(PolicyPaths); i++) {
+            SIZE_T length = wcsnlen(PolicyPaths[i], MAX_PATH_LENGTH);
+            UpsertAllowedApp(table, PolicyPaths[i], length, i == 1, 0, HashProcessPath(PolicyPaths[i], length));
+        }
+        PublishRules(table);
+    }
+    ReleaseRuleLock();
+
+    BuildPatternSet(&set);
+    if (!NT_SUCCESS(BuildPatternTable((const UCHAR*)&set, sizeof(set), &patterns))) {
+        return FALSE;
+    }
+    g_Context.ActivePatterns = patterns;
+    g_Context.Enabled = TRUE;
+    g_Context.PermitUnknown = TRUE;
+    g_Context.PendingTimeout = 30000LL * 10000;
+
+    g_RegistryPresent = FALSE;
+    return NT_SUCCESS(SaveBootPolicy()) && g_RegistryPresent && g_RegistryType == REG_BINARY;
+}
+
+static void CheckPolicyRoundTrip(void) {
+    UCHAR saved[CHECK_REGISTRY_MAX];
+    BOOLEAN loaded;
+
+    CHECK(SavePolicy(), "policy saved");
+    ULONG length = g_RegistryLength;
+    RtlCopyMemory(saved, g_RegistryValue, length);
+
+    CHECK(NT_SUCCESS(LoadPolicy(saved, length, REG_BINARY, &loaded)), "saved policy loads");
+    CHECK(g_Context.Enabled && g_Context.PermitUnknown && g_Context.PendingTimeout == 30000LL * 10000,
+          "settings restored");
+    CHECK(g_Context.RuleTables[0]->Count == 2 && g_Context.RuleTables[1]->Count == 2, "both copies loaded");
+    CHECK(g_Context.ActivePatterns && g_Context.ActivePatterns->SourceLength == sizeof(CHECK_PATTERN_SET),
+          "pattern set restored");
+
+    BOOLEAN blocked = TRUE;
+    SIZE_T pathLength = wcsnlen(PolicyPaths[0], MAX_PATH_LENGTH);
+    CHECK(IsAppInList(PolicyPaths[0], pathLength, HashProcessPath(PolicyPaths[0], pathLength), &blocked) &&
+          !blocked, "allowed rule restored");
+    CHECK(PathBlocked(PolicyPaths[1]), "blocked rule restored");
+    CHECK(PathBlocked(L"\\device\\other\\x.exe"), "pattern rule restored");
+
+    g_RegistryPresent = FALSE;
+    ResetPolicyState();
+    CHECK(LoadBootPolicy(&g_ServiceKey) == STATUS_OBJECT_NAME_NOT_FOUND && !g_Context.Enabled,
+          "missing policy loads nothing");
+}
+
+// Helper: Expect a modified copy of the saved policy to be rejected whole
+static void CheckPolicyRejected(const UCHAR* data, ULONG length, ULONG type, const char* what) {
+    BOOLEAN loaded;
+    NTSTATUS status = LoadPolicy(data, length, type, &loaded);
+    CHECK(!NT_SUCCESS(status) && !loaded, what);
+}
+
+// The saved policy that CheckPolicyInvalid modifies. Like registry data, the
+// entries and the pattern set in it are not naturally aligned, so they are
+// only ever copied in and out.
+static UCHAR g_SavedPolicy[CHECK_REGISTRY_MAX];
+static ULONG g_SavedLength;
+static UCHAR g_Blob[CHECK_REGISTRY_MAX];
+
+// Helpers: Reset g_Blob to the saved policy, with one part replaced
+static void BlobWithHeader(const POLICY_HEADER* header) {
+    RtlCopyMemory(g_Blob, g_SavedPolicy, g_SavedLength);
+    RtlCopyMemory(g_Blob, header, sizeof(*header));
+}
+
+static void BlobWithEntry(UINT32 index, const POLICY_ENTRY* entry) {
+    RtlCopyMemory(g_Blob, g_SavedPolicy, g_SavedLength);
+    RtlCopyMemory(g_Blob + sizeof(POLICY_HEADER) + (SIZE_T)index * sizeof(POLICY_ENTRY), entry, sizeof(*entry));
+}
+
+static void CheckPolicyInvalid(void) {
+    POLICY_HEADER header;
+    POLICY_HEADER changedHeader;
+    POLICY_ENTRY entry;
+    POLICY_ENTRY changedEntry;
+    PATTERN_SET_HEADER patternHeader;
+    BOOLEAN loaded;
+
+    if (!SavePolicy()) {
+        CHECK(FALSE, "policy saved");
+        return;
+    }
+    g_SavedLength = g_RegistryLength;
+    RtlCopyMemory(g_SavedPolicy, g_RegistryValue, g_SavedLength);
+    RtlCopyMemory(&header, g_SavedPolicy, sizeof(header));
+    RtlCopyMemory(&entry, g_SavedPolicy + sizeof(POLICY_HEADER) + sizeof(POLICY_ENTRY), sizeof(entry));
+    ULONG length = g_SavedLength;
+
+    BlobWithHeader(&header);
+    CheckPolicyRejected(g_Blob, length, REG_DWORD, "policy of another type rejected");
+    CheckPolicyRejected(g_Blob, sizeof(POLICY_HEADER) - 1, REG_BINARY, "short header rejected");
+    CheckPolicyRejected(g_Blob, length - 1, REG_BINARY, "truncated policy rejected");
+    CheckPolicyRejected(g_Blob, length + 1, REG_BINARY, "trailing byte rejected");
+
+    changedHeader = header;
+    changedHeader.magic ^= 1;
+    BlobWithHeader(&changedHeader);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "bad magic rejected");
+
+    changedHeader = header;
+    changedHeader.version = POLICY_VERSION - 1;
+    BlobWithHeader(&changedHeader);
+    CHECK(LoadPolicy(g_Blob, length, REG_BINARY, &loaded) == STATUS_REVISION_MISMATCH && !loaded,
+          "old version rejected as a mismatch");
+
+    changedHeader = header;
+    changedHeader.count = 0x10000001; // Entry bytes overflow 32 bits
+    BlobWithHeader(&changedHeader);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "wrapping entry count rejected");
+
+    changedHeader = header;
+    changedHeader.pathChars += 1;
+    BlobWithHeader(&changedHeader);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "path length mismatch rejected");
+
+    // Entry path ranges and hashes
+    changedEntry = entry;
+    changedEntry.pathHash ^= 1;
+    BlobWithEntry(1, &changedEntry);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "hash not matching its path rejected");
+
+    changedEntry = entry;
+    changedEntry.pathLength = 0;
+    BlobWithEntry(1, &changedEntry);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "empty path rejected");
+
+    changedEntry = entry;
+    changedEntry.pathLength = MAX_PATH_LENGTH;
+    BlobWithEntry(1, &changedEntry);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "over-long path rejected");
+
+    changedEntry = entry;
+    changedEntry.pathOffset = header.pathChars - entry.pathLength + 1;
+    BlobWithEntry(1, &changedEntry);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "path past the path block rejected");
+
+    changedEntry = entry;
+    changedEntry.pathOffset = 0xFFFFFFFF;
+    BlobWithEntry(1, &changedEntry);
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "wrapping path offset rejected");
+
+    // A bad pattern set discards the rules that validated too
+    BlobWithHeader(&header);
+    PUCHAR patterns = g_Blob + length - header.patternLength;
+    RtlCopyMemory(&patternHeader, patterns, sizeof(patternHeader));
+    patternHeader.version = PATTERN_SET_VERSION + 1;
+    RtlCopyMemory(patterns, &patternHeader, sizeof(patternHeader));
+    CheckPolicyRejected(g_Blob, length, REG_BINARY, "policy with a bad pattern set rejected");
+
+    BlobWithHeader(&header);
+    CHECK(NT_SUCCESS(LoadPolicy(g_Blob, length, REG_BINARY, &loaded)) && loaded, "unmodified policy still loads");
+}
+
+int main(void) {
+    // The same set-up DriverEntry does for these parts
+    RtlZeroMemory(&g_Context, sizeof(g_Context));
+    g_Context.CpuStatsCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    g_Context.CpuStats = (PCPU_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        g_Context.CpuStatsCount * sizeof(CPU_STATS), NETGUARD_POOL_TAG);
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    g_Context.LatencyFrequency = frequency.QuadPart;
+    g_Context.LatencyNsPerTick = (1000000000ULL << 32) / (ULONG64)frequency.QuadPart;
+    if (!g_Context.CpuStats || !NT_SUCCESS(InitializeRuleTables()) || !NT_SUCCESS(InitializeDnsCache())) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    RtlInitUnicodeString(&g_ServiceKey, L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\NetGuardWFP");
+
+    CheckDnsValid();
+    CheckDnsHeader();
+    CheckDnsTruncated();
+    CheckDnsPointers();
+    CheckDnsNames();
+    CheckPatternValid();
+    CheckPatternInvalid();
+    CheckPolicyRoundTrip();
+    CheckPolicyInvalid();
+
+    ResetPolicyState();
+    FreeDnsCache();
+
+    if (g_Failures) {
+        printf("%d check(s) failed\n", g_Failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
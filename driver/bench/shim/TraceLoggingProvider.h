@@ -0,0 +1,37 @@
+/*
+ * NetGuard benchmark - user-mode stand-in for TraceLoggingProvider.h
+ *
+ * No ETW session ever listens, so events are type-checked but never
+ * evaluated, like the disabled provider in the driver minus its enabled
+ * check.
+ */
+
+#pragma once
+
+typedef struct _TLG_PROVIDER* TraceLoggingHProvider;
+
+#define TRACELOGGING_DECLARE_PROVIDER(handle) extern const TraceLoggingHProvider handle
+
+#define WINEVENT_OPCODE_START   1
+#define WINEVENT_OPCODE_STOP    2
+#define WINEVENT_LEVEL_INFO     4
+#define WINEVENT_LEVEL_VERBOSE  5
+
+#define TraceLoggingOpcode(opcode) (opcode)
+#define TraceLoggingLevel(level) (level)
+#define TraceLoggingKeyword(keyword) (keyword)
+#define TraceLoggingBoolean(value, name) (value)
+#define TraceLoggingUInt16(value, name) (value)
+#define TraceLoggingUInt32(value, name) (value)
+#define TraceLoggingUInt64(value, name) (value)
+#define TraceLoggingInt32(value, name) (value)
+#define TraceLoggingInt64(value, name) (value)
+#define TraceLoggingNTStatus(value, name) (value)
+#define TraceLoggingBinary(value, size, name) (value), (size)
+
+static inline void ShimTraceLoggingWrite(const char* name, ...) {
+    (void)name;
+}
+
+#define TraceLoggingWrite(provider, name, ...) \
+    do { if (0) ShimTraceLoggingWrite(name, __VA_ARGS__); } while (0)
@@ -0,0 +1,5 @@
+/*
+ * NetGuard benchmark - user-mode stand-in for fwpmk.h (nothing is needed)
+ */
+
+#pragma once
@@ -0,0 +1,199 @@
+/*
+ * NetGuard benchmark - user-mode stand-in for fwpsk.h
+ *
+ * The classify-side WFP types, with only the fields the engine reads. Every
+ * ALE authorization layer gets the IPv4 connect layer's field order.
+ * Pending an operation always succeeds and completing one does nothing.
+ */
+
+#pragma once
+
+typedef UINT32 FWP_ACTION_TYPE;
+
+#define FWP_ACTION_FLAG_TERMINATING     0x00001000
+#define FWP_ACTION_FLAG_NON_TERMINATING 0x00002000
+#define FWP_ACTION_BLOCK    (0x00000001 | FWP_ACTION_FLAG_TERMINATING)
+#define FWP_ACTION_PERMIT   (0x00000002 | FWP_ACTION_FLAG_TERMINATING)
+#define FWP_ACTION_CONTINUE (0x00000006 | FWP_ACTION_FLAG_NON_TERMINATING)
+
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+#define FWP_CONDITION_FLAG_IS_LOOPBACK    0x00000001
+#define FWP_CONDITION_FLAG_IS_REAUTHORIZE 0x00000004
+
+typedef enum FWP_DIRECTION_ {
+    FWP_DIRECTION_OUTBOUND,
+    FWP_DIRECTION_INBOUND
+} FWP_DIRECTION;
+
+typedef struct FWP_BYTE_BLOB_ {
+    UINT32 size;
+    UINT8* data;
+} FWP_BYTE_BLOB;
+
+typedef struct FWP_BYTE_ARRAY16_ {
+    UINT8 byteArray16[16];
+} FWP_BYTE_ARRAY16;
+
+typedef struct FWP_VALUE0_ {
+    UINT32 type;
+    union {
+        UINT8 uint8;
+        UINT16 uint16;
+        UINT32 uint32;
+        UINT64* uint64;
+        FWP_BYTE_ARRAY16* byteArray16;
+        FWP_BYTE_BLOB* byteBlob;
+    };
+} FWP_VALUE0;
+
+typedef struct FWPS_INCOMING_VALUE0_ {
+    FWP_VALUE0 value;
+} FWPS_INCOMING_VALUE0;
+
+typedef struct FWPS_INCOMING_VALUES0_ {
+    UINT16 layerId;
+    UINT32 valueCount;
+    FWPS_INCOMING_VALUE0* incomingValue;
+} FWPS_INCOMING_VALUES0;
+
+enum {
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_PROTOCOL,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_FLAGS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_MAX
+};
+
+enum {
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_PROTOCOL,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_FLAGS,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_MAX
+};
+
+enum {
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_PROTOCOL,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_FLAGS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_MAX
+};
+
+enum {
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_PROTOCOL,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_FLAGS,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_MAX
+};
+
+enum {
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_INTERFACE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_INTERFACE_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_TUNNEL_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_FLAGS,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_MAX
+};
+
+enum {
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_ALE_APP_ID,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_ALE_USER_ID,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_ADDRESS,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_ADDRESS_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_INTERFACE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_INTERFACE_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_TUNNEL_TYPE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_FLAGS,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_MAX
+};
+
+#define FWPS_METADATA_FIELD_PROCESS_PATH      0x00000080
+#define FWPS_METADATA_FIELD_PROCESS_ID        0x00000100
+#define FWPS_METADATA_FIELD_COMPLETION_HANDLE 0x00000800
+#define FWPS_IS_METADATA_FIELD_PRESENT(metadata, field) \
+    (((metadata)->currentMetadataValues & (field)) == (field))
+
+typedef struct FWPS_INCOMING_METADATA_VALUES0_ {
+    UINT32 currentMetadataValues;
+    UINT64 processId;
+    FWP_BYTE_BLOB* processPath;
+    HANDLE completionHandle;
+    UINT64 flowHandle;
+} FWPS_INCOMING_METADATA_VALUES0;
+
+#define FWPS_RIGHT_ACTION_WRITE       0x00000001
+#define FWPS_CLASSIFY_OUT_FLAG_ABSORB 0x00000001
+
+typedef struct FWPS_CLASSIFY_OUT0_ {
+    FWP_ACTION_TYPE actionType;
+    UINT64 outContext;
+    UINT64 filterId;
+    UINT32 rights;
+    UINT32 flags;
+    UINT32 reserved;
+} FWPS_CLASSIFY_OUT0;
+
+typedef struct FWPS_FILTER1_ {
+    UINT64 filterId;
+} FWPS_FILTER1;
+
+typedef enum FWPS_CALLOUT_NOTIFY_TYPE_ {
+    FWPS_CALLOUT_NOTIFY_ADD_FILTER,
+    FWPS_CALLOUT_NOTIFY_DELETE_FILTER
+} FWPS_CALLOUT_NOTIFY_TYPE;
+
+typedef struct _NET_BUFFER_LIST NET_BUFFER_LIST, *PNET_BUFFER_LIST;
+
+// Only named by netguard.h; the stream layer is not benchmarked
+typedef struct FWPS_STREAM_DATA0_ {
+    UINT32 flags;
+    SIZE_T dataLength;
+    PNET_BUFFER_LIST netBufferListChain;
+} FWPS_STREAM_DATA0;
+
+typedef struct FWPS_STREAM_CALLOUT_IO_PACKET0_ {
+    FWPS_STREAM_DATA0* streamData;
+    SIZE_T missedBytes;
+    UINT32 countBytesRequired;
+    SIZE_T countBytesEnforced;
+    UINT32 streamAction;
+} FWPS_STREAM_CALLOUT_IO_PACKET0;
+
+static inline NTSTATUS FwpsPendOperation0(HANDLE completionHandle, HANDLE* completionContext) {
+    *completionContext = completionHandle;
+    return STATUS_SUCCESS;
+}
+
+static inline void FwpsCompleteOperation0(HANDLE completionContext, PNET_BUFFER_LIST netBufferList) {
+    (void)completionContext;
+    (void)netBufferList;
+}
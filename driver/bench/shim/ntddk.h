@@ -0,0 +1,667 @@
+/*
+ * NetGuard benchmark - user-mode stand-in for ntddk.h
+ *
+ * Just enough of the kernel API for netguard_rules.c, netguard_pending.c,
+ * netguard_classify.c, netguard_dns.c and netguard_policy.c to build and run
+ * as an ordinary process. Spin locks and interlocked operations are real
+ * (GCC/Clang atomics) so multi-threaded runs contend the way classify does
+ * on real processors; IRQL changes are no-ops and DPCs run inline where
+ * they are queued.
+ *
+ * Build with -fshort-wchar: WCHAR must be 16 bits, like wchar_t on Windows.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+typedef uint8_t UINT8, UCHAR, BOOLEAN, *PUINT8, *PUCHAR, *PBOOLEAN;
+typedef uint16_t UINT16, USHORT;
+typedef uint32_t UINT32, ULONG, *PUINT32, *PULONG;
+typedef int32_t LONG, *PLONG, NTSTATUS;
+typedef uint64_t UINT64, ULONG64, ULONGLONG, *PUINT64;
+typedef int64_t LONG64, LONGLONG, *PLONG64;
+typedef uintptr_t ULONG_PTR, KSPIN_LOCK, *PKSPIN_LOCK;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef void VOID, *PVOID, *HANDLE;
+typedef char CHAR, *PCHAR;
+typedef wchar_t WCHAR, *PWCHAR;
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define MAXULONG 0xffffffffUL
+
+_Static_assert(sizeof(WCHAR) == 2, "build with -fshort-wchar");
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCHAR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _GUID {
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define TRUE 1
+#define FALSE 0
+#define NTAPI
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define RTL_NUMBER_OF(a) (sizeof(a) / sizeof((a)[0]))
+#define ANYSIZE_ARRAY 1
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+#define CTL_CODE(type, function, method, access) (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW        ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL           ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER      ((NTSTATUS)0xC000000DL)
+#define STATUS_BUFFER_TOO_SMALL       ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND  ((NTSTATUS)0xC0000034L)
+#define STATUS_REVISION_MISMATCH      ((NTSTATUS)0xC0000059L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_INTERNAL_ERROR         ((NTSTATUS)0xC00000E5L)
+#define STATUS_CANCELLED              ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND              ((NTSTATUS)0xC0000225L)
+#define NT_SUCCESS(status) (((NTSTATUS)(status)) >= 0)
+
+#define FILE_DEVICE_UNKNOWN 0x22
+#define METHOD_BUFFERED 0
+#define FILE_READ_DATA 1
+#define FILE_WRITE_DATA 2
+
+#define PASSIVE_LEVEL 0
+#define DISPATCH_LEVEL 2
+#define IO_NO_INCREMENT 0
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+// Processors the benchmark can pretend to have: one per thread
+#define SHIM_MAX_PROCESSORS 64
+
+// Processor index of the calling thread, set by the benchmark per thread
+extern _Thread_local ULONG ShimProcessorIndex;
+
+// Objects the shared header refers to but the engine never touches
+typedef struct _DEVICE_OBJECT* PDEVICE_OBJECT;
+typedef struct _FILE_OBJECT* PFILE_OBJECT;
+typedef struct _MDL* PMDL;
+typedef struct _EPROCESS* PEPROCESS;
+
+typedef struct _PS_CREATE_NOTIFY_INFO {
+    SIZE_T Size;
+} PS_CREATE_NOTIFY_INFO, *PPS_CREATE_NOTIFY_INFO;
+
+// Memory
+typedef ULONG64 POOL_FLAGS;
+#define POOL_FLAG_UNINITIALIZED 0x0000000000000002ULL
+#define POOL_FLAG_CACHE_ALIGNED 0x0000000000000004ULL
+#define POOL_FLAG_NON_PAGED     0x0000000000000040ULL
+#define POOL_FLAG_PAGED         0x0000000000000100ULL
+
+static inline PVOID ExAllocatePool2(POOL_FLAGS flags, SIZE_T size, ULONG tag) {
+    (void)tag;
+    PVOID p = aligned_alloc(64, (size + 63) & ~(SIZE_T)63);
+    if (p && !(flags & POOL_FLAG_UNINITIALIZED)) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+static inline void ExFreePoolWithTag(PVOID p, ULONG tag) {
+    (void)tag;
+    free(p);
+}
+
+// Lookaside lists hand out fresh allocations of the entry size
+typedef int POOL_TYPE;
+#define NonPagedPoolNx 512
+
+typedef struct _LOOKASIDE_LIST_EX {
+    SIZE_T Size;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+static inline NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX lookaside, PVOID allocate, PVOID free,
+                                                  POOL_TYPE poolType, ULONG flags, SIZE_T size,
+                                                  ULONG tag, USHORT depth) {
+    (void)allocate; (void)free; (void)poolType; (void)flags; (void)tag; (void)depth;
+    lookaside->Size = size;
+    return STATUS_SUCCESS;
+}
+
+static inline void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX lookaside) {
+    (void)lookaside;
+}
+
+static inline PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX lookaside) {
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, lookaside->Size, 0);
+}
+
+static inline void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX lookaside, PVOID entry) {
+    (void)lookaside;
+    ExFreePoolWithTag(entry, 0);
+}
+
+#define RtlCopyMemory(d, s, n) memcpy((d), (s), (n))
+#define RtlMoveMemory(d, s, n) memmove((d), (s), (n))
+#define RtlZeroMemory(d, n) memset((d), 0, (n))
+#define RtlFillMemory(d, n, v) memset((d), (v), (n))
+#define RtlEqualMemory(a, b, n) (memcmp((a), (b), (n)) == 0)
+
+// Strings. Only ASCII case folding; the benchmark's paths are ASCII.
+static inline WCHAR RtlDowncaseUnicodeChar(WCHAR c) {
+    return c;
+}
+
+static inline SIZE_T ShimWcsnlen(const WCHAR* s, SIZE_T maxChars) {
+    SIZE_T n = 0;
+    while (n < maxChars && s[n] != L'\0') {
+        n++;
+    }
+    return n;
+}
+
+static inline int ShimWcsnicmp(const WCHAR* a, const WCHAR* b, SIZE_T count) {
+    for (SIZE_T i = 0; i < count; i++) {
+        WCHAR ca = a[i], cb = b[i];
+        if (ca >= L'A' && ca <= L'Z') {
+            ca += L'a' - L'A';
+        }
+        if (cb >= L'A' && cb <= L'Z') {
+            cb += L'a' - L'A';
+        }
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+        if (ca == L'\0') {
+            break;
+        }
+    }
+    return 0;
+}
+
+#define wcsnlen ShimWcsnlen
+#define _wcsnicmp ShimWcsnicmp
+
+static inline void RtlInitUnicodeString(PUNICODE_STRING string, const WCHAR* source) {
+    SIZE_T length = source ? ShimWcsnlen(source, 0x7FFF) * sizeof(WCHAR) : 0;
+    string->Length = (USHORT)length;
+    string->MaximumLength = (USHORT)(source ? length + sizeof(WCHAR) : 0);
+    string->Buffer = (PWCHAR)source;
+}
+
+// Registry, for netguard_policy.c. Only declared: the correctness check
+// implements them over one in-memory value, and the benchmark never calls
+// them.
+typedef HANDLE* PHANDLE;
+typedef ULONG ACCESS_MASK;
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG Length;
+    HANDLE RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG Attributes;
+    PVOID SecurityDescriptor;
+    PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define OBJ_CASE_INSENSITIVE 0x00000040
+#define OBJ_KERNEL_HANDLE    0x00000200
+#define InitializeObjectAttributes(p, n, a, r, s) \
+    do { \
+        (p)->Length = sizeof(OBJECT_ATTRIBUTES); \
+        (p)->RootDirectory = (r); \
+        (p)->Attributes = (a); \
+        (p)->ObjectName = (n); \
+        (p)->SecurityDescriptor = (s); \
+        (p)->SecurityQualityOfService = NULL; \
+    } while (0)
+
+#define KEY_QUERY_VALUE    0x0001
+#define KEY_SET_VALUE      0x0002
+#define KEY_CREATE_SUB_KEY 0x0004
+#define KEY_READ           0x20019
+#define REG_OPTION_NON_VOLATILE 0
+#define REG_BINARY 3
+#define REG_DWORD 4
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+    KeyValueBasicInformation,
+    KeyValueFullInformation,
+    KeyValuePartialInformation,
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+    ULONG TitleIndex;
+    ULONG Type;
+    ULONG DataLength;
+    UCHAR Data[1];
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+NTSTATUS ZwOpenKey(PHANDLE key, ACCESS_MASK access, POBJECT_ATTRIBUTES attributes);
+NTSTATUS ZwCreateKey(PHANDLE key, ACCESS_MASK access, POBJECT_ATTRIBUTES attributes, ULONG titleIndex,
+                     PUNICODE_STRING keyClass, ULONG createOptions, PULONG disposition);
+NTSTATUS ZwQueryValueKey(HANDLE key, PUNICODE_STRING valueName, KEY_VALUE_INFORMATION_CLASS infoClass,
+                         PVOID information, ULONG length, PULONG resultLength);
+NTSTATUS ZwSetValueKey(HANDLE key, PUNICODE_STRING valueName, ULONG titleIndex, ULONG type,
+                       PVOID data, ULONG size);
+NTSTATUS ZwClose(HANDLE handle);
+
+// Interlocked operations and fenced reads
+static inline LONG InterlockedIncrement(volatile LONG* p) {
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedDecrement(volatile LONG* p) {
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG64 InterlockedIncrement64(volatile LONG64* p) {
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG64 InterlockedAdd64(volatile LONG64* p, LONG64 value) {
+    return __atomic_add_fetch(p, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG64 InterlockedExchange64(volatile LONG64* p, LONG64 value) {
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+static inline PVOID InterlockedExchangePointer(PVOID volatile* p, PVOID value) {
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedExchange(volatile LONG* p, LONG value) {
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedCompareExchange(volatile LONG* p, LONG exchange, LONG comparand) {
+    __atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline LONG64 InterlockedCompareExchange64(volatile LONG64* p, LONG64 exchange, LONG64 comparand) {
+    __atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline LONG ReadNoFence(const volatile LONG* p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline LONG ReadAcquire(const volatile LONG* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline LONG64 ReadNoFence64(const volatile LONG64* p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline PVOID ReadPointerNoFence(PVOID const volatile* p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline PVOID ReadPointerAcquire(PVOID const volatile* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void WriteRelease(volatile LONG* p, LONG value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static inline void KeMemoryBarrier(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// IRQL: nothing to raise in user mode
+static inline void KeRaiseIrql(KIRQL newIrql, PKIRQL oldIrql) {
+    (void)newIrql;
+    *oldIrql = PASSIVE_LEVEL;
+}
+
+static inline void KeLowerIrql(KIRQL irql) {
+    (void)irql;
+}
+
+// Spin locks
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define YieldProcessor() __asm__ __volatile__("yield")
+#else
+#define YieldProcessor() ((void)0)
+#endif
+
+static inline void KeInitializeSpinLock(PKSPIN_LOCK lock) {
+    *lock = 0;
+}
+
+static inline void KeAcquireSpinLock(PKSPIN_LOCK lock, PKIRQL oldIrql) {
+    *oldIrql = PASSIVE_LEVEL;
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            YieldProcessor();
+        }
+    }
+}
+
+static inline void KeReleaseSpinLock(PKSPIN_LOCK lock, KIRQL oldIrql) {
+    (void)oldIrql;
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// Fast mutexes
+typedef struct _FAST_MUTEX {
+    pthread_mutex_t Mutex;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+static inline void ExInitializeFastMutex(PFAST_MUTEX mutex) {
+    pthread_mutex_init(&mutex->Mutex, NULL);
+}
+
+static inline void ExAcquireFastMutex(PFAST_MUTEX mutex) {
+    pthread_mutex_lock(&mutex->Mutex);
+}
+
+static inline void ExReleaseFastMutex(PFAST_MUTEX mutex) {
+    pthread_mutex_unlock(&mutex->Mutex);
+}
+
+// Events
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode
+} MODE;
+
+typedef struct _KEVENT {
+    volatile LONG Signaled;
+} KEVENT, *PKEVENT;
+
+static inline void KeInitializeEvent(PKEVENT event, EVENT_TYPE type, BOOLEAN state) {
+    (void)type;
+    event->Signaled = state;
+}
+
+static inline LONG KeSetEvent(PKEVENT event, LONG increment, BOOLEAN wait) {
+    (void)increment;
+    (void)wait;
+    return __atomic_exchange_n(&event->Signaled, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void KeClearEvent(PKEVENT event) {
+    __atomic_store_n(&event->Signaled, 0, __ATOMIC_SEQ_CST);
+}
+
+static inline NTSTATUS KeWaitForSingleObject(PVOID object, KWAIT_REASON reason, MODE mode,
+                                             BOOLEAN alertable, PLARGE_INTEGER timeout) {
+    (void)reason;
+    (void)mode;
+    (void)alertable;
+    (void)timeout;
+    while (!__atomic_load_n(&((PKEVENT)object)->Signaled, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    return STATUS_SUCCESS;
+}
+
+// Processors and DPCs. A single "active processor" whose DPC runs inline,
+// so WaitForRuleReaders returns at once: the benchmark never publishes
+// rules while classify threads are running.
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _KDPC KDPC, *PKDPC;
+typedef void KDEFERRED_ROUTINE(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+
+struct _KDPC {
+    KDEFERRED_ROUTINE* DeferredRoutine;
+    PVOID DeferredContext;
+};
+
+static inline ULONG KeQueryActiveProcessorCountEx(USHORT group) {
+    (void)group;
+    return 1;
+}
+
+static inline ULONG KeQueryMaximumProcessorCountEx(USHORT group) {
+    (void)group;
+    return SHIM_MAX_PROCESSORS;
+}
+
+static inline ULONG KeGetCurrentProcessorIndex(void) {
+    return ShimProcessorIndex;
+}
+
+static inline NTSTATUS KeGetProcessorNumberFromIndex(ULONG index, PPROCESSOR_NUMBER processor) {
+    processor->Group = 0;
+    processor->Number = (UCHAR)index;
+    processor->Reserved = 0;
+    return STATUS_SUCCESS;
+}
+
+static inline void KeInitializeDpc(PKDPC dpc, KDEFERRED_ROUTINE* routine, PVOID context) {
+    dpc->DeferredRoutine = routine;
+    dpc->DeferredContext = context;
+}
+
+static inline NTSTATUS KeSetTargetProcessorDpcEx(PKDPC dpc, PPROCESSOR_NUMBER processor) {
+    (void)dpc;
+    (void)processor;
+    return STATUS_SUCCESS;
+}
+
+static inline BOOLEAN KeInsertQueueDpc(PKDPC dpc, PVOID argument1, PVOID argument2) {
+    dpc->DeferredRoutine(dpc, dpc->DeferredContext, argument1, argument2);
+    return TRUE;
+}
+
+// Timers never fire: the benchmark does not start the pending sweeper
+typedef struct _KTIMER {
+    int unused;
+} KTIMER, *PKTIMER;
+
+static inline void KeInitializeTimer(PKTIMER timer) {
+    (void)timer;
+}
+
+static inline BOOLEAN KeSetCoalescableTimer(PKTIMER timer, LARGE_INTEGER dueTime, ULONG period,
+                                            ULONG tolerableDelay, PKDPC dpc) {
+    (void)timer; (void)dueTime; (void)period; (void)tolerableDelay; (void)dpc;
+    return FALSE;
+}
+
+static inline BOOLEAN KeCancelTimer(PKTIMER timer) {
+    (void)timer;
+    return FALSE;
+}
+
+static inline void KeFlushQueuedDpcs(void) {
+}
+
+// System time in 100ns units since 1601, like the kernel's
+static inline void KeQuerySystemTime(PLARGE_INTEGER time) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time->QuadPart = (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100 + 116444736000000000LL;
+}
+
+// Interrupt time: 100ns units since boot, never adjusted
+static inline ULONGLONG KeQueryInterruptTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+// Performance counter at 10 MHz, the frequency Windows reports on
+// invariant-TSC hardware
+static inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency) {
+    struct timespec now;
+    LARGE_INTEGER ticks;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (frequency) {
+        frequency->QuadPart = 10000000;
+    }
+    ticks.QuadPart = (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+    return ticks;
+}
+
+static inline BOOLEAN _BitScanReverse64(ULONG* index, ULONG64 mask) {
+    if (mask == 0) {
+        return FALSE;
+    }
+    *index = 63 - (ULONG)__builtin_clzll(mask);
+    return TRUE;
+}
+
+// Lists
+static inline void InitializeListHead(PLIST_ENTRY head) {
+    head->Flink = head->Blink = head;
+}
+
+static inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+    entry->Flink = head;
+    entry->Blink = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink = entry;
+}
+
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY entry) {
+    entry->Blink->Flink = entry->Flink;
+    entry->Flink->Blink = entry->Blink;
+    return entry->Flink == entry->Blink;
+}
+
+// IRPs and the cancel-safe queue, enough for parked GET_PENDING requests
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK;
+
+typedef struct _IO_STACK_LOCATION {
+    PFILE_OBJECT FileObject;
+    union {
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+        } DeviceIoControl;
+    } Parameters;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IRP {
+    IO_STATUS_BLOCK IoStatus;
+    union {
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+    struct {
+        struct {
+            PVOID DriverContext[4];
+            LIST_ENTRY ListEntry;
+        } Overlay;
+    } Tail;
+    IO_STACK_LOCATION Stack; // The only stack location
+} IRP, *PIRP;
+
+static inline PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP irp) {
+    return &irp->Stack;
+}
+
+// Completed requests are simply dropped; the benchmark parks none
+static inline void IoCompleteRequest(PIRP irp, CHAR priorityBoost) {
+    (void)irp;
+    (void)priorityBoost;
+}
+
+typedef struct _IO_CSQ IO_CSQ, *PIO_CSQ;
+typedef NTSTATUS IO_CSQ_INSERT_IRP_EX(PIO_CSQ Csq, PIRP Irp, PVOID InsertContext);
+typedef void IO_CSQ_REMOVE_IRP(PIO_CSQ Csq, PIRP Irp);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext);
+typedef void IO_CSQ_ACQUIRE_LOCK(PIO_CSQ Csq, PKIRQL Irql);
+typedef void IO_CSQ_RELEASE_LOCK(PIO_CSQ Csq, KIRQL Irql);
+typedef void IO_CSQ_COMPLETE_CANCELED_IRP(PIO_CSQ Csq, PIRP Irp);
+
+struct _IO_CSQ {
+    IO_CSQ_INSERT_IRP_EX* InsertIrp;
+    IO_CSQ_REMOVE_IRP* RemoveIrp;
+    IO_CSQ_PEEK_NEXT_IRP* PeekNextIrp;
+    IO_CSQ_ACQUIRE_LOCK* AcquireLock;
+    IO_CSQ_RELEASE_LOCK* ReleaseLock;
+    IO_CSQ_COMPLETE_CANCELED_IRP* CompleteCanceledIrp;
+};
+
+typedef struct _IO_CSQ_IRP_CONTEXT* PIO_CSQ_IRP_CONTEXT;
+
+static inline NTSTATUS IoCsqInitializeEx(PIO_CSQ csq, IO_CSQ_INSERT_IRP_EX* insertIrp,
+                                         IO_CSQ_REMOVE_IRP* removeIrp, IO_CSQ_PEEK_NEXT_IRP* peekNextIrp,
+                                         IO_CSQ_ACQUIRE_LOCK* acquireLock, IO_CSQ_RELEASE_LOCK* releaseLock,
+                                         IO_CSQ_COMPLETE_CANCELED_IRP* completeCanceledIrp) {
+    csq->InsertIrp = insertIrp;
+    csq->RemoveIrp = removeIrp;
+    csq->PeekNextIrp = peekNextIrp;
+    csq->AcquireLock = acquireLock;
+    csq->ReleaseLock = releaseLock;
+    csq->CompleteCanceledIrp = completeCanceledIrp;
+    return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS IoCsqInsertIrpEx(PIO_CSQ csq, PIRP irp, PIO_CSQ_IRP_CONTEXT context, PVOID insertContext) {
+    KIRQL irql;
+    (void)context;
+    csq->AcquireLock(csq, &irql);
+    NTSTATUS status = csq->InsertIrp(csq, irp, insertContext);
+    csq->ReleaseLock(csq, irql);
+    return status;
+}
+
+static inline PIRP IoCsqRemoveNextIrp(PIO_CSQ csq, PVOID peekContext) {
+    KIRQL irql;
+    csq->AcquireLock(csq, &irql);
+    PIRP irp = csq->PeekNextIrp(csq, NULL, peekContext);
+    if (irp) {
+        csq->RemoveIrp(csq, irp);
+    }
+    csq->ReleaseLock(csq, irql);
+    return irp;
+}
@@ -0,0 +1,695 @@
+/*
+ * NetGuard connection-storm load test
+ *
+ * End-to-end companion to bench/: opens TCP or UDP connects at a fixed rate
+ * against a sink and reports connect latency percentiles with connection
+ * filtering disabled and enabled, and how the pending queue behaves when
+ * many unknown applications connect at once.
+ *
+ * Loopback traffic is permitted ahead of the callouts, so connects to this
+ * host (127.0.0.1 or any of its own addresses) never reach the driver. Run
+ * the sink on another machine:
+ *
+ *   netguard_load sink [-p port]
+ *   netguard_load run -s host [-p port] [-r rate] [-t threads] [-d seconds] [-u] [-m both|disabled|enabled]
+ *   netguard_load storm -s host [-p port] [-a apps] [-r rate] [-t threads] [-d seconds] [-u]
+ *
+ * run and storm talk to \\.\NetGuardWFP and need an elevated prompt. Stop
+ * the NetGuard service first: storm expects nobody to answer its prompts,
+ * and both commands change the filtering state the service set.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+// Must match netguard.h
+#define IOCTL_NETGUARD_ADD_ALLOWED    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_REMOVE_ALLOWED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_ENABLE         CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_DISABLE        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_GET_STATS      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define MAX_PATH_LENGTH 512
+
+typedef struct _ALLOWED_APP {
+    WCHAR processPath[MAX_PATH_LENGTH];
+    BOOLEAN blocked;
+} ALLOWED_APP, *PALLOWED_APP;
+
+typedef struct _NETGUARD_STATS {
+    UINT16 version;
+    UINT16 size;
+    UINT32 pendingCount;
+    UINT32 pendingHighWater;
+    UINT32 reserved;
+    UINT64 totalConnections;
+    UINT64 allowedConnections;
+    UINT64 blockedConnections;
+    UINT64 pendedConnections;
+    UINT64 timedOutConnections;
+    UINT64 droppedConnections;
+    UINT64 pidCacheHits;
+    UINT64 pidCacheMisses;
+    UINT64 addressBlockedConnections;
+} NETGUARD_STATS, *PNETGUARD_STATS;
+
+#define DEFAULT_PORT "7199"
+#define SINK_ACCEPT_THREADS 4
+#define MAX_LOAD_THREADS 256
+#define MAX_STORM_APPS 256
+#define UDP_ECHO_TIMEOUT_MS 2000
+
+typedef struct _LOAD_CONFIG {
+    SOCKADDR_STORAGE sink;
+    int sinkLength;
+    BOOL udp;
+    UINT32 rate;    // Connects per second across all threads
+    UINT32 threads;
+    UINT32 seconds;
+} LOAD_CONFIG, *PLOAD_CONFIG;
+
+typedef struct _LOAD_THREAD {
+    const LOAD_CONFIG* config;
+    UINT32 index;
+    LONGLONG start;
+    double* latencies; // Microseconds, completed connects only
+    SIZE_T capacity;
+    SIZE_T count;
+    UINT64 attempts;
+    UINT64 failed;
+} LOAD_THREAD, *PLOAD_THREAD;
+
+typedef struct _LOAD_RESULT {
+    double* latencies;
+    SIZE_T count;
+    UINT64 attempts;
+    UINT64 failed;
+    double seconds;
+} LOAD_RESULT, *PLOAD_RESULT;
+
+// Header of the result file a storm child leaves behind, followed by count
+// latencies
+typedef struct _CHILD_RESULT {
+    UINT64 attempts;
+    UINT64 failed;
+    UINT64 count;
+} CHILD_RESULT, *PCHILD_RESULT;
+
+static LARGE_INTEGER g_Frequency;
+
+static LONGLONG Ticks(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static double TicksToMicroseconds(LONGLONG ticks) {
+    return (double)ticks * 1e6 / (double)g_Frequency.QuadPart;
+}
+
+static int CompareLatency(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+// Helper: Latency at quantile q of a sorted array
+static double Percentile(const double* sorted, SIZE_T count, double q) {
+    if (count == 0) {
+        return 0;
+    }
+    SIZE_T index = (SIZE_T)(q * (double)count);
+    return sorted[min(index, count - 1)];
+}
+
+// Helper: One connect. TCP times connect(); UDP times connect() plus an echo
+// round trip, since the connect layer is authorized on the first send.
+static BOOL ConnectOnce(const LOAD_CONFIG* config, double* latency) {
+    SOCKET s = socket(config->sink.ss_family, config->udp ? SOCK_DGRAM : SOCK_STREAM,
+                      config->udp ? IPPROTO_UDP : IPPROTO_TCP);
+    if (s == INVALID_SOCKET) {
+        return FALSE;
+    }
+
+    BOOL ok;
+    LONGLONG start = Ticks();
+    if (config->udp) {
+        DWORD timeout = UDP_ECHO_TIMEOUT_MS;
+        char probe = 'n';
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        start = Ticks();
+        ok = connect(s, (const struct sockaddr*)&config->sink, config->sinkLength) == 0 &&
+             send(s, &probe, 1, 0) == 1 &&
+             recv(s, &probe, 1, 0) == 1;
+    } else {
+        // Reset on close so thousands of connects do not sit in TIME_WAIT
+        struct linger abortive = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, (const char*)&abortive, sizeof(abortive));
+        start = Ticks();
+        ok = connect(s, (const struct sockaddr*)&config->sink, config->sinkLength) == 0;
+    }
+    *latency = TicksToMicroseconds(Ticks() - start);
+
+    closesocket(s);
+    return ok;
+}
+
+static DWORD WINAPI LoadThread(LPVOID parameter) {
+    PLOAD_THREAD context = (PLOAD_THREAD)parameter;
+    const LOAD_CONFIG* config = context->config;
+
+    // Each thread keeps its own schedule, offset so the threads interleave
+    LONGLONG interval = g_Frequency.QuadPart * config->threads / config->rate;
+    LONGLONG next = context->start + interval * context->index / config->threads;
+    LONGLONG end = context->start + g_Frequency.QuadPart * config->seconds;
+
+    while (next < end && context->count < context->capacity) {
+        LONGLONG now = Ticks();
+        if (next - now > g_Frequency.QuadPart / 500) {
+            Sleep(1);
+            continue;
+        }
+        while (Ticks() < next) {
+            YieldProcessor();
+        }
+
+        double latency;
+        context->attempts++;
+        if (ConnectOnce(config, &latency)) {
+            context->latencies[context->count++] = latency;
+        } else {
+            context->failed++;
+        }
+
+        // A thread that falls behind connects back to back; the achieved
+        // rate is reported
+        next += interval;
+    }
+    return 0;
+}
+
+// Helper: Run the configured load and collect every thread's latencies
+static BOOL RunLoad(const LOAD_CONFIG* config, PLOAD_RESULT result) {
+    LOAD_THREAD threads[MAX_LOAD_THREADS];
+    HANDLE handles[MAX_LOAD_THREADS];
+    SIZE_T perThread = (SIZE_T)config->rate / config->threads * config->seconds + 16;
+    LONGLONG start = Ticks() + g_Frequency.QuadPart / 10;
+
+    memset(result, 0, sizeof(*result));
+    result->latencies = (double*)malloc(perThread * config->threads * sizeof(double));
+    if (!result->latencies) {
+        return FALSE;
+    }
+
+    for (UINT32 t = 0; t < config->threads; t++) {
+        memset(&threads[t], 0, sizeof(threads[t]));
+        threads[t].config = config;
+        threads[t].index = t;
+        threads[t].start = start;
+        threads[t].latencies = result->latencies + perThread * t;
+        threads[t].capacity = perThread;
+        handles[t] = CreateThread(NULL, 0, LoadThread, &threads[t], 0, NULL);
+        if (!handles[t]) {
+            fprintf(stderr, "CreateThread failed: %lu\n", GetLastError());
+            exit(1);
+        }
+    }
+
+    for (UINT32 t = 0; t < config->threads; t++) {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+    }
+    result->seconds = TicksToMicroseconds(Ticks() - start) / 1e6;
+
+    // Pack the per-thread slices together
+    for (UINT32 t = 0; t < config->threads; t++) {
+        memmove(result->latencies + result->count, threads[t].latencies, threads[t].count * sizeof(double));
+        result->count += threads[t].count;
+        result->attempts += threads[t].attempts;
+        result->failed += threads[t].failed;
+    }
+    qsort(result->latencies, result->count, sizeof(double), CompareLatency);
+    return TRUE;
+}
+
+static void PrintLatencyHeader(void) {
+    printf("%-10s %9s %8s %9s %9s %9s %9s %9s\n",
+           "", "connects", "failed", "per sec", "p50 us", "p99 us", "p999 us", "max us");
+}
+
+static void PrintLatency(const char* label, const LOAD_RESULT* result) {
+    printf("%-10s %9llu %8llu %9.0f %9.1f %9.1f %9.1f %9.1f\n", label,
+           (unsigned long long)result->attempts, (unsigned long long)result->failed,
+           result->seconds > 0 ? (double)result->attempts / result->seconds : 0,
+           Percentile(result->latencies, result->count, 0.50),
+           Percentile(result->latencies, result->count, 0.99),
+           Percentile(result->latencies, result->count, 0.999),
+           result->count ? result->latencies[result->count - 1] : 0);
+}
+
+static HANDLE OpenDriver(void) {
+    HANDLE device = CreateFileW(L"\\\\.\\NetGuardWFP", GENERIC_READ | GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (device == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "cannot open \\\\.\\NetGuardWFP (error %lu); is the driver loaded and the prompt elevated?\n",
+                GetLastError());
+    }
+    return device;
+}
+
+static BOOL DriverIoctl(HANDLE device, DWORD code, PVOID input, DWORD inputLength,
+                        PVOID output, DWORD outputLength) {
+    DWORD returned;
+    if (!DeviceIoControl(device, code, input, inputLength, output, outputLength, &returned, NULL)) {
+        fprintf(stderr, "IOCTL 0x%08lx failed: %lu\n", code, GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL GetStats(HANDLE device, PNETGUARD_STATS stats) {
+    memset(stats, 0, sizeof(*stats));
+    return DriverIoctl(device, IOCTL_NETGUARD_GET_STATS, NULL, 0, stats, sizeof(*stats));
+}
+
+// Helper: C:\dir\app.exe -> \Device\HarddiskVolumeN\dir\app.exe, the form
+// rules are keyed by
+static BOOL DosPathToNtPath(const WCHAR* dosPath, WCHAR* ntPath, DWORD chars) {
+    WCHAR drive[3] = { dosPath[0], L':', L'\0' };
+    WCHAR device[MAX_PATH_LENGTH];
+
+    if (dosPath[0] == L'\0' || dosPath[1] != L':' || dosPath[2] != L'\\') {
+        return FALSE;
+    }
+    if (!QueryDosDeviceW(drive, device, MAX_PATH_LENGTH)) {
+        return FALSE;
+    }
+    return _snwprintf_s(ntPath, chars, _TRUNCATE, L"%ls%ls", device, dosPath + 2) > 0;
+}
+
+// Helper: Add or remove this executable's allow rule, so run measures a
+// known application rather than a pended one
+static BOOL SetSelfAllowed(HANDLE device, BOOL allowed) {
+    WCHAR dosPath[MAX_PATH_LENGTH];
+    ALLOWED_APP app = { 0 };
+
+    if (!GetModuleFileNameW(NULL, dosPath, MAX_PATH_LENGTH) ||
+        !DosPathToNtPath(dosPath, app.processPath, MAX_PATH_LENGTH)) {
+        fprintf(stderr, "cannot map this executable's path to a device path\n");
+        return FALSE;
+    }
+    return DriverIoctl(device, allowed ? IOCTL_NETGUARD_ADD_ALLOWED : IOCTL_NETGUARD_REMOVE_ALLOWED,
+                       &app, sizeof(app), NULL, 0);
+}
+
+static BOOL ResolveSink(const char* host, const char* port, BOOL udp, PLOAD_CONFIG config) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo* found = NULL;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &found) != 0 || !found) {
+        fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+        return FALSE;
+    }
+    memcpy(&config->sink, found->ai_addr, found->ai_addrlen);
+    config->sinkLength = (int)found->ai_addrlen;
+    freeaddrinfo(found);
+    return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// sink
+// ---------------------------------------------------------------------------
+
+static DWORD WINAPI SinkAcceptThread(LPVOID parameter) {
+    SOCKET listener = (SOCKET)parameter;
+    struct linger abortive = { 1, 0 };
+
+    for (;;) {
+        SOCKET s = accept(listener, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            continue;
+        }
+        setsockopt(s, SOL_SOCKET, SO_LINGER, (const char*)&abortive, sizeof(abortive));
+        closesocket(s);
+    }
+}
+
+static DWORD WINAPI SinkEchoThread(LPVOID parameter) {
+    SOCKET s = (SOCKET)parameter;
+    SOCKADDR_STORAGE from;
+    char buffer[64];
+
+    for (;;) {
+        int fromLength = sizeof(from);
+        int received = recvfrom(s, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &fromLength);
+        if (received > 0) {
+            sendto(s, buffer, received, 0, (const struct sockaddr*)&from, fromLength);
+        }
+    }
+}
+
+static int RunSink(const char* port) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo* found = NULL;
+    BOOL on = TRUE;
+
+    hints.ai_family = AF_INET6;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &found) != 0) {
+        fprintf(stderr, "bad port %s\n", port);
+        return 1;
+    }
+
+    // Dual-stack sockets, so IPv4 and IPv6 clients share one port
+    SOCKET listener = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET echo = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    DWORD off = 0;
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&off, sizeof(off));
+    setsockopt(echo, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&off, sizeof(off));
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+    if (bind(listener, found->ai_addr, (int)found->ai_addrlen) != 0 ||
+        listen(listener, SOMAXCONN) != 0 ||
+        bind(echo, found->ai_addr, (int)found->ai_addrlen) != 0) {
+        fprintf(stderr, "cannot listen on port %s: %d\n", port, WSAGetLastError());
+        return 1;
+    }
+    freeaddrinfo(found);
+
+    for (int i = 0; i < SINK_ACCEPT_THREADS; i++) {
+        CloseHandle(CreateThread(NULL, 0, SinkAcceptThread, (LPVOID)listener, 0, NULL));
+    }
+    CloseHandle(CreateThread(NULL, 0, SinkEchoThread, (LPVOID)echo, 0, NULL));
+
+    printf("sink: accepting TCP and echoing UDP on port %s; Ctrl+C to stop\n", port);
+    Sleep(INFINITE);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// run
+// ---------------------------------------------------------------------------
+
+static void PrintStatsDelta(const NETGUARD_STATS* before, const NETGUARD_STATS* after) {
+    printf("%-10s classified %llu, allowed %llu, blocked %llu, pended %llu\n", "",
+           (unsigned long long)(after->totalConnections - before->totalConnections),
+           (unsigned long long)(after->allowedConnections - before->allowedConnections),
+           (unsigned long long)(after->blockedConnections - before->blockedConnections),
+           (unsigned long long)(after->pendedConnections - before->pendedConnections));
+}
+
+static int RunLatency(const LOAD_CONFIG* config, const char* mode) {
+    BOOL phases[2] = { FALSE, TRUE }; // Filtering disabled, then enabled
+    UINT32 first = strcmp(mode, "enabled") == 0 ? 1 : 0;
+    UINT32 last = strcmp(mode, "disabled") == 0 ? 0 : 1;
+
+    HANDLE device = OpenDriver();
+    if (device == INVALID_HANDLE_VALUE || !SetSelfAllowed(device, TRUE)) {
+        return 1;
+    }
+
+    printf("%s connects at %u/s on %u threads for %u s per phase\n",
+           config->udp ? "UDP" : "TCP", config->rate, config->threads, config->seconds);
+    PrintLatencyHeader();
+
+    for (UINT32 phase = first; phase <= last; phase++) {
+        NETGUARD_STATS before, after;
+        LOAD_RESULT result;
+
+        if (!DriverIoctl(device, phases[phase] ? IOCTL_NETGUARD_ENABLE : IOCTL_NETGUARD_DISABLE, NULL, 0, NULL, 0)) {
+            break;
+        }
+        GetStats(device, &before);
+        if (!RunLoad(config, &result)) {
+            fprintf(stderr, "out of memory\n");
+            break;
+        }
+        GetStats(device, &after);
+
+        PrintLatency(phases[phase] ? "enabled" : "disabled", &result);
+        if (phases[phase]) {
+            PrintStatsDelta(&before, &after);
+        }
+        free(result.latencies);
+    }
+
+    SetSelfAllowed(device, FALSE);
+    printf("filtering left %s\n", phases[last] ? "enabled" : "disabled");
+    CloseHandle(device);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// storm
+// ---------------------------------------------------------------------------
+
+// A storm child: same load, results written to a file for the parent
+static int RunChild(const LOAD_CONFIG* config, const char* output) {
+    LOAD_RESULT result;
+    CHILD_RESULT header;
+
+    if (!RunLoad(config, &result)) {
+        return 1;
+    }
+
+    FILE* file = fopen(output, "wb");
+    if (!file) {
+        return 1;
+    }
+    header.attempts = result.attempts;
+    header.failed = result.failed;
+    header.count = result.count;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(result.latencies, sizeof(double), result.count, file);
+    fclose(file);
+    return 0;
+}
+
+// Helper: Fold one child's result file into the storm totals
+static void MergeChildResult(const char* path, PLOAD_RESULT total, SIZE_T* capacity) {
+    CHILD_RESULT header;
+    FILE* file = fopen(path, "rb");
+
+    if (!file) {
+        return;
+    }
+    if (fread(&header, sizeof(header), 1, file) == 1) {
+        if (total->count + header.count > *capacity) {
+            SIZE_T grown = max(*capacity * 2, total->count + (SIZE_T)header.count);
+            double* latencies = (double*)realloc(total->latencies, grown * sizeof(double));
+            if (!latencies) {
+                fclose(file);
+                return;
+            }
+            total->latencies = latencies;
+            *capacity = grown;
+        }
+        total->count += fread(total->latencies + total->count, sizeof(double), (SIZE_T)header.count, file);
+        total->attempts += header.attempts;
+        total->failed += header.failed;
+    }
+    fclose(file);
+}
+
+static int RunStorm(const LOAD_CONFIG* config, const char* host, const char* port, UINT32 apps) {
+    WCHAR self[MAX_PATH_LENGTH];
+    WCHAR directory[MAX_PATH_LENGTH];
+    WCHAR temp[MAX_PATH_LENGTH];
+    HANDLE processes[MAX_STORM_APPS];
+    UINT32 started = 0;
+
+    HANDLE device = OpenDriver();
+    if (device == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    // Every child runs from its own copy, so each one is a new unknown app
+    GetModuleFileNameW(NULL, self, MAX_PATH_LENGTH);
+    GetTempPathW(MAX_PATH_LENGTH, temp);
+    _snwprintf_s(directory, MAX_PATH_LENGTH, _TRUNCATE, L"%lsnetguard_storm_%lu", temp, GetTickCount());
+    if (!CreateDirectoryW(directory, NULL)) {
+        fprintf(stderr, "cannot create %ls: %lu\n", directory, GetLastError());
+        return 1;
+    }
+
+    NETGUARD_STATS before, now;
+    if (!DriverIoctl(device, IOCTL_NETGUARD_ENABLE, NULL, 0, NULL, 0) || !GetStats(device, &before)) {
+        return 1;
+    }
+
+    printf("storm: %u unknown apps, each %s connecting at %u/s on %u threads for %u s\n",
+           apps, config->udp ? "UDP" : "TCP", config->rate, config->threads, config->seconds);
+
+    for (UINT32 i = 0; i < apps; i++) {
+        WCHAR image[MAX_PATH_LENGTH];
+        WCHAR commandLine[1024];
+        STARTUPINFOW startup = { sizeof(startup) };
+        PROCESS_INFORMATION process;
+
+        _snwprintf_s(image, MAX_PATH_LENGTH, _TRUNCATE, L"%ls\\app%03u.exe", directory, i);
+        _snwprintf_s(commandLine, RTL_NUMBER_OF(commandLine), _TRUNCATE,
+                     L"\"%ls\" child -s %hs -p %hs -r %u -t %u -d %u%ls -o \"%ls\\app%03u.lat\"",
+                     image, host, port, config->rate, config->threads, config->seconds,
+                     config->udp ? L" -u" : L"", directory, i);
+        if (!CopyFileW(self, image, FALSE) ||
+            !CreateProcessW(image, commandLine, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL,
+                            &startup, &process)) {
+            fprintf(stderr, "cannot start storm app %u: %lu\n", i, GetLastError());
+            break;
+        }
+        CloseHandle(process.hThread);
+        processes[started++] = process.hProcess;
+    }
+
+    // Watch the queue while the apps run. A pended connect returns when its
+    // entry times out, so this lasts up to the driver timeout past the load.
+    UINT32 peakPending = 0;
+    LONGLONG stormStart = Ticks();
+    for (UINT32 waited = 0; waited < started;) {
+        if (WaitForSingleObject(processes[waited], 100) == WAIT_OBJECT_0) {
+            waited++;
+            continue;
+        }
+        if (GetStats(device, &now)) {
+            peakPending = max(peakPending, now.pendingCount);
+        }
+    }
+    double stormSeconds = TicksToMicroseconds(Ticks() - stormStart) / 1e6;
+
+    LOAD_RESULT total = { 0 };
+    SIZE_T capacity = 0;
+    for (UINT32 i = 0; i < started; i++) {
+        char path[MAX_PATH_LENGTH * 2];
+        WCHAR file[MAX_PATH_LENGTH];
+
+        CloseHandle(processes[i]);
+        _snprintf_s(path, sizeof(path), _TRUNCATE, "%ls\\app%03u.lat", directory, i);
+        MergeChildResult(path, &total, &capacity);
+        DeleteFileA(path);
+        _snwprintf_s(file, MAX_PATH_LENGTH, _TRUNCATE, L"%ls\\app%03u.exe", directory, i);
+        DeleteFileW(file);
+    }
+    RemoveDirectoryW(directory);
+    qsort(total.latencies, total.count, sizeof(double), CompareLatency);
+    total.seconds = stormSeconds;
+
+    GetStats(device, &now);
+    PrintLatencyHeader();
+    PrintLatency("storm", &total);
+    printf("queue      pended %llu, timed out %llu, queue full %llu, blocked %llu\n",
+           (unsigned long long)(now.pendedConnections - before.pendedConnections),
+           (unsigned long long)(now.timedOutConnections - before.timedOutConnections),
+           (unsigned long long)(now.droppedConnections - before.droppedConnections),
+           (unsigned long long)(now.blockedConnections - before.blockedConnections));
+    printf("           pending entries peak %u (driver high water %u), %u still pending\n",
+           peakPending, now.pendingHighWater, now.pendingCount);
+    printf("filtering left enabled\n");
+
+    free(total.latencies);
+    CloseHandle(device);
+    return 0;
+}
+
+static void Usage(void) {
+    fprintf(stderr,
+        "usage:\n"
+        "  netguard_load sink [-p port]\n"
+        "  netguard_load run -s host [-p port] [-r rate] [-t threads] [-d seconds] [-u] [-m both|disabled|enabled]\n"
+        "  netguard_load storm -s host [-p port] [-a apps] [-r rate] [-t threads] [-d seconds] [-u]\n"
+        "rate is connects per second (per app for storm); -u uses UDP\n");
+}
+
+int main(int argc, char** argv) {
+    WSADATA wsa;
+    LOAD_CONFIG config = { 0 };
+    const char* host = NULL;
+    const char* port = DEFAULT_PORT;
+    const char* mode = "both";
+    const char* output = NULL;
+    UINT32 apps = 16;
+
+    if (argc < 2) {
+        Usage();
+        return 2;
+    }
+
+    BOOL storm = strcmp(argv[1], "storm") == 0;
+    config.rate = storm ? 50 : 2000;
+    config.threads = storm ? 16 : 8;
+    config.seconds = 10;
+
+    for (int i = 2; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-u") == 0) {
+            config.udp = TRUE;
+            continue;
+        }
+        if (!value) {
+            Usage();
+            return 2;
+        }
+        if (strcmp(argv[i], "-s") == 0) {
+            host = value;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            port = value;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            config.rate = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            config.threads = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            config.seconds = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            apps = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mode = value;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            output = value;
+        } else {
+            Usage();
+            return 2;
+        }
+        i++;
+    }
+
+    QueryPerformanceFrequency(&g_Frequency);
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "sink") == 0) {
+        return RunSink(port);
+    }
+
+    if (!host || config.rate == 0 || config.threads == 0 || config.threads > MAX_LOAD_THREADS ||
+        config.seconds == 0 || apps == 0 || apps > MAX_STORM_APPS ||
+        !ResolveSink(host, port, config.udp, &config)) {
+        Usage();
+        return 2;
+    }
+
+    // Every thread needs at least one connect per second to schedule
+    config.threads = min(config.threads, config.rate);
+
+    if (strcmp(argv[1], "run") == 0) {
+        return RunLatency(&config, mode);
+    }
+    if (storm) {
+        return RunStorm(&config, host, port, apps);
+    }
+    if (strcmp(argv[1], "child") == 0 && output) {
+        return RunChild(&config, output);
+    }
+    Usage();
+    return 2;
+}
@@ -0,0 +1,1404 @@
+/*
+ * NetGuard WFP Callout Driver - shared definitions
+ *
+ * Wire formats, tables and global state used across the driver:
+ *   netguard_wfp.c      - driver entry, WFP registration, IOCTLs, flows, events
+ *   netguard_rules.c    - allow/block rule table, pattern rules and process
+ *                         verdict cache
+ *   netguard_pending.c  - pending connection queue and parked GET_PENDING IRPs
+ *   netguard_classify.c - the connect and accept classify decisions
+ *   netguard_policy.c   - boot policy saved to and loaded from the registry
+ *   netguard_dns.c      - DNS response parsing and the address-to-name cache
+ *   netguard_shaping.c  - per-app rate limits at the stream and datagram layers
+ *
+ * The rules, pending, classify and DNS files use nothing beyond what
+ * bench/shim provides, so they also build into the user-mode benchmark.
+ */
+
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <fwpsk.h>
+#include <fwpmk.h>
+#include <mstcpip.h>
+#include <TraceLoggingProvider.h>
+
+#define NETGUARD_DEVICE_NAME L"\\Device\\NetGuardWFP"
+#define NETGUARD_SYMBOLIC_NAME L"\\DosDevices\\NetGuardWFP"
+
+// IOCTL codes for user-mode communication
+#define IOCTL_NETGUARD_GET_PENDING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_NETGUARD_RESPOND        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_ADD_ALLOWED    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_REMOVE_ALLOWED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_ENABLE         CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_DISABLE        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SET_TIMEOUT    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SET_RULES      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_GET_STATS      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_NETGUARD_MAP_EVENTS     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_NETGUARD_GET_TRAFFIC    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_NETGUARD_SET_ADDRESS_RULES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SET_OVERFLOW_POLICY CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SAVE_POLICY    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SET_PATTERN_RULES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_NETGUARD_SET_EVENT_FILTER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80F, METHOD_BUFFERED, FILE_READ_DATA)
+
+// Maximum pending connections
+#define MAX_PENDING_CONNECTIONS 256
+#define MAX_PATH_LENGTH 512
+#define NETGUARD_POOL_TAG 'dGgN'
+
+// Pended connections left unanswered this long get the timeout verdict
+#define DEFAULT_PENDING_TIMEOUT_MS 30000
+
+// The sweeper timer applies that verdict this often while entries wait, so
+// an entry expires at most this late (the timer may also be coalesced by up
+// to PENDING_SWEEP_TOLERANCE_MS)
+#define PENDING_SWEEP_INTERVAL_MS 500
+#define PENDING_SWEEP_TOLERANCE_MS 100
+
+// Pending queue: a ring of per-app entries indexed by connectionId, so
+// RESPOND is O(1), plus a path-hash index so connects from an app that is
+// already waiting coalesce into its entry. Each entry records (and holds
+// pended) up to MAX_PENDING_ENDPOINTS connects; further connects from the same
+// app are only counted and blocked.
+#define MAX_PENDING_ENDPOINTS 8
+#define PENDING_APP_SLOTS (MAX_PENDING_CONNECTIONS * 2)
+#define PENDING_SLOT(connectionId) ((UINT16)((connectionId) & (MAX_PENDING_CONNECTIONS - 1)))
+
+// Remote and local addresses in events, pending records and the endpoint
+// memo: 16 bytes in network byte order, IPv4 in its IPv4-mapped IPv6 form
+// (::ffff:a.b.c.d), so one field serves both families
+#define NETGUARD_ADDRESS_LENGTH 16
+
+// ALE authorization layers the decision and address callouts are
+// registered at, indexing the per-layer callout and filter IDs
+#define CLASSIFY_CONNECT_V4     0
+#define CLASSIFY_CONNECT_V6     1
+#define CLASSIFY_RECV_ACCEPT_V4 2
+#define CLASSIFY_RECV_ACCEPT_V6 3
+#define CLASSIFY_LAYER_COUNT    4
+
+// Field indices of one of those layers. Each callout entry point passes its
+// layer's constant descriptor to a FORCEINLINE engine, so every instance is
+// compiled with its indices and address family folded in: the IPv4 connect
+// path reads the same fields it always did, with no per-layer branch.
+typedef struct _CLASSIFY_LAYER {
+    UINT8 direction; // FWP_DIRECTION_*
+    BOOLEAN v6;      // Addresses are FWP_BYTE_ARRAY16, not host-order UINT32
+    UINT16 localAddress;
+    UINT16 localPort;
+    UINT16 remoteAddress;
+    UINT16 remotePort;
+    UINT16 protocol;
+    UINT16 flags;
+} CLASSIFY_LAYER, *PCLASSIFY_LAYER;
+
+static const CLASSIFY_LAYER ClassifyConnectV4 = {
+    FWP_DIRECTION_OUTBOUND, FALSE,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_PROTOCOL, FWPS_FIELD_ALE_AUTH_CONNECT_V4_FLAGS
+};
+
+static const CLASSIFY_LAYER ClassifyConnectV6 = {
+    FWP_DIRECTION_OUTBOUND, TRUE,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_PROTOCOL, FWPS_FIELD_ALE_AUTH_CONNECT_V6_FLAGS
+};
+
+static const CLASSIFY_LAYER ClassifyRecvAcceptV4 = {
+    FWP_DIRECTION_INBOUND, FALSE,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_PROTOCOL, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_FLAGS
+};
+
+static const CLASSIFY_LAYER ClassifyRecvAcceptV6 = {
+    FWP_DIRECTION_INBOUND, TRUE,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_PORT,
+    FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_PROTOCOL, FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_FLAGS
+};
+
+// Field indices of an ALE_AUTH_LISTEN layer, for the listen callout. The
+// layer has no remote endpoint or protocol: it only sees TCP listens.
+typedef struct _LISTEN_LAYER {
+    BOOLEAN v6;
+    UINT16 localAddress;
+    UINT16 localPort;
+    UINT16 flags;
+} LISTEN_LAYER, *PLISTEN_LAYER;
+
+#define LISTEN_LAYER_COUNT 2 // V4, V6
+
+static const LISTEN_LAYER ListenV4 = {
+    FALSE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_LISTEN_V4_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V4_FLAGS
+};
+
+static const LISTEN_LAYER ListenV6 = {
+    TRUE,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_AUTH_LISTEN_V6_IP_LOCAL_PORT,
+    FWPS_FIELD_ALE_AUTH_LISTEN_V6_FLAGS
+};
+
+// Address families of the flow-established, stream and datagram callouts,
+// indexing their callout and filter IDs
+#define FLOW_FAMILY_V4    0
+#define FLOW_FAMILY_V6    1
+#define FLOW_FAMILY_COUNT 2
+
+// DNS name cache: the IPv4 and IPv6 addresses in inbound DNS answers, each
+// mapped to the name that was queried. DNS_CACHE_BUCKETS buckets of DNS_CACHE_WAYS
+// entries; a new address replaces an expired entry, or else the one that
+// expires first. Entries live for the answer's TTL, clamped to
+// [DNS_MIN_TTL_SECONDS, DNS_MAX_TTL_SECONDS], so an app connecting a while
+// after its lookup is still tagged.
+#define DNS_MAX_NAME_LENGTH 253 // Dotted text, no terminator
+#define DNS_MAX_MESSAGE 512     // Bytes of a response that are parsed
+#define DNS_MAX_ANSWERS 32
+#define DNS_CACHE_BUCKETS 256   // A power of two
+#define DNS_CACHE_WAYS 4
+#define DNS_MIN_TTL_SECONDS 300
+#define DNS_MAX_TTL_SECONDS 86400
+
+// Rule index sizing. The index is a power of two that doubles whenever the
+// load factor would pass 0.5, or a rule would land more than RULE_MAX_PROBE
+// slots from its home slot. A lookup therefore inspects at most
+// RULE_MAX_PROBE slots and calls _wcsnicmp only on a full 64-bit hash match,
+// however many rules there are.
+#define RULE_INITIAL_SLOTS 64
+#define RULE_INITIAL_APPS 32
+#define RULE_MAX_PROBE 32
+#define RULE_SLOT_EMPTY 0xFFFFFFFF
+
+// Rule paths are packed into chunks of this size, allocated from a lookaside
+// list as a table copy fills up
+#define RULE_PATH_CHUNK_SIZE (16 * 1024)
+
+// Process verdict cache: direct-mapped on the process ID. Each slot is one
+// 64-bit word so it is read and replaced atomically without a lock:
+//   bits 0-31 processId, bits 32-61 rule generation, bits 62-63 state.
+// A slot is only trusted while its generation matches RuleGeneration, and
+// process exit marks the slot dead so a reused PID never inherits a verdict.
+#define PID_CACHE_SLOTS 1024
+#define PID_CACHE_EMPTY 0
+#define PID_CACHE_ALLOW 1
+#define PID_CACHE_BLOCK 2
+#define PID_CACHE_DEAD  3
+#define PID_CACHE_GENERATION_MASK 0x3FFFFFFF
+#define PID_CACHE_SLOT(pid) (((pid) >> 2) & (PID_CACHE_SLOTS - 1))
+#define PID_CACHE_ENTRY(pid, generation, state) \
+    ((LONG64)(((UINT64)(state) << 62) | \
+              ((UINT64)((generation) & PID_CACHE_GENERATION_MASK) << 32) | (UINT32)(pid)))
+
+// Endpoint verdict memo: the recent verdicts of (app, remote endpoint,
+// protocol), so a storm of connects to the same endpoints (unconnected UDP
+// sockets authorize every new remote, and resolvers open a socket per query)
+// costs one probe instead of a rule lookup and a trip through PendingLock.
+// Rule verdicts are memoized for UDP; an unknown app's blocked connects for
+// any protocol. Direct-mapped; each slot is written under a sequence count
+// and read without a lock. A slot is only trusted until it expires and while
+// its generation matches EndpointMemoGeneration().
+#define ENDPOINT_MEMO_SLOTS 1024
+#define ENDPOINT_MEMO_TTL_MS 1000
+#define ENDPOINT_MEMO_EMPTY   0
+#define ENDPOINT_MEMO_ALLOW   1 // Rule verdicts
+#define ENDPOINT_MEMO_BLOCK   2
+#define ENDPOINT_MEMO_UNKNOWN 3 // No rule; blocked by the pending path
+
+typedef struct _ENDPOINT_MEMO_ENTRY {
+    volatile LONG sequence;   // Odd while the slot is being rewritten
+    LONG generation;
+    UINT64 pathHash;
+    UINT64 remoteAddress[2];  // NETGUARD_ADDRESS_LENGTH bytes, compared as two words
+    UINT16 remotePort;
+    UINT8 protocol;
+    UINT8 verdict;            // ENDPOINT_MEMO_*
+    ULONG expires;            // Interrupt time in ms, wrapping
+    volatile LONG suppressed; // UNKNOWN hits not reported as events yet
+} ENDPOINT_MEMO_ENTRY, *PENDPOINT_MEMO_ENTRY;
+
+// GET_PENDING wire format. The output is a PENDING_BATCH_HEADER followed by
+// recordCount packed PENDING_RECORDs; each record is followed by its
+// endpointCount PENDING_REMOTEs, then pathLength WCHARs and then hostLength
+// chars of the first remote's DNS name (neither terminated).
+// Walk records with recordLength, never with sizeof, so later versions can
+// append fields. When moreData is set, pass nextCursor back in a
+// PENDING_QUERY to read the next chunk. A query with afterId set only
+// reports, and only waits for, connections with a higher connectionId, so a
+// caller that re-issues GET_PENDING straight away is not handed the same
+// unanswered connections again.
+#define PENDING_RECORD_VERSION 3
+
+#pragma pack(push, 1)
+typedef struct _PENDING_QUERY {
+    UINT16 version;
+    UINT32 cursor;  // 0 starts from the beginning
+    UINT64 afterId; // Appended later; 0 (or absent) reports every connection
+} PENDING_QUERY, *PPENDING_QUERY;
+
+// IOCTL_NETGUARD_RESPOND input: one or more of these, back to back
+typedef struct _PENDING_RESPONSE {
+    UINT64 connectionId;
+    BOOLEAN allowed;
+} PENDING_RESPONSE, *PPENDING_RESPONSE;
+
+// Remote endpoint of a coalesced connect or accept
+typedef struct _PENDING_REMOTE {
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH]; // Version 3; was a host-order IPv4 UINT32
+    UINT16 remotePort;
+} PENDING_REMOTE, *PPENDING_REMOTE;
+
+typedef struct _PENDING_BATCH_HEADER {
+    UINT16 version;
+    UINT16 recordCount;
+    UINT32 totalLength; // Header plus records, in bytes
+    UINT32 nextCursor;
+    BOOLEAN moreData;
+} PENDING_BATCH_HEADER, *PPENDING_BATCH_HEADER;
+
+typedef struct _PENDING_RECORD {
+    UINT16 recordLength; // Including the trailing endpoints and path
+    UINT64 connectionId;
+    UINT32 processId;
+    LARGE_INTEGER timestamp;
+    UINT32 connectionCount;
+    UINT8 endpointCount;
+    UINT16 pathLength; // In WCHARs
+    UINT8 hostLength;  // Version 2; 0 if the remote has no cached name
+} PENDING_RECORD, *PPENDING_RECORD;
+#pragma pack(pop)
+
+// Smallest GET_PENDING output buffer: room for one record of any size
+#define PENDING_MIN_OUTPUT (sizeof(PENDING_BATCH_HEADER) + sizeof(PENDING_RECORD) + \
+                            MAX_PENDING_ENDPOINTS * sizeof(PENDING_REMOTE) + \
+                            (MAX_PATH_LENGTH - 1) * sizeof(WCHAR) + DNS_MAX_NAME_LENGTH)
+
+// Pending connection structure. One per unknown app; remoteAddress/remotePort
+// are the first connect, remotes[] the first endpointCount connects.
+typedef struct _PENDING_CONNECTION {
+    UINT64 connectionId;
+    UINT32 processId;
+    WCHAR processPath[MAX_PATH_LENGTH];
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH];
+    UINT16 remotePort;
+    LARGE_INTEGER timestamp;
+    BOOLEAN responded;
+    BOOLEAN allowed;
+    UINT32 connectionCount; // Connects coalesced into this entry
+    UINT32 endpointCount;
+    PENDING_REMOTE remotes[MAX_PENDING_ENDPOINTS];
+    UINT8 hostLength;
+    CHAR hostName[DNS_MAX_NAME_LENGTH]; // Of remoteAddress, from the DNS cache
+} PENDING_CONNECTION, *PPENDING_CONNECTION;
+
+// Driver-side state of one recorded connect
+#define PENDED_NONE     0 // Not pended (blocked outright or already reauthorized)
+#define PENDED_HELD     1 // Completion handle held, waiting for the user
+#define PENDED_RELEASED 2 // Completed, waiting for its reauthorization
+
+// Driver-side bookkeeping for a pending connection. Only info is returned to
+// user mode (packed into a PENDING_RECORD); completion handles never leave
+// the kernel. Allocated from PendingLookaside while it occupies a ring slot.
+typedef struct _PENDING_ENTRY {
+    UINT64 pathHash;
+    PENDING_CONNECTION info;
+    UINT32 awaitingReauth;
+    HANDLE completionContext[MAX_PENDING_ENDPOINTS]; // From FwpsPendOperation0
+    UINT16 localPort[MAX_PENDING_ENDPOINTS];
+    UINT8 pendState[MAX_PENDING_ENDPOINTS];
+} PENDING_ENTRY, *PPENDING_ENTRY;
+
+// IOCTL_NETGUARD_ENABLE input, optional: without it unknown apps are pended
+#define ENABLE_FLAG_PERMIT_UNKNOWN 0x1 // Enforce rules only; let unknown apps through
+
+typedef struct _ENABLE_REQUEST {
+    UINT32 flags;
+} ENABLE_REQUEST, *PENABLE_REQUEST;
+
+// How NetGuardClassifyFn should treat a connect from an unknown app
+#define PENDING_ACTION_PERMIT 0
+#define PENDING_ACTION_BLOCK  1
+#define PENDING_ACTION_PENDED 2
+
+// IOCTL_NETGUARD_SET_TIMEOUT input
+typedef struct _PENDING_TIMEOUT_CONFIG {
+    UINT32 timeoutMs;
+    BOOLEAN allowOnTimeout; // Verdict applied when the user never answers
+} PENDING_TIMEOUT_CONFIG, *PPENDING_TIMEOUT_CONFIG;
+
+// IOCTL_NETGUARD_SET_OVERFLOW_POLICY input: what happens to a connect from a
+// new unknown app when every pending entry is taken
+#define PENDING_OVERFLOW_ALLOW       0 // Let it through (fail open, the default)
+#define PENDING_OVERFLOW_BLOCK       1 // Block it (fail closed)
+#define PENDING_OVERFLOW_DROP_OLDEST 2 // Give the oldest unanswered entry the
+                                       // timeout verdict and take its slot
+
+typedef struct _PENDING_OVERFLOW_CONFIG {
+    UINT32 policy;
+} PENDING_OVERFLOW_CONFIG, *PPENDING_OVERFLOW_CONFIG;
+
+
+// IOCTL_NETGUARD_ADD_ALLOWED / REMOVE_ALLOWED input
+typedef struct _ALLOWED_APP {
+    WCHAR processPath[MAX_PATH_LENGTH];
+    BOOLEAN blocked; // TRUE = blocked, FALSE = allowed
+} ALLOWED_APP, *PALLOWED_APP;
+
+// IOCTL_NETGUARD_SET_RULES input: a RULE_SET_HEADER followed by count packed
+// RULE_SET_ENTRYs, each followed by pathLength WCHARs (not terminated). The
+// whole set is applied in one swap: either every entry takes effect or none.
+#define RULE_SET_VERSION 2
+#define RULE_SET_FLAG_REPLACE 0x1 // Drop existing rules first; otherwise merge
+
+#pragma pack(push, 1)
+typedef struct _RULE_SET_HEADER {
+    UINT16 version;
+    UINT16 flags;
+    UINT32 count;
+} RULE_SET_HEADER, *PRULE_SET_HEADER;
+
+typedef struct _RULE_SET_ENTRY {
+    UINT16 entryLength; // Including the trailing path
+    BOOLEAN blocked;
+    UINT16 pathLength;  // In WCHARs, at most MAX_PATH_LENGTH - 1
+    UINT32 rateLimit;   // Version 2: bytes per second in each direction, 0 = none
+} RULE_SET_ENTRY, *PRULE_SET_ENTRY;
+#pragma pack(pop)
+
+// RULE_SET_ENTRY rateLimit for a merge that leaves the rule's current limit
+// as it is; a new rule gets none. IOCTL_NETGUARD_ADD_ALLOWED always keeps it.
+#define RATE_LIMIT_KEEP 0xFFFFFFFF
+
+// IOCTL_NETGUARD_SET_PATTERN_RULES input: prefix, suffix and wildcard path
+// rules, compiled by the service into one DFA over case-folded path
+// characters. Characters are first mapped to a class: folded ASCII through
+// asciiClass, anything else through the sorted wide[] list, and characters in
+// neither are class 0. A PATTERN_SET_HEADER is followed by asciiClass[128],
+// wideCount PATTERN_WIDE_CLASSes, stateCount PATTERN_STATEs and then
+// stateCount * classCount UINT16 next states, row by row. State 0 is the
+// start state. A header with stateCount 0 removes the pattern rules.
+//
+// The state a path ends in gives the verdict of the highest-priority pattern
+// matching the whole path. Exact rules rank PATTERN_PRIORITY_EXACT: a pattern
+// overrides an exact rule for the same path only with a higher priority.
+#define PATTERN_SET_VERSION 1
+#define PATTERN_MAX_CLASSES 256
+#define PATTERN_MAX_STATES 65535
+#define PATTERN_MAX_SIZE (4 * 1024 * 1024)
+#define PATTERN_PRIORITY_EXACT 0x8000
+
+#define PATTERN_VERDICT_NONE  0
+#define PATTERN_VERDICT_ALLOW 1
+#define PATTERN_VERDICT_BLOCK 2
+
+#define PATTERN_STATE_FINAL 0x1 // Every transition loops back: stop walking
+
+typedef struct _PATTERN_SET_HEADER {
+    UINT16 version;
+    UINT16 classCount; // At most PATTERN_MAX_CLASSES
+    UINT32 stateCount; // At most PATTERN_MAX_STATES
+    UINT32 wideCount;
+    UINT32 reserved;
+} PATTERN_SET_HEADER, *PPATTERN_SET_HEADER;
+
+typedef struct _PATTERN_WIDE_CLASS {
+    WCHAR character; // Folded, at least 0x80
+    UINT16 classIndex;
+} PATTERN_WIDE_CLASS, *PPATTERN_WIDE_CLASS;
+
+typedef struct _PATTERN_STATE {
+    UINT8 verdict; // PATTERN_VERDICT_*
+    UINT8 flags;   // PATTERN_STATE_*
+    UINT16 priority;
+} PATTERN_STATE, *PPATTERN_STATE;
+
+// A validated pattern set, read lock-free at DISPATCH_LEVEL like the rule
+// tables and replaced under RuleWriteLock. The input is kept verbatim after
+// the table (Source) so the boot policy can store it; the arrays point into it.
+typedef struct _PATTERN_TABLE {
+    const UINT8* AsciiClass;
+    const PATTERN_WIDE_CLASS* Wide;
+    const PATTERN_STATE* States;
+    const UINT16* Next;
+    UINT32 ClassCount;
+    UINT32 WideCount;
+    UINT32 SourceLength;
+    UINT16 MaxPriority; // Of any state with a verdict
+    UINT16 reserved;
+} PATTERN_TABLE, *PPATTERN_TABLE;
+
+// Boot policy: the rules and filtering settings IOCTL_NETGUARD_SAVE_POLICY
+// stores in the REG_BINARY value POLICY_VALUE_NAME under the service key's
+// Parameters subkey, and DriverEntry loads before registering the callouts.
+// A POLICY_HEADER is followed by count POLICY_ENTRYs, then by the paths they
+// point into (not terminated), then by patternLength bytes of pattern set
+// (SET_PATTERN_RULES input) if there is one. pathHash is the driver's own
+// HashProcessPath; loading checks every one against its path, and the
+// version changes if the hash ever does.
+#define POLICY_VALUE_NAME L"Policy"
+#define POLICY_MAGIC 0x4C50474E // "NGPL"
+#define POLICY_VERSION 3
+#define POLICY_FLAG_ENABLED       0x1 // Filter from load, before the service connects
+#define POLICY_FLAG_TIMEOUT_ALLOW 0x2 // PendingTimeoutAllow
+#define POLICY_FLAG_PERMIT_UNKNOWN 0x4 // PermitUnknown
+#define POLICY_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct _POLICY_HEADER {
+    UINT32 magic;
+    UINT16 version;
+    UINT16 flags;
+    UINT32 count;
+    UINT32 timeoutMs;
+    UINT32 overflowPolicy;
+    UINT32 pathChars; // Total WCHARs following the entries
+    UINT32 patternLength;
+} POLICY_HEADER, *PPOLICY_HEADER;
+
+typedef struct _POLICY_ENTRY {
+    UINT64 pathHash;
+    UINT32 pathOffset; // In WCHARs, from the first path
+    UINT16 pathLength; // In WCHARs, at most MAX_PATH_LENGTH - 1
+    BOOLEAN blocked;
+    UINT8 reserved;
+    UINT32 rateLimit;  // Version 3
+    UINT32 reserved2;
+} POLICY_ENTRY, *PPOLICY_ENTRY;
+
+// Rule index slot: the case-folded path hash plus the Apps index it refers
+// to, so probing never touches the rule records or their paths
+typedef struct _RULE_SLOT {
+    UINT64 pathHash;
+    UINT32 appIndex;
+    UINT32 reserved;
+} RULE_SLOT, *PRULE_SLOT;
+
+// One rule. The terminated path lives in the owning table's path arena.
+typedef struct _RULE_APP {
+    PWCHAR processPath;
+    UINT16 pathLength; // In WCHARs, excluding the terminator
+    BOOLEAN blocked;   // TRUE = blocked, FALSE = allowed
+    UINT32 rateLimit;  // Bytes per second in each direction, 0 = none
+} RULE_APP, *PRULE_APP;
+
+// One chunk of a table copy's path arena. Paths are carved front to back
+// from the newest chunk; a removed rule's path stays behind as dead space
+// until the copy is next rebuilt by CopyRuleTable.
+typedef struct _RULE_PATH_CHUNK {
+    struct _RULE_PATH_CHUNK* next;
+    UINT32 used; // WCHARs of data handed out
+    UINT32 reserved;
+    WCHAR data[(RULE_PATH_CHUNK_SIZE - 16) / sizeof(WCHAR)];
+} RULE_PATH_CHUNK, *PRULE_PATH_CHUNK;
+
+// One copy of the allow/block list. Two copies exist (left-right scheme):
+// classify reads whichever one ActiveRules points at without taking a lock,
+// and writers mutate the other copy, publish it, wait for readers of the old
+// copy to drain, then replay the same mutation on the old copy. Only the
+// standby copy is ever resized, so readers never see an array move.
+typedef struct _RULE_TABLE {
+    PRULE_SLOT Slots;
+    UINT32 SlotCount;   // Power of two
+    UINT32 Count;
+    UINT32 Capacity;    // Of Apps
+    PRULE_APP Apps;     // Dense, Count in use
+    PRULE_PATH_CHUNK PathChunks; // Newest first
+    SIZE_T PathBytes;   // Held by live rules' paths
+    SIZE_T ArenaBytes;  // Held by chunks, live or dead
+} RULE_TABLE, *PRULE_TABLE;
+
+// IOCTL_NETGUARD_GET_STATS output. Later versions only append fields: the
+// driver fills as much as the caller's buffer holds (at least the version 3
+// fields) and sets size to the bytes returned.
+#define NETGUARD_STATS_VERSION 7
+
+// Log2 latency histograms: bucket 0 counts durations under 1 ns, bucket i
+// durations in [2^(i-1), 2^i) ns, and the last bucket everything longer.
+// Durations come from KeQueryPerformanceCounter, so they are only as fine
+// as its frequency (100 ns at the usual 10 MHz).
+#define LATENCY_BUCKETS 32
+
+typedef struct _NETGUARD_STATS {
+    UINT16 version;
+    UINT16 size;
+    UINT32 pendingCount;       // Pending entries right now
+    UINT32 pendingHighWater;   // Most pending entries ever held at once
+    UINT32 reserved;
+    UINT64 totalConnections;   // Connects classified while enabled
+    UINT64 allowedConnections;
+    UINT64 blockedConnections;
+    UINT64 pendedConnections;  // Held for the user, counted once per connect
+    UINT64 timedOutConnections;// Pended connects given the timeout verdict
+    UINT64 droppedConnections; // Unknown connects the full queue had no entry for
+    UINT64 pidCacheHits;       // Version 2
+    UINT64 pidCacheMisses;
+    UINT64 addressBlockedConnections; // Version 3
+    UINT32 latencyBuckets;            // Version 4: LATENCY_BUCKETS
+    UINT32 reserved2;
+    UINT64 classifyLatency[LATENCY_BUCKETS]; // NetGuardClassifyFn duration
+    UINT64 pendingLockHold[LATENCY_BUCKETS]; // PendingLock hold time
+    UINT64 ruleLockHold[LATENCY_BUCKETS];    // RuleWriteLock hold time
+    UINT64 evictedEntries;     // Version 5: entries dropped by PENDING_OVERFLOW_DROP_OLDEST
+    UINT64 endpointMemoHits;   // Version 6: connects answered by the endpoint verdict memo
+    UINT64 rateHeldSends;      // Version 7: outbound stream indications queued by a rate limit
+    UINT64 rateDeferredReceives; // Inbound stream indications deferred by a rate limit
+    UINT64 rateDroppedDatagrams; // Datagrams dropped over a rate limit
+    UINT64 rateDroppedBytes;
+    UINT64 rateHeldBytes;      // Outbound stream bytes waiting for their budget right now,
+                               // at most RATE_MAX_HELD_BYTES
+} NETGUARD_STATS, *PNETGUARD_STATS;
+
+#define NETGUARD_STATS_V3_SIZE FIELD_OFFSET(NETGUARD_STATS, latencyBuckets)
+
+// Per-processor counters. Each block sits on its own cache line and is only
+// written by the processor it belongs to, so counting never moves a line
+// between cores; GET_STATS sums the blocks. Updates are still interlocked
+// because classify can run at PASSIVE_LEVEL and migrate mid-increment.
+typedef struct DECLSPEC_CACHEALIGN _CPU_STATS {
+    volatile LONG64 TotalConnections;
+    volatile LONG64 AllowedConnections;
+    volatile LONG64 BlockedConnections;
+    volatile LONG64 PendedConnections;
+    volatile LONG64 TimedOutConnections;
+    volatile LONG64 DroppedConnections;
+    volatile LONG64 PidCacheHits;
+    volatile LONG64 PidCacheMisses;
+    volatile LONG64 AddressBlockedConnections;
+    volatile LONG64 ClassifyLatency[LATENCY_BUCKETS];
+    volatile LONG64 PendingLockHold[LATENCY_BUCKETS];
+    volatile LONG64 RuleLockHold[LATENCY_BUCKETS];
+    volatile LONG64 EvictedEntries;
+    volatile LONG64 EndpointMemoHits;
+    volatile LONG64 RateHeldSends;
+    volatile LONG64 RateDeferredReceives;
+    volatile LONG64 RateDroppedDatagrams;
+    volatile LONG64 RateDroppedBytes;
+} CPU_STATS, *PCPU_STATS;
+
+#define COUNT_STAT(field) \
+    InterlockedIncrement64(&g_Context.CpuStats[KeGetCurrentProcessorIndex()].field)
+
+#define RECORD_LATENCY(histogram, ticks) \
+    InterlockedIncrement64(&g_Context.CpuStats[KeGetCurrentProcessorIndex()].histogram[LatencyBucket(ticks)])
+
+// TraceLogging provider "NetGuard.Driver". Nothing is logged unless an ETW
+// session enables it; until then each TraceLoggingWrite is one enabled check.
+TRACELOGGING_DECLARE_PROVIDER(g_NetGuardTraceProvider);
+
+#define NETGUARD_TRACE_KEYWORD_CLASSIFY 0x1 // Connect classify entry and exit
+#define NETGUARD_TRACE_KEYWORD_PENDING  0x2 // Pending queue enqueue and dequeue
+#define NETGUARD_TRACE_KEYWORD_RULES    0x4 // Rule table swaps
+
+// Connection event rings, mapped into a consumer with IOCTL_NETGUARD_MAP_EVENTS.
+// Every handle that maps them gets its own section, and only the events its
+// filter (IOCTL_NETGUARD_SET_EVENT_FILTER) passes are copied into it, so a
+// slow consumer fills and drops in its own rings without holding up others.
+// The section starts with an EVENT_SECTION_HEADER, followed by ringCount
+// EVENT_RINGs, ringStride bytes apart, one per processor. Each ring has a
+// single producer (the driver, at DISPATCH_LEVEL on that processor) and a
+// single consumer (the handle's owner), so neither side takes a lock: the
+// driver advances Head after writing a record, the consumer advances Tail
+// after reading one. A full ring drops the new record and counts it in Dropped.
+#define EVENT_SECTION_VERSION 7
+#define EVENT_RING_CAPACITY 1024 // Records per ring, a power of two
+#define EVENT_MAX_SUBSCRIBERS 4  // Handles that can have the rings mapped at once
+
+// Room for the remote's DNS name in an event, NUL-terminated; it makes a
+// record three cache lines. Longer names keep their last characters, so the
+// registered domain survives.
+#define EVENT_HOST_NAME_LENGTH 104
+
+#define EVENT_TYPE_CONNECT 1 // Flow established
+#define EVENT_TYPE_CLOSE   2 // Flow deleted
+#define EVENT_TYPE_BLOCK   3 // Connect or accept blocked or pended in classify
+#define EVENT_TYPE_LISTEN  4 // Version 7; a TCP socket started listening
+#define EVENT_TYPE_ACCEPT  5 // Version 7; an inbound connect reached the accept decision
+
+// BLOCK, LISTEN and ACCEPT records have flowId 0; LISTEN ones also have no
+// remote endpoint
+
+typedef struct _NETGUARD_EVENT {
+    UINT8 type;
+    UINT8 protocol;
+    UINT8 direction;  // FWP_DIRECTION_OUTBOUND / FWP_DIRECTION_INBOUND
+    UINT8 verdict;    // FLOW_VERDICT_*; ACCEPT: the decision, UNKNOWN if pended
+    UINT32 processId;
+    UINT64 flowId;    // Pairs CONNECT with CLOSE; 0 for BLOCK
+    LARGE_INTEGER timestamp;
+    UINT8 localAddress[NETGUARD_ADDRESS_LENGTH]; // Version 6; NETGUARD_ADDRESS_LENGTH form
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH];
+    UINT16 localPort; // Host byte order
+    UINT16 remotePort;
+    UINT32 suppressed;    // Version 5; BLOCK: identical blocks since the last record
+    UINT64 bytesSent;     // Version 2; flow totals, set on CLOSE only
+    UINT64 bytesReceived;
+    UINT64 pathHash;      // Version 4; HashProcessPath of the app, 0 if unknown
+    CHAR hostName[EVENT_HOST_NAME_LENGTH]; // Version 3; DNS name of remoteAddress
+} NETGUARD_EVENT, *PNETGUARD_EVENT;
+
+typedef struct DECLSPEC_CACHEALIGN _EVENT_SECTION_HEADER {
+    UINT32 version;
+    UINT32 ringCount;
+    UINT32 ringCapacity;
+    UINT32 recordSize;
+    UINT32 ringOffset;
+    UINT32 ringStride;
+    volatile LONG consumerWaiting; // Set by a consumer about to block on its event
+} EVENT_SECTION_HEADER, *PEVENT_SECTION_HEADER;
+
+typedef struct _EVENT_RING {
+    DECLSPEC_CACHEALIGN volatile LONG Head; // Written by the driver only
+    volatile LONG Dropped;
+    DECLSPEC_CACHEALIGN volatile LONG Tail; // Written by the consumer only
+    DECLSPEC_CACHEALIGN NETGUARD_EVENT Records[EVENT_RING_CAPACITY];
+} EVENT_RING, *PEVENT_RING;
+
+// IOCTL_NETGUARD_MAP_EVENTS input and output
+typedef struct _EVENT_MAP_REQUEST {
+    UINT64 eventHandle; // Optional event signalled when a waiting consumer has work
+} EVENT_MAP_REQUEST, *PEVENT_MAP_REQUEST;
+
+typedef struct _EVENT_MAP_RESULT {
+    UINT64 baseAddress;
+    UINT32 length;
+    UINT32 reserved;
+} EVENT_MAP_RESULT, *PEVENT_MAP_RESULT;
+
+// IOCTL_NETGUARD_SET_EVENT_FILTER input: which events the calling handle's
+// rings receive. An EVENT_FILTER_HEADER is followed by portRangeCount packed
+// EVENT_PORT_RANGEs and then pathCount paths, each a UINT16 length in WCHARs
+// followed by that many WCHARs (not terminated). An event passes if its type
+// is in typeMask, its local or remote port is in one of the ranges, and its
+// app is one of the paths; a zero mask or count leaves that test out. A
+// handle without a filter receives everything.
+#define EVENT_FILTER_VERSION 1
+#define EVENT_FILTER_MAX_PORT_RANGES 8
+#define EVENT_FILTER_MAX_PATHS 256
+#define EVENT_FILTER_MAX_SIZE (sizeof(EVENT_FILTER_HEADER) + \
+    EVENT_FILTER_MAX_PORT_RANGES * sizeof(EVENT_PORT_RANGE) + \
+    EVENT_FILTER_MAX_PATHS * (sizeof(UINT16) + MAX_PATH_LENGTH * sizeof(WCHAR)))
+
+#pragma pack(push, 1)
+typedef struct _EVENT_FILTER_HEADER {
+    UINT16 version;
+    UINT16 typeMask;       // 1 << EVENT_TYPE_*
+    UINT16 portRangeCount;
+    UINT16 pathCount;
+} EVENT_FILTER_HEADER, *PEVENT_FILTER_HEADER;
+
+typedef struct _EVENT_PORT_RANGE {
+    UINT16 low;  // Inclusive, host byte order
+    UINT16 high;
+} EVENT_PORT_RANGE, *PEVENT_PORT_RANGE;
+#pragma pack(pop)
+
+// A handle's filter as PublishEvent checks it, the paths reduced to a sorted
+// array of their hashes
+typedef struct _EVENT_FILTER {
+    UINT16 TypeMask;
+    UINT16 PortRangeCount;
+    UINT32 PathCount;
+    EVENT_PORT_RANGE PortRanges[EVENT_FILTER_MAX_PORT_RANGES];
+    UINT64 PathHashes[ANYSIZE_ARRAY];
+} EVENT_FILTER, *PEVENT_FILTER;
+
+// Per-handle state, allocated on create and kept in FileObject->FsContext.
+// The section is allocated on the first MAP_EVENTS and freed on close; while
+// it is mapped the subscriber sits in EventSubscribers, where PublishEvent
+// finds it.
+typedef struct _EVENT_SUBSCRIBER {
+    PVOID Section;
+    ULONG SectionLength;
+    PMDL Mdl;
+    PVOID UserAddress;
+    PEPROCESS OwnerProcess;
+    PKEVENT EventObject;
+    PEVENT_FILTER volatile Filter; // NULL = every event
+} EVENT_SUBSCRIBER, *PEVENT_SUBSCRIBER;
+
+// Per-app traffic accounting. Each app seen on a flow gets a TRAFFIC_APP slot
+// (kept until unload) and, on every processor, an APP_BYTES block at the
+// same index that only grows. GET_TRAFFIC sums the blocks and reports what
+// changed since the previous call, so counting never takes a lock or resets
+// a counter another processor is adding to.
+#define TRAFFIC_APP_SLOTS 512 // A power of two
+#define TRAFFIC_MAX_PROBE 32
+#define TRAFFIC_APP_NONE 0xFFFF
+
+typedef struct _TRAFFIC_APP {
+    UINT64 pathHash; // 0 = free; written last, with release semantics
+    UINT16 pathLength;
+    WCHAR path[MAX_PATH_LENGTH];
+} TRAFFIC_APP, *PTRAFFIC_APP;
+
+typedef struct _APP_BYTES {
+    volatile LONG64 bytesSent;
+    volatile LONG64 bytesReceived;
+    volatile LONG64 flows;
+} APP_BYTES, *PAPP_BYTES;
+
+// Per-app rate limits. A rule's rateLimit caps its app's stream and datagram
+// payload in each direction separately. The budget is a token bucket per
+// traffic slot and direction (APP_RATE), refilled from the interrupt time
+// when it is drawn on. Processors do not draw from it per packet: each takes
+// a grant of about 1/RATE_GRANTS_PER_SECOND of the limit into its own
+// RATE_BUCKET and spends that without touching shared lines. A packet
+// passes while its processor's bucket is positive and may take it into
+// debt, which the next grant repays first. Over the limit, outbound stream
+// data is held and reinjected as budget arrives, inbound stream data is
+// deferred (which closes the TCP receive window), and datagrams are dropped.
+#define RATE_SEND    0
+#define RATE_RECEIVE 1
+#define RATE_DIRECTIONS 2
+#define RATE_GRANTS_PER_SECOND 64
+#define RATE_MIN_GRANT 1500          // Bytes; one full-size packet
+#define RATE_MAX_GRANT (64 * 1024)
+#define RATE_BURST_MS 100            // Budget an idle app can bank
+#define RATE_RETRY_MS 10             // Held and deferred data is retried this often
+
+// Absorbed sends look sent to the app, so nothing else stops it queueing a
+// whole upload in nonpaged pool. A flow holds at most RATE_HELD_BURSTS of
+// its app's bursts, and all flows together RATE_MAX_HELD_BYTES; a send past
+// either cap aborts the flow, as a failed clone does.
+#define RATE_HELD_BURSTS 16
+#define RATE_MAX_HELD_BYTES (64 * 1024 * 1024)
+
+typedef struct DECLSPEC_CACHEALIGN _APP_RATE {
+    KSPIN_LOCK Lock;            // Serializes refills and grants
+    volatile LONG Limit;        // Bytes per second, 0 = unlimited; read lock-free
+    volatile LONG Generation;   // Bumped when Limit changes; resets the processor buckets
+    LONG64 Tokens[RATE_DIRECTIONS];
+    LONG64 Refilled[RATE_DIRECTIONS]; // Interrupt time the tokens were last brought up to
+} APP_RATE, *PAPP_RATE;
+
+// One processor's share of an app's budget. Only touched at DISPATCH_LEVEL
+// on the processor it belongs to, so it needs no interlocked updates.
+typedef struct _RATE_BUCKET {
+    LONG Generation;
+    LONG Reserved;
+    LONG64 Tokens[RATE_DIRECTIONS]; // May be negative: debt from the last packet
+} RATE_BUCKET, *PRATE_BUCKET;
+
+// Outbound stream data of a flow over its app's limit: a clone of the
+// indication, injected back into the stream once budget allows. The
+// original is absorbed. A disconnect with no data has no clone.
+typedef struct _HELD_STREAM_DATA {
+    struct _HELD_STREAM_DATA* Next;
+    PNET_BUFFER_LIST Clone;
+    SIZE_T DataLength;
+    UINT32 StreamFlags;
+} HELD_STREAM_DATA, *PHELD_STREAM_DATA;
+
+// GET_TRAFFIC wire format: a TRAFFIC_BATCH_HEADER followed by recordCount
+// packed TRAFFIC_RECORDs, each followed by pathLength WCHARs (not
+// terminated). Only apps whose counters moved are listed. When moreData is
+// set the rest is still owed; call again.
+#define TRAFFIC_RECORD_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct _TRAFFIC_BATCH_HEADER {
+    UINT16 version;
+    UINT16 recordCount;
+    UINT32 totalLength; // Header plus records, in bytes
+    BOOLEAN moreData;
+} TRAFFIC_BATCH_HEADER, *PTRAFFIC_BATCH_HEADER;
+
+typedef struct _TRAFFIC_RECORD {
+    UINT16 recordLength; // Including the trailing path
+    UINT64 bytesSent;    // Since the previous GET_TRAFFIC
+    UINT64 bytesReceived;
+    UINT32 flows;        // Flows established since the previous GET_TRAFFIC
+    UINT16 pathLength;   // In WCHARs
+} TRAFFIC_RECORD, *PTRAFFIC_RECORD;
+#pragma pack(pop)
+
+// Smallest GET_TRAFFIC output buffer: room for one record of any size
+#define TRAFFIC_MIN_OUTPUT (sizeof(TRAFFIC_BATCH_HEADER) + sizeof(TRAFFIC_RECORD) + \
+                            (MAX_PATH_LENGTH - 1) * sizeof(WCHAR))
+
+// Remote address rules. IPv4 and IPv6 prefixes are checked by a callout
+// filter weighted above the app rule filters, so a blocked address stays
+// blocked for known apps too. Longest-prefix match is resolved when the
+// rules are loaded: the prefixes are flattened into the sorted start
+// addresses of the ranges between prefix boundaries, each with the action
+// of the longest prefix covering it. A lookup is a binary search for the
+// last start at or below the address, narrowed first by a direct index on
+// the top 16 address bits. n prefixes give at most 2n + 1 ranges.
+#define ADDRESS_RULE_VERSION 1
+#define ADDRESS_RULE_FLAG_BEGIN  0x1 // Discard the staged prefixes first
+#define ADDRESS_RULE_FLAG_COMMIT 0x2 // Build the staged prefixes and swap them in
+#define ADDRESS_MAX_PREFIXES (2 * 1024 * 1024)
+#define ADDRESS_INDEX_SLOTS 65536 // Top 16 address bits
+
+#define ADDRESS_FAMILY_V4 4
+#define ADDRESS_FAMILY_V6 6
+
+#define ADDRESS_ACTION_NONE   0 // Not covered by any prefix
+#define ADDRESS_ACTION_BLOCK  1
+#define ADDRESS_ACTION_PERMIT 2 // Exception inside a blocked prefix
+
+// IOCTL_NETGUARD_SET_ADDRESS_RULES input: an ADDRESS_RULE_HEADER followed by
+// count ADDRESS_RULE_ENTRYs. Large sets are sent in chunks; the first has
+// ADDRESS_RULE_FLAG_BEGIN, the last ADDRESS_RULE_FLAG_COMMIT.
+#pragma pack(push, 1)
+typedef struct _ADDRESS_RULE_HEADER {
+    UINT16 version;
+    UINT16 flags;
+    UINT32 count;
+} ADDRESS_RULE_HEADER, *PADDRESS_RULE_HEADER;
+
+typedef struct _ADDRESS_RULE_ENTRY {
+    UINT8 family;       // ADDRESS_FAMILY_*
+    UINT8 prefixLength;
+    UINT8 action;       // ADDRESS_ACTION_BLOCK or ADDRESS_ACTION_PERMIT
+    UINT8 address[16];  // Network byte order; IPv4 uses the first 4 bytes
+} ADDRESS_RULE_ENTRY, *PADDRESS_RULE_ENTRY;
+#pragma pack(pop)
+
+// 128-bit address, most significant bits first. IPv4 addresses sit in the
+// top 32 bits so both families share the build code.
+typedef struct _ADDRESS_KEY {
+    UINT64 high;
+    UINT64 low;
+} ADDRESS_KEY, *PADDRESS_KEY;
+
+// Staged prefix, start address masked to the prefix length
+typedef struct _ADDRESS_PREFIX {
+    ADDRESS_KEY start;
+    UINT32 sequence; // Arrival order; the later of two equal prefixes wins
+    UINT8 family;
+    UINT8 prefixLength;
+    UINT8 action;
+} ADDRESS_PREFIX, *PADDRESS_PREFIX;
+
+// Built rules, one allocation. Index[k] is the first range whose start has
+// top 16 bits >= k; Index[ADDRESS_INDEX_SLOTS] is the range count. Starts[0]
+// is always the lowest address.
+typedef struct _ADDRESS_TABLE {
+    UINT32 v4Count;
+    UINT32 v6Count;
+    PUINT32 v4Starts;
+    PUINT8 v4Actions;
+    PADDRESS_KEY v6Starts;
+    PUINT8 v6Actions;
+    UINT32 v4Index[ADDRESS_INDEX_SLOTS + 1];
+    UINT32 v6Index[ADDRESS_INDEX_SLOTS + 1];
+} ADDRESS_TABLE, *PADDRESS_TABLE;
+
+// Cached verdict for a flow
+#define FLOW_VERDICT_UNKNOWN 0
+#define FLOW_VERDICT_ALLOW   1
+#define FLOW_VERDICT_BLOCK   2
+
+// Layers a FLOW_CONTEXT can be associated with
+#define FLOW_ASSOC_CONNECT  0x1 // ALE_AUTH_CONNECT, for reauthorizations
+#define FLOW_ASSOC_STREAM   0x2 // STREAM, TCP byte counts
+#define FLOW_ASSOC_DATAGRAM 0x4 // DATAGRAM_DATA, byte counts of other protocols
+
+// Per-flow record attached with FwpsFlowAssociateContext0 when a flow is
+// established. Reauthorizations of the flow at ALE_AUTH_CONNECT are answered
+// from it while ruleGeneration still matches the rule table, and the data
+// layer callouts count its bytes. It holds one reference per association
+// plus one while NetGuardFlowEstablishedFn sets it up; the last
+// NetGuardFlowDeleteFn frees it.
+typedef struct _FLOW_CONTEXT {
+    LIST_ENTRY listEntry;
+    UINT64 flowHandle;
+    volatile LONG refCount;
+    volatile LONG associations; // FLOW_ASSOC_*
+    UINT32 processId;
+    UINT64 pathHash;
+    LONG ruleGeneration;
+    UINT32 verdict;
+    UINT16 appIndex;            // TRAFFIC_APP slot, or TRAFFIC_APP_NONE
+    BOOLEAN reported;           // CONNECT published, so CLOSE is due
+
+    // Rate limiting, under ThrottleLock. A flow is in ThrottledFlows, holding
+    // a reference, while it has held sends or a deferred receive.
+    volatile LONG throttled;
+    BOOLEAN receiveDeferred;
+    LIST_ENTRY throttleEntry;
+    PHELD_STREAM_DATA heldHead;
+    PHELD_STREAM_DATA heldTail;
+    SIZE_T heldBytes;           // DataLength of heldHead..heldTail together
+
+    // Endpoint, kept for the CLOSE event
+    UINT8 family; // FLOW_FAMILY_*; picks the layers the flow is associated with
+    UINT8 localAddress[NETGUARD_ADDRESS_LENGTH];
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH];
+    UINT16 localPort;
+    UINT16 remotePort;
+    UINT8 protocol;
+    UINT8 direction;
+
+    // Per-flow counters
+    volatile LONG64 authorizations;
+    volatile LONG64 cachedAuthorizations;
+    volatile LONG64 bytesSent;
+    volatile LONG64 bytesReceived;
+} FLOW_CONTEXT, *PFLOW_CONTEXT;
+
+// One DNS cache entry. Written under DnsLock and read without a lock:
+// writers make sequence odd while they change the entry, and readers retry
+// if it was odd or changed while they copied.
+typedef struct _DNS_CACHE_ENTRY {
+    volatile LONG sequence;
+    UINT64 address[2]; // NETGUARD_ADDRESS_LENGTH bytes, IPv4 mapped; zero = empty
+    LONGLONG expires;  // KeQuerySystemTime, 100ns units
+    UINT8 nameLength;
+    CHAR name[DNS_MAX_NAME_LENGTH];
+} DNS_CACHE_ENTRY, *PDNS_CACHE_ENTRY;
+
+// Global state
+typedef struct _NETGUARD_CONTEXT {
+    PDEVICE_OBJECT DeviceObject;
+    HANDLE EngineHandle;
+    HANDLE BfeStateHandle; // BFE state subscription, for a driver started before BFE
+    volatile LONG WfpRegistered; // Set by whoever registers the callouts first
+    UINT32 CalloutIds[CLASSIFY_LAYER_COUNT]; // Decision callout per CLASSIFY_* layer
+    UINT64 FilterIds[CLASSIFY_LAYER_COUNT];
+    UINT32 FlowCalloutIds[FLOW_FAMILY_COUNT];
+    UINT64 FlowFilterIds[FLOW_FAMILY_COUNT];
+    UINT32 AddressCalloutIds[CLASSIFY_LAYER_COUNT];
+    UINT64 AddressFilterIds[CLASSIFY_LAYER_COUNT];
+    UINT32 StreamCalloutIds[FLOW_FAMILY_COUNT];
+    UINT64 StreamFilterIds[FLOW_FAMILY_COUNT];
+    UINT32 DatagramCalloutIds[FLOW_FAMILY_COUNT];
+    UINT64 DatagramFilterIds[FLOW_FAMILY_COUNT];
+    UINT64 LoopbackFilterIds[CLASSIFY_LAYER_COUNT];
+    UINT32 ListenCalloutIds[LISTEN_LAYER_COUNT];
+    UINT64 ListenFilterIds[LISTEN_LAYER_COUNT];
+    BOOLEAN Enabled;
+    BOOLEAN PermitUnknown; // While Enabled: permit apps with no rule rather than pend them
+
+    // Pending connections
+    PPENDING_ENTRY PendingConnections[MAX_PENDING_CONNECTIONS]; // NULL = free
+    UINT16 PendingAppIndex[PENDING_APP_SLOTS]; // Ring slot + 1, 0 = empty
+    LOOKASIDE_LIST_EX PendingLookaside; // PENDING_ENTRYs
+    BOOLEAN PendingLookasideReady;
+    UINT64 NextPendingId;
+    UINT32 PendingCount;
+    UINT32 UnansweredCount;
+    volatile LONG PendingAnswers; // Entries given a verdict, by the user or the timeout
+    KSPIN_LOCK PendingLock;
+
+    // GET_PENDING IRPs parked until a pending connection arrives (inverted
+    // call). Protected by PendingLock so queueing and arrival cannot race.
+    IO_CSQ PendingIrpQueue;
+    LIST_ENTRY PendingIrpList;
+    LONGLONG PendingTimeout; // 100ns units
+    BOOLEAN PendingTimeoutAllow;
+    UINT32 PendingOverflowPolicy;
+
+    // Periodic sweep applying the timeout verdict, so entries expire even
+    // when no connect or GET_PENDING comes along to notice
+    KTIMER PendingSweepTimer;
+    KDPC PendingSweepDpc;
+
+    // Allowed/blocked apps
+    PRULE_TABLE RuleTables[2];
+    PRULE_TABLE volatile ActiveRules;
+    FAST_MUTEX RuleWriteLock;
+    LOOKASIDE_LIST_EX RulePathLookaside; // RULE_PATH_CHUNKs
+    BOOLEAN RulePathLookasideReady;
+    BOOLEAN RulesDiverged; // A replay failed; resync the standby before writing
+
+    // BFE permit/block filter mirroring each rule, indexed like Apps. Only
+    // installed while Enabled. Grown on demand; protected by RuleWriteLock.
+    PUINT64 AppFilterIds;
+    UINT32 AppFilterCapacity;
+    BOOLEAN AppFiltersInstalled;
+
+    // Remote address rules. The active table is read lock-free at
+    // DISPATCH_LEVEL and replaced under RuleWriteLock like the rule tables.
+    // Prefixes are staged in paged pool under AddressStagingLock.
+    PADDRESS_TABLE volatile ActiveAddressRules;
+    PPATTERN_TABLE volatile ActivePatterns; // Pattern rules, NULL = none
+    PADDRESS_PREFIX AddressStaging;
+    UINT32 AddressStagedCount;
+    UINT32 AddressStagingCapacity;
+    FAST_MUTEX AddressStagingLock;
+
+    // Per-processor DPCs used to wait out lock-free rule readers
+    PKDPC GraceDpcs;
+    ULONG GraceDpcCount;
+    LONG GraceRemaining;
+    KEVENT GraceEvent;
+
+    // Names of remote addresses, from inbound DNS answers; see DNS_CACHE_ENTRY
+    PDNS_CACHE_ENTRY DnsCache; // DNS_CACHE_BUCKETS * DNS_CACHE_WAYS entries
+    KSPIN_LOCK DnsLock;
+
+    // Bumped every time a rule change is published; invalidates flow verdicts
+    volatile LONG RuleGeneration;
+
+    // Verdicts of recently seen processes, see PID_CACHE_ENTRY. Only used
+    // when the process notify routine is registered, which event mappings
+    // also depend on.
+    volatile LONG64 PidCache[PID_CACHE_SLOTS];
+    BOOLEAN PidCacheEnabled;
+
+    // Recent verdicts per app and endpoint, see ENDPOINT_MEMO_ENTRY
+    ENDPOINT_MEMO_ENTRY EndpointMemo[ENDPOINT_MEMO_SLOTS];
+
+    // Flows carrying a FLOW_CONTEXT, so they can be detached at unload
+    LIST_ENTRY FlowList;
+    KSPIN_LOCK FlowLock;
+
+    // Handles with the event rings mapped. PublishEvent reads the slots
+    // lock-free at DISPATCH_LEVEL; they and the subscribers' filters change
+    // under RuleWriteLock, and readers are drained with WaitForRuleReaders
+    // before a subscriber's mapping or old filter is released.
+    PEVENT_SUBSCRIBER volatile EventSubscribers[EVENT_MAX_SUBSCRIBERS];
+    volatile LONG EventSubscriberCount;
+
+    // Statistics, one CPU_STATS per possible processor
+    PCPU_STATS CpuStats;
+    ULONG CpuStatsCount;
+
+    // Per-app traffic: TRAFFIC_APP_SLOTS APP_BYTES per processor, indexed
+    // like TrafficApps, and what GET_TRAFFIC last reported for each app.
+    // TrafficLock serializes slot assignment and GET_TRAFFIC.
+    PTRAFFIC_APP TrafficApps;
+    PAPP_BYTES CpuAppBytes;
+    PAPP_BYTES TrafficReported;
+    KSPIN_LOCK TrafficLock;
+    UINT32 PendingHighWater; // Protected by PendingLock
+
+    // Rate limits: an APP_RATE per traffic slot, and TRAFFIC_APP_SLOTS
+    // RATE_BUCKETs per processor indexed the same way. Flows with held or
+    // deferred stream data wait in ThrottledFlows, which ThrottleTimer
+    // retries every RATE_RETRY_MS while it is not empty.
+    PAPP_RATE AppRates;
+    PRATE_BUCKET CpuRateBuckets;
+    HANDLE StreamInjectionHandle;
+    LIST_ENTRY ThrottledFlows;
+    KSPIN_LOCK ThrottleLock;
+    KTIMER ThrottleTimer;
+    KDPC ThrottleDpc;
+    BOOLEAN ThrottleTimerArmed; // Protected by ThrottleLock
+    BOOLEAN ThrottleStopping;
+    volatile LONG64 RateHeldBytes;
+
+    // Latency histograms: performance counter frequency, nanoseconds per
+    // tick scaled by 2^32, and when the current holder took each timed lock
+    LONGLONG LatencyFrequency;
+    UINT64 LatencyNsPerTick;
+    LONGLONG PendingLockAcquired; // Written only by the PendingLock holder
+    LONGLONG RuleLockAcquired;    // Written only by the RuleWriteLock holder
+
+    // The service key DriverEntry was given, for the boot policy
+    UNICODE_STRING ServiceKeyPath;
+} NETGUARD_CONTEXT, *PNETGUARD_CONTEXT;
+
+extern NETGUARD_CONTEXT g_Context;
+
+FORCEINLINE LONGLONG LatencyNow(void) {
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+// Helper: Histogram bucket of a duration in performance counter ticks
+FORCEINLINE ULONG LatencyBucket(LONGLONG ticks) {
+    ULONG bit;
+
+    // Anything past a second would overflow the scaling; it is off the
+    // scale anyway
+    if (ticks >= g_Context.LatencyFrequency) {
+        return LATENCY_BUCKETS - 1;
+    }
+    ULONG64 ns = ((ULONG64)max(ticks, 0) * g_Context.LatencyNsPerTick) >> 32;
+    if (!_BitScanReverse64(&bit, ns)) {
+        return 0;
+    }
+    return min(bit + 1, LATENCY_BUCKETS - 1);
+}
+
+// PendingLock and RuleWriteLock are taken through these so their hold times
+// land in the histograms. The time is recorded once the lock is released.
+FORCEINLINE void AcquirePendingLock(PKIRQL oldIrql) {
+    KeAcquireSpinLock(&g_Context.PendingLock, oldIrql);
+    g_Context.PendingLockAcquired = LatencyNow();
+}
+
+FORCEINLINE void ReleasePendingLock(KIRQL oldIrql) {
+    LONGLONG held = LatencyNow() - g_Context.PendingLockAcquired;
+    KeReleaseSpinLock(&g_Context.PendingLock, oldIrql);
+    RECORD_LATENCY(PendingLockHold, held);
+}
+
+FORCEINLINE void AcquireRuleLock(void) {
+    ExAcquireFastMutex(&g_Context.RuleWriteLock);
+    g_Context.RuleLockAcquired = LatencyNow();
+}
+
+FORCEINLINE void ReleaseRuleLock(void) {
+    LONGLONG held = LatencyNow() - g_Context.RuleLockAcquired;
+    ExReleaseFastMutex(&g_Context.RuleWriteLock);
+    RECORD_LATENCY(RuleLockHold, held);
+}
+
+// Helper: Write a host-order IPv4 address in its IPv4-mapped form
+FORCEINLINE void MapAddress4(UINT32 address, UINT8* mapped) {
+    RtlZeroMemory(mapped, 10);
+    mapped[10] = 0xFF;
+    mapped[11] = 0xFF;
+    mapped[12] = (UINT8)(address >> 24);
+    mapped[13] = (UINT8)(address >> 16);
+    mapped[14] = (UINT8)(address >> 8);
+    mapped[15] = (UINT8)address;
+}
+
+// Helper: Copy an address field of a CLASSIFY_LAYER in NETGUARD_ADDRESS_LENGTH
+// form
+FORCEINLINE void ReadLayerAddress(const CLASSIFY_LAYER* layer, const FWPS_INCOMING_VALUES0* inFixedValues,
+                                  UINT16 field, UINT8* address) {
+    if (layer->v6) {
+        RtlCopyMemory(address, inFixedValues->incomingValue[field].value.byteArray16->byteArray16,
+                      NETGUARD_ADDRESS_LENGTH);
+    } else {
+        MapAddress4(inFixedValues->incomingValue[field].value.uint32, address);
+    }
+}
+
+// WFP Callout functions. The decision and address callouts have one entry
+// point per CLASSIFY_* layer; NetGuardClassifyFn is the IPv4 connect one.
+void NTAPI NetGuardClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardClassifyConnect6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardClassifyAccept4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardClassifyAccept6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+// LISTEN events; inspection only, one entry point per address family
+void NTAPI NetGuardListen4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardListen6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+NTSTATUS NTAPI NetGuardNotifyFn(
+    FWPS_CALLOUT_NOTIFY_TYPE notifyType,
+    const GUID* filterKey,
+    FWPS_FILTER1* filter
+);
+
+void NTAPI NetGuardFlowDeleteFn(
+    UINT16 layerId,
+    UINT32 calloutId,
+    UINT64 flowContext
+);
+
+// Flow established, one entry point per address family
+void NTAPI NetGuardFlowEstablishedFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardFlowEstablished6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardAddressClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardAddressConnect6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardAddressAccept4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardAddressAccept6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+// Data layers. The stream callout serves both STREAM layers; the datagram
+// callout has one entry point per address family.
+void NTAPI NetGuardStreamClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardDatagramClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+void NTAPI NetGuardDatagram6ClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+);
+
+// netguard_rules.c
+UINT64 HashProcessPath(const WCHAR* processPath, SIZE_T maxChars);
+void WaitForRuleReaders(void);
+UINT32 FindAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash);
+int IsAppInList(const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash, PBOOLEAN isBlocked);
+UINT32 LookupPidVerdict(UINT32 processId, LONG generation, PLONG64 observed);
+void StorePidVerdict(UINT32 processId, LONG generation, LONG64 observed, BOOLEAN blocked);
+LONG EndpointMemoGeneration(void);
+UINT32 LookupEndpointVerdict(UINT64 pathHash, const UINT8* remoteAddress, UINT16 remotePort, UINT8 protocol,
+                             LONG generation);
+UINT32 StoreEndpointVerdict(UINT64 pathHash, const UINT8* remoteAddress, UINT16 remotePort, UINT8 protocol,
+                            LONG generation, UINT8 verdict);
+void NotePidCacheProcess(UINT32 processId, BOOLEAN created);
+NTSTATUS UpsertAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength,
+                          BOOLEAN blocked, UINT32 rateLimit, UINT64 pathHash);
+NTSTATUS RemoveAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash);
+void ClearRuleTable(PRULE_TABLE table);
+NTSTATUS CopyRuleTable(PRULE_TABLE dst, PRULE_TABLE src);
+void FreeRuleTable(PRULE_TABLE table);
+PRULE_TABLE StandbyRules(void);
+NTSTATUS SyncStandbyRules(void);
+PRULE_TABLE PublishRules(PRULE_TABLE standby);
+NTSTATUS ApplyRuleSet(PRULE_TABLE table, PVOID inputBuffer, ULONG inputLength);
+NTSTATUS LoadPolicyRules(PRULE_TABLE table, const POLICY_ENTRY* entries, UINT32 count, const WCHAR* paths);
+NTSTATUS BuildPatternTable(const UCHAR* data, ULONG length, PPATTERN_TABLE* table);
+BOOLEAN PatternOverridesRule(PRULE_APP app);
+NTSTATUS InitializeRuleTables(void);
+
+// netguard_pending.c
+NTSTATUS InitializePendingQueue(void);
+void DeletePendingQueue(void);
+UINT32 ResolvePendingEntry(PPENDING_ENTRY entry, BOOLEAN allowed, HANDLE* completions);
+void ExpireStalePending(void);
+ULONG CopyPendingToBuffer(PVOID outputBuffer, ULONG outputLength, UINT32 cursor, UINT64 afterId);
+UINT32 QueuePendingConnection(UINT32 processId, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash,
+                              const UINT8* remoteAddress, UINT16 remotePort, UINT16 localPort,
+                              BOOLEAN isReauth, HANDLE completionHandle);
+void CompleteAllPending(void);
+void StartPendingSweeper(void);
+void StopPendingSweeper(void);
+
+// netguard_classify.c
+SIZE_T GetProcessPath(const FWPS_INCOMING_METADATA_VALUES0* inMetaValues, const WCHAR** processPath);
+
+// netguard_policy.c
+NTSTATUS SaveBootPolicy(void);
+NTSTATUS LoadBootPolicy(PUNICODE_STRING registryPath);
+void FreeBootPolicy(void);
+
+// netguard_dns.c
+NTSTATUS InitializeDnsCache(void);
+void FreeDnsCache(void);
+void ParseDnsResponse(const UCHAR* message, ULONG length);
+UINT32 LookupDnsName(const UINT8* address, PCHAR name);
+
+// netguard_shaping.c
+NTSTATUS InitializeRateLimits(void);
+void StopRateLimits(void);
+void FreeRateLimits(void);
+void RefreshAppRates(void);
+void SetFlowRateLimit(PFLOW_CONTEXT flow, const WCHAR* processPath, SIZE_T pathLength);
+BOOLEAN ConsumeAppTokens(UINT16 appIndex, UINT32 direction, SIZE_T bytes);
+BOOLEAN ShapeStreamData(PFLOW_CONTEXT flow, FWPS_STREAM_CALLOUT_IO_PACKET0* packet, FWPS_CLASSIFY_OUT0* classifyOut);
+void ReleaseHeldStreamData(PFLOW_CONTEXT flow);
+
+// netguard_wfp.c
+void PublishEvent(PNETGUARD_EVENT event);
+void ReleaseFlowContext(PFLOW_CONTEXT flow);
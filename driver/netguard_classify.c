@@ -0,0 +1,425 @@
+/*
+ * NetGuard WFP Callout Driver - connect and accept classify
+ *
+ * The decision for each connect at ALE_AUTH_CONNECT_V4/V6 and each accept at
+ * ALE_AUTH_RECV_ACCEPT_V4/V6: cached flow verdict, process verdict cache,
+ * rule table, then the pending queue. One engine serves all four layers
+ * through their CLASSIFY_LAYER descriptors. Accepts, and listens at
+ * ALE_AUTH_LISTEN_V4/V6, are also reported as events, so listeners on
+ * watched ports are seen as they happen rather than by polling.
+ */
+
+#include "netguard.h"
+
+// Helper: Point at the process path in the classify metadata without
+// copying it. Returns the length in WCHARs, excluding any terminator and
+// capped at MAX_PATH_LENGTH - 1; an absent path is returned as L"".
+SIZE_T GetProcessPath(const FWPS_INCOMING_METADATA_VALUES0* inMetaValues, const WCHAR** processPath) {
+    *processPath = L"";
+
+    if (!FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_PATH) ||
+        !inMetaValues->processPath || inMetaValues->processPath->size < sizeof(WCHAR)) {
+        return 0;
+    }
+
+    *processPath = (const WCHAR*)inMetaValues->processPath->data;
+    return wcsnlen(*processPath, min(inMetaValues->processPath->size / sizeof(WCHAR), MAX_PATH_LENGTH - 1));
+}
+
+// Helper: The connect or accept decision at one layer, timed and traced by
+// ClassifyTimed
+FORCEINLINE void ClassifyConnect(
+    const CLASSIFY_LAYER* layer,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    // Default: permit
+    classifyOut->actionType = FWP_ACTION_PERMIT;
+
+    if (!g_Context.Enabled) {
+        return;
+    }
+
+    COUNT_STAT(TotalConnections);
+
+    // Reauthorization of an established flow: answer from its cached verdict
+    // unless the rules changed since it was recorded
+    PFLOW_CONTEXT flow = (PFLOW_CONTEXT)flowContext;
+    if (flow) {
+        InterlockedIncrement64(&flow->authorizations);
+        if (flow->verdict != FLOW_VERDICT_UNKNOWN &&
+            flow->ruleGeneration == ReadNoFence(&g_Context.RuleGeneration)) {
+            InterlockedIncrement64(&flow->cachedAuthorizations);
+            if (flow->verdict == FLOW_VERDICT_BLOCK) {
+                classifyOut->actionType = FWP_ACTION_BLOCK;
+                classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+                COUNT_STAT(BlockedConnections);
+            } else {
+                COUNT_STAT(AllowedConnections);
+            }
+            return;
+        }
+    }
+
+    // Get process ID
+    UINT32 processId = 0;
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        processId = (UINT32)inMetaValues->processId;
+    }
+
+    // Get ports, protocol and flags; the remote address is read only once
+    // the process verdict cache missed
+    UINT16 remotePort = inFixedValues->incomingValue[layer->remotePort].value.uint16;
+    UINT16 localPort = inFixedValues->incomingValue[layer->localPort].value.uint16;
+    UINT8 protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+    UINT32 flags = inFixedValues->incomingValue[layer->flags].value.uint32;
+    BOOLEAN isReauth = (flags & FWP_CONDITION_FLAG_IS_REAUTHORIZE) != 0;
+
+    // Skip system processes
+    if (processId == 0 || processId == 4) {
+        return;
+    }
+
+    // Repeat callers: answer from the process verdict cache without
+    // touching the path
+    LONG generation = ReadNoFence(&g_Context.RuleGeneration);
+    LONG64 observed = 0;
+    if (g_Context.PidCacheEnabled) {
+        UINT32 cached = LookupPidVerdict(processId, generation, &observed);
+        if (cached != PID_CACHE_EMPTY) {
+            COUNT_STAT(PidCacheHits);
+            if (cached == PID_CACHE_BLOCK) {
+                classifyOut->actionType = FWP_ACTION_BLOCK;
+                classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+                COUNT_STAT(BlockedConnections);
+            } else {
+                COUNT_STAT(AllowedConnections);
+            }
+            return;
+        }
+        COUNT_STAT(PidCacheMisses);
+    }
+
+    // Get process path. It is hashed and compared in place; only a new
+    // pending entry takes a copy.
+    const WCHAR* processPath;
+    SIZE_T pathLength = GetProcessPath(inMetaValues, &processPath);
+    UINT64 pathHash = HashProcessPath(processPath, pathLength);
+    UINT8 remoteAddress[NETGUARD_ADDRESS_LENGTH];
+    ReadLayerAddress(layer, inFixedValues, layer->remoteAddress, remoteAddress);
+
+    // Endpoint storms: a repeat of a recent (app, endpoint) is answered from
+    // the memo. Reauthorizations skip it, since they collect the user's answer.
+    LONG memoGeneration = EndpointMemoGeneration();
+    UINT32 memo = isReauth ? ENDPOINT_MEMO_EMPTY
+                           : LookupEndpointVerdict(pathHash, remoteAddress, remotePort, protocol, memoGeneration);
+    if (memo == ENDPOINT_MEMO_UNKNOWN) {
+        // Counted by the memo and reported with the next classified block
+        COUNT_STAT(EndpointMemoHits);
+        if (classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) {
+            classifyOut->actionType = FWP_ACTION_BLOCK;
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            COUNT_STAT(BlockedConnections);
+        }
+        return;
+    }
+
+    // Check if app is in allowed/blocked list
+    BOOLEAN isBlocked = FALSE;
+    if (memo != ENDPOINT_MEMO_EMPTY || IsAppInList(processPath, pathLength, pathHash, &isBlocked)) {
+        if (memo != ENDPOINT_MEMO_EMPTY) {
+            isBlocked = memo == ENDPOINT_MEMO_BLOCK;
+            COUNT_STAT(EndpointMemoHits);
+        } else if (protocol == IPPROTO_UDP) {
+            StoreEndpointVerdict(pathHash, remoteAddress, remotePort, protocol, memoGeneration,
+                                 isBlocked ? ENDPOINT_MEMO_BLOCK : ENDPOINT_MEMO_ALLOW);
+        }
+        if (flow) {
+            flow->verdict = isBlocked ? FLOW_VERDICT_BLOCK : FLOW_VERDICT_ALLOW;
+            flow->ruleGeneration = generation;
+        }
+        if (g_Context.PidCacheEnabled) {
+            StorePidVerdict(processId, generation, observed, isBlocked);
+        }
+        if (isBlocked) {
+            classifyOut->actionType = FWP_ACTION_BLOCK;
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            COUNT_STAT(BlockedConnections);
+        } else {
+            COUNT_STAT(AllowedConnections);
+        }
+        return;
+    }
+
+    // Another filter already decided and we may not override it
+    if (!(classifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
+    }
+
+    // Rules only: nobody is asked about unknown apps, so let them through
+    if (g_Context.PermitUnknown) {
+        COUNT_STAT(AllowedConnections);
+        return;
+    }
+
+    // Unknown app - pend the connect until the user responds (a reauthorized
+    // connect picks up the answer here). If it cannot be pended it is blocked.
+    HANDLE completionHandle = NULL;
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_COMPLETION_HANDLE)) {
+        completionHandle = inMetaValues->completionHandle;
+    }
+
+    // Stale entries are expired by the sweeper timer, not here, so a connect
+    // never pays for scanning the whole queue
+    UINT32 action = QueuePendingConnection(processId, processPath, pathLength, pathHash,
+                                           remoteAddress, remotePort, localPort, isReauth, completionHandle);
+    if (action == PENDING_ACTION_PERMIT) {
+        COUNT_STAT(AllowedConnections);
+        return;
+    }
+
+    classifyOut->actionType = FWP_ACTION_BLOCK;
+    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+
+    // Repeats of a block that was not pended are answered by the memo for a
+    // while; this event reports the ones it answered since the last
+    NETGUARD_EVENT event = {0};
+    if (action == PENDING_ACTION_BLOCK && !isReauth) {
+        event.suppressed = StoreEndpointVerdict(pathHash, remoteAddress, remotePort, protocol, memoGeneration,
+                                                ENDPOINT_MEMO_UNKNOWN);
+    }
+    event.type = EVENT_TYPE_BLOCK;
+    event.protocol = protocol;
+    event.direction = layer->direction;
+    event.verdict = FLOW_VERDICT_UNKNOWN;
+    event.processId = processId;
+    event.pathHash = pathLength > 0 ? pathHash : 0;
+    ReadLayerAddress(layer, inFixedValues, layer->localAddress, event.localAddress);
+    RtlCopyMemory(event.remoteAddress, remoteAddress, NETGUARD_ADDRESS_LENGTH);
+    event.localPort = localPort;
+    event.remotePort = remotePort;
+    PublishEvent(&event);
+
+    if (action == PENDING_ACTION_PENDED) {
+        // The verdict is delivered on reauthorization, not now
+        classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
+        COUNT_STAT(PendedConnections);
+    } else {
+        COUNT_STAT(BlockedConnections);
+    }
+}
+
+// Helper: Run the decision for one layer, with its latency histogram and
+// start/stop trace events. The remote address is traced as the raw field: 4
+// host-order bytes on the IPv4 layers, 16 network-order bytes on IPv6 ones.
+FORCEINLINE void ClassifyTimed(
+    const CLASSIFY_LAYER* layer,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    LONGLONG start = LatencyNow();
+    const FWP_VALUE0* remoteAddress = &inFixedValues->incomingValue[layer->remoteAddress].value;
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "Classify",
+        TraceLoggingOpcode(WINEVENT_OPCODE_START),
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_CLASSIFY),
+        TraceLoggingUInt16(inFixedValues->layerId, "layerId"),
+        TraceLoggingUInt64(inMetaValues->processId, "processId"),
+        TraceLoggingBinary(layer->v6 ? (const void*)remoteAddress->byteArray16 : (const void*)&remoteAddress->uint32,
+                           layer->v6 ? NETGUARD_ADDRESS_LENGTH : sizeof(UINT32), "remoteAddress"),
+        TraceLoggingUInt16(inFixedValues->incomingValue[layer->remotePort].value.uint16, "remotePort"));
+
+    ClassifyConnect(layer, inFixedValues, inMetaValues, flowContext, classifyOut);
+
+    LONGLONG elapsed = LatencyNow() - start;
+    RECORD_LATENCY(ClassifyLatency, elapsed);
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "Classify",
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_CLASSIFY),
+        TraceLoggingUInt32(classifyOut->actionType, "action"),
+        TraceLoggingBoolean((classifyOut->flags & FWPS_CLASSIFY_OUT_FLAG_ABSORB) != 0, "pended"),
+        TraceLoggingInt64(elapsed, "ticks"));
+}
+
+// Helper: Publish the ACCEPT event for an inbound connect the engine just
+// decided. Reauthorizations are left out, so each accept is reported once.
+// Consumers choose the watched ports with their event filter.
+FORCEINLINE void PublishAcceptEvent(
+    const CLASSIFY_LAYER* layer,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    const FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    if (!ReadNoFence(&g_Context.EventSubscriberCount) ||
+        (inFixedValues->incomingValue[layer->flags].value.uint32 & FWP_CONDITION_FLAG_IS_REAUTHORIZE)) {
+        return;
+    }
+
+    NETGUARD_EVENT event = {0};
+    const WCHAR* processPath;
+    SIZE_T pathLength = GetProcessPath(inMetaValues, &processPath);
+
+    event.type = EVENT_TYPE_ACCEPT;
+    event.protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+    event.direction = layer->direction;
+    if (classifyOut->actionType != FWP_ACTION_BLOCK) {
+        event.verdict = FLOW_VERDICT_ALLOW;
+    } else {
+        event.verdict = (classifyOut->flags & FWPS_CLASSIFY_OUT_FLAG_ABSORB) ? FLOW_VERDICT_UNKNOWN : FLOW_VERDICT_BLOCK;
+    }
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        event.processId = (UINT32)inMetaValues->processId;
+    }
+    event.pathHash = pathLength > 0 ? HashProcessPath(processPath, pathLength) : 0;
+    ReadLayerAddress(layer, inFixedValues, layer->localAddress, event.localAddress);
+    ReadLayerAddress(layer, inFixedValues, layer->remoteAddress, event.remoteAddress);
+    event.localPort = inFixedValues->incomingValue[layer->localPort].value.uint16;
+    event.remotePort = inFixedValues->incomingValue[layer->remotePort].value.uint16;
+    PublishEvent(&event);
+}
+
+// Helper: Publish the LISTEN event for a socket starting to listen. Never
+// decides anything: the filter is an inspection filter.
+FORCEINLINE void ClassifyListen(
+    const LISTEN_LAYER* layer,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    classifyOut->actionType = FWP_ACTION_CONTINUE;
+
+    if (!ReadNoFence(&g_Context.EventSubscriberCount) ||
+        (inFixedValues->incomingValue[layer->flags].value.uint32 & FWP_CONDITION_FLAG_IS_REAUTHORIZE)) {
+        return;
+    }
+
+    NETGUARD_EVENT event = {0};
+    const WCHAR* processPath;
+    SIZE_T pathLength = GetProcessPath(inMetaValues, &processPath);
+    const FWP_VALUE0* localAddress = &inFixedValues->incomingValue[layer->localAddress].value;
+
+    event.type = EVENT_TYPE_LISTEN;
+    event.protocol = IPPROTO_TCP;
+    event.direction = FWP_DIRECTION_INBOUND;
+    event.verdict = FLOW_VERDICT_UNKNOWN;
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        event.processId = (UINT32)inMetaValues->processId;
+    }
+    event.pathHash = pathLength > 0 ? HashProcessPath(processPath, pathLength) : 0;
+    if (layer->v6) {
+        RtlCopyMemory(event.localAddress, localAddress->byteArray16->byteArray16, NETGUARD_ADDRESS_LENGTH);
+    } else {
+        MapAddress4(localAddress->uint32, event.localAddress);
+    }
+    event.localPort = inFixedValues->incomingValue[layer->localPort].value.uint16;
+    PublishEvent(&event);
+}
+
+// WFP Classify functions - one per CLASSIFY_* layer, each its own instance
+// of the engine
+void NTAPI NetGuardClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyTimed(&ClassifyConnectV4, inFixedValues, inMetaValues, flowContext, classifyOut);
+}
+
+void NTAPI NetGuardClassifyConnect6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyTimed(&ClassifyConnectV6, inFixedValues, inMetaValues, flowContext, classifyOut);
+}
+
+void NTAPI NetGuardClassifyAccept4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyTimed(&ClassifyRecvAcceptV4, inFixedValues, inMetaValues, flowContext, classifyOut);
+    PublishAcceptEvent(&ClassifyRecvAcceptV4, inFixedValues, inMetaValues, classifyOut);
+}
+
+void NTAPI NetGuardClassifyAccept6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyTimed(&ClassifyRecvAcceptV6, inFixedValues, inMetaValues, flowContext, classifyOut);
+    PublishAcceptEvent(&ClassifyRecvAcceptV6, inFixedValues, inMetaValues, classifyOut);
+}
+
+void NTAPI NetGuardListen4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyListen(&ListenV4, inFixedValues, inMetaValues, classifyOut);
+}
+
+void NTAPI NetGuardListen6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyListen(&ListenV6, inFixedValues, inMetaValues, classifyOut);
+}
@@ -0,0 +1,249 @@
+/*
+ * NetGuard WFP Callout Driver - DNS name cache
+ *
+ * Inbound DNS answers seen by the datagram callout are parsed here, and the
+ * IPv4 and IPv6 addresses they carry are mapped to the name that was queried. Pending
+ * records and connection events carry that name, so the service can show the
+ * hostname the app asked for instead of reverse-resolving every address.
+ */
+
+#include "netguard.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_POINTERS 16   // Compression pointers followed per name
+#define DNS_FLAG_RESPONSE 0x8000
+#define DNS_RCODE_MASK 0x000F
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+// Helper: Big-endian reads from a DNS message
+static UINT16 ReadDns16(const UCHAR* p) {
+    return (UINT16)((p[0] << 8) | p[1]);
+}
+
+static UINT32 ReadDns32(const UCHAR* p) {
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | p[3];
+}
+
+// Helper: Bucket of an address, given as two words
+static PDNS_CACHE_ENTRY DnsBucket(const UINT64* address) {
+    UINT64 key = address[0] ^ (address[1] * 0xC2B2AE3D27D4EB4FULL);
+    UINT32 bucket = (UINT32)((key * 0x9E3779B97F4A7C15ULL) >> 56); // Top bits of a Fibonacci hash
+    return &g_Context.DnsCache[(bucket & (DNS_CACHE_BUCKETS - 1)) * DNS_CACHE_WAYS];
+}
+
+// Helper: Read a possibly compressed name starting at offset. With name set,
+// the labels are written to it as lowercase dotted text and *nameLength is
+// set; names with characters outside printable ASCII are rejected. Returns
+// the offset just past the name where it started, or 0 if it is malformed.
+static ULONG ReadDnsName(const UCHAR* message, ULONG length, ULONG offset, PCHAR name, PUINT32 nameLength) {
+    ULONG end = 0;
+    UINT32 written = 0;
+    UINT32 pointers = 0;
+
+    while (offset < length) {
+        UINT8 label = message[offset];
+
+        if (label == 0) {
+            if (nameLength) {
+                *nameLength = written;
+            }
+            return end ? end : offset + 1;
+        }
+
+        if ((label & 0xC0) == 0xC0) {
+            if (offset + 1 >= length || ++pointers > DNS_MAX_POINTERS) {
+                return 0;
+            }
+            if (!end) {
+                end = offset + 2;
+            }
+            offset = ((ULONG)(label & 0x3F) << 8) | message[offset + 1];
+            continue;
+        }
+        if ((label & 0xC0) != 0 || offset + 1 + label > length) {
+            return 0;
+        }
+
+        if (name) {
+            if (written + (written ? 1 : 0) + label > DNS_MAX_NAME_LENGTH) {
+                return 0;
+            }
+            if (written) {
+                name[written++] = '.';
+            }
+            for (UINT32 i = 0; i < label; i++) {
+                CHAR c = (CHAR)message[offset + 1 + i];
+                if (c <= ' ' || c > '~') {
+                    return 0;
+                }
+                if (c >= 'A' && c <= 'Z') {
+                    c += 'a' - 'A';
+                }
+                name[written++] = c;
+            }
+        }
+        offset += 1 + label;
+    }
+
+    return 0;
+}
+
+// Helper: Remember that address (NETGUARD_ADDRESS_LENGTH bytes) belongs to
+// name. Callable at IRQL <= DISPATCH_LEVEL.
+static void StoreDnsName(const UINT8* address, const CHAR* name, UINT32 nameLength, UINT32 ttl) {
+    UINT64 key[2];
+    RtlCopyMemory(key, address, NETGUARD_ADDRESS_LENGTH);
+    if ((key[0] | key[1]) == 0) {
+        return;
+    }
+
+    PDNS_CACHE_ENTRY bucket = DnsBucket(key);
+    PDNS_CACHE_ENTRY target = NULL;
+    LARGE_INTEGER now;
+    KIRQL oldIrql;
+
+    KeQuerySystemTime(&now);
+    ttl = min(max(ttl, DNS_MIN_TTL_SECONDS), DNS_MAX_TTL_SECONDS);
+
+    KeAcquireSpinLock(&g_Context.DnsLock, &oldIrql);
+
+    // The address's own entry, else an empty or expired one, else the one
+    // that would expire first
+    for (UINT32 way = 0; way < DNS_CACHE_WAYS; way++) {
+        PDNS_CACHE_ENTRY entry = &bucket[way];
+        if (entry->address[0] == key[0] && entry->address[1] == key[1]) {
+            target = entry;
+            break;
+        }
+        if (!target || entry->expires < target->expires) {
+            target = entry;
+        }
+    }
+
+    InterlockedIncrement(&target->sequence);
+    target->address[0] = key[0];
+    target->address[1] = key[1];
+    target->expires = now.QuadPart + (LONGLONG)ttl * 10000000;
+    target->nameLength = (UINT8)nameLength;
+    RtlCopyMemory(target->name, name, nameLength);
+    InterlockedIncrement(&target->sequence);
+
+    KeReleaseSpinLock(&g_Context.DnsLock, oldIrql);
+}
+
+// Helper: Cache the A and AAAA records of a DNS response under its question
+// name.
+// message starts at the DNS header; anything malformed is ignored. CNAME
+// chains need no following: every address in the answer is what the
+// question name resolved to.
+void ParseDnsResponse(const UCHAR* message, ULONG length) {
+    CHAR name[DNS_MAX_NAME_LENGTH];
+    UINT32 nameLength = 0;
+
+    if (!g_Context.DnsCache || length < DNS_HEADER_SIZE) {
+        return;
+    }
+
+    UINT16 flags = ReadDns16(message + 2);
+    UINT16 questions = ReadDns16(message + 4);
+    UINT16 answers = ReadDns16(message + 6);
+    if (!(flags & DNS_FLAG_RESPONSE) || (flags & DNS_RCODE_MASK) != 0 || questions != 1 || answers == 0) {
+        return;
+    }
+
+    ULONG offset = ReadDnsName(message, length, DNS_HEADER_SIZE, name, &nameLength);
+    if (!offset || nameLength == 0 || offset + 4 > length) {
+        return;
+    }
+    offset += 4; // QTYPE, QCLASS
+
+    for (UINT32 i = 0; i < answers && i < DNS_MAX_ANSWERS; i++) {
+        offset = ReadDnsName(message, length, offset, NULL, NULL);
+        if (!offset || offset + 10 > length) {
+            return;
+        }
+
+        UINT16 type = ReadDns16(message + offset);
+        UINT16 recordClass = ReadDns16(message + offset + 2);
+        UINT32 ttl = ReadDns32(message + offset + 4);
+        UINT16 dataLength = ReadDns16(message + offset + 8);
+        offset += 10;
+        if (offset + dataLength > length) {
+            return;
+        }
+
+        if (type == DNS_TYPE_A && recordClass == DNS_CLASS_IN && dataLength == 4) {
+            UINT32 address4 = ReadDns32(message + offset);
+            if (address4 != 0) {
+                UINT8 address[NETGUARD_ADDRESS_LENGTH];
+                MapAddress4(address4, address);
+                StoreDnsName(address, name, nameLength, ttl);
+            }
+        } else if (type == DNS_TYPE_AAAA && recordClass == DNS_CLASS_IN && dataLength == NETGUARD_ADDRESS_LENGTH) {
+            StoreDnsName(message + offset, name, nameLength, ttl);
+        }
+        offset += dataLength;
+    }
+}
+
+// Helper: Copy the cached name of an address (NETGUARD_ADDRESS_LENGTH bytes,
+// IPv4 mapped) into name, which has room for DNS_MAX_NAME_LENGTH chars.
+// Returns its length, or 0 if there is none. Lock-free; callable at IRQL <=
+// DISPATCH_LEVEL.
+UINT32 LookupDnsName(const UINT8* address, PCHAR name) {
+    LARGE_INTEGER now;
+    UINT64 key[2];
+
+    RtlCopyMemory(key, address, NETGUARD_ADDRESS_LENGTH);
+    if (!g_Context.DnsCache || (key[0] | key[1]) == 0) {
+        return 0;
+    }
+    KeQuerySystemTime(&now);
+
+    PDNS_CACHE_ENTRY bucket = DnsBucket(key);
+    for (UINT32 way = 0; way < DNS_CACHE_WAYS; way++) {
+        PDNS_CACHE_ENTRY entry = &bucket[way];
+
+        for (;;) {
+            LONG sequence = ReadAcquire(&entry->sequence);
+            if (sequence & 1) {
+                YieldProcessor();
+                continue;
+            }
+            if (entry->address[0] != key[0] || entry->address[1] != key[1]) {
+                break;
+            }
+
+            LONGLONG expires = entry->expires;
+            UINT32 nameLength = min(entry->nameLength, DNS_MAX_NAME_LENGTH);
+            RtlCopyMemory(name, entry->name, nameLength);
+
+            KeMemoryBarrier();
+            if (ReadNoFence(&entry->sequence) != sequence) {
+                continue; // Rewritten while copying
+            }
+            return (expires > now.QuadPart) ? nameLength : 0;
+        }
+    }
+
+    return 0;
+}
+
+// Helper: Allocate the DNS cache
+NTSTATUS InitializeDnsCache(void) {
+    KeInitializeSpinLock(&g_Context.DnsLock);
+
+    g_Context.DnsCache = (PDNS_CACHE_ENTRY)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        DNS_CACHE_BUCKETS * DNS_CACHE_WAYS * sizeof(DNS_CACHE_ENTRY), NETGUARD_POOL_TAG);
+    return g_Context.DnsCache ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+// Helper: Free the DNS cache. Only called once no classify can be running.
+void FreeDnsCache(void) {
+    if (g_Context.DnsCache) {
+        ExFreePoolWithTag(g_Context.DnsCache, NETGUARD_POOL_TAG);
+        g_Context.DnsCache = NULL;
+    }
+}
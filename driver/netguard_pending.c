@@ -0,0 +1,551 @@
+/*
+ * NetGuard WFP Callout Driver - pending queue
+ *
+ * Connects from apps without a rule, held (pended) until the user answers
+ * through IOCTL_NETGUARD_RESPOND or the timeout verdict applies, and the
+ * GET_PENDING requests parked until one arrives.
+ */
+
+#include "netguard.h"
+
+// Helper: Find the waiting entry for an app. Caller holds PendingLock.
+PPENDING_ENTRY FindPendingApp(UINT64 pathHash, const WCHAR* processPath, SIZE_T pathLength) {
+    for (UINT32 probe = 0; probe < PENDING_APP_SLOTS; probe++) {
+        UINT16 ref = g_Context.PendingAppIndex[(pathHash + probe) & (PENDING_APP_SLOTS - 1)];
+        if (ref == 0) {
+            break;
+        }
+
+        PPENDING_ENTRY entry = g_Context.PendingConnections[ref - 1];
+        if (entry->pathHash == pathHash && entry->info.processPath[pathLength] == L'\0' &&
+            _wcsnicmp(entry->info.processPath, processPath, pathLength) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Helper: Drop an entry from the app index with backward-shift deletion, so
+// probe sequences stay unbroken without tombstones. Caller holds PendingLock.
+void UnindexPendingApp(PPENDING_ENTRY entry) {
+    UINT16 ref = PENDING_SLOT(entry->info.connectionId) + 1;
+    UINT32 hole = (UINT32)entry->pathHash & (PENDING_APP_SLOTS - 1);
+
+    while (g_Context.PendingAppIndex[hole] != ref) {
+        hole = (hole + 1) & (PENDING_APP_SLOTS - 1);
+    }
+
+    for (UINT32 next = (hole + 1) & (PENDING_APP_SLOTS - 1); ;
+         next = (next + 1) & (PENDING_APP_SLOTS - 1)) {
+        UINT16 moving = g_Context.PendingAppIndex[next];
+        if (moving == 0) {
+            break;
+        }
+
+        // Shift back only entries whose home slot is not in (hole, next]
+        UINT32 home = (UINT32)g_Context.PendingConnections[moving - 1]->pathHash & (PENDING_APP_SLOTS - 1);
+        if (((next - home) & (PENDING_APP_SLOTS - 1)) >= ((next - hole) & (PENDING_APP_SLOTS - 1))) {
+            g_Context.PendingAppIndex[hole] = moving;
+            hole = next;
+        }
+    }
+
+    g_Context.PendingAppIndex[hole] = 0;
+}
+
+// Helper: Retire an entry and give it back to the lookaside list. Caller
+// holds PendingLock.
+void FreePendingEntry(PPENDING_ENTRY entry) {
+    UnindexPendingApp(entry);
+    if (!entry->info.responded) {
+        g_Context.UnansweredCount--;
+    }
+    g_Context.PendingConnections[PENDING_SLOT(entry->info.connectionId)] = NULL;
+    g_Context.PendingCount--;
+    ExFreeToLookasideListEx(&g_Context.PendingLookaside, entry);
+}
+
+// Helper: Record a verdict on an entry and collect the completion handles it
+// holds into completions[] (room for MAX_PENDING_ENDPOINTS is required).
+// Frees the entry when no reauthorization is expected. Caller holds PendingLock.
+UINT32 ResolvePendingEntry(PPENDING_ENTRY entry, BOOLEAN allowed, HANDLE* completions) {
+    UINT32 count = 0;
+
+    entry->info.responded = TRUE;
+    entry->info.allowed = allowed;
+    g_Context.UnansweredCount--;
+    InterlockedIncrement(&g_Context.PendingAnswers); // Retires memoized blocks
+
+    for (UINT32 i = 0; i < entry->info.endpointCount; i++) {
+        if (entry->pendState[i] == PENDED_HELD) {
+            completions[count++] = entry->completionContext[i];
+            entry->completionContext[i] = NULL;
+            entry->pendState[i] = PENDED_RELEASED;
+        }
+    }
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "PendingDequeue",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_PENDING),
+        TraceLoggingUInt64(entry->info.connectionId, "connectionId"),
+        TraceLoggingBoolean(allowed, "allowed"),
+        TraceLoggingUInt32(count, "released"));
+
+    entry->awaitingReauth = count;
+    if (count == 0) {
+        FreePendingEntry(entry);
+    }
+    return count;
+}
+
+// Helper: Apply the timeout verdict to pended connections nobody answered,
+// and drop answered entries whose reauthorization never arrived (the socket
+// went away). Completion happens outside PendingLock because completing a
+// pended operation re-enters NetGuardClassifyFn.
+void ExpireStalePending(void) {
+    HANDLE expired[4 * MAX_PENDING_ENDPOINTS];
+    UINT32 expiredCount;
+    UINT32 slot = 0;
+    LARGE_INTEGER now;
+
+    KeQuerySystemTime(&now);
+
+    do {
+        KIRQL oldIrql;
+        expiredCount = 0;
+
+        AcquirePendingLock(&oldIrql);
+
+        for (; slot < MAX_PENDING_CONNECTIONS &&
+               expiredCount + MAX_PENDING_ENDPOINTS <= RTL_NUMBER_OF(expired); slot++) {
+            PPENDING_ENTRY entry = g_Context.PendingConnections[slot];
+            if (!entry) {
+                continue;
+            }
+
+            LONGLONG age = now.QuadPart - entry->info.timestamp.QuadPart;
+            if (!entry->info.responded) {
+                if (age >= g_Context.PendingTimeout) {
+                    UINT32 held = ResolvePendingEntry(entry, g_Context.PendingTimeoutAllow,
+                                                      &expired[expiredCount]);
+                    InterlockedAdd64(&g_Context.CpuStats[KeGetCurrentProcessorIndex()].TimedOutConnections, held);
+                    expiredCount += held;
+                }
+            } else if (age >= 2 * g_Context.PendingTimeout) {
+                FreePendingEntry(entry);
+            }
+        }
+
+        ReleasePendingLock(oldIrql);
+
+        for (UINT32 i = 0; i < expiredCount; i++) {
+            FwpsCompleteOperation0(expired[i], NULL);
+        }
+    } while (slot < MAX_PENDING_CONNECTIONS);
+}
+
+// Helper: Pack unanswered pending connections newer than afterId into a
+// GET_PENDING buffer, starting at ring slot cursor. outputLength must be at
+// least PENDING_MIN_OUTPUT. Returns the bytes written.
+ULONG CopyPendingToBuffer(PVOID outputBuffer, ULONG outputLength, UINT32 cursor, UINT64 afterId) {
+    KIRQL oldIrql;
+    PPENDING_BATCH_HEADER header = (PPENDING_BATCH_HEADER)outputBuffer;
+    PUCHAR out = (PUCHAR)outputBuffer + sizeof(PENDING_BATCH_HEADER);
+    PUCHAR end = (PUCHAR)outputBuffer + outputLength;
+    UINT32 slot;
+
+    RtlZeroMemory(header, sizeof(PENDING_BATCH_HEADER));
+    header->version = PENDING_RECORD_VERSION;
+
+    AcquirePendingLock(&oldIrql);
+
+    for (slot = cursor; slot < MAX_PENDING_CONNECTIONS; slot++) {
+        PPENDING_ENTRY entry = g_Context.PendingConnections[slot];
+        if (!entry || entry->info.responded || entry->info.connectionId <= afterId) {
+            continue;
+        }
+
+        UINT16 pathLength = (UINT16)wcsnlen(entry->info.processPath, MAX_PATH_LENGTH);
+        ULONG recordLength = sizeof(PENDING_RECORD) +
+                             entry->info.endpointCount * sizeof(PENDING_REMOTE) +
+                             pathLength * sizeof(WCHAR) + entry->info.hostLength;
+        if (recordLength > (ULONG)(end - out)) {
+            header->moreData = TRUE;
+            break;
+        }
+
+        PENDING_RECORD record;
+        record.recordLength = (UINT16)recordLength;
+        record.connectionId = entry->info.connectionId;
+        record.processId = entry->info.processId;
+        record.timestamp = entry->info.timestamp;
+        record.connectionCount = entry->info.connectionCount;
+        record.endpointCount = (UINT8)entry->info.endpointCount;
+        record.pathLength = pathLength;
+        record.hostLength = entry->info.hostLength;
+
+        // out is unaligned, so build the fixed part on the stack
+        RtlCopyMemory(out, &record, sizeof(record));
+        out += sizeof(record);
+        RtlCopyMemory(out, entry->info.remotes, entry->info.endpointCount * sizeof(PENDING_REMOTE));
+        out += entry->info.endpointCount * sizeof(PENDING_REMOTE);
+        RtlCopyMemory(out, entry->info.processPath, pathLength * sizeof(WCHAR));
+        out += pathLength * sizeof(WCHAR);
+        RtlCopyMemory(out, entry->info.hostName, entry->info.hostLength);
+        out += entry->info.hostLength;
+
+        header->recordCount++;
+    }
+
+    ReleasePendingLock(oldIrql);
+
+    header->nextCursor = slot;
+    header->totalLength = (UINT32)(out - (PUCHAR)outputBuffer);
+    return header->totalLength;
+}
+
+// Helper: Whether an unanswered pending connection newer than afterId
+// exists. Caller holds PendingLock.
+BOOLEAN HasUnansweredAfter(UINT64 afterId) {
+    if (g_Context.UnansweredCount == 0 || afterId >= g_Context.NextPendingId) {
+        return FALSE;
+    }
+    if (afterId == 0) {
+        return TRUE;
+    }
+
+    for (UINT32 slot = 0; slot < MAX_PENDING_CONNECTIONS; slot++) {
+        PPENDING_ENTRY entry = g_Context.PendingConnections[slot];
+        if (entry && !entry->info.responded && entry->info.connectionId > afterId) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Cancel-safe queue callbacks for parked GET_PENDING IRPs. The queue lock is
+// PendingLock, so PendingIrpInsert runs atomically with respect to
+// QueuePendingConnection and can refuse to park an IRP that could be answered.
+// InsertContext points to the query's afterId, which is kept in
+// DriverContext[0] for the completion.
+NTSTATUS PendingIrpInsert(PIO_CSQ Csq, PIRP Irp, PVOID InsertContext) {
+    UNREFERENCED_PARAMETER(Csq);
+    UINT64 afterId = *(PUINT64)InsertContext;
+
+    if (HasUnansweredAfter(afterId)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    Irp->Tail.Overlay.DriverContext[0] = (PVOID)(ULONG_PTR)afterId;
+    InsertTailList(&g_Context.PendingIrpList, &Irp->Tail.Overlay.ListEntry);
+    return STATUS_SUCCESS;
+}
+
+void PendingIrpRemove(PIO_CSQ Csq, PIRP Irp) {
+    UNREFERENCED_PARAMETER(Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+// PeekContext, when set, is the FILE_OBJECT whose IRPs are wanted
+PIRP PendingIrpPeekNext(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext) {
+    UNREFERENCED_PARAMETER(Csq);
+
+    PLIST_ENTRY entry = Irp ? Irp->Tail.Overlay.ListEntry.Flink : g_Context.PendingIrpList.Flink;
+
+    for (; entry != &g_Context.PendingIrpList; entry = entry->Flink) {
+        PIRP next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+        if (!PeekContext || IoGetCurrentIrpStackLocation(next)->FileObject == (PFILE_OBJECT)PeekContext) {
+            return next;
+        }
+    }
+
+    return NULL;
+}
+
+void PendingIrpAcquireLock(PIO_CSQ Csq, PKIRQL Irql) {
+    UNREFERENCED_PARAMETER(Csq);
+    AcquirePendingLock(Irql);
+}
+
+void PendingIrpReleaseLock(PIO_CSQ Csq, KIRQL Irql) {
+    UNREFERENCED_PARAMETER(Csq);
+    ReleasePendingLock(Irql);
+}
+
+void PendingIrpCompleteCanceled(PIO_CSQ Csq, PIRP Irp) {
+    UNREFERENCED_PARAMETER(Csq);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+// Helper: Take a ring slot for a new app, or NULL when the queue is full or
+// no entry can be allocated. Caller holds PendingLock.
+static PPENDING_ENTRY NewPendingEntry(UINT32 processId, const WCHAR* processPath, SIZE_T pathLength,
+                                      UINT64 pathHash, const UINT8* remoteAddress, UINT16 remotePort) {
+    // Take the ring slot of the next connection ID, skipping slots whose
+    // older entry is still waiting
+    for (UINT32 attempt = 0; attempt < MAX_PENDING_CONNECTIONS && g_Context.PendingCount < MAX_PENDING_CONNECTIONS; attempt++) {
+        UINT64 connectionId = ++g_Context.NextPendingId;
+        if (g_Context.PendingConnections[PENDING_SLOT(connectionId)]) {
+            continue;
+        }
+
+        PPENDING_ENTRY entry = (PPENDING_ENTRY)ExAllocateFromLookasideListEx(&g_Context.PendingLookaside);
+        if (!entry) {
+            return NULL;
+        }
+        RtlZeroMemory(entry, sizeof(PENDING_ENTRY));
+        g_Context.PendingConnections[PENDING_SLOT(connectionId)] = entry;
+        entry->pathHash = pathHash;
+        entry->info.connectionId = connectionId;
+        entry->info.processId = processId;
+        RtlCopyMemory(entry->info.processPath, processPath, pathLength * sizeof(WCHAR));
+        RtlCopyMemory(entry->info.remoteAddress, remoteAddress, NETGUARD_ADDRESS_LENGTH);
+        entry->info.remotePort = remotePort;
+        entry->info.hostLength = (UINT8)LookupDnsName(remoteAddress, entry->info.hostName);
+        KeQuerySystemTime(&entry->info.timestamp);
+
+        UINT32 home = (UINT32)pathHash & (PENDING_APP_SLOTS - 1);
+        while (g_Context.PendingAppIndex[home] != 0) {
+            home = (home + 1) & (PENDING_APP_SLOTS - 1);
+        }
+        g_Context.PendingAppIndex[home] = PENDING_SLOT(connectionId) + 1;
+
+        g_Context.PendingCount++;
+        g_Context.UnansweredCount++;
+        if (g_Context.PendingCount > g_Context.PendingHighWater) {
+            g_Context.PendingHighWater = g_Context.PendingCount;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+// Helper: The unanswered entry with the lowest connection ID, or NULL.
+// Caller holds PendingLock.
+static PPENDING_ENTRY FindOldestUnanswered(void) {
+    PPENDING_ENTRY oldest = NULL;
+
+    for (UINT32 slot = 0; slot < MAX_PENDING_CONNECTIONS; slot++) {
+        PPENDING_ENTRY entry = g_Context.PendingConnections[slot];
+        if (entry && !entry->info.responded &&
+            (!oldest || entry->info.connectionId < oldest->info.connectionId)) {
+            oldest = entry;
+        }
+    }
+    return oldest;
+}
+
+// Helper: Decide what to do with a connect from an app that has no rule.
+// - An answered entry for the app supplies its verdict (this is how the
+//   reauthorization after FwpsCompleteOperation0 gets the user's answer).
+// - A waiting entry absorbs the connect: it is counted, recorded and, while
+//   there is room, pended alongside the first one.
+// - Otherwise a new entry is taken from the ring. When completionHandle is
+//   supplied the classify is pended with FwpsPendOperation0 so the connect
+//   can be released by IOCTL_NETGUARD_RESPOND instead of being dropped.
+// - With the ring full, PendingOverflowPolicy decides.
+// Returns PENDING_ACTION_PERMIT only for an answered allow or an overflow.
+UINT32 QueuePendingConnection(UINT32 processId, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash,
+                              const UINT8* remoteAddress, UINT16 remotePort, UINT16 localPort,
+                              BOOLEAN isReauth, HANDLE completionHandle) {
+    KIRQL oldIrql;
+    UINT32 action = PENDING_ACTION_PERMIT;
+    BOOLEAN created = FALSE;
+    UINT64 connectionId = 0;
+    HANDLE evicted[MAX_PENDING_ENDPOINTS];
+    UINT32 evictedCount = 0;
+
+    AcquirePendingLock(&oldIrql);
+
+    PPENDING_ENTRY entry = FindPendingApp(pathHash, processPath, pathLength);
+
+    if (entry && entry->info.responded) {
+        action = entry->info.allowed ? PENDING_ACTION_PERMIT : PENDING_ACTION_BLOCK;
+
+        if (isReauth) {
+            for (UINT32 i = 0; i < entry->info.endpointCount; i++) {
+                if (entry->pendState[i] == PENDED_RELEASED && entry->localPort[i] == localPort &&
+                    entry->info.remotes[i].remotePort == remotePort &&
+                    RtlEqualMemory(entry->info.remotes[i].remoteAddress, remoteAddress, NETGUARD_ADDRESS_LENGTH)) {
+                    entry->pendState[i] = PENDED_NONE;
+                    if (--entry->awaitingReauth == 0) {
+                        FreePendingEntry(entry);
+                    }
+                    break;
+                }
+            }
+        }
+        ReleasePendingLock(oldIrql);
+        return action;
+    }
+
+    if (!entry) {
+        entry = NewPendingEntry(processId, processPath, pathLength, pathHash, remoteAddress, remotePort);
+
+        if (!entry) {
+            COUNT_STAT(DroppedConnections);
+
+            if (g_Context.PendingOverflowPolicy == PENDING_OVERFLOW_BLOCK) {
+                action = PENDING_ACTION_BLOCK;
+            } else if (g_Context.PendingOverflowPolicy == PENDING_OVERFLOW_DROP_OLDEST) {
+                // The oldest waiter gets the timeout verdict early. Its slot
+                // is free at once unless it held connects, which keep it until
+                // their reauthorizations; meanwhile this connect gets the same
+                // verdict.
+                action = g_Context.PendingTimeoutAllow ? PENDING_ACTION_PERMIT : PENDING_ACTION_BLOCK;
+                PPENDING_ENTRY oldest = FindOldestUnanswered();
+                if (oldest) {
+                    evictedCount = ResolvePendingEntry(oldest, g_Context.PendingTimeoutAllow, evicted);
+                    COUNT_STAT(EvictedEntries);
+                    entry = NewPendingEntry(processId, processPath, pathLength, pathHash, remoteAddress, remotePort);
+                }
+            }
+        }
+        created = entry != NULL;
+    }
+
+    if (entry) {
+        action = PENDING_ACTION_BLOCK;
+        entry->info.connectionCount++;
+
+        UINT32 i = entry->info.endpointCount;
+        if (i < MAX_PENDING_ENDPOINTS) {
+            RtlCopyMemory(entry->info.remotes[i].remoteAddress, remoteAddress, NETGUARD_ADDRESS_LENGTH);
+            entry->info.remotes[i].remotePort = remotePort;
+            entry->localPort[i] = localPort;
+            entry->pendState[i] = PENDED_NONE;
+            if (completionHandle &&
+                NT_SUCCESS(FwpsPendOperation0(completionHandle, &entry->completionContext[i]))) {
+                entry->pendState[i] = PENDED_HELD;
+                action = PENDING_ACTION_PENDED;
+            }
+            entry->info.endpointCount++;
+        }
+        connectionId = entry->info.connectionId;
+    }
+
+    ReleasePendingLock(oldIrql);
+
+    for (UINT32 i = 0; i < evictedCount; i++) {
+        FwpsCompleteOperation0(evicted[i], NULL);
+    }
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "PendingEnqueue",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_PENDING),
+        TraceLoggingUInt64(connectionId, "connectionId"), // 0: queue full
+        TraceLoggingUInt32(processId, "processId"),
+        TraceLoggingBoolean(created, "created"),
+        TraceLoggingUInt32(action, "action"));
+
+    // Hand a new app to a waiting GET_PENDING request, if any
+    if (created) {
+        PIRP irp = IoCsqRemoveNextIrp(&g_Context.PendingIrpQueue, NULL);
+        if (irp) {
+            PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(irp);
+            irp->IoStatus.Information = CopyPendingToBuffer(irp->AssociatedIrp.SystemBuffer,
+                irpSp->Parameters.DeviceIoControl.OutputBufferLength, 0,
+                (UINT64)(ULONG_PTR)irp->Tail.Overlay.DriverContext[0]);
+            irp->IoStatus.Status = STATUS_SUCCESS;
+            IoCompleteRequest(irp, IO_NO_INCREMENT);
+        }
+    }
+
+    return action;
+}
+
+// Helper: Release every pended connection, e.g. when filtering is disabled,
+// unknown apps are permitted, or the driver unloads. The reauthorization sees
+// Enabled == FALSE or PermitUnknown and permits.
+void CompleteAllPending(void) {
+    HANDLE completions[4 * MAX_PENDING_ENDPOINTS];
+    UINT32 count;
+    UINT32 slot = 0;
+
+    do {
+        KIRQL oldIrql;
+        count = 0;
+
+        AcquirePendingLock(&oldIrql);
+        for (; slot < MAX_PENDING_CONNECTIONS &&
+               count + MAX_PENDING_ENDPOINTS <= RTL_NUMBER_OF(completions); slot++) {
+            PPENDING_ENTRY entry = g_Context.PendingConnections[slot];
+            if (!entry) {
+                continue;
+            }
+            for (UINT32 i = 0; i < entry->info.endpointCount; i++) {
+                if (entry->pendState[i] == PENDED_HELD) {
+                    completions[count++] = entry->completionContext[i];
+                }
+            }
+            FreePendingEntry(entry);
+        }
+        ReleasePendingLock(oldIrql);
+
+        for (UINT32 i = 0; i < count; i++) {
+            FwpsCompleteOperation0(completions[i], NULL);
+        }
+    } while (slot < MAX_PENDING_CONNECTIONS);
+}
+
+// Helper: Set up the pending queue. Called once, with g_Context zeroed.
+NTSTATUS InitializePendingQueue(void) {
+    KeInitializeSpinLock(&g_Context.PendingLock);
+    InitializeListHead(&g_Context.PendingIrpList);
+    IoCsqInitializeEx(&g_Context.PendingIrpQueue, PendingIrpInsert, PendingIrpRemove,
+                      PendingIrpPeekNext, PendingIrpAcquireLock, PendingIrpReleaseLock,
+                      PendingIrpCompleteCanceled);
+    g_Context.PendingTimeout = (LONGLONG)DEFAULT_PENDING_TIMEOUT_MS * 10000;
+    g_Context.PendingTimeoutAllow = FALSE;
+    g_Context.PendingOverflowPolicy = PENDING_OVERFLOW_ALLOW;
+
+    // Entries are taken at DISPATCH_LEVEL under PendingLock
+    NTSTATUS status = ExInitializeLookasideListEx(&g_Context.PendingLookaside, NULL, NULL, NonPagedPoolNx,
+        0, sizeof(PENDING_ENTRY), NETGUARD_POOL_TAG, 0);
+    if (NT_SUCCESS(status)) {
+        g_Context.PendingLookasideReady = TRUE;
+    }
+    return status;
+}
+
+// Helper: Release the entry lookaside list. Every entry must have been freed
+// (CompleteAllPending).
+void DeletePendingQueue(void) {
+    if (g_Context.PendingLookasideReady) {
+        ExDeleteLookasideListEx(&g_Context.PendingLookaside);
+        g_Context.PendingLookasideReady = FALSE;
+    }
+}
+
+// Timer DPC: expire stale entries while any exist
+static void PendingSweepDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // Unlocked peek: a racing insert is caught by the next tick
+    if (ReadNoFence((volatile LONG*)&g_Context.PendingCount) != 0) {
+        ExpireStalePending();
+    }
+}
+
+// Helper: Start the periodic sweep. Called once the statistics it updates exist.
+void StartPendingSweeper(void) {
+    LARGE_INTEGER dueTime;
+
+    KeInitializeTimer(&g_Context.PendingSweepTimer);
+    KeInitializeDpc(&g_Context.PendingSweepDpc, PendingSweepDpc, NULL);
+
+    dueTime.QuadPart = -(LONGLONG)PENDING_SWEEP_INTERVAL_MS * 10000;
+    KeSetCoalescableTimer(&g_Context.PendingSweepTimer, dueTime, PENDING_SWEEP_INTERVAL_MS,
+                          PENDING_SWEEP_TOLERANCE_MS, &g_Context.PendingSweepDpc);
+}
+
+// Helper: Stop the sweep and wait out a DPC that is already running
+void StopPendingSweeper(void) {
+    KeCancelTimer(&g_Context.PendingSweepTimer);
+    KeFlushQueuedDpcs();
+}
@@ -0,0 +1,270 @@
+/*
+ * NetGuard WFP Callout Driver - boot policy
+ *
+ * The rule set, pattern rules and filtering settings saved under the service
+ * key, so the driver enforces them from the moment it loads instead of
+ * starting empty until the service connects and replays its rules.
+ */
+
+#include "netguard.h"
+
+// Helper: Open the Parameters subkey of the service key, creating it for
+// writing. The caller closes *key.
+static NTSTATUS OpenPolicyKey(BOOLEAN forWrite, PHANDLE key) {
+    OBJECT_ATTRIBUTES attributes;
+    UNICODE_STRING parametersName;
+    HANDLE serviceKey;
+    NTSTATUS status;
+
+    if (!g_Context.ServiceKeyPath.Buffer) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    InitializeObjectAttributes(&attributes, &g_Context.ServiceKeyPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwOpenKey(&serviceKey, forWrite ? KEY_CREATE_SUB_KEY : KEY_READ, &attributes);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlInitUnicodeString(&parametersName, L"Parameters");
+    InitializeObjectAttributes(&attributes, &parametersName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, serviceKey, NULL);
+    if (forWrite) {
+        status = ZwCreateKey(key, KEY_SET_VALUE, &attributes, 0, NULL, REG_OPTION_NON_VOLATILE, NULL);
+    } else {
+        status = ZwOpenKey(key, KEY_QUERY_VALUE, &attributes);
+    }
+
+    ZwClose(serviceKey);
+    return status;
+}
+
+// Helper: Check a policy blob before anything is loaded from it: the header,
+// the exact length, and every entry's path range and hash. A stored hash
+// that doesn't match its path would leave the rule unreachable and the
+// index inconsistent, so it rejects the blob. The pattern set is checked by
+// BuildPatternTable.
+static NTSTATUS ValidatePolicy(const UCHAR* data, ULONG length) {
+    POLICY_HEADER header;
+
+    if (length < sizeof(POLICY_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    RtlCopyMemory(&header, data, sizeof(header));
+    if (header.magic != POLICY_MAGIC) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (header.version != POLICY_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    if (sizeof(POLICY_HEADER) + (UINT64)header.count * sizeof(POLICY_ENTRY) +
+        (UINT64)header.pathChars * sizeof(WCHAR) + header.patternLength != length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const UCHAR* entries = data + sizeof(POLICY_HEADER);
+    const WCHAR* paths = (const WCHAR*)(entries + (SIZE_T)header.count * sizeof(POLICY_ENTRY));
+    for (UINT32 i = 0; i < header.count; i++) {
+        POLICY_ENTRY entry;
+        RtlCopyMemory(&entry, entries + (SIZE_T)i * sizeof(POLICY_ENTRY), sizeof(entry));
+        if (entry.pathLength == 0 || entry.pathLength >= MAX_PATH_LENGTH ||
+            (UINT64)entry.pathOffset + entry.pathLength > header.pathChars) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (HashProcessPath(paths + entry.pathOffset, entry.pathLength) != entry.pathHash) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Helper: Write the active rules, pattern rules and the current filtering
+// settings to the registry as the policy the next DriverEntry loads. Entries
+// are written in index order with the hashes the index already holds.
+NTSTATUS SaveBootPolicy(void) {
+    UNICODE_STRING valueName;
+    HANDLE key;
+    NTSTATUS status;
+
+    RtlInitUnicodeString(&valueName, POLICY_VALUE_NAME);
+    AcquireRuleLock();
+
+    PRULE_TABLE table = g_Context.ActiveRules;
+    PPATTERN_TABLE patterns = g_Context.ActivePatterns;
+    UINT32 patternLength = patterns ? patterns->SourceLength : 0;
+    SIZE_T pathChars = table->PathBytes / sizeof(WCHAR) - table->Count; // Less the terminators
+    SIZE_T size = sizeof(POLICY_HEADER) + (SIZE_T)table->Count * sizeof(POLICY_ENTRY) +
+                  pathChars * sizeof(WCHAR) + patternLength;
+    if (size > POLICY_MAX_SIZE) {
+        ReleaseRuleLock();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    PPOLICY_HEADER header = (PPOLICY_HEADER)ExAllocatePool2(POOL_FLAG_PAGED, size, NETGUARD_POOL_TAG);
+    if (!header) {
+        ReleaseRuleLock();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    header->magic = POLICY_MAGIC;
+    header->version = POLICY_VERSION;
+    header->flags = (g_Context.Enabled ? POLICY_FLAG_ENABLED : 0) |
+                    (g_Context.PendingTimeoutAllow ? POLICY_FLAG_TIMEOUT_ALLOW : 0) |
+                    (g_Context.PermitUnknown ? POLICY_FLAG_PERMIT_UNKNOWN : 0);
+    header->count = table->Count;
+    header->timeoutMs = (UINT32)(g_Context.PendingTimeout / 10000);
+    header->overflowPolicy = g_Context.PendingOverflowPolicy;
+    header->pathChars = (UINT32)pathChars;
+    header->patternLength = patternLength;
+
+    // The entries follow the 28-byte header, so they are only 4-byte aligned
+    // and are copied in whole, as ValidatePolicy copies them out
+    PUCHAR entries = (PUCHAR)(header + 1);
+    PWCHAR paths = (PWCHAR)(entries + (SIZE_T)table->Count * sizeof(POLICY_ENTRY));
+    UINT32 written = 0;
+    UINT32 offset = 0;
+
+    for (UINT32 slot = 0; slot < table->SlotCount; slot++) {
+        PRULE_SLOT index = &table->Slots[slot];
+        if (index->appIndex == RULE_SLOT_EMPTY) {
+            continue;
+        }
+
+        PRULE_APP app = &table->Apps[index->appIndex];
+        POLICY_ENTRY entry;
+        RtlZeroMemory(&entry, sizeof(entry));
+        entry.pathHash = index->pathHash;
+        entry.pathOffset = offset;
+        entry.pathLength = app->pathLength;
+        entry.blocked = app->blocked;
+        entry.rateLimit = app->rateLimit;
+        RtlCopyMemory(entries + (SIZE_T)written * sizeof(POLICY_ENTRY), &entry, sizeof(entry));
+        RtlCopyMemory(paths + offset, app->processPath, app->pathLength * sizeof(WCHAR));
+        offset += app->pathLength;
+        written++;
+    }
+
+    if (patterns) {
+        RtlCopyMemory(paths + pathChars, patterns + 1, patternLength);
+    }
+
+    ReleaseRuleLock();
+
+    status = OpenPolicyKey(TRUE, &key);
+    if (NT_SUCCESS(status)) {
+        status = ZwSetValueKey(key, &valueName, 0, REG_BINARY, header, (ULONG)size);
+        ZwClose(key);
+    }
+
+    ExFreePoolWithTag(header, NETGUARD_POOL_TAG);
+    return status;
+}
+
+// Helper: Remember the service key and load the saved policy, if any, into
+// both rule table copies and the pattern rules. Called by DriverEntry before
+// the callouts are registered, so no reader or writer can be active. On
+// failure the rules stay empty and filtering stays off, as without a policy.
+NTSTATUS LoadBootPolicy(PUNICODE_STRING registryPath) {
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION value = NULL;
+    LONGLONG start = LatencyNow();
+    UINT32 count = 0;
+    HANDLE key;
+    ULONG length;
+    NTSTATUS status;
+
+    RtlInitUnicodeString(&valueName, POLICY_VALUE_NAME);
+    g_Context.ServiceKeyPath.Buffer = (PWCHAR)ExAllocatePool2(POOL_FLAG_PAGED,
+        registryPath->Length, NETGUARD_POOL_TAG);
+    if (!g_Context.ServiceKeyPath.Buffer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlCopyMemory(g_Context.ServiceKeyPath.Buffer, registryPath->Buffer, registryPath->Length);
+    g_Context.ServiceKeyPath.Length = registryPath->Length;
+    g_Context.ServiceKeyPath.MaximumLength = registryPath->Length;
+
+    status = OpenPolicyKey(FALSE, &key);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ZwQueryValueKey(key, &valueName, KeyValuePartialInformation, NULL, 0, &length);
+    if (status == STATUS_BUFFER_TOO_SMALL || status == STATUS_BUFFER_OVERFLOW) {
+        if (length > FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + POLICY_MAX_SIZE) {
+            status = STATUS_INVALID_PARAMETER;
+        } else {
+            value = (PKEY_VALUE_PARTIAL_INFORMATION)ExAllocatePool2(POOL_FLAG_PAGED, length, NETGUARD_POOL_TAG);
+            status = value ? ZwQueryValueKey(key, &valueName, KeyValuePartialInformation, value, length, &length)
+                           : STATUS_INSUFFICIENT_RESOURCES;
+        }
+    } else if (NT_SUCCESS(status)) {
+        status = STATUS_INVALID_PARAMETER; // Not expected without a buffer
+    }
+    ZwClose(key);
+
+    if (NT_SUCCESS(status) && value->Type != REG_BINARY) {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    if (NT_SUCCESS(status)) {
+        status = ValidatePolicy(value->Data, value->DataLength);
+    }
+
+    if (NT_SUCCESS(status)) {
+        POLICY_HEADER header;
+        RtlCopyMemory(&header, value->Data, sizeof(header));
+        const POLICY_ENTRY* entries = (const POLICY_ENTRY*)(value->Data + sizeof(POLICY_HEADER));
+        const WCHAR* paths = (const WCHAR*)(value->Data + sizeof(POLICY_HEADER) +
+                                            (SIZE_T)header.count * sizeof(POLICY_ENTRY));
+        PPATTERN_TABLE patterns = NULL;
+
+        if (header.patternLength > 0) {
+            status = BuildPatternTable((const UCHAR*)(paths + header.pathChars), header.patternLength, &patterns);
+        }
+        for (int i = 0; i < 2 && NT_SUCCESS(status); i++) {
+            status = LoadPolicyRules(g_Context.RuleTables[i], entries, header.count, paths);
+        }
+
+        if (NT_SUCCESS(status)) {
+            g_Context.ActivePatterns = patterns;
+            count = header.count;
+            g_Context.PendingTimeout = (LONGLONG)max(header.timeoutMs, 1000) * 10000;
+            g_Context.PendingTimeoutAllow = (header.flags & POLICY_FLAG_TIMEOUT_ALLOW) != 0;
+            if (header.overflowPolicy <= PENDING_OVERFLOW_DROP_OLDEST) {
+                g_Context.PendingOverflowPolicy = header.overflowPolicy;
+            }
+            g_Context.Enabled = (header.flags & POLICY_FLAG_ENABLED) != 0;
+            g_Context.PermitUnknown = (header.flags & POLICY_FLAG_PERMIT_UNKNOWN) != 0;
+        } else {
+            // Both copies must match; start empty rather than half loaded
+            ClearRuleTable(g_Context.RuleTables[0]);
+            ClearRuleTable(g_Context.RuleTables[1]);
+            if (patterns) {
+                ExFreePoolWithTag(patterns, NETGUARD_POOL_TAG);
+            }
+        }
+    }
+
+    if (value) {
+        ExFreePoolWithTag(value, NETGUARD_POOL_TAG);
+    }
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "PolicyLoad",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_RULES),
+        TraceLoggingNTStatus(status, "status"),
+        TraceLoggingUInt32(count, "ruleCount"),
+        TraceLoggingBoolean(g_Context.Enabled, "enabled"),
+        TraceLoggingBoolean(g_Context.PermitUnknown, "permitUnknown"),
+        TraceLoggingInt64(LatencyNow() - start, "loadTicks"));
+    return status;
+}
+
+// Helper: Release the saved service key path
+void FreeBootPolicy(void) {
+    if (g_Context.ServiceKeyPath.Buffer) {
+        ExFreePoolWithTag(g_Context.ServiceKeyPath.Buffer, NETGUARD_POOL_TAG);
+        RtlZeroMemory(&g_Context.ServiceKeyPath, sizeof(UNICODE_STRING));
+    }
+}
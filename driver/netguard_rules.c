@@ -0,0 +1,881 @@
+/*
+ * NetGuard WFP Callout Driver - rule table
+ *
+ * The allow/block list classify consults for every connect, kept as two
+ * copies so lookups never take a lock, the pattern rules behind it and the
+ * process verdict cache in front of it.
+ */
+
+#include "netguard.h"
+
+// Helper: Case-folded 64-bit FNV-1a hash of a process path. ASCII is folded
+// inline; anything else goes through RtlDowncaseUnicodeChar so that paths
+// _wcsnicmp considers equal always hash equal.
+UINT64 HashProcessPath(const WCHAR* processPath, SIZE_T maxChars) {
+    UINT64 hash = 0xcbf29ce484222325ULL;
+
+    for (SIZE_T i = 0; i < maxChars && processPath[i] != L'\0'; i++) {
+        WCHAR c = processPath[i];
+        if (c >= L'A' && c <= L'Z') {
+            c += L'a' - L'A';
+        } else if (c >= 0x80) {
+            c = RtlDowncaseUnicodeChar(c);
+        }
+        hash ^= (UINT64)c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Helper: Grace-period DPC, one per processor
+void NTAPI RuleGraceDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (InterlockedDecrement(&g_Context.GraceRemaining) == 0) {
+        KeSetEvent(&g_Context.GraceEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+// Helper: Wait until no processor can still be reading the previously active
+// rule table. Readers only touch a table at DISPATCH_LEVEL, and a DPC cannot
+// run on a processor until that processor drops below DISPATCH_LEVEL, so once
+// a DPC has run everywhere every reader that saw the old pointer has finished.
+// Caller holds RuleWriteLock.
+void WaitForRuleReaders(void) {
+    KeClearEvent(&g_Context.GraceEvent);
+    g_Context.GraceRemaining = (LONG)g_Context.GraceDpcCount;
+
+    for (ULONG i = 0; i < g_Context.GraceDpcCount; i++) {
+        KeInsertQueueDpc(&g_Context.GraceDpcs[i], NULL, NULL);
+    }
+
+    KeWaitForSingleObject(&g_Context.GraceEvent, Executive, KernelMode, FALSE, NULL);
+}
+
+// Helper: Find the index slot of a rule. processPath need not be terminated.
+// Returns RULE_SLOT_EMPTY if there is no rule for the path.
+UINT32 FindAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash) {
+    UINT32 mask = table->SlotCount - 1;
+    UINT32 slot = (UINT32)pathHash & mask;
+
+    for (UINT32 probe = 0; probe < RULE_MAX_PROBE; probe++) {
+        UINT32 index = (slot + probe) & mask;
+        PRULE_SLOT entry = &table->Slots[index];
+
+        if (entry->appIndex == RULE_SLOT_EMPTY) {
+            break;
+        }
+
+        PRULE_APP existing = &table->Apps[entry->appIndex];
+        if (entry->pathHash == pathHash && existing->pathLength == pathLength &&
+            _wcsnicmp(existing->processPath, processPath, pathLength) == 0) {
+            return index;
+        }
+    }
+
+    return RULE_SLOT_EMPTY;
+}
+
+// Helper: Character class of a folded non-ASCII character, by binary search
+// of the sorted wide class list. Class 0 if the patterns never name it.
+static UINT32 FindWideClass(PPATTERN_TABLE table, WCHAR c) {
+    UINT32 low = 0;
+    UINT32 high = table->WideCount;
+
+    while (low < high) {
+        UINT32 middle = low + (high - low) / 2;
+        if (table->Wide[middle].character < c) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < table->WideCount && table->Wide[low].character == c) {
+        return table->Wide[low].classIndex;
+    }
+    return 0;
+}
+
+// Helper: Walk a path through the pattern DFA, one transition per character
+// and folding case as HashProcessPath does. Stops early once a final state
+// is reached. Returns the state the path ends in.
+static const PATTERN_STATE* MatchPattern(PPATTERN_TABLE table, const WCHAR* processPath, SIZE_T pathLength) {
+    UINT32 state = 0;
+
+    for (SIZE_T i = 0; i < pathLength && !(table->States[state].flags & PATTERN_STATE_FINAL); i++) {
+        WCHAR c = processPath[i];
+        UINT32 classIndex;
+        if (c < 0x80) {
+            if (c >= L'A' && c <= L'Z') {
+                c += L'a' - L'A';
+            }
+            classIndex = table->AsciiClass[c];
+        } else {
+            classIndex = FindWideClass(table, RtlDowncaseUnicodeChar(c));
+        }
+        state = table->Next[state * table->ClassCount + classIndex];
+    }
+
+    return &table->States[state];
+}
+
+// Helper: Check if process is in allowed/blocked list. Lock-free: the lookup
+// runs at DISPATCH_LEVEL so it cannot be preempted or migrated while it holds
+// a pointer into the active table, which is what WaitForRuleReaders relies on.
+// The pattern rules are only walked when no exact rule matches, or when some
+// pattern outranks exact rules. processPath need not be terminated.
+int IsAppInList(const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash, PBOOLEAN isBlocked) {
+    KIRQL oldIrql;
+    int found = 0;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    PRULE_TABLE table = (PRULE_TABLE)ReadPointerAcquire((PVOID*)&g_Context.ActiveRules);
+    UINT32 slot = FindAllowedApp(table, processPath, pathLength, pathHash);
+    if (slot != RULE_SLOT_EMPTY) {
+        *isBlocked = table->Apps[table->Slots[slot].appIndex].blocked;
+        found = 1;
+    }
+
+    PPATTERN_TABLE patterns = (PPATTERN_TABLE)ReadPointerAcquire((PVOID*)&g_Context.ActivePatterns);
+    if (patterns && (!found || patterns->MaxPriority > PATTERN_PRIORITY_EXACT)) {
+        const PATTERN_STATE* match = MatchPattern(patterns, processPath, pathLength);
+        if (match->verdict != PATTERN_VERDICT_NONE && (!found || match->priority > PATTERN_PRIORITY_EXACT)) {
+            *isBlocked = (match->verdict == PATTERN_VERDICT_BLOCK);
+            found = 1;
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+    return found;
+}
+
+// Helper: Look up the cached verdict for a process. Returns PID_CACHE_ALLOW
+// or PID_CACHE_BLOCK on a hit; otherwise PID_CACHE_EMPTY, with *observed set
+// to the slot contents StorePidVerdict must still find to fill it.
+UINT32 LookupPidVerdict(UINT32 processId, LONG generation, PLONG64 observed) {
+    LONG64 value = ReadNoFence64(&g_Context.PidCache[PID_CACHE_SLOT(processId)]);
+    UINT32 state = (UINT32)((UINT64)value >> 62);
+
+    *observed = value;
+    if ((UINT32)value == processId && (state == PID_CACHE_ALLOW || state == PID_CACHE_BLOCK) &&
+        (UINT32)(((UINT64)value >> 32) & PID_CACHE_GENERATION_MASK) == ((UINT32)generation & PID_CACHE_GENERATION_MASK)) {
+        return state;
+    }
+    return PID_CACHE_EMPTY;
+}
+
+// Helper: Remember a rule verdict for a process. The compare-exchange fails,
+// leaving the slot alone, if the process exited (or another process filled
+// the slot) since LookupPidVerdict; a dead slot for the same PID is never
+// refilled until the PID is handed to a new process.
+void StorePidVerdict(UINT32 processId, LONG generation, LONG64 observed, BOOLEAN blocked) {
+    if ((UINT32)observed == processId && ((UINT64)observed >> 62) == PID_CACHE_DEAD) {
+        return;
+    }
+
+    InterlockedCompareExchange64(&g_Context.PidCache[PID_CACHE_SLOT(processId)],
+        PID_CACHE_ENTRY(processId, generation, blocked ? PID_CACHE_BLOCK : PID_CACHE_ALLOW),
+        observed);
+}
+
+// Helper: Keep the process verdict cache in step with process notifications.
+// A PID's slot is marked dead when the process exits and cleared when the
+// PID is reused, before the new process can connect.
+void NotePidCacheProcess(UINT32 processId, BOOLEAN created) {
+    volatile LONG64* slot = &g_Context.PidCache[PID_CACHE_SLOT(processId)];
+    LONG64 value = ReadNoFence64(slot);
+
+    if (created) {
+        if ((UINT32)value == processId) {
+            InterlockedCompareExchange64(slot, PID_CACHE_EMPTY, value);
+        }
+    } else {
+        InterlockedExchange64(slot, PID_CACHE_ENTRY(processId, 0, PID_CACHE_DEAD));
+    }
+}
+
+// Helper: What an endpoint memo slot must have been stored under to be
+// trusted. Both counters only grow, so their sum changes whenever either
+// does: a rule change or any pending entry getting its verdict.
+LONG EndpointMemoGeneration(void) {
+    return ReadNoFence(&g_Context.RuleGeneration) + ReadNoFence(&g_Context.PendingAnswers);
+}
+
+// Helper: Slot of an (app, endpoint, protocol); address is the remote
+// address as two words
+static PENDPOINT_MEMO_ENTRY EndpointMemoSlot(UINT64 pathHash, const UINT64* address, UINT16 remotePort, UINT8 protocol) {
+    UINT64 key = pathHash ^ address[0] ^ (address[1] * 0xC2B2AE3D27D4EB4FULL) ^ ((UINT64)remotePort << 8) ^ protocol;
+    UINT32 slot = (UINT32)((key * 0x9E3779B97F4A7C15ULL) >> 54); // Top bits of a Fibonacci hash
+    return &g_Context.EndpointMemo[slot & (ENDPOINT_MEMO_SLOTS - 1)];
+}
+
+// Helper: Look up the memoized verdict of a connect. Returns ENDPOINT_MEMO_*;
+// a slot being rewritten reads as empty. An UNKNOWN hit is counted in the
+// slot, so the connect can be reported later. Lock-free; callable at IRQL <=
+// DISPATCH_LEVEL.
+UINT32 LookupEndpointVerdict(UINT64 pathHash, const UINT8* remoteAddress, UINT16 remotePort, UINT8 protocol,
+                             LONG generation) {
+    UINT64 address[2];
+    RtlCopyMemory(address, remoteAddress, sizeof(address));
+
+    PENDPOINT_MEMO_ENTRY entry = EndpointMemoSlot(pathHash, address, remotePort, protocol);
+    LONG sequence = ReadAcquire(&entry->sequence);
+
+    if (sequence & 1) {
+        return ENDPOINT_MEMO_EMPTY;
+    }
+
+    BOOLEAN match = entry->pathHash == pathHash &&
+                    entry->remoteAddress[0] == address[0] && entry->remoteAddress[1] == address[1] &&
+                    entry->remotePort == remotePort && entry->protocol == protocol &&
+                    entry->generation == generation &&
+                    (LONG)(entry->expires - (ULONG)(KeQueryInterruptTime() / 10000)) > 0;
+    UINT32 verdict = entry->verdict;
+
+    KeMemoryBarrier();
+    if (!match || ReadNoFence(&entry->sequence) != sequence) {
+        return ENDPOINT_MEMO_EMPTY;
+    }
+
+    if (verdict == ENDPOINT_MEMO_UNKNOWN) {
+        InterlockedIncrement(&entry->suppressed);
+    }
+    return verdict;
+}
+
+// Helper: Memoize the verdict of a connect for ENDPOINT_MEMO_TTL_MS. Skipped
+// if another processor is rewriting the slot. Returns the hits the slot
+// counted if it held the same connect, which the caller reports with this
+// one, else 0. Callable at IRQL <= DISPATCH_LEVEL.
+UINT32 StoreEndpointVerdict(UINT64 pathHash, const UINT8* remoteAddress, UINT16 remotePort, UINT8 protocol,
+                            LONG generation, UINT8 verdict) {
+    UINT64 address[2];
+    RtlCopyMemory(address, remoteAddress, sizeof(address));
+
+    PENDPOINT_MEMO_ENTRY entry = EndpointMemoSlot(pathHash, address, remotePort, protocol);
+    LONG sequence = ReadNoFence(&entry->sequence);
+
+    if ((sequence & 1) || InterlockedCompareExchange(&entry->sequence, sequence + 1, sequence) != sequence) {
+        return 0;
+    }
+
+    BOOLEAN same = entry->pathHash == pathHash &&
+                   entry->remoteAddress[0] == address[0] && entry->remoteAddress[1] == address[1] &&
+                   entry->remotePort == remotePort && entry->protocol == protocol;
+    LONG suppressed = InterlockedExchange(&entry->suppressed, 0);
+
+    entry->generation = generation;
+    entry->pathHash = pathHash;
+    entry->remoteAddress[0] = address[0];
+    entry->remoteAddress[1] = address[1];
+    entry->remotePort = remotePort;
+    entry->protocol = protocol;
+    entry->verdict = verdict;
+    entry->expires = (ULONG)(KeQueryInterruptTime() / 10000) + ENDPOINT_MEMO_TTL_MS;
+    WriteRelease(&entry->sequence, sequence + 2);
+
+    return same ? (UINT32)suppressed : 0;
+}
+
+// Helper: Store a slot in an index without checking for duplicates. Returns
+// FALSE if every slot within RULE_MAX_PROBE of its home is taken.
+static BOOLEAN InsertRuleSlot(PRULE_SLOT slots, UINT32 slotCount, UINT64 pathHash, UINT32 appIndex) {
+    UINT32 mask = slotCount - 1;
+
+    for (UINT32 probe = 0; probe < RULE_MAX_PROBE; probe++) {
+        PRULE_SLOT entry = &slots[((UINT32)pathHash + probe) & mask];
+        if (entry->appIndex == RULE_SLOT_EMPTY) {
+            entry->pathHash = pathHash;
+            entry->appIndex = appIndex;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Helper: Build an index of at least slotCount slots over every rule in the
+// table, doubling until each rule fits within RULE_MAX_PROBE. On success the
+// caller owns *slots and *builtCount.
+static NTSTATUS BuildRuleIndex(PRULE_TABLE table, UINT32 slotCount, PRULE_SLOT* slots, PUINT32 builtCount) {
+    while (slotCount < RULE_INITIAL_SLOTS || slotCount < table->Count * 2) {
+        slotCount *= 2;
+    }
+
+    for (;;) {
+        if (slotCount > MAXULONG / 2 / sizeof(RULE_SLOT)) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        PRULE_SLOT index = (PRULE_SLOT)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            (SIZE_T)slotCount * sizeof(RULE_SLOT), NETGUARD_POOL_TAG);
+        if (!index) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlFillMemory(index, (SIZE_T)slotCount * sizeof(RULE_SLOT), 0xFF);
+
+        UINT32 i;
+        for (i = 0; i < table->Count; i++) {
+            PRULE_APP app = &table->Apps[i];
+            if (!InsertRuleSlot(index, slotCount, HashProcessPath(app->processPath, app->pathLength), i)) {
+                break;
+            }
+        }
+        if (i == table->Count) {
+            *slots = index;
+            *builtCount = slotCount;
+            return STATUS_SUCCESS;
+        }
+
+        ExFreePoolWithTag(index, NETGUARD_POOL_TAG);
+        slotCount *= 2;
+    }
+}
+
+// Helper: Replace a table's index with a larger one. Standby copy only.
+static NTSTATUS GrowRuleIndex(PRULE_TABLE table) {
+    PRULE_SLOT slots;
+    UINT32 slotCount;
+
+    NTSTATUS status = BuildRuleIndex(table, table->SlotCount * 2, &slots, &slotCount);
+    if (NT_SUCCESS(status)) {
+        ExFreePoolWithTag(table->Slots, NETGUARD_POOL_TAG);
+        table->Slots = slots;
+        table->SlotCount = slotCount;
+    }
+    return status;
+}
+
+// Helper: Make room in Apps for one more rule. Standby copy only.
+static NTSTATUS ReserveRuleApp(PRULE_TABLE table) {
+    if (table->Count < table->Capacity) {
+        return STATUS_SUCCESS;
+    }
+
+    UINT32 capacity = table->Capacity ? table->Capacity * 2 : RULE_INITIAL_APPS;
+    if (capacity > MAXULONG / sizeof(RULE_APP)) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    PRULE_APP apps = (PRULE_APP)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        (SIZE_T)capacity * sizeof(RULE_APP), NETGUARD_POOL_TAG);
+    if (!apps) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (table->Apps) {
+        RtlCopyMemory(apps, table->Apps, (SIZE_T)table->Count * sizeof(RULE_APP));
+        ExFreePoolWithTag(table->Apps, NETGUARD_POOL_TAG);
+    }
+    table->Apps = apps;
+    table->Capacity = capacity;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Carve room for a terminated path of pathLength WCHARs out of a
+// path arena, taking a new chunk from the lookaside list when the newest one
+// is full. Returns NULL on allocation failure.
+static PWCHAR AllocateRulePath(PRULE_PATH_CHUNK* chunks, PSIZE_T arenaBytes, SIZE_T pathLength) {
+    PRULE_PATH_CHUNK chunk = *chunks;
+    UINT32 needed = (UINT32)pathLength + 1;
+
+    if (!chunk || needed > RTL_NUMBER_OF(chunk->data) - chunk->used) {
+        chunk = (PRULE_PATH_CHUNK)ExAllocateFromLookasideListEx(&g_Context.RulePathLookaside);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = *chunks;
+        chunk->used = 0;
+        *chunks = chunk;
+        *arenaBytes += sizeof(RULE_PATH_CHUNK);
+    }
+
+    PWCHAR path = &chunk->data[chunk->used];
+    chunk->used += needed;
+    return path;
+}
+
+// Helper: Return every chunk of a path arena to the lookaside list
+static void FreeRulePaths(PRULE_PATH_CHUNK chunks) {
+    while (chunks) {
+        PRULE_PATH_CHUNK next = chunks->next;
+        ExFreeToLookasideListEx(&g_Context.RulePathLookaside, chunks);
+        chunks = next;
+    }
+}
+
+// Helper: Add a rule to one table copy, or update the verdict and rate limit
+// of the rule already present for the path. RATE_LIMIT_KEEP leaves an
+// existing rule's limit alone. Leaves the rules untouched on failure so
+// both copies stay identical (the index or Apps may have grown).
+NTSTATUS UpsertAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength,
+                          BOOLEAN blocked, UINT32 rateLimit, UINT64 pathHash) {
+    UINT32 existing = FindAllowedApp(table, processPath, pathLength, pathHash);
+    if (existing != RULE_SLOT_EMPTY) {
+        table->Apps[table->Slots[existing].appIndex].blocked = blocked;
+        if (rateLimit != RATE_LIMIT_KEEP) {
+            table->Apps[table->Slots[existing].appIndex].rateLimit = rateLimit;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    if (pathLength == 0 || pathLength >= MAX_PATH_LENGTH) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = ReserveRuleApp(table);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Keep the load factor at or below 0.5
+    if ((table->Count + 1) * 2 > table->SlotCount) {
+        status = GrowRuleIndex(table);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    PWCHAR path = AllocateRulePath(&table->PathChunks, &table->ArenaBytes, pathLength);
+    if (!path) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Grow rather than let the probe sequence exceed the documented lookup bound
+    while (!InsertRuleSlot(table->Slots, table->SlotCount, pathHash, table->Count)) {
+        status = GrowRuleIndex(table);
+        if (!NT_SUCCESS(status)) {
+            table->PathChunks->used -= (UINT32)pathLength + 1;
+            return status;
+        }
+    }
+
+    RtlCopyMemory(path, processPath, pathLength * sizeof(WCHAR));
+    path[pathLength] = L'\0';
+
+    PRULE_APP app = &table->Apps[table->Count];
+    app->processPath = path;
+    app->pathLength = (UINT16)pathLength;
+    app->blocked = blocked;
+    app->rateLimit = rateLimit == RATE_LIMIT_KEEP ? 0 : rateLimit;
+    table->Count++;
+    table->PathBytes += (pathLength + 1) * sizeof(WCHAR);
+    return STATUS_SUCCESS;
+}
+// Helper: Remove a rule from one table copy. The last record moves into the
+// freed one so Apps stays dense, and the index uses backward-shift deletion
+// so no probe sequence ever grows past RULE_MAX_PROBE. The path stays in the
+// arena as dead space until the copy is rebuilt.
+NTSTATUS RemoveAllowedApp(PRULE_TABLE table, const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash) {
+    UINT32 mask = table->SlotCount - 1;
+    UINT32 hole = FindAllowedApp(table, processPath, pathLength, pathHash);
+    if (hole == RULE_SLOT_EMPTY) {
+        return STATUS_NOT_FOUND;
+    }
+
+    UINT32 freed = table->Slots[hole].appIndex;
+    UINT32 last = table->Count - 1;
+    UINT32 movingSlot = RULE_SLOT_EMPTY;
+    if (freed != last) {
+        movingSlot = FindAllowedApp(table, table->Apps[last].processPath, table->Apps[last].pathLength,
+            HashProcessPath(table->Apps[last].processPath, table->Apps[last].pathLength));
+        if (movingSlot == RULE_SLOT_EMPTY) {
+            // The last record is not where its path hashes to; leave the
+            // table as it is rather than index with the miss
+            return STATUS_INTERNAL_ERROR;
+        }
+    }
+
+    table->PathBytes -= (table->Apps[freed].pathLength + 1) * sizeof(WCHAR);
+    if (freed != last) {
+        table->Apps[freed] = table->Apps[last];
+        table->Slots[movingSlot].appIndex = freed;
+    }
+    table->Count--;
+
+    for (UINT32 next = (hole + 1) & mask; ; next = (next + 1) & mask) {
+        PRULE_SLOT entry = &table->Slots[next];
+        if (entry->appIndex == RULE_SLOT_EMPTY) {
+            break;
+        }
+
+        // Shift back only entries whose home slot is not in (hole, next]
+        UINT32 home = (UINT32)entry->pathHash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->Slots[hole] = *entry;
+            hole = next;
+        }
+    }
+
+    table->Slots[hole].pathHash = 0;
+    table->Slots[hole].appIndex = RULE_SLOT_EMPTY;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Drop every rule from one table copy, keeping its arrays
+void ClearRuleTable(PRULE_TABLE table) {
+    RtlFillMemory(table->Slots, (SIZE_T)table->SlotCount * sizeof(RULE_SLOT), 0xFF);
+    table->Count = 0;
+    FreeRulePaths(table->PathChunks);
+    table->PathChunks = NULL;
+    table->PathBytes = 0;
+    table->ArenaBytes = 0;
+}
+
+// Helper: Rebuild dst as an exact copy of src, sized to src's rule count and
+// with its paths packed into a fresh arena, which drops any dead space. dst
+// must not be visible to readers. dst is left untouched on failure.
+NTSTATUS CopyRuleTable(PRULE_TABLE dst, PRULE_TABLE src) {
+    RULE_TABLE copy = { 0 };
+    NTSTATUS status;
+
+    copy.Capacity = RULE_INITIAL_APPS;
+    while (copy.Capacity < src->Count) {
+        copy.Capacity *= 2;
+    }
+    copy.Apps = (PRULE_APP)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        (SIZE_T)copy.Capacity * sizeof(RULE_APP), NETGUARD_POOL_TAG);
+    if (!copy.Apps) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (UINT32 i = 0; i < src->Count; i++) {
+        PRULE_APP app = &src->Apps[i];
+        PWCHAR path = AllocateRulePath(&copy.PathChunks, &copy.ArenaBytes, app->pathLength);
+        if (!path) {
+            FreeRulePaths(copy.PathChunks);
+            ExFreePoolWithTag(copy.Apps, NETGUARD_POOL_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(path, app->processPath, (app->pathLength + 1) * sizeof(WCHAR));
+        copy.Apps[i] = *app;
+        copy.Apps[i].processPath = path;
+    }
+    copy.Count = src->Count;
+    copy.PathBytes = src->PathBytes;
+
+    // At least src's slot count, so the copy probes no further than src does
+    status = BuildRuleIndex(&copy, src->SlotCount, &copy.Slots, &copy.SlotCount);
+    if (!NT_SUCCESS(status)) {
+        FreeRulePaths(copy.PathChunks);
+        ExFreePoolWithTag(copy.Apps, NETGUARD_POOL_TAG);
+        return status;
+    }
+
+    FreeRuleTable(dst);
+    *dst = copy;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Release one table copy's index, records and path arena
+void FreeRuleTable(PRULE_TABLE table) {
+    if (table->Slots) {
+        ExFreePoolWithTag(table->Slots, NETGUARD_POOL_TAG);
+    }
+    if (table->Apps) {
+        ExFreePoolWithTag(table->Apps, NETGUARD_POOL_TAG);
+    }
+    FreeRulePaths(table->PathChunks);
+    RtlZeroMemory(table, sizeof(RULE_TABLE));
+}
+
+// Helper: The rule copy classify is not reading. Caller holds RuleWriteLock.
+PRULE_TABLE StandbyRules(void) {
+    return (g_Context.ActiveRules == g_Context.RuleTables[0]) ?
+        g_Context.RuleTables[1] : g_Context.RuleTables[0];
+}
+
+// Helper: Bring the standby copy back in line with the active one if an
+// earlier replay could not allocate. Call before mutating the standby copy.
+// Caller holds RuleWriteLock.
+NTSTATUS SyncStandbyRules(void) {
+    if (!g_Context.RulesDiverged) {
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS status = CopyRuleTable(StandbyRules(), g_Context.ActiveRules);
+    if (NT_SUCCESS(status)) {
+        g_Context.RulesDiverged = FALSE;
+    }
+    return status;
+}
+
+// Helper: Make the standby copy active, invalidate cached flow verdicts and
+// wait out readers of the previous copy. Returns the previous copy, which is
+// now the standby and must be brought in line with the new one.
+// Caller holds RuleWriteLock.
+PRULE_TABLE PublishRules(PRULE_TABLE standby) {
+    PRULE_TABLE previous = g_Context.ActiveRules;
+
+    InterlockedExchangePointer((PVOID*)&g_Context.ActiveRules, standby);
+    LONG generation = InterlockedIncrement(&g_Context.RuleGeneration);
+    LONGLONG start = LatencyNow();
+    WaitForRuleReaders();
+
+    TraceLoggingWrite(g_NetGuardTraceProvider, "RuleSwap",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(NETGUARD_TRACE_KEYWORD_RULES),
+        TraceLoggingInt32(generation, "generation"),
+        TraceLoggingUInt32(standby->Count, "ruleCount"),
+        TraceLoggingInt64(LatencyNow() - start, "drainTicks"));
+    return previous;
+}
+
+// Helper: Apply a SET_RULES request to the standby copy. Validates the whole
+// input before touching the table.
+NTSTATUS ApplyRuleSet(PRULE_TABLE table, PVOID inputBuffer, ULONG inputLength) {
+    PRULE_SET_HEADER header = (PRULE_SET_HEADER)inputBuffer;
+    PUCHAR cursor;
+    PUCHAR end = (PUCHAR)inputBuffer + inputLength;
+
+    if (inputLength < sizeof(RULE_SET_HEADER)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    if (header->version != RULE_SET_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    cursor = (PUCHAR)(header + 1);
+    for (UINT32 i = 0; i < header->count; i++) {
+        RULE_SET_ENTRY entry;
+        if ((ULONG)(end - cursor) < sizeof(RULE_SET_ENTRY)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        RtlCopyMemory(&entry, cursor, sizeof(entry));
+        if (entry.pathLength == 0 || entry.pathLength >= MAX_PATH_LENGTH ||
+            entry.entryLength < sizeof(RULE_SET_ENTRY) + entry.pathLength * sizeof(WCHAR) ||
+            entry.entryLength > (ULONG)(end - cursor)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        cursor += entry.entryLength;
+    }
+
+    if (header->flags & RULE_SET_FLAG_REPLACE) {
+        ClearRuleTable(table);
+    }
+
+    cursor = (PUCHAR)(header + 1);
+    for (UINT32 i = 0; i < header->count; i++) {
+        RULE_SET_ENTRY entry;
+        WCHAR path[MAX_PATH_LENGTH];
+
+        // Entries are packed, so copy the path out to an aligned buffer
+        RtlCopyMemory(&entry, cursor, sizeof(entry));
+        RtlCopyMemory(path, cursor + sizeof(entry), entry.pathLength * sizeof(WCHAR));
+        path[entry.pathLength] = L'\0';
+
+        NTSTATUS status = UpsertAllowedApp(table, path, entry.pathLength, entry.blocked, entry.rateLimit,
+                                           HashProcessPath(path, entry.pathLength));
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+        cursor += entry.entryLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Helper: Fill an empty table copy from a validated boot policy. Apps and
+// the index are sized for every entry up front, and the stored hashes, which
+// ValidatePolicy checked, are used as they are, so the load never grows.
+// entries may be unaligned.
+NTSTATUS LoadPolicyRules(PRULE_TABLE table, const POLICY_ENTRY* entries, UINT32 count, const WCHAR* paths) {
+    NTSTATUS status;
+
+    if (count > table->Capacity) {
+        if (count > MAXULONG / sizeof(RULE_APP)) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        PRULE_APP apps = (PRULE_APP)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            (SIZE_T)count * sizeof(RULE_APP), NETGUARD_POOL_TAG);
+        if (!apps) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (table->Apps) {
+            ExFreePoolWithTag(table->Apps, NETGUARD_POOL_TAG);
+        }
+        table->Apps = apps;
+        table->Capacity = count;
+    }
+
+    // The table is empty, so a larger index starts out empty too
+    if ((UINT64)count * 2 > table->SlotCount) {
+        UINT32 slotCount = table->SlotCount;
+        while ((UINT64)count * 2 > slotCount) {
+            slotCount *= 2;
+        }
+
+        PRULE_SLOT slots = (PRULE_SLOT)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            (SIZE_T)slotCount * sizeof(RULE_SLOT), NETGUARD_POOL_TAG);
+        if (!slots) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlFillMemory(slots, (SIZE_T)slotCount * sizeof(RULE_SLOT), 0xFF);
+        ExFreePoolWithTag(table->Slots, NETGUARD_POOL_TAG);
+        table->Slots = slots;
+        table->SlotCount = slotCount;
+    }
+
+    for (UINT32 i = 0; i < count; i++) {
+        POLICY_ENTRY entry;
+        RtlCopyMemory(&entry, &entries[i], sizeof(entry));
+
+        status = UpsertAllowedApp(table, paths + entry.pathOffset, entry.pathLength, entry.blocked,
+                                  entry.rateLimit, entry.pathHash);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Helper: Validate a SET_PATTERN_RULES input and copy it into a pattern table.
+// Every class and state index is checked here so MatchPattern never has to.
+// A set with no states yields *table = NULL, i.e. no pattern rules.
+NTSTATUS BuildPatternTable(const UCHAR* data, ULONG length, PPATTERN_TABLE* table) {
+    PATTERN_SET_HEADER header;
+
+    *table = NULL;
+    if (length < sizeof(PATTERN_SET_HEADER)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    RtlCopyMemory(&header, data, sizeof(header));
+    if (header.version != PATTERN_SET_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    if (header.stateCount == 0) {
+        return STATUS_SUCCESS;
+    }
+    if (header.classCount == 0 || header.classCount > PATTERN_MAX_CLASSES ||
+        header.stateCount > PATTERN_MAX_STATES || length > PATTERN_MAX_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (sizeof(PATTERN_SET_HEADER) + 128 + (UINT64)header.wideCount * sizeof(PATTERN_WIDE_CLASS) +
+        (UINT64)header.stateCount * sizeof(PATTERN_STATE) +
+        (UINT64)header.stateCount * header.classCount * sizeof(UINT16) != length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PPATTERN_TABLE built = (PPATTERN_TABLE)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(PATTERN_TABLE) + length, NETGUARD_POOL_TAG);
+    if (!built) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    PUCHAR source = (PUCHAR)(built + 1);
+    RtlCopyMemory(source, data, length);
+    built->AsciiClass = source + sizeof(PATTERN_SET_HEADER);
+    built->Wide = (const PATTERN_WIDE_CLASS*)(built->AsciiClass + 128);
+    built->States = (const PATTERN_STATE*)(built->Wide + header.wideCount);
+    built->Next = (const UINT16*)(built->States + header.stateCount);
+    built->ClassCount = header.classCount;
+    built->WideCount = header.wideCount;
+    built->SourceLength = length;
+
+    NTSTATUS status = STATUS_SUCCESS;
+    for (UINT32 i = 0; i < 128; i++) {
+        if (built->AsciiClass[i] >= header.classCount) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+    }
+    for (UINT32 i = 0; i < header.wideCount; i++) {
+        if (built->Wide[i].character < 0x80 || built->Wide[i].classIndex >= header.classCount ||
+            (i > 0 && built->Wide[i].character <= built->Wide[i - 1].character)) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+    }
+    for (UINT32 state = 0; state < header.stateCount && NT_SUCCESS(status); state++) {
+        const PATTERN_STATE* entry = &built->States[state];
+        const UINT16* row = &built->Next[(SIZE_T)state * header.classCount];
+        if (entry->verdict > PATTERN_VERDICT_BLOCK) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        if (entry->verdict != PATTERN_VERDICT_NONE) {
+            built->MaxPriority = max(built->MaxPriority, entry->priority);
+        }
+
+        // A final state ends the walk, so it must really never be left
+        for (UINT32 c = 0; c < header.classCount; c++) {
+            if (row[c] >= header.stateCount ||
+                ((entry->flags & PATTERN_STATE_FINAL) && row[c] != state)) {
+                status = STATUS_INVALID_PARAMETER;
+            }
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        ExFreePoolWithTag(built, NETGUARD_POOL_TAG);
+        return status;
+    }
+
+    *table = built;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Whether a pattern outranks the exact rule for this app, so the rule
+// must not be mirrored as a BFE filter: the callout decides that path.
+// Caller holds RuleWriteLock.
+BOOLEAN PatternOverridesRule(PRULE_APP app) {
+    PPATTERN_TABLE patterns = g_Context.ActivePatterns;
+
+    if (!patterns || patterns->MaxPriority <= PATTERN_PRIORITY_EXACT) {
+        return FALSE;
+    }
+
+    const PATTERN_STATE* match = MatchPattern(patterns, app->processPath, app->pathLength);
+    return match->verdict != PATTERN_VERDICT_NONE && match->priority > PATTERN_PRIORITY_EXACT;
+}
+
+// Helper: Set up the rule write lock, the path chunk lookaside list, both
+// (empty) rule table copies and the grace-period DPCs
+NTSTATUS InitializeRuleTables(void) {
+    NTSTATUS status;
+
+    ExInitializeFastMutex(&g_Context.RuleWriteLock);
+    KeInitializeEvent(&g_Context.GraceEvent, NotificationEvent, FALSE);
+
+    status = ExInitializeLookasideListEx(&g_Context.RulePathLookaside, NULL, NULL, NonPagedPoolNx,
+        0, sizeof(RULE_PATH_CHUNK), NETGUARD_POOL_TAG, 0);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    g_Context.RulePathLookasideReady = TRUE;
+
+    for (int i = 0; i < 2; i++) {
+        PRULE_TABLE table = (PRULE_TABLE)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(RULE_TABLE), NETGUARD_POOL_TAG);
+        if (!table) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        g_Context.RuleTables[i] = table;
+
+        table->SlotCount = RULE_INITIAL_SLOTS;
+        table->Slots = (PRULE_SLOT)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            RULE_INITIAL_SLOTS * sizeof(RULE_SLOT), NETGUARD_POOL_TAG);
+        if (!table->Slots) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlFillMemory(table->Slots, RULE_INITIAL_SLOTS * sizeof(RULE_SLOT), 0xFF);
+    }
+    g_Context.ActiveRules = g_Context.RuleTables[0];
+
+    g_Context.GraceDpcCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    g_Context.GraceDpcs = (PKDPC)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        g_Context.GraceDpcCount * sizeof(KDPC), NETGUARD_POOL_TAG);
+    if (!g_Context.GraceDpcs) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < g_Context.GraceDpcCount; i++) {
+        PROCESSOR_NUMBER processor;
+        KeGetProcessorNumberFromIndex(i, &processor);
+        KeInitializeDpc(&g_Context.GraceDpcs[i], RuleGraceDpc, NULL);
+        KeSetTargetProcessorDpcEx(&g_Context.GraceDpcs[i], &processor);
+    }
+
+    return STATUS_SUCCESS;
+}
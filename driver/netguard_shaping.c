@@ -0,0 +1,518 @@
+/*
+ * NetGuard WFP Callout Driver - per-app rate limits
+ *
+ * The token buckets behind a rule's rateLimit, and the stream shaping that
+ * enforces them for TCP without breaking connections: over the limit,
+ * outbound data is cloned, absorbed and injected again as the budget
+ * refills, and inbound data is deferred until it does. The datagram classify
+ * polices UDP itself, dropping whatever ConsumeAppTokens refuses.
+ */
+
+#include "netguard.h"
+
+// Helper: Budget a processor takes at a time, and the most an app banks
+static LONG64 RateGrant(UINT32 limit) {
+    return min(max((LONG64)limit / RATE_GRANTS_PER_SECOND, RATE_MIN_GRANT), RATE_MAX_GRANT);
+}
+
+static LONG64 RateBurst(UINT32 limit) {
+    return max((LONG64)limit * RATE_BURST_MS / 1000, RateGrant(limit));
+}
+
+// Helper: The most a flow of the app may hold in sends. Lock-free.
+static SIZE_T HeldSendCap(UINT16 appIndex) {
+    UINT32 limit = (UINT32)ReadNoFence(&g_Context.AppRates[appIndex].Limit);
+    return limit ? (SIZE_T)(RATE_HELD_BURSTS * RateBurst(limit)) : RATE_MAX_HELD_BYTES;
+}
+
+// Helper: Whether an app has a limit. Lock-free.
+static BOOLEAN IsAppRateLimited(UINT16 appIndex) {
+    return appIndex != TRAFFIC_APP_NONE && g_Context.AppRates &&
+           ReadNoFence(&g_Context.AppRates[appIndex].Limit) != 0;
+}
+
+// Helper: Take up to wanted bytes of an app's budget in one direction,
+// topping it up first for the time since the last refill. Returns the bytes
+// taken, 0 when the budget is spent. Called at DISPATCH_LEVEL.
+static LONG64 TakeRateGrant(PAPP_RATE rate, UINT32 direction, LONG64 wanted) {
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    LONG64 taken;
+
+    KeAcquireSpinLockAtDpcLevel(&rate->Lock);
+
+    UINT32 limit = (UINT32)rate->Limit;
+    if (limit == 0) {
+        KeReleaseSpinLockFromDpcLevel(&rate->Lock);
+        return wanted; // Lifted since the caller looked
+    }
+
+    LONG64 burst = RateBurst(limit);
+    LONG64 elapsed = now - rate->Refilled[direction];
+    if (elapsed >= 10000000) {
+        // Idle for a second or more: full, and the product below could overflow
+        rate->Tokens[direction] = burst;
+        rate->Refilled[direction] = now;
+    } else if (elapsed > 0) {
+        // Move the refill time on only by what the added bytes paid for, so
+        // frequent small refills do not round the rate down
+        LONG64 added = elapsed * limit / 10000000;
+        rate->Tokens[direction] = min(rate->Tokens[direction] + added, burst);
+        rate->Refilled[direction] += added * 10000000 / limit;
+    }
+
+    taken = min(max(rate->Tokens[direction], 0), wanted);
+    rate->Tokens[direction] -= taken;
+
+    KeReleaseSpinLockFromDpcLevel(&rate->Lock);
+    return taken;
+}
+
+// Helper: Spend bytes of an app's budget in one direction. Returns FALSE,
+// spending nothing, when the app is over its limit. Apps without a limit
+// cost one read. Callable at IRQL <= DISPATCH_LEVEL.
+BOOLEAN ConsumeAppTokens(UINT16 appIndex, UINT32 direction, SIZE_T bytes) {
+    KIRQL oldIrql;
+
+    if (bytes == 0 || !IsAppRateLimited(appIndex)) {
+        return TRUE;
+    }
+    PAPP_RATE rate = &g_Context.AppRates[appIndex];
+
+    // The bucket is only this processor's while nothing can move us off it
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    PRATE_BUCKET bucket = &g_Context.CpuRateBuckets[(SIZE_T)KeGetCurrentProcessorIndex() * TRAFFIC_APP_SLOTS +
+                                                    appIndex];
+    LONG generation = ReadAcquire(&rate->Generation);
+    if (bucket->Generation != generation) {
+        bucket->Generation = generation;
+        bucket->Tokens[RATE_SEND] = 0;
+        bucket->Tokens[RATE_RECEIVE] = 0;
+    }
+
+    // Spent or in debt: repay the debt and take one grant
+    if (bucket->Tokens[direction] <= 0) {
+        UINT32 limit = (UINT32)ReadNoFence(&rate->Limit);
+        bucket->Tokens[direction] += TakeRateGrant(rate, direction,
+                                                   RateGrant(limit) - bucket->Tokens[direction]);
+    }
+
+    BOOLEAN allowed = bucket->Tokens[direction] > 0;
+    if (allowed) {
+        bucket->Tokens[direction] -= (LONG64)bytes;
+    }
+
+    KeLowerIrql(oldIrql);
+    return allowed;
+}
+
+// Helper: Give a traffic slot a new limit, starting from a full burst.
+// Callable at IRQL <= DISPATCH_LEVEL.
+static void SetAppRateLimit(UINT16 appIndex, UINT32 limit) {
+    PAPP_RATE rate = &g_Context.AppRates[appIndex];
+    KIRQL oldIrql;
+
+    if ((UINT32)ReadNoFence(&rate->Limit) == limit) {
+        return;
+    }
+
+    KeAcquireSpinLock(&rate->Lock, &oldIrql);
+    if ((UINT32)rate->Limit != limit) {
+        LONG64 now = (LONG64)KeQueryInterruptTime();
+        for (UINT32 direction = 0; direction < RATE_DIRECTIONS; direction++) {
+            rate->Tokens[direction] = limit ? RateBurst(limit) : 0;
+            rate->Refilled[direction] = now;
+        }
+        InterlockedIncrement(&rate->Generation);
+        InterlockedExchange(&rate->Limit, (LONG)limit);
+    }
+    KeReleaseSpinLock(&rate->Lock, oldIrql);
+}
+
+// Helper: Limit the exact rule for an app sets, 0 if it has none or blocks.
+// Pattern rules carry no limit. Caller is at DISPATCH_LEVEL or holds
+// RuleWriteLock, as for any reader of the active rules.
+static UINT32 RuleRateLimit(const WCHAR* processPath, SIZE_T pathLength, UINT64 pathHash) {
+    PRULE_TABLE table = (PRULE_TABLE)ReadPointerAcquire((PVOID*)&g_Context.ActiveRules);
+
+    UINT32 slot = FindAllowedApp(table, processPath, pathLength, pathHash);
+    if (slot == RULE_SLOT_EMPTY) {
+        return 0;
+    }
+
+    PRULE_APP app = &table->Apps[table->Slots[slot].appIndex];
+    return app->blocked ? 0 : app->rateLimit;
+}
+
+// Helper: Bring every traffic slot's limit in line with the active rules.
+// Called under RuleWriteLock once a rule change is published; the publish
+// has waited out any SetFlowRateLimit that read the previous rules, so the
+// limits this sets are the ones that stay.
+void RefreshAppRates(void) {
+    if (!g_Context.AppRates) {
+        return;
+    }
+
+    for (UINT32 slot = 0; slot < TRAFFIC_APP_SLOTS; slot++) {
+        PTRAFFIC_APP app = &g_Context.TrafficApps[slot];
+        if (ReadAcquire64((volatile LONG64*)&app->pathHash) == 0) {
+            continue;
+        }
+        SetAppRateLimit((UINT16)slot, RuleRateLimit(app->path, app->pathLength,
+                                                    HashProcessPath(app->path, app->pathLength)));
+    }
+}
+
+// Helper: Set the limit of a new flow's app from the rules, looking it up
+// and storing it in one DISPATCH_LEVEL section so RefreshAppRates always
+// has the last word
+void SetFlowRateLimit(PFLOW_CONTEXT flow, const WCHAR* processPath, SIZE_T pathLength) {
+    KIRQL oldIrql;
+
+    if (flow->appIndex == TRAFFIC_APP_NONE || !g_Context.AppRates) {
+        return;
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    SetAppRateLimit(flow->appIndex, RuleRateLimit(processPath, pathLength, flow->pathHash));
+    KeLowerIrql(oldIrql);
+}
+
+// Helper: Put a flow on ThrottledFlows unless it is there already, taking
+// the reference it holds while listed, and make sure the retry timer runs.
+// Caller holds ThrottleLock.
+static void ThrottleFlow(PFLOW_CONTEXT flow) {
+    if (!flow->throttled) {
+        InterlockedIncrement(&flow->refCount);
+        InterlockedExchange(&flow->throttled, TRUE);
+        InsertTailList(&g_Context.ThrottledFlows, &flow->throttleEntry);
+    }
+
+    if (!g_Context.ThrottleTimerArmed && !g_Context.ThrottleStopping) {
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -(LONGLONG)RATE_RETRY_MS * 10000;
+        KeSetTimer(&g_Context.ThrottleTimer, dueTime, &g_Context.ThrottleDpc);
+        g_Context.ThrottleTimerArmed = TRUE;
+    }
+}
+
+// Stream inject completion: the clone has been sent on or dropped
+static void NTAPI StreamInjectComplete(void* context, NET_BUFFER_LIST* netBufferList, BOOLEAN dispatchLevel) {
+    UNREFERENCED_PARAMETER(context);
+
+    if (netBufferList) {
+        FwpsDiscardClonedStreamData0(netBufferList, 0, dispatchLevel);
+    }
+}
+
+// Helper: Free a chain of held sends without sending them
+static void DiscardHeldStreamData(PHELD_STREAM_DATA held) {
+    BOOLEAN dispatchLevel = KeGetCurrentIrql() == DISPATCH_LEVEL;
+
+    while (held) {
+        PHELD_STREAM_DATA next = held->Next;
+        if (held->Clone) {
+            FwpsDiscardClonedStreamData0(held->Clone, 0, dispatchLevel);
+        }
+        InterlockedAdd64(&g_Context.RateHeldBytes, -(LONG64)held->DataLength);
+        ExFreePoolWithTag(held, NETGUARD_POOL_TAG);
+        held = next;
+    }
+}
+
+// Helper: The STREAM layer, and its callout, a flow's data is classified at
+static UINT16 FlowStreamLayer(PFLOW_CONTEXT flow, UINT32* calloutId) {
+    *calloutId = g_Context.StreamCalloutIds[flow->family];
+    return flow->family == FLOW_FAMILY_V6 ? FWPS_LAYER_STREAM_V6 : FWPS_LAYER_STREAM_V4;
+}
+
+// Helper: Inject a chain of held sends back into their flow, in order, and
+// free the records. Injection only fails once the flow is going away, and
+// then the clone is simply discarded.
+static void InjectHeldStreamData(PFLOW_CONTEXT flow, PHELD_STREAM_DATA held) {
+    UINT32 calloutId;
+    UINT16 layerId = FlowStreamLayer(flow, &calloutId);
+
+    while (held) {
+        PHELD_STREAM_DATA next = held->Next;
+
+        NTSTATUS status = FwpsStreamInjectAsync0(g_Context.StreamInjectionHandle, NULL, 0, flow->flowHandle,
+                                                 calloutId, layerId,
+                                                 held->StreamFlags, held->Clone, held->DataLength,
+                                                 StreamInjectComplete, NULL);
+        if (!NT_SUCCESS(status) && held->Clone) {
+            FwpsDiscardClonedStreamData0(held->Clone, 0, TRUE);
+        }
+
+        InterlockedAdd64(&g_Context.RateHeldBytes, -(LONG64)held->DataLength);
+        ExFreePoolWithTag(held, NETGUARD_POOL_TAG);
+        held = next;
+    }
+}
+
+// Timer DPC: give throttled flows what their apps' budgets now allow. Held
+// sends are injected in order and a deferred receive is resumed; a flow
+// leaves ThrottledFlows once it has neither. Injecting and resuming can
+// classify again on this thread, so both happen outside ThrottleLock, and
+// the flow stays listed meanwhile so new sends still queue behind.
+static void ThrottleDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    LIST_ENTRY visited;
+    LIST_ENTRY leaving;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    InitializeListHead(&visited);
+    InitializeListHead(&leaving);
+
+    KeAcquireSpinLockAtDpcLevel(&g_Context.ThrottleLock);
+    g_Context.ThrottleTimerArmed = FALSE;
+
+    while (!IsListEmpty(&g_Context.ThrottledFlows)) {
+        PFLOW_CONTEXT flow = CONTAINING_RECORD(RemoveHeadList(&g_Context.ThrottledFlows), FLOW_CONTEXT,
+                                               throttleEntry);
+        InsertTailList(&visited, &flow->throttleEntry);
+
+        PHELD_STREAM_DATA ready = NULL;
+        PHELD_STREAM_DATA* readyTail = &ready;
+        while (flow->heldHead && ConsumeAppTokens(flow->appIndex, RATE_SEND, flow->heldHead->DataLength)) {
+            PHELD_STREAM_DATA held = flow->heldHead;
+            flow->heldHead = held->Next;
+            flow->heldBytes -= held->DataLength;
+            held->Next = NULL;
+            *readyTail = held;
+            readyTail = &held->Next;
+        }
+        if (!flow->heldHead) {
+            flow->heldTail = NULL;
+        }
+
+        // A one-byte probe; the resumed data pays for itself when it is
+        // indicated again
+        BOOLEAN resume = flow->receiveDeferred && ConsumeAppTokens(flow->appIndex, RATE_RECEIVE, 1);
+        if (resume) {
+            flow->receiveDeferred = FALSE;
+        }
+        if (!ready && !resume) {
+            continue;
+        }
+
+        InterlockedIncrement(&flow->refCount);
+        KeReleaseSpinLockFromDpcLevel(&g_Context.ThrottleLock);
+
+        InjectHeldStreamData(flow, ready);
+        if (resume) {
+            UINT32 calloutId;
+            UINT16 layerId = FlowStreamLayer(flow, &calloutId);
+            FwpsStreamContinue0(flow->flowHandle, calloutId, layerId, FWPS_STREAM_FLAG_RECEIVE);
+        }
+        ReleaseFlowContext(flow);
+
+        KeAcquireSpinLockAtDpcLevel(&g_Context.ThrottleLock);
+    }
+
+    while (!IsListEmpty(&visited)) {
+        PFLOW_CONTEXT flow = CONTAINING_RECORD(RemoveHeadList(&visited), FLOW_CONTEXT, throttleEntry);
+        if (!flow->heldHead && !flow->receiveDeferred) {
+            InterlockedExchange(&flow->throttled, FALSE);
+            InsertTailList(&leaving, &flow->throttleEntry);
+        } else {
+            InsertTailList(&g_Context.ThrottledFlows, &flow->throttleEntry);
+        }
+    }
+
+    if (!IsListEmpty(&g_Context.ThrottledFlows) && !g_Context.ThrottleStopping) {
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -(LONGLONG)RATE_RETRY_MS * 10000;
+        KeSetTimer(&g_Context.ThrottleTimer, dueTime, &g_Context.ThrottleDpc);
+        g_Context.ThrottleTimerArmed = TRUE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&g_Context.ThrottleLock);
+
+    // Drop the references the departed flows held while listed
+    while (!IsListEmpty(&leaving)) {
+        PFLOW_CONTEXT flow = CONTAINING_RECORD(RemoveHeadList(&leaving), FLOW_CONTEXT, throttleEntry);
+        ReleaseFlowContext(flow);
+    }
+}
+
+// Helper: Apply the flow's app limit to one stream indication. Returns TRUE
+// if the data is new and should be counted: it passes now, or it was held
+// to be injected later. Returns FALSE for a deferred receive, which is
+// counted when it is indicated again, and for data this driver injected,
+// which was counted when it was held. packet and classifyOut are set for
+// whatever was decided.
+BOOLEAN ShapeStreamData(PFLOW_CONTEXT flow, FWPS_STREAM_CALLOUT_IO_PACKET0* packet, FWPS_CLASSIFY_OUT0* classifyOut) {
+    FWPS_STREAM_DATA0* data = packet->streamData;
+    BOOLEAN send = (data->flags & FWPS_STREAM_FLAG_SEND) != 0;
+    BOOLEAN throttled = ReadNoFence(&flow->throttled) != 0;
+    KIRQL oldIrql;
+
+    if ((!send && !(data->flags & FWPS_STREAM_FLAG_RECEIVE)) ||
+        (!throttled && !IsAppRateLimited(flow->appIndex))) {
+        return TRUE;
+    }
+
+    if (send && data->netBufferListChain && g_Context.StreamInjectionHandle &&
+        FwpsQueryPacketInjectionState0(g_Context.StreamInjectionHandle, data->netBufferListChain, NULL) ==
+            FWPS_PACKET_INJECTED_BY_SELF) {
+        return FALSE;
+    }
+
+    // Something weighted above us decided already
+    if (!(classifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return TRUE;
+    }
+
+    if (!send) {
+        if (ConsumeAppTokens(flow->appIndex, RATE_RECEIVE, data->dataLength)) {
+            return TRUE;
+        }
+
+        // Leave the data with the stack; its receive window closes until
+        // ThrottleDpcRoutine resumes the flow
+        KeAcquireSpinLock(&g_Context.ThrottleLock, &oldIrql);
+        flow->receiveDeferred = TRUE;
+        ThrottleFlow(flow);
+        KeReleaseSpinLock(&g_Context.ThrottleLock, oldIrql);
+
+        packet->streamAction = FWPS_STREAM_ACTION_DEFER;
+        packet->countBytesEnforced = 0;
+        classifyOut->actionType = FWP_ACTION_NONE;
+        COUNT_STAT(RateDeferredReceives);
+        return FALSE;
+    }
+
+    // Sends already held must go first, whatever the budget says now
+    if (!throttled && ConsumeAppTokens(flow->appIndex, RATE_SEND, data->dataLength)) {
+        return TRUE;
+    }
+
+    // Stay within the held send caps. Indications of one flow are serialized
+    // and the timer only shrinks heldBytes, so reading it unlocked is safe.
+    // An empty queue always takes one indication.
+    BOOLEAN full = (flow->heldBytes > 0 && flow->heldBytes + data->dataLength > HeldSendCap(flow->appIndex)) ||
+                   ReadNoFence64(&g_Context.RateHeldBytes) + (LONG64)data->dataLength > RATE_MAX_HELD_BYTES;
+
+    PHELD_STREAM_DATA held = full ? NULL : (PHELD_STREAM_DATA)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                                                          sizeof(HELD_STREAM_DATA),
+                                                                          NETGUARD_POOL_TAG);
+    if (held && data->dataLength > 0 &&
+        !NT_SUCCESS(FwpsCloneStreamData0(data, NULL, NULL, 0, &held->Clone))) {
+        ExFreePoolWithTag(held, NETGUARD_POOL_TAG);
+        held = NULL;
+    }
+    if (!held) {
+        if (!throttled) {
+            return TRUE; // Nothing held to overtake; let it exceed the limit
+        }
+
+        // Passing it would reorder the stream, and holding it would pass a
+        // cap; drop the connection instead
+        classifyOut->actionType = FWP_ACTION_BLOCK;
+        classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+        return FALSE;
+    }
+    held->DataLength = data->dataLength;
+    held->StreamFlags = data->flags;
+    InterlockedAdd64(&g_Context.RateHeldBytes, (LONG64)held->DataLength);
+
+    KeAcquireSpinLock(&g_Context.ThrottleLock, &oldIrql);
+    if (flow->heldTail) {
+        flow->heldTail->Next = held;
+    } else {
+        flow->heldHead = held;
+    }
+    flow->heldTail = held;
+    flow->heldBytes += held->DataLength;
+    ThrottleFlow(flow);
+    KeReleaseSpinLock(&g_Context.ThrottleLock, oldIrql);
+
+    packet->streamAction = FWPS_STREAM_ACTION_NONE;
+    packet->countBytesEnforced = 0;
+    classifyOut->actionType = FWP_ACTION_BLOCK;
+    classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
+    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    COUNT_STAT(RateHeldSends);
+    return TRUE;
+}
+
+// Helper: Drop a flow's held sends and take it off ThrottledFlows. Called
+// as its stream association goes away, after which nothing can be injected
+// into it or resumed.
+void ReleaseHeldStreamData(PFLOW_CONTEXT flow) {
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&g_Context.ThrottleLock, &oldIrql);
+    PHELD_STREAM_DATA held = flow->heldHead;
+    flow->heldHead = NULL;
+    flow->heldTail = NULL;
+    flow->heldBytes = 0;
+    flow->receiveDeferred = FALSE;
+    BOOLEAN listed = flow->throttled != 0;
+    if (listed) {
+        RemoveEntryList(&flow->throttleEntry);
+        InterlockedExchange(&flow->throttled, FALSE);
+    }
+    KeReleaseSpinLock(&g_Context.ThrottleLock, oldIrql);
+
+    DiscardHeldStreamData(held);
+    if (listed) {
+        ReleaseFlowContext(flow);
+    }
+}
+
+// Helper: Allocate the rate state and the stream injection handle. Called
+// once the statistics exist, which size the processor buckets.
+NTSTATUS InitializeRateLimits(void) {
+    InitializeListHead(&g_Context.ThrottledFlows);
+    KeInitializeSpinLock(&g_Context.ThrottleLock);
+    KeInitializeTimer(&g_Context.ThrottleTimer);
+    KeInitializeDpc(&g_Context.ThrottleDpc, ThrottleDpcRoutine, NULL);
+
+    g_Context.AppRates = (PAPP_RATE)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        TRAFFIC_APP_SLOTS * sizeof(APP_RATE), NETGUARD_POOL_TAG);
+    g_Context.CpuRateBuckets = (PRATE_BUCKET)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        (SIZE_T)g_Context.CpuStatsCount * TRAFFIC_APP_SLOTS * sizeof(RATE_BUCKET), NETGUARD_POOL_TAG);
+    if (!g_Context.AppRates || !g_Context.CpuRateBuckets) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    for (UINT32 slot = 0; slot < TRAFFIC_APP_SLOTS; slot++) {
+        KeInitializeSpinLock(&g_Context.AppRates[slot].Lock);
+    }
+
+    return FwpsInjectionHandleCreate0(AF_UNSPEC, FWPS_INJECTION_TYPE_STREAM, &g_Context.StreamInjectionHandle);
+}
+
+// Helper: Stop the retry timer and wait out a DPC that is already running.
+// Held data left behind is dropped as the flows are detached.
+void StopRateLimits(void) {
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&g_Context.ThrottleLock, &oldIrql);
+    g_Context.ThrottleStopping = TRUE;
+    KeReleaseSpinLock(&g_Context.ThrottleLock, oldIrql);
+
+    KeCancelTimer(&g_Context.ThrottleTimer);
+    KeFlushQueuedDpcs();
+}
+
+// Helper: Free the rate state and the injection handle. Only called once
+// no classify can be running and every flow is detached.
+void FreeRateLimits(void) {
+    if (g_Context.StreamInjectionHandle) {
+        FwpsInjectionHandleDestroy0(g_Context.StreamInjectionHandle);
+        g_Context.StreamInjectionHandle = NULL;
+    }
+    if (g_Context.AppRates) {
+        ExFreePoolWithTag(g_Context.AppRates, NETGUARD_POOL_TAG);
+        g_Context.AppRates = NULL;
+    }
+    if (g_Context.CpuRateBuckets) {
+        ExFreePoolWithTag(g_Context.CpuRateBuckets, NETGUARD_POOL_TAG);
+        g_Context.CpuRateBuckets = NULL;
+    }
+}
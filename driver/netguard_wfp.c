@@ -10,72 +10,16 @@
  *
  * To build: Use Visual Studio with WDK or run from Developer Command Prompt:
  *   msbuild netguard_wfp.vcxproj /p:Configuration=Release /p:Platform=x64
+ *
+ * The rule table, pending queue, connect classify and DNS name cache live in
+ * netguard_rules.c, netguard_pending.c, netguard_classify.c and
+ * netguard_dns.c so bench/ can build them in user mode; the boot policy and
+ * the rate limits live in netguard_policy.c and netguard_shaping.c. This file
+ * holds everything else.
  */
 
-#include <ntddk.h>
-#include <wdf.h>
-#include <fwpsk.h>
-#include <fwpmk.h>
-#include <mstcpip.h>
-
-#define NETGUARD_DEVICE_NAME L"\\Device\\NetGuardWFP"
-#define NETGUARD_SYMBOLIC_NAME L"\\DosDevices\\NetGuardWFP"
-
-// IOCTL codes for user-mode communication
-#define IOCTL_NETGUARD_GET_PENDING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_DATA)
-#define IOCTL_NETGUARD_RESPOND        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA)
-#define IOCTL_NETGUARD_ADD_ALLOWED    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_WRITE_DATA)
-#define IOCTL_NETGUARD_REMOVE_ALLOWED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA)
-#define IOCTL_NETGUARD_ENABLE         CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_WRITE_DATA)
-#define IOCTL_NETGUARD_DISABLE        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_WRITE_DATA)
-
-// Maximum pending connections
-#define MAX_PENDING_CONNECTIONS 256
-#define MAX_ALLOWED_APPS 1024
-#define MAX_PATH_LENGTH 512
-
-// Pending connection structure
-typedef struct _PENDING_CONNECTION {
-    UINT64 connectionId;
-    UINT32 processId;
-    WCHAR processPath[MAX_PATH_LENGTH];
-    UINT32 remoteIp;
-    UINT16 remotePort;
-    LARGE_INTEGER timestamp;
-    BOOLEAN responded;
-    BOOLEAN allowed;
-} PENDING_CONNECTION, *PPENDING_CONNECTION;
-
-// Allowed application structure
-typedef struct _ALLOWED_APP {
-    WCHAR processPath[MAX_PATH_LENGTH];
-    BOOLEAN blocked; // TRUE = blocked, FALSE = allowed
-} ALLOWED_APP, *PALLOWED_APP;
-
-// Global state
-typedef struct _NETGUARD_CONTEXT {
-    PDEVICE_OBJECT DeviceObject;
-    HANDLE EngineHandle;
-    UINT32 CalloutId;
-    UINT32 FilterId;
-    BOOLEAN Enabled;
-
-    // Pending connections
-    PENDING_CONNECTION PendingConnections[MAX_PENDING_CONNECTIONS];
-    UINT32 PendingCount;
-    KSPIN_LOCK PendingLock;
-    KEVENT PendingEvent;
-
-    // Allowed/blocked apps
-    ALLOWED_APP AllowedApps[MAX_ALLOWED_APPS];
-    UINT32 AllowedCount;
-    KSPIN_LOCK AllowedLock;
-
-    // Statistics
-    UINT64 TotalConnections;
-    UINT64 BlockedConnections;
-    UINT64 AllowedConnections;
-} NETGUARD_CONTEXT, *PNETGUARD_CONTEXT;
+#include "netguard.h"
+#include <wdmsec.h>
 
 NETGUARD_CONTEXT g_Context = {0};
 
@@ -85,13 +29,1136 @@ DRIVER_UNLOAD DriverUnload;
 
 NTSTATUS NetGuardCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS NetGuardClose(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+NTSTATUS NetGuardCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS NetGuardDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
-NTSTATUS RegisterWfpCallout(void);
-NTSTATUS UnregisterWfpCallout(void);
+NTSTATUS RegisterWfpCallout(void);
+NTSTATUS UnregisterWfpCallout(void);
+
+// GUIDs for WFP registration
+DEFINE_GUID(NETGUARD_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc);
+
+DEFINE_GUID(NETGUARD_FLOW_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbd);
+
+DEFINE_GUID(NETGUARD_STREAM_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbe);
+
+DEFINE_GUID(NETGUARD_DATAGRAM_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbf);
+
+DEFINE_GUID(NETGUARD_ADDRESS_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc0);
+
+DEFINE_GUID(NETGUARD_CONNECT6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc1);
+
+DEFINE_GUID(NETGUARD_ACCEPT4_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc2);
+
+DEFINE_GUID(NETGUARD_ACCEPT6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc3);
+
+DEFINE_GUID(NETGUARD_ADDRESS_CONNECT6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc4);
+
+DEFINE_GUID(NETGUARD_ADDRESS_ACCEPT4_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc5);
+
+DEFINE_GUID(NETGUARD_ADDRESS_ACCEPT6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc6);
+
+DEFINE_GUID(NETGUARD_LISTEN4_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc7);
+
+DEFINE_GUID(NETGUARD_LISTEN6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc8);
+
+DEFINE_GUID(NETGUARD_FLOW6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xc9);
+
+DEFINE_GUID(NETGUARD_STREAM6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xca);
+
+DEFINE_GUID(NETGUARD_DATAGRAM6_CALLOUT_GUID,
+    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xcb);
+
+DEFINE_GUID(NETGUARD_SUBLAYER_GUID,
+    0x87654321, 0x4321, 0x4321, 0x43, 0x21, 0xab, 0xcd, 0xef, 0x12, 0x34, 0x56);
+
+// Device class for IoCreateDeviceSecure, so an administrator can override
+// the device ACL under the class key
+DEFINE_GUID(NETGUARD_DEVICE_CLASS_GUID,
+    0x87654321, 0x4321, 0x4321, 0x43, 0x21, 0xab, 0xcd, 0xef, 0x12, 0x34, 0x57);
+
+// TraceLogging provider, {0dc76911-4288-4e7c-b0db-376ada770b00}
+TRACELOGGING_DEFINE_PROVIDER(g_NetGuardTraceProvider, "NetGuard.Driver",
+    (0x0dc76911, 0x4288, 0x4e7c, 0xb0, 0xdb, 0x37, 0x6a, 0xda, 0x77, 0x0b, 0x00));
+
+// Helper: Add a BFE filter at an ALE layer in our sublayer. Filters with a
+// higher weight are evaluated first; the callout filter has the lowest.
+NTSTATUS AddConditionFilter(
+    const GUID* layerKey,
+    FWP_ACTION_TYPE action,
+    UINT8 weight,
+    UINT32 flags,
+    FWPM_FILTER_CONDITION0* condition,
+    PWCHAR name,
+    UINT64* filterId
+) {
+    FWPM_FILTER0 filter = {0};
+
+    filter.layerKey = *layerKey;
+    filter.subLayerKey = NETGUARD_SUBLAYER_GUID;
+    filter.displayData.name = name;
+    filter.displayData.description = L"Filter for NetGuard connection control";
+    filter.flags = flags;
+    filter.action.type = action;
+    filter.weight.type = FWP_UINT8;
+    filter.weight.uint8 = weight;
+    filter.numFilterConditions = 1;
+    filter.filterCondition = condition;
+
+    return FwpmFilterAdd0(g_Context.EngineHandle, &filter, NULL, filterId);
+}
+
+// Helper: Make room in AppFilterIds for at least count rules. New entries
+// are zero (no filter). Caller holds RuleWriteLock.
+static NTSTATUS ReserveAppFilterIds(UINT32 count) {
+    if (count <= g_Context.AppFilterCapacity) {
+        return STATUS_SUCCESS;
+    }
+
+    UINT32 capacity = g_Context.AppFilterCapacity ? g_Context.AppFilterCapacity : RULE_INITIAL_APPS;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    PUINT64 filterIds = (PUINT64)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        (SIZE_T)capacity * sizeof(UINT64), NETGUARD_POOL_TAG);
+    if (!filterIds) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (g_Context.AppFilterIds) {
+        RtlCopyMemory(filterIds, g_Context.AppFilterIds, (SIZE_T)g_Context.AppFilterCapacity * sizeof(UINT64));
+        ExFreePoolWithTag(g_Context.AppFilterIds, NETGUARD_POOL_TAG);
+    }
+    g_Context.AppFilterIds = filterIds;
+    g_Context.AppFilterCapacity = capacity;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Forget every installed filter ID. Caller holds RuleWriteLock.
+static void ClearAppFilterIds(void) {
+    if (g_Context.AppFilterIds) {
+        RtlZeroMemory(g_Context.AppFilterIds, (SIZE_T)g_Context.AppFilterCapacity * sizeof(UINT64));
+    }
+}
+
+// Helper: Mirror one rule as a native permit/block filter on its app ID, so
+// BFE answers connects from known apps without calling NetGuardClassifyFn.
+// The app ID BFE matches against is the lowercased NT path including its
+// terminator, i.e. the processPath metadata classify sees. Block filters
+// clear the action right, as a block from the callout does. Rules a pattern
+// overrides get no filter. Only the IPv4 connect layer gets these; on the
+// other layers the callout's lock-free lookup answers known apps, so a rule
+// change costs one BFE filter rather than four. Caller holds RuleWriteLock.
+NTSTATUS AddAppFilter(UINT32 appIndex) {
+    PRULE_APP app = &g_Context.ActiveRules->Apps[appIndex];
+    WCHAR appId[MAX_PATH_LENGTH];
+    FWP_BYTE_BLOB blob;
+    FWPM_FILTER_CONDITION0 condition = {0};
+    SIZE_T length = app->pathLength;
+
+    NTSTATUS status = ReserveAppFilterIds(appIndex + 1);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    if (PatternOverridesRule(app)) {
+        return STATUS_SUCCESS;
+    }
+
+    for (SIZE_T i = 0; i < length; i++) {
+        appId[i] = RtlDowncaseUnicodeChar(app->processPath[i]);
+    }
+    appId[length] = L'\0';
+
+    blob.size = (UINT32)((length + 1) * sizeof(WCHAR));
+    blob.data = (UINT8*)appId;
+
+    condition.fieldKey = FWPM_CONDITION_ALE_APP_ID;
+    condition.matchType = FWP_MATCH_EQUAL;
+    condition.conditionValue.type = FWP_BYTE_BLOB_TYPE;
+    condition.conditionValue.byteBlob = &blob;
+
+    return AddConditionFilter(&FWPM_LAYER_ALE_AUTH_CONNECT_V4, app->blocked ? FWP_ACTION_BLOCK : FWP_ACTION_PERMIT, 0xD,
+                              app->blocked ? FWPM_FILTER_FLAG_CLEAR_ACTION_RIGHT : FWPM_FILTER_FLAG_NONE,
+                              &condition, L"NetGuard App Rule", &g_Context.AppFilterIds[appIndex]);
+}
+
+// Helper: Delete the filter mirroring one rule. Caller holds RuleWriteLock.
+void RemoveAppFilter(UINT32 appIndex) {
+    if (appIndex < g_Context.AppFilterCapacity && g_Context.AppFilterIds[appIndex]) {
+        FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.AppFilterIds[appIndex]);
+        g_Context.AppFilterIds[appIndex] = 0;
+    }
+}
+
+// Helper: Install (or remove) filters for every rule in the active table in
+// one BFE transaction. If installing fails, nothing is left half-installed:
+// the callout still enforces every rule. Caller holds RuleWriteLock.
+NTSTATUS SyncAppFilters(BOOLEAN install) {
+    NTSTATUS status;
+
+    if (!g_Context.EngineHandle || install == g_Context.AppFiltersInstalled) {
+        return STATUS_SUCCESS;
+    }
+
+    status = FwpmTransactionBegin0(g_Context.EngineHandle, 0);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (UINT32 i = 0; i < g_Context.ActiveRules->Count && NT_SUCCESS(status); i++) {
+        if (install) {
+            status = AddAppFilter(i);
+        } else {
+            RemoveAppFilter(i);
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        FwpmTransactionAbort0(g_Context.EngineHandle);
+        ClearAppFilterIds();
+        return status;
+    }
+
+    status = FwpmTransactionCommit0(g_Context.EngineHandle);
+    if (NT_SUCCESS(status)) {
+        g_Context.AppFiltersInstalled = install;
+    }
+    if (!NT_SUCCESS(status) || !install) {
+        ClearAppFilterIds();
+    }
+    return status;
+}
+
+// Helper: Order staged prefixes by family, start address, length, then
+// arrival, so containing prefixes come before the prefixes they contain
+int CompareAddressPrefixes(PADDRESS_PREFIX a, PADDRESS_PREFIX b) {
+    if (a->family != b->family) {
+        return a->family < b->family ? -1 : 1;
+    }
+    if (a->start.high != b->start.high) {
+        return a->start.high < b->start.high ? -1 : 1;
+    }
+    if (a->start.low != b->start.low) {
+        return a->start.low < b->start.low ? -1 : 1;
+    }
+    if (a->prefixLength != b->prefixLength) {
+        return a->prefixLength < b->prefixLength ? -1 : 1;
+    }
+    if (a->sequence != b->sequence) {
+        return a->sequence < b->sequence ? -1 : 1;
+    }
+    return 0;
+}
+
+// Helper: Heap sort the staged prefixes (in place, no recursion)
+void SortAddressPrefixes(PADDRESS_PREFIX items, UINT32 count) {
+    for (UINT32 end = count, start = count / 2; end > 1;) {
+        UINT32 root;
+        if (start > 0) {
+            root = --start;
+        } else {
+            ADDRESS_PREFIX swap = items[0];
+            items[0] = items[--end];
+            items[end] = swap;
+            root = 0;
+        }
+
+        for (;;) {
+            UINT32 child = 2 * root + 1;
+            if (child >= end) {
+                break;
+            }
+            if (child + 1 < end && CompareAddressPrefixes(&items[child], &items[child + 1]) < 0) {
+                child++;
+            }
+            if (CompareAddressPrefixes(&items[root], &items[child]) >= 0) {
+                break;
+            }
+            ADDRESS_PREFIX swap = items[root];
+            items[root] = items[child];
+            items[child] = swap;
+            root = child;
+        }
+    }
+}
+
+// Helper: Address of a prefix length worth of leading one bits
+ADDRESS_KEY AddressPrefixMask(UINT8 prefixLength) {
+    ADDRESS_KEY mask;
+    mask.high = prefixLength == 0 ? 0 : prefixLength >= 64 ? ~0ULL : ~0ULL << (64 - prefixLength);
+    mask.low = prefixLength <= 64 ? 0 : ~0ULL << (128 - prefixLength);
+    return mask;
+}
+
+// Helper: Range under construction for one family
+typedef struct _ADDRESS_BUILDER {
+    BOOLEAN v6;
+    UINT32 count;
+    PUINT32 starts4;
+    PADDRESS_KEY starts6;
+    PUINT8 actions;
+} ADDRESS_BUILDER, *PADDRESS_BUILDER;
+
+ADDRESS_KEY AddressBuilderStart(PADDRESS_BUILDER builder, UINT32 index) {
+    ADDRESS_KEY key = {0};
+    if (builder->v6) {
+        key = builder->starts6[index];
+    } else {
+        key.high = (UINT64)builder->starts4[index] << 32;
+    }
+    return key;
+}
+
+// Helper: Start a new range at start with the given action. A range starting
+// where the previous one did replaces it, and one with the previous action
+// is merged into it.
+void AddressBuilderEmit(PADDRESS_BUILDER builder, ADDRESS_KEY start, UINT8 action) {
+    if (builder->count > 0) {
+        ADDRESS_KEY last = AddressBuilderStart(builder, builder->count - 1);
+        if (last.high == start.high && last.low == start.low) {
+            builder->count--;
+        }
+    }
+    if (builder->count > 0 && builder->actions[builder->count - 1] == action) {
+        return;
+    }
+
+    if (builder->v6) {
+        builder->starts6[builder->count] = start;
+    } else {
+        builder->starts4[builder->count] = (UINT32)(start.high >> 32);
+    }
+    builder->actions[builder->count] = action;
+    builder->count++;
+}
+
+// Helper: Flatten sorted prefixes of one family into ranges. The builder
+// must have room for 2 * count + 1 ranges.
+void BuildAddressRanges(PADDRESS_BUILDER builder, PADDRESS_PREFIX prefixes, UINT32 count) {
+    PADDRESS_PREFIX stack[129]; // Open prefixes, each inside the one below
+    ADDRESS_KEY zero = {0};
+    UINT32 depth = 0;
+
+    AddressBuilderEmit(builder, zero, ADDRESS_ACTION_NONE);
+
+    for (UINT32 i = 0; i <= count; i++) {
+        PADDRESS_PREFIX prefix = i < count ? &prefixes[i] : NULL;
+
+        // Close the open prefixes that end before this one starts; the range
+        // after each belongs to the prefix around it
+        while (depth > 0) {
+            PADDRESS_PREFIX top = stack[depth - 1];
+            ADDRESS_KEY mask = AddressPrefixMask(top->prefixLength);
+            ADDRESS_KEY end = { top->start.high | ~mask.high, top->start.low | ~mask.low };
+
+            if (prefix && (end.high > prefix->start.high ||
+                           (end.high == prefix->start.high && end.low >= prefix->start.low))) {
+                break;
+            }
+            depth--;
+
+            // end + 1, unless end is the last address
+            ADDRESS_KEY next = { end.high, end.low + 1 };
+            if (next.low == 0) {
+                next.high++;
+                if (next.high == 0) {
+                    continue;
+                }
+            }
+            AddressBuilderEmit(builder, next, depth > 0 ? stack[depth - 1]->action : ADDRESS_ACTION_NONE);
+        }
+
+        if (prefix) {
+            // A repeated prefix replaces the earlier copy instead of nesting
+            PADDRESS_PREFIX top = depth > 0 ? stack[depth - 1] : NULL;
+            if (top && top->prefixLength == prefix->prefixLength &&
+                top->start.high == prefix->start.high && top->start.low == prefix->start.low) {
+                depth--;
+            }
+            AddressBuilderEmit(builder, prefix->start, prefix->action);
+            stack[depth++] = prefix;
+        }
+    }
+}
+
+// Helper: Fill a direct index over the top 16 bits of the range starts
+void BuildAddressIndex(PADDRESS_BUILDER builder, PUINT32 index) {
+    UINT32 range = 0;
+
+    for (UINT32 slot = 0; slot <= ADDRESS_INDEX_SLOTS; slot++) {
+        while (range < builder->count &&
+               (UINT32)(AddressBuilderStart(builder, range).high >> 48) < slot) {
+            range++;
+        }
+        index[slot] = range;
+    }
+}
+
+// Helper: Build an address table from the staged prefixes. Sorts the staging
+// buffer. Returns NULL without memory. Caller holds AddressStagingLock.
+PADDRESS_TABLE BuildAddressTable(void) {
+    PADDRESS_PREFIX prefixes = g_Context.AddressStaging;
+    UINT32 count = g_Context.AddressStagedCount;
+    UINT32 v4Prefixes = 0;
+    ADDRESS_BUILDER v4 = {0};
+    ADDRESS_BUILDER v6 = {0};
+    PADDRESS_TABLE table = NULL;
+
+    SortAddressPrefixes(prefixes, count);
+    while (v4Prefixes < count && prefixes[v4Prefixes].family == ADDRESS_FAMILY_V4) {
+        v4Prefixes++;
+    }
+
+    // Ranges are built at their worst-case size in paged pool, then copied
+    // into an exactly sized non-paged table
+    SIZE_T v4Capacity = 2 * (SIZE_T)v4Prefixes + 1;
+    SIZE_T v6Capacity = 2 * (SIZE_T)(count - v4Prefixes) + 1;
+    v4.starts4 = (PUINT32)ExAllocatePool2(POOL_FLAG_PAGED, v4Capacity * sizeof(UINT32), NETGUARD_POOL_TAG);
+    v4.actions = (PUINT8)ExAllocatePool2(POOL_FLAG_PAGED, v4Capacity, NETGUARD_POOL_TAG);
+    v6.v6 = TRUE;
+    v6.starts6 = (PADDRESS_KEY)ExAllocatePool2(POOL_FLAG_PAGED, v6Capacity * sizeof(ADDRESS_KEY), NETGUARD_POOL_TAG);
+    v6.actions = (PUINT8)ExAllocatePool2(POOL_FLAG_PAGED, v6Capacity, NETGUARD_POOL_TAG);
+
+    if (v4.starts4 && v4.actions && v6.starts6 && v6.actions) {
+        BuildAddressRanges(&v4, prefixes, v4Prefixes);
+        BuildAddressRanges(&v6, prefixes + v4Prefixes, count - v4Prefixes);
+
+        SIZE_T length = sizeof(ADDRESS_TABLE) + v6.count * sizeof(ADDRESS_KEY) +
+                        v4.count * sizeof(UINT32) + v4.count + v6.count;
+        table = (PADDRESS_TABLE)ExAllocatePool2(POOL_FLAG_NON_PAGED, length, NETGUARD_POOL_TAG);
+    }
+
+    if (table) {
+        table->v4Count = v4.count;
+        table->v6Count = v6.count;
+        table->v6Starts = (PADDRESS_KEY)(table + 1);
+        table->v4Starts = (PUINT32)(table->v6Starts + v6.count);
+        table->v4Actions = (PUINT8)(table->v4Starts + v4.count);
+        table->v6Actions = table->v4Actions + v4.count;
+
+        RtlCopyMemory(table->v6Starts, v6.starts6, v6.count * sizeof(ADDRESS_KEY));
+        RtlCopyMemory(table->v4Starts, v4.starts4, v4.count * sizeof(UINT32));
+        RtlCopyMemory(table->v4Actions, v4.actions, v4.count);
+        RtlCopyMemory(table->v6Actions, v6.actions, v6.count);
+        BuildAddressIndex(&v4, table->v4Index);
+        BuildAddressIndex(&v6, table->v6Index);
+    }
+
+    if (v4.starts4) {
+        ExFreePoolWithTag(v4.starts4, NETGUARD_POOL_TAG);
+    }
+    if (v4.actions) {
+        ExFreePoolWithTag(v4.actions, NETGUARD_POOL_TAG);
+    }
+    if (v6.starts6) {
+        ExFreePoolWithTag(v6.starts6, NETGUARD_POOL_TAG);
+    }
+    if (v6.actions) {
+        ExFreePoolWithTag(v6.actions, NETGUARD_POOL_TAG);
+    }
+    return table;
+}
+
+// Helper: Action for an IPv4 address (host byte order)
+UINT8 LookupAddress4(PADDRESS_TABLE table, UINT32 address) {
+    UINT32 slot = address >> 16;
+    UINT32 low = table->v4Index[slot];
+    UINT32 high = table->v4Index[slot + 1];
+
+    // First range starting above the address; the one before it holds it
+    while (low < high) {
+        UINT32 mid = low + (high - low) / 2;
+        if (table->v4Starts[mid] <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? table->v4Actions[low - 1] : ADDRESS_ACTION_NONE;
+}
+
+// Helper: Action for an IPv6 address (network byte order)
+UINT8 LookupAddress6(PADDRESS_TABLE table, const UINT8* address) {
+    ADDRESS_KEY key = {0};
+    for (int i = 0; i < 8; i++) {
+        key.high = (key.high << 8) | address[i];
+        key.low = (key.low << 8) | address[8 + i];
+    }
+
+    UINT32 slot = (UINT32)(key.high >> 48);
+    UINT32 low = table->v6Index[slot];
+    UINT32 high = table->v6Index[slot + 1];
+
+    while (low < high) {
+        UINT32 mid = low + (high - low) / 2;
+        PADDRESS_KEY start = &table->v6Starts[mid];
+        if (start->high < key.high || (start->high == key.high && start->low <= key.low)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? table->v6Actions[low - 1] : ADDRESS_ACTION_NONE;
+}
+
+// Helper: Discard the staged prefixes. Caller holds AddressStagingLock.
+void ClearAddressStaging(void) {
+    if (g_Context.AddressStaging) {
+        ExFreePoolWithTag(g_Context.AddressStaging, NETGUARD_POOL_TAG);
+        g_Context.AddressStaging = NULL;
+    }
+    g_Context.AddressStagedCount = 0;
+    g_Context.AddressStagingCapacity = 0;
+}
+
+// Helper: Validate one SET_ADDRESS_RULES chunk and append it to the staged
+// prefixes. Nothing is staged unless the whole chunk is valid.
+// Caller holds AddressStagingLock.
+NTSTATUS StageAddressRules(PADDRESS_RULE_HEADER header, ULONG inputLength) {
+    PADDRESS_RULE_ENTRY entries = (PADDRESS_RULE_ENTRY)(header + 1);
+
+    if (header->count > (inputLength - sizeof(ADDRESS_RULE_HEADER)) / sizeof(ADDRESS_RULE_ENTRY)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    for (UINT32 i = 0; i < header->count; i++) {
+        PADDRESS_RULE_ENTRY entry = &entries[i];
+        UINT8 maxLength = entry->family == ADDRESS_FAMILY_V4 ? 32 : 128;
+        if ((entry->family != ADDRESS_FAMILY_V4 && entry->family != ADDRESS_FAMILY_V6) ||
+            entry->prefixLength > maxLength ||
+            (entry->action != ADDRESS_ACTION_BLOCK && entry->action != ADDRESS_ACTION_PERMIT)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    UINT32 needed = g_Context.AddressStagedCount + header->count;
+    if (needed > ADDRESS_MAX_PREFIXES) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    if (needed > g_Context.AddressStagingCapacity) {
+        UINT32 capacity = g_Context.AddressStagingCapacity ? g_Context.AddressStagingCapacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        if (capacity > ADDRESS_MAX_PREFIXES) {
+            capacity = ADDRESS_MAX_PREFIXES;
+        }
+
+        PADDRESS_PREFIX staging = (PADDRESS_PREFIX)ExAllocatePool2(POOL_FLAG_PAGED,
+            (SIZE_T)capacity * sizeof(ADDRESS_PREFIX), NETGUARD_POOL_TAG);
+        if (!staging) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (g_Context.AddressStaging) {
+            RtlCopyMemory(staging, g_Context.AddressStaging,
+                          g_Context.AddressStagedCount * sizeof(ADDRESS_PREFIX));
+            ExFreePoolWithTag(g_Context.AddressStaging, NETGUARD_POOL_TAG);
+        }
+        g_Context.AddressStaging = staging;
+        g_Context.AddressStagingCapacity = capacity;
+    }
+
+    for (UINT32 i = 0; i < header->count; i++) {
+        PADDRESS_RULE_ENTRY entry = &entries[i];
+        PADDRESS_PREFIX prefix = &g_Context.AddressStaging[g_Context.AddressStagedCount];
+        UINT8 bytes = entry->family == ADDRESS_FAMILY_V4 ? 4 : 16;
+        UINT8 address[16] = {0};
+
+        RtlCopyMemory(address, entry->address, bytes);
+        prefix->start.high = 0;
+        prefix->start.low = 0;
+        for (int b = 0; b < 8; b++) {
+            prefix->start.high = (prefix->start.high << 8) | address[b];
+            prefix->start.low = (prefix->start.low << 8) | address[8 + b];
+        }
+
+        ADDRESS_KEY mask = AddressPrefixMask(entry->prefixLength);
+        prefix->start.high &= mask.high;
+        prefix->start.low &= mask.low;
+        prefix->sequence = g_Context.AddressStagedCount;
+        prefix->family = entry->family;
+        prefix->prefixLength = entry->prefixLength;
+        prefix->action = entry->action;
+        g_Context.AddressStagedCount++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Helper: Build the staged prefixes and make them the active address rules.
+// An empty set removes the address rules. The staging is consumed either way.
+// Caller holds AddressStagingLock.
+NTSTATUS CommitAddressRules(void) {
+    PADDRESS_TABLE table = NULL;
+
+    if (g_Context.AddressStagedCount > 0) {
+        table = BuildAddressTable();
+        if (!table) {
+            ClearAddressStaging();
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    ClearAddressStaging();
+
+    AcquireRuleLock();
+    PADDRESS_TABLE previous = (PADDRESS_TABLE)InterlockedExchangePointer(
+        (PVOID volatile*)&g_Context.ActiveAddressRules, table);
+    if (previous) {
+        WaitForRuleReaders();
+    }
+    ReleaseRuleLock();
+
+    if (previous) {
+        ExFreePoolWithTag(previous, NETGUARD_POOL_TAG);
+    }
+    return STATUS_SUCCESS;
+}
+
+// Helper: Make a pattern table (or NULL, for none) the active pattern rules
+// and free the previous one. The app filters are rebuilt around the swap
+// since which rules a pattern overrides may change.
+void CommitPatternRules(PPATTERN_TABLE table) {
+    AcquireRuleLock();
+
+    BOOLEAN refilter = g_Context.AppFiltersInstalled;
+    SyncAppFilters(FALSE);
+
+    PPATTERN_TABLE previous = (PPATTERN_TABLE)InterlockedExchangePointer(
+        (PVOID volatile*)&g_Context.ActivePatterns, table);
+    InterlockedIncrement(&g_Context.RuleGeneration);
+    WaitForRuleReaders();
+
+    if (refilter) {
+        SyncAppFilters(TRUE);
+    }
+    ReleaseRuleLock();
+
+    if (previous) {
+        ExFreePoolWithTag(previous, NETGUARD_POOL_TAG);
+    }
+}
+
+// Helper: Ring of the given processor in a subscriber's section
+PEVENT_RING GetEventRing(PEVENT_SUBSCRIBER subscriber, ULONG index) {
+    PEVENT_SECTION_HEADER header = (PEVENT_SECTION_HEADER)subscriber->Section;
+    return (PEVENT_RING)((PUCHAR)header + header->ringOffset + index * header->ringStride);
+}
+
+// Helper: Does an event pass a subscriber's filter (NULL passes everything)
+BOOLEAN EventPassesFilter(const EVENT_FILTER* filter, const NETGUARD_EVENT* event) {
+    if (!filter) {
+        return TRUE;
+    }
+
+    if (filter->TypeMask && !(filter->TypeMask & (1 << event->type))) {
+        return FALSE;
+    }
+
+    if (filter->PortRangeCount) {
+        UINT16 i;
+        for (i = 0; i < filter->PortRangeCount; i++) {
+            const EVENT_PORT_RANGE* range = &filter->PortRanges[i];
+            if ((event->localPort >= range->low && event->localPort <= range->high) ||
+                (event->remotePort >= range->low && event->remotePort <= range->high)) {
+                break;
+            }
+        }
+        if (i == filter->PortRangeCount) {
+            return FALSE;
+        }
+    }
+
+    if (filter->PathCount) {
+        if (!event->pathHash) {
+            return FALSE;
+        }
+        UINT32 low = 0;
+        UINT32 high = filter->PathCount;
+        while (low < high) {
+            UINT32 mid = low + (high - low) / 2;
+            if (filter->PathHashes[mid] < event->pathHash) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low == filter->PathCount || filter->PathHashes[low] != event->pathHash) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Helper: Append a record to this processor's ring in a subscriber's
+// section and wake its consumer if it is waiting. Called at DISPATCH_LEVEL.
+void WriteEventRecord(PEVENT_SUBSCRIBER subscriber, const NETGUARD_EVENT* event) {
+    PEVENT_SECTION_HEADER header = (PEVENT_SECTION_HEADER)subscriber->Section;
+    PEVENT_RING ring = GetEventRing(subscriber, KeGetCurrentProcessorIndex());
+    LONG head = ring->Head;
+
+    // Tail is user-writable; any value that doesn't make sense reads as full
+    if ((ULONG)(head - ReadAcquire(&ring->Tail)) >= EVENT_RING_CAPACITY) {
+        ring->Dropped++;
+    } else {
+        ring->Records[head & (EVENT_RING_CAPACITY - 1)] = *event;
+        WriteRelease(&ring->Head, head + 1);
+    }
+
+    if (ReadAcquire(&header->consumerWaiting) && InterlockedExchange(&header->consumerWaiting, 0)) {
+        if (subscriber->EventObject) {
+            KeSetEvent(subscriber->EventObject, IO_NO_INCREMENT, FALSE);
+        }
+    }
+}
+
+// Helper: Copy a record into the rings of every subscriber whose filter
+// passes it, tagged with the remote's DNS name if one is cached. Nothing is
+// looked up or copied for an event nobody subscribed to. Callable at IRQL
+// <= DISPATCH_LEVEL.
+void PublishEvent(PNETGUARD_EVENT event) {
+    PEVENT_SUBSCRIBER targets[EVENT_MAX_SUBSCRIBERS];
+    CHAR hostName[DNS_MAX_NAME_LENGTH];
+    UINT32 targetCount = 0;
+    KIRQL oldIrql;
+
+    if (!ReadNoFence(&g_Context.EventSubscriberCount)) {
+        return;
+    }
+
+    // Staying on one processor makes this each ring's only producer, and
+    // UnmapEventSection's grace period covers everything from here on
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    for (UINT32 i = 0; i < EVENT_MAX_SUBSCRIBERS; i++) {
+        PEVENT_SUBSCRIBER subscriber = (PEVENT_SUBSCRIBER)ReadPointerAcquire((PVOID*)&g_Context.EventSubscribers[i]);
+        if (subscriber &&
+            EventPassesFilter((PEVENT_FILTER)ReadPointerAcquire((PVOID*)&subscriber->Filter), event)) {
+            targets[targetCount++] = subscriber;
+        }
+    }
+
+    if (targetCount > 0) {
+        KeQuerySystemTime(&event->timestamp);
+
+        // Keep the end of a name too long for the record
+        UINT32 hostLength = LookupDnsName(event->remoteAddress, hostName);
+        UINT32 skip = hostLength > EVENT_HOST_NAME_LENGTH - 1 ? hostLength - (EVENT_HOST_NAME_LENGTH - 1) : 0;
+        RtlCopyMemory(event->hostName, hostName + skip, hostLength - skip);
+        event->hostName[hostLength - skip] = '\0';
+
+        for (UINT32 i = 0; i < targetCount; i++) {
+            WriteEventRecord(targets[i], event);
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+}
+
+// Helper: Allocate a subscriber's event section on its first mapping
+NTSTATUS InitializeEventSection(PEVENT_SUBSCRIBER subscriber) {
+    ULONG ringCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ULONG ringStride = (ULONG)ROUND_TO_PAGES(sizeof(EVENT_RING));
+    ULONG ringOffset = (ULONG)ROUND_TO_PAGES(sizeof(EVENT_SECTION_HEADER));
+    ULONG length = ringOffset + ringCount * ringStride;
+
+    if (subscriber->Section) {
+        return STATUS_SUCCESS;
+    }
+
+    PVOID section = ExAllocatePool2(POOL_FLAG_NON_PAGED, length, NETGUARD_POOL_TAG);
+    if (!section) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    PMDL mdl = IoAllocateMdl(section, length, FALSE, FALSE, NULL);
+    if (!mdl) {
+        ExFreePoolWithTag(section, NETGUARD_POOL_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    PEVENT_SECTION_HEADER header = (PEVENT_SECTION_HEADER)section;
+    header->version = EVENT_SECTION_VERSION;
+    header->ringCount = ringCount;
+    header->ringCapacity = EVENT_RING_CAPACITY;
+    header->recordSize = sizeof(NETGUARD_EVENT);
+    header->ringOffset = ringOffset;
+    header->ringStride = ringStride;
+
+    subscriber->Section = section;
+    subscriber->SectionLength = length;
+    subscriber->Mdl = mdl;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Map a handle's event section into the calling process and start
+// publishing to it. One mapping per handle, and at most
+// EVENT_MAX_SUBSCRIBERS handles at a time.
+NTSTATUS MapEventSection(PEVENT_SUBSCRIBER subscriber, PEVENT_MAP_REQUEST request, PEVENT_MAP_RESULT result) {
+    NTSTATUS status;
+    PKEVENT event = NULL;
+    PVOID userAddress = NULL;
+    UINT32 slot;
+
+    AcquireRuleLock();
+
+    for (slot = 0; slot < EVENT_MAX_SUBSCRIBERS; slot++) {
+        if (!g_Context.EventSubscribers[slot]) {
+            break;
+        }
+    }
+    if (subscriber->UserAddress || slot == EVENT_MAX_SUBSCRIBERS) {
+        ReleaseRuleLock();
+        return STATUS_DEVICE_BUSY;
+    }
+
+    // Only NetGuardProcessNotify unmaps a mapping whose owner exited first
+    if (!g_Context.PidCacheEnabled) {
+        ReleaseRuleLock();
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    status = InitializeEventSection(subscriber);
+    if (NT_SUCCESS(status) && request && request->eventHandle) {
+        status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)request->eventHandle, EVENT_MODIFY_STATE,
+                                           *ExEventObjectType, UserMode, (PVOID*)&event, NULL);
+    }
+
+    if (NT_SUCCESS(status)) {
+        __try {
+            userAddress = MmMapLockedPagesSpecifyCache(subscriber->Mdl, UserMode, MmCached, NULL,
+                                                       FALSE, NormalPagePriority | MdlMappingNoExecute);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            userAddress = NULL;
+        }
+        if (!userAddress) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        if (event) {
+            ObDereferenceObject(event);
+        }
+        ReleaseRuleLock();
+        return status;
+    }
+
+    subscriber->UserAddress = userAddress;
+    subscriber->OwnerProcess = PsGetCurrentProcess();
+    ObReferenceObject(subscriber->OwnerProcess);
+    subscriber->EventObject = event;
+    InterlockedExchangePointer((PVOID*)&g_Context.EventSubscribers[slot], subscriber);
+    InterlockedIncrement(&g_Context.EventSubscriberCount);
+
+    ReleaseRuleLock();
+
+    result->baseAddress = (UINT64)(ULONG_PTR)userAddress;
+    result->length = subscriber->SectionLength;
+    result->reserved = 0;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Stop publishing to a mapped handle and tear down its mapping.
+// Called with the rule lock held.
+static void UnmapEventSectionLocked(PEVENT_SUBSCRIBER subscriber) {
+    KAPC_STATE apcState;
+
+    // Stop producers, then wait out any still writing to the rings
+    for (UINT32 slot = 0; slot < EVENT_MAX_SUBSCRIBERS; slot++) {
+        if (g_Context.EventSubscribers[slot] == subscriber) {
+            InterlockedExchangePointer((PVOID*)&g_Context.EventSubscribers[slot], NULL);
+            InterlockedDecrement(&g_Context.EventSubscriberCount);
+        }
+    }
+    WaitForRuleReaders();
+
+    // Cleanup normally runs in the owner's context, but a duplicated handle
+    // can be closed from elsewhere
+    BOOLEAN attach = (PsGetCurrentProcess() != subscriber->OwnerProcess);
+    if (attach) {
+        KeStackAttachProcess(subscriber->OwnerProcess, &apcState);
+    }
+    MmUnmapLockedPages(subscriber->UserAddress, subscriber->Mdl);
+    if (attach) {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(subscriber->OwnerProcess);
+    if (subscriber->EventObject) {
+        ObDereferenceObject(subscriber->EventObject);
+    }
+    subscriber->UserAddress = NULL;
+    subscriber->OwnerProcess = NULL;
+    subscriber->EventObject = NULL;
+}
+
+// Helper: Stop publishing to a handle and tear down its mapping, if it has one
+void UnmapEventSection(PEVENT_SUBSCRIBER subscriber) {
+    AcquireRuleLock();
+    if (subscriber->UserAddress) {
+        UnmapEventSectionLocked(subscriber);
+    }
+    ReleaseRuleLock();
+}
+
+// Process notify routine: keeps the process verdict cache current, and
+// removes the mappings a process owns as it exits. A handle duplicated into
+// another process can outlive the owner, and its mapping must not outlive
+// the address space it is in. Exit notifications arrive in the exiting
+// process while its address space is still intact.
+void NetGuardProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
+    NotePidCacheProcess((UINT32)(ULONG_PTR)ProcessId, CreateInfo != NULL);
+
+    if (CreateInfo || !ReadNoFence(&g_Context.EventSubscriberCount)) {
+        return;
+    }
+
+    // A listed subscriber stays allocated while the lock is held: its
+    // cleanup has to take the lock to unlist it before close can free it
+    AcquireRuleLock();
+    for (UINT32 slot = 0; slot < EVENT_MAX_SUBSCRIBERS; slot++) {
+        PEVENT_SUBSCRIBER subscriber = g_Context.EventSubscribers[slot];
+        if (subscriber && subscriber->OwnerProcess == Process) {
+            UnmapEventSectionLocked(subscriber);
+        }
+    }
+    ReleaseRuleLock();
+}
+
+// Helper: Check a SET_EVENT_FILTER input and build the filter it describes.
+// A filter that passes everything yields NULL.
+NTSTATUS BuildEventFilter(const UCHAR* data, ULONG length, PEVENT_FILTER* result) {
+    EVENT_FILTER_HEADER header;
+
+    *result = NULL;
+    if (length < sizeof(EVENT_FILTER_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    RtlCopyMemory(&header, data, sizeof(header));
+    if (header.version != EVENT_FILTER_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    if (header.portRangeCount > EVENT_FILTER_MAX_PORT_RANGES || header.pathCount > EVENT_FILTER_MAX_PATHS ||
+        sizeof(EVENT_FILTER_HEADER) + (ULONG)header.portRangeCount * sizeof(EVENT_PORT_RANGE) > length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (header.typeMask == 0 && header.portRangeCount == 0 && header.pathCount == 0) {
+        return length == sizeof(EVENT_FILTER_HEADER) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    }
+
+    PEVENT_FILTER filter = (PEVENT_FILTER)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(EVENT_FILTER, PathHashes) + max(header.pathCount, 1) * sizeof(UINT64), NETGUARD_POOL_TAG);
+    if (!filter) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    filter->TypeMask = header.typeMask;
+    filter->PortRangeCount = header.portRangeCount;
+    filter->PathCount = header.pathCount;
+
+    ULONG offset = sizeof(EVENT_FILTER_HEADER);
+    RtlCopyMemory(filter->PortRanges, data + offset, header.portRangeCount * sizeof(EVENT_PORT_RANGE));
+    offset += header.portRangeCount * sizeof(EVENT_PORT_RANGE);
+    for (UINT16 i = 0; i < header.portRangeCount; i++) {
+        if (filter->PortRanges[i].low > filter->PortRanges[i].high) {
+            ExFreePoolWithTag(filter, NETGUARD_POOL_TAG);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    // Hash the paths as classify does, keeping the array sorted
+    for (UINT32 i = 0; i < header.pathCount; i++) {
+        UINT16 pathLength;
+        if (offset + sizeof(UINT16) > length) {
+            ExFreePoolWithTag(filter, NETGUARD_POOL_TAG);
+            return STATUS_INVALID_PARAMETER;
+        }
+        RtlCopyMemory(&pathLength, data + offset, sizeof(UINT16));
+        offset += sizeof(UINT16);
+        if (pathLength == 0 || pathLength >= MAX_PATH_LENGTH || offset + pathLength * sizeof(WCHAR) > length) {
+            ExFreePoolWithTag(filter, NETGUARD_POOL_TAG);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        UINT64 hash = HashProcessPath((const WCHAR*)(data + offset), pathLength);
+        offset += pathLength * sizeof(WCHAR);
+
+        UINT32 j = i;
+        for (; j > 0 && filter->PathHashes[j - 1] > hash; j--) {
+            filter->PathHashes[j] = filter->PathHashes[j - 1];
+        }
+        filter->PathHashes[j] = hash;
+    }
+
+    if (offset != length) {
+        ExFreePoolWithTag(filter, NETGUARD_POOL_TAG);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *result = filter;
+    return STATUS_SUCCESS;
+}
+
+// Helper: Replace a handle's event filter, freeing the previous one once no
+// publisher can still be reading it
+void SetEventFilter(PEVENT_SUBSCRIBER subscriber, PEVENT_FILTER filter) {
+    AcquireRuleLock();
+    PEVENT_FILTER previous = (PEVENT_FILTER)InterlockedExchangePointer((PVOID*)&subscriber->Filter, filter);
+    if (previous) {
+        WaitForRuleReaders();
+    }
+    ReleaseRuleLock();
+
+    if (previous) {
+        ExFreePoolWithTag(previous, NETGUARD_POOL_TAG);
+    }
+}
+
+// Helper: Free a handle's state on close. Cleanup has already unmapped it.
+void FreeEventSubscriber(PEVENT_SUBSCRIBER subscriber) {
+    if (subscriber->Filter) {
+        ExFreePoolWithTag(subscriber->Filter, NETGUARD_POOL_TAG);
+    }
+    if (subscriber->Mdl) {
+        IoFreeMdl(subscriber->Mdl);
+    }
+    if (subscriber->Section) {
+        ExFreePoolWithTag(subscriber->Section, NETGUARD_POOL_TAG);
+    }
+    ExFreePoolWithTag(subscriber, NETGUARD_POOL_TAG);
+}
+
+// Helper: Remote address rules at one layer, checked by a callout filter
+// ahead of the app rule filters. Blocks or lets evaluation continue; it
+// never permits on its own.
+FORCEINLINE void ClassifyAddress(
+    const CLASSIFY_LAYER* layer,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    KIRQL oldIrql;
+    UINT8 action;
+
+    classifyOut->actionType = FWP_ACTION_CONTINUE;
+
+    if (!g_Context.Enabled || !ReadPointerNoFence((PVOID*)&g_Context.ActiveAddressRules) ||
+        !(classifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
+    }
+
+    const FWP_VALUE0* remoteAddress = &inFixedValues->incomingValue[layer->remoteAddress].value;
+
+    // Lock-free like IsAppInList
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    PADDRESS_TABLE table = (PADDRESS_TABLE)ReadPointerAcquire((PVOID*)&g_Context.ActiveAddressRules);
+    if (!table) {
+        action = ADDRESS_ACTION_NONE;
+    } else if (layer->v6) {
+        action = LookupAddress6(table, remoteAddress->byteArray16->byteArray16);
+    } else {
+        action = LookupAddress4(table, remoteAddress->uint32);
+    }
+    KeLowerIrql(oldIrql);
+
+    if (action != ADDRESS_ACTION_BLOCK) {
+        return;
+    }
+
+    classifyOut->actionType = FWP_ACTION_BLOCK;
+    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    COUNT_STAT(AddressBlockedConnections);
+
+    NETGUARD_EVENT event = {0};
+    event.type = EVENT_TYPE_BLOCK;
+    event.protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+    event.direction = layer->direction;
+    event.verdict = FLOW_VERDICT_BLOCK;
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        event.processId = (UINT32)inMetaValues->processId;
+    }
+    const WCHAR* processPath;
+    SIZE_T pathLength = GetProcessPath(inMetaValues, &processPath);
+    if (pathLength > 0) {
+        event.pathHash = HashProcessPath(processPath, pathLength);
+    }
+    ReadLayerAddress(layer, inFixedValues, layer->localAddress, event.localAddress);
+    ReadLayerAddress(layer, inFixedValues, layer->remoteAddress, event.remoteAddress);
+    event.localPort = inFixedValues->incomingValue[layer->localPort].value.uint16;
+    event.remotePort = inFixedValues->incomingValue[layer->remotePort].value.uint16;
+    PublishEvent(&event);
+}
+
+// WFP address classify functions - one per CLASSIFY_* layer
+void NTAPI NetGuardAddressClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyAddress(&ClassifyConnectV4, inFixedValues, inMetaValues, classifyOut);
+}
+
+void NTAPI NetGuardAddressConnect6Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyAddress(&ClassifyConnectV6, inFixedValues, inMetaValues, classifyOut);
+}
+
+void NTAPI NetGuardAddressAccept4Fn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyAddress(&ClassifyRecvAcceptV4, inFixedValues, inMetaValues, classifyOut);
+}
 
-// WFP Callout functions
-void NTAPI NetGuardClassifyFn(
+void NTAPI NetGuardAddressAccept6Fn(
     const FWPS_INCOMING_VALUES0* inFixedValues,
     const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
     void* layerData,
@@ -99,78 +1166,430 @@ void NTAPI NetGuardClassifyFn(
     const FWPS_FILTER1* filter,
     UINT64 flowContext,
     FWPS_CLASSIFY_OUT0* classifyOut
-);
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    ClassifyAddress(&ClassifyRecvAcceptV6, inFixedValues, inMetaValues, classifyOut);
+}
 
+// WFP Notify function
 NTSTATUS NTAPI NetGuardNotifyFn(
     FWPS_CALLOUT_NOTIFY_TYPE notifyType,
     const GUID* filterKey,
     FWPS_FILTER1* filter
-);
+) {
+    UNREFERENCED_PARAMETER(notifyType);
+    UNREFERENCED_PARAMETER(filterKey);
+    UNREFERENCED_PARAMETER(filter);
+    return STATUS_SUCCESS;
+}
 
-void NTAPI NetGuardFlowDeleteFn(
-    UINT16 layerId,
-    UINT32 calloutId,
-    UINT64 flowContext
-);
+// Helper: Traffic slot of an app, assigning one on first sight. Returns
+// TRAFFIC_APP_NONE when the table is full. Callable at IRQL <= DISPATCH_LEVEL.
+UINT16 FindTrafficApp(UINT64 pathHash, const WCHAR* processPath, SIZE_T pathLength) {
+    PTRAFFIC_APP apps = g_Context.TrafficApps;
+    UINT16 result = TRAFFIC_APP_NONE;
+    KIRQL oldIrql;
 
-// GUIDs for WFP registration
-DEFINE_GUID(NETGUARD_CALLOUT_GUID,
-    0x12345678, 0x1234, 0x1234, 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc);
+    if (!apps || pathLength == 0) {
+        return TRAFFIC_APP_NONE;
+    }
+    if (pathHash == 0) {
+        pathHash = 1; // 0 marks a free slot
+    }
 
-DEFINE_GUID(NETGUARD_SUBLAYER_GUID,
-    0x87654321, 0x4321, 0x4321, 0x43, 0x21, 0xab, 0xcd, 0xef, 0x12, 0x34, 0x56);
+    // Slots are never changed once taken, so known apps are found without
+    // the lock; apps are told apart by hash alone
+    for (UINT32 probe = 0; probe < TRAFFIC_MAX_PROBE; probe++) {
+        UINT32 slot = (UINT32)(pathHash + probe) & (TRAFFIC_APP_SLOTS - 1);
+        UINT64 slotHash = (UINT64)ReadAcquire64((volatile LONG64*)&apps[slot].pathHash);
+        if (slotHash == pathHash) {
+            return (UINT16)slot;
+        }
+        if (slotHash == 0) {
+            break;
+        }
+    }
+
+    KeAcquireSpinLock(&g_Context.TrafficLock, &oldIrql);
+    for (UINT32 probe = 0; probe < TRAFFIC_MAX_PROBE; probe++) {
+        UINT32 slot = (UINT32)(pathHash + probe) & (TRAFFIC_APP_SLOTS - 1);
+        if (apps[slot].pathHash == pathHash) {
+            result = (UINT16)slot;
+            break;
+        }
+        if (apps[slot].pathHash == 0) {
+            apps[slot].pathLength = (UINT16)pathLength;
+            RtlCopyMemory(apps[slot].path, processPath, pathLength * sizeof(WCHAR));
+            WriteRelease64((volatile LONG64*)&apps[slot].pathHash, (LONG64)pathHash);
+            result = (UINT16)slot;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&g_Context.TrafficLock, oldIrql);
+
+    return result;
+}
+
+// Helper: This processor's counters for a traffic slot
+PAPP_BYTES GetAppBytes(UINT16 appIndex) {
+    return &g_Context.CpuAppBytes[(SIZE_T)KeGetCurrentProcessorIndex() * TRAFFIC_APP_SLOTS + appIndex];
+}
+
+// Helper: Count bytes against a flow and its app
+void ChargeFlowBytes(PFLOW_CONTEXT flow, SIZE_T bytesSent, SIZE_T bytesReceived) {
+    if (bytesSent) {
+        InterlockedAdd64(&flow->bytesSent, (LONG64)bytesSent);
+    }
+    if (bytesReceived) {
+        InterlockedAdd64(&flow->bytesReceived, (LONG64)bytesReceived);
+    }
+
+    if (flow->appIndex != TRAFFIC_APP_NONE) {
+        PAPP_BYTES bytes = GetAppBytes(flow->appIndex);
+        if (bytesSent) {
+            InterlockedAdd64(&bytes->bytesSent, (LONG64)bytesSent);
+        }
+        if (bytesReceived) {
+            InterlockedAdd64(&bytes->bytesReceived, (LONG64)bytesReceived);
+        }
+    }
+}
 
-// Helper: Check if process is in allowed/blocked list
-int IsAppInList(PWCHAR processPath, PBOOLEAN isBlocked) {
+// Helper: Write the traffic of every app that changed since the last call
+// to a GET_TRAFFIC output buffer and mark it reported. Returns the number of
+// bytes written.
+ULONG CopyTrafficToBuffer(PVOID buffer, ULONG bufferLength) {
+    PTRAFFIC_BATCH_HEADER header = (PTRAFFIC_BATCH_HEADER)buffer;
+    PUCHAR out = (PUCHAR)buffer + sizeof(TRAFFIC_BATCH_HEADER);
+    ULONG remaining = bufferLength - sizeof(TRAFFIC_BATCH_HEADER);
     KIRQL oldIrql;
-    int found = 0;
 
-    KeAcquireSpinLock(&g_Context.AllowedLock, &oldIrql);
+    RtlZeroMemory(header, sizeof(TRAFFIC_BATCH_HEADER));
+    header->version = TRAFFIC_RECORD_VERSION;
 
-    for (UINT32 i = 0; i < g_Context.AllowedCount; i++) {
-        if (_wcsicmp(g_Context.AllowedApps[i].processPath, processPath) == 0) {
-            *isBlocked = g_Context.AllowedApps[i].blocked;
-            found = 1;
+    KeAcquireSpinLock(&g_Context.TrafficLock, &oldIrql);
+
+    for (UINT32 slot = 0; slot < TRAFFIC_APP_SLOTS; slot++) {
+        PTRAFFIC_APP app = &g_Context.TrafficApps[slot];
+        if (app->pathHash == 0) {
+            continue;
+        }
+
+        APP_BYTES total = {0};
+        for (ULONG cpu = 0; cpu < g_Context.CpuStatsCount; cpu++) {
+            PAPP_BYTES bytes = &g_Context.CpuAppBytes[(SIZE_T)cpu * TRAFFIC_APP_SLOTS + slot];
+            total.bytesSent += ReadNoFence64(&bytes->bytesSent);
+            total.bytesReceived += ReadNoFence64(&bytes->bytesReceived);
+            total.flows += ReadNoFence64(&bytes->flows);
+        }
+
+        PAPP_BYTES reported = &g_Context.TrafficReported[slot];
+        if (total.bytesSent == reported->bytesSent &&
+            total.bytesReceived == reported->bytesReceived &&
+            total.flows == reported->flows) {
+            continue;
+        }
+
+        ULONG recordLength = sizeof(TRAFFIC_RECORD) + app->pathLength * sizeof(WCHAR);
+        if (recordLength > remaining) {
+            header->moreData = TRUE;
             break;
         }
+
+        PTRAFFIC_RECORD record = (PTRAFFIC_RECORD)out;
+        record->recordLength = (UINT16)recordLength;
+        record->bytesSent = (UINT64)(total.bytesSent - reported->bytesSent);
+        record->bytesReceived = (UINT64)(total.bytesReceived - reported->bytesReceived);
+        record->flows = (UINT32)(total.flows - reported->flows);
+        record->pathLength = app->pathLength;
+        RtlCopyMemory(out + sizeof(TRAFFIC_RECORD), app->path, app->pathLength * sizeof(WCHAR));
+        *reported = total;
+
+        out += recordLength;
+        remaining -= recordLength;
+        header->recordCount++;
     }
 
-    KeReleaseSpinLock(&g_Context.AllowedLock, oldIrql);
-    return found;
+    KeReleaseSpinLock(&g_Context.TrafficLock, oldIrql);
+
+    header->totalLength = (UINT32)(out - (PUCHAR)buffer);
+    return header->totalLength;
+}
+
+// Helper: Take a reference on a flow context unless it is already on its
+// way to being freed
+BOOLEAN TryReferenceFlowContext(PFLOW_CONTEXT flow) {
+    LONG count = ReadNoFence(&flow->refCount);
+
+    while (count > 0) {
+        LONG previous = InterlockedCompareExchange(&flow->refCount, count + 1, count);
+        if (previous == count) {
+            return TRUE;
+        }
+        count = previous;
+    }
+    return FALSE;
 }
 
-// Helper: Add pending connection
-UINT64 AddPendingConnection(UINT32 processId, PWCHAR processPath, UINT32 remoteIp, UINT16 remotePort) {
+// Helper: Drop a flow context reference. The last one reports the close,
+// unlinks and frees.
+void ReleaseFlowContext(PFLOW_CONTEXT flow) {
+    if (InterlockedDecrement(&flow->refCount) != 0) {
+        return;
+    }
+
+    if (flow->reported) {
+        NETGUARD_EVENT event = {0};
+        event.type = EVENT_TYPE_CLOSE;
+        event.protocol = flow->protocol;
+        event.direction = flow->direction;
+        event.verdict = (UINT8)flow->verdict;
+        event.processId = flow->processId;
+        event.flowId = flow->flowHandle;
+        RtlCopyMemory(event.localAddress, flow->localAddress, NETGUARD_ADDRESS_LENGTH);
+        RtlCopyMemory(event.remoteAddress, flow->remoteAddress, NETGUARD_ADDRESS_LENGTH);
+        event.localPort = flow->localPort;
+        event.remotePort = flow->remotePort;
+        event.bytesSent = (UINT64)ReadNoFence64(&flow->bytesSent);
+        event.bytesReceived = (UINT64)ReadNoFence64(&flow->bytesReceived);
+        event.pathHash = flow->pathHash;
+        PublishEvent(&event);
+    }
+
     KIRQL oldIrql;
-    UINT64 connectionId = 0;
+    KeAcquireSpinLock(&g_Context.FlowLock, &oldIrql);
+    RemoveEntryList(&flow->listEntry);
+    KeReleaseSpinLock(&g_Context.FlowLock, oldIrql);
+
+    ExFreePoolWithTag(flow, NETGUARD_POOL_TAG);
+}
+
+// Field indices of an ALE_FLOW_ESTABLISHED layer and of the DATAGRAM_DATA
+// layer of the same family, plus the run-time layers a flow of that family
+// is associated with. Indexed by FLOW_FAMILY_*.
+typedef struct _FLOW_LAYER {
+    BOOLEAN v6; // Addresses are FWP_BYTE_ARRAY16, not host-order UINT32
+    UINT16 localAddress;
+    UINT16 localPort;
+    UINT16 remoteAddress;
+    UINT16 remotePort;
+    UINT16 protocol;
+    UINT16 direction;
+    UINT16 datagramDirection;
+    UINT16 datagramRemotePort;
+    UINT16 datagramProtocol;
+    UINT16 connectLayerId;
+    UINT16 streamLayerId;
+    UINT16 datagramLayerId;
+    UINT32 connectClassify; // CLASSIFY_* of connectLayerId
+} FLOW_LAYER;
+
+static const FLOW_LAYER FlowLayers[FLOW_FAMILY_COUNT] = {
+    { FALSE,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_IP_LOCAL_PORT,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_IP_REMOTE_PORT,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_IP_PROTOCOL, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_DIRECTION,
+      FWPS_FIELD_DATAGRAM_DATA_V4_DIRECTION, FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT,
+      FWPS_FIELD_DATAGRAM_DATA_V4_IP_PROTOCOL,
+      FWPS_LAYER_ALE_AUTH_CONNECT_V4, FWPS_LAYER_STREAM_V4, FWPS_LAYER_DATAGRAM_DATA_V4, CLASSIFY_CONNECT_V4 },
+    { TRUE,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_IP_LOCAL_ADDRESS, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_IP_LOCAL_PORT,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_IP_REMOTE_ADDRESS, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_IP_REMOTE_PORT,
+      FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_IP_PROTOCOL, FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_DIRECTION,
+      FWPS_FIELD_DATAGRAM_DATA_V6_DIRECTION, FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT,
+      FWPS_FIELD_DATAGRAM_DATA_V6_IP_PROTOCOL,
+      FWPS_LAYER_ALE_AUTH_CONNECT_V6, FWPS_LAYER_STREAM_V6, FWPS_LAYER_DATAGRAM_DATA_V6, CLASSIFY_CONNECT_V6 },
+};
+
+// Helper: Copy an address field of a FLOW_LAYER in NETGUARD_ADDRESS_LENGTH form
+FORCEINLINE void ReadFlowAddress(const FLOW_LAYER* layer, const FWPS_INCOMING_VALUES0* inFixedValues,
+                                 UINT16 field, UINT8* address) {
+    if (layer->v6) {
+        RtlCopyMemory(address, inFixedValues->incomingValue[field].value.byteArray16->byteArray16,
+                      NETGUARD_ADDRESS_LENGTH);
+    } else {
+        MapAddress4(inFixedValues->incomingValue[field].value.uint32, address);
+    }
+}
+
+// Helper: Layer and callout of a FLOW_ASSOC_* association, in the flow's
+// address family
+void GetFlowAssociationTarget(PFLOW_CONTEXT flow, LONG association, UINT16* layerId, UINT32* calloutId) {
+    const FLOW_LAYER* layer = &FlowLayers[flow->family];
+
+    switch (association) {
+        case FLOW_ASSOC_STREAM:
+            *layerId = layer->streamLayerId;
+            *calloutId = g_Context.StreamCalloutIds[flow->family];
+            break;
+        case FLOW_ASSOC_DATAGRAM:
+            *layerId = layer->datagramLayerId;
+            *calloutId = g_Context.DatagramCalloutIds[flow->family];
+            break;
+        default:
+            *layerId = layer->connectLayerId;
+            *calloutId = g_Context.CalloutIds[layer->connectClassify];
+            break;
+    }
+}
+
+// Helper: Associate a flow context with one more layer, taking the
+// reference that layer's NetGuardFlowDeleteFn will drop
+void AssociateFlowContext(PFLOW_CONTEXT flow, LONG association) {
+    UINT16 layerId;
+    UINT32 calloutId;
+
+    GetFlowAssociationTarget(flow, association, &layerId, &calloutId);
+    if (calloutId == 0) {
+        return;
+    }
+
+    InterlockedIncrement(&flow->refCount);
+    InterlockedOr(&flow->associations, association);
+
+    if (!NT_SUCCESS(FwpsFlowAssociateContext0(flow->flowHandle, layerId, calloutId, (UINT64)flow))) {
+        InterlockedAnd(&flow->associations, ~association);
+        InterlockedDecrement(&flow->refCount); // The setup reference is still held
+    }
+}
+
+// WFP Flow Delete function - called once per layer the context was
+// associated with
+void NTAPI NetGuardFlowDeleteFn(
+    UINT16 layerId,
+    UINT32 calloutId,
+    UINT64 flowContext
+) {
+    UNREFERENCED_PARAMETER(calloutId);
 
-    KeAcquireSpinLock(&g_Context.PendingLock, &oldIrql);
+    PFLOW_CONTEXT flow = (PFLOW_CONTEXT)flowContext;
+    if (!flow) {
+        return;
+    }
+
+    if (layerId == FWPS_LAYER_STREAM_V4 || layerId == FWPS_LAYER_STREAM_V6) {
+        ReleaseHeldStreamData(flow);
+    }
+    ReleaseFlowContext(flow);
+}
+
+// Helper: Attach a FLOW_CONTEXT to a new flow at one ALE_FLOW_ESTABLISHED
+// layer, so later reauthorizations at ALE_AUTH_CONNECT can skip the rule
+// lookup and the data layers can count and limit its bytes
+FORCEINLINE void FlowEstablished(
+    UINT8 family,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    const FLOW_LAYER* layer = &FlowLayers[family];
+
+    // Inspection only
+    classifyOut->actionType = FWP_ACTION_CONTINUE;
+
+    // Flows are tracked while filtering is on or someone reads the event rings
+    if ((!g_Context.Enabled && !ReadNoFence(&g_Context.EventSubscriberCount)) ||
+        !FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_FLOW_HANDLE) ||
+        !FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        return;
+    }
 
-    if (g_Context.PendingCount < MAX_PENDING_CONNECTIONS) {
-        PPENDING_CONNECTION conn = &g_Context.PendingConnections[g_Context.PendingCount];
+    UINT32 processId = (UINT32)inMetaValues->processId;
+    if (processId == 0 || processId == 4) {
+        return;
+    }
 
-        conn->connectionId = InterlockedIncrement64((PLONG64)&g_Context.TotalConnections);
-        conn->processId = processId;
-        wcsncpy(conn->processPath, processPath, MAX_PATH_LENGTH - 1);
-        conn->remoteIp = remoteIp;
-        conn->remotePort = remotePort;
-        KeQuerySystemTime(&conn->timestamp);
-        conn->responded = FALSE;
-        conn->allowed = FALSE;
+    PFLOW_CONTEXT flow = (PFLOW_CONTEXT)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(FLOW_CONTEXT), NETGUARD_POOL_TAG);
+    if (!flow) {
+        return;
+    }
 
-        connectionId = conn->connectionId;
-        g_Context.PendingCount++;
+    flow->flowHandle = inMetaValues->flowHandle;
+    flow->refCount = 1; // Setup reference, dropped at the end
+    flow->processId = processId;
+    flow->verdict = FLOW_VERDICT_UNKNOWN;
+    flow->appIndex = TRAFFIC_APP_NONE;
+    flow->family = family;
+    ReadFlowAddress(layer, inFixedValues, layer->localAddress, flow->localAddress);
+    ReadFlowAddress(layer, inFixedValues, layer->remoteAddress, flow->remoteAddress);
+    flow->localPort = inFixedValues->incomingValue[layer->localPort].value.uint16;
+    flow->remotePort = inFixedValues->incomingValue[layer->remotePort].value.uint16;
+    flow->protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+    flow->direction = (UINT8)inFixedValues->incomingValue[layer->direction].value.uint32;
+
+    // Record the verdict once per flow; an unknown app stays UNKNOWN so its
+    // reauthorizations still go through the pending path
+    const WCHAR* processPath;
+    SIZE_T pathLength = GetProcessPath(inMetaValues, &processPath);
+    if (pathLength > 0) {
+        BOOLEAN isBlocked = FALSE;
+        flow->ruleGeneration = ReadNoFence(&g_Context.RuleGeneration);
+        flow->pathHash = HashProcessPath(processPath, pathLength);
+        if (IsAppInList(processPath, pathLength, flow->pathHash, &isBlocked)) {
+            flow->verdict = isBlocked ? FLOW_VERDICT_BLOCK : FLOW_VERDICT_ALLOW;
+        }
+        flow->appIndex = FindTrafficApp(flow->pathHash, processPath, pathLength);
+        SetFlowRateLimit(flow, processPath, pathLength);
+    }
 
-        // Signal user-mode that there's a pending connection
-        KeSetEvent(&g_Context.PendingEvent, IO_NO_INCREMENT, FALSE);
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&g_Context.FlowLock, &oldIrql);
+    InsertTailList(&g_Context.FlowList, &flow->listEntry);
+    KeReleaseSpinLock(&g_Context.FlowLock, oldIrql);
+
+    AssociateFlowContext(flow, FLOW_ASSOC_CONNECT);
+    AssociateFlowContext(flow, flow->protocol == IPPROTO_TCP ? FLOW_ASSOC_STREAM : FLOW_ASSOC_DATAGRAM);
+
+    // Only flows that will get a CLOSE are reported. The setup reference
+    // keeps the CLOSE from overtaking the CONNECT.
+    if (ReadNoFence(&flow->associations)) {
+        flow->reported = TRUE;
+
+        NETGUARD_EVENT event = {0};
+        event.type = EVENT_TYPE_CONNECT;
+        event.protocol = flow->protocol;
+        event.direction = flow->direction;
+        event.verdict = (UINT8)flow->verdict;
+        event.processId = flow->processId;
+        event.flowId = flow->flowHandle;
+        RtlCopyMemory(event.localAddress, flow->localAddress, NETGUARD_ADDRESS_LENGTH);
+        RtlCopyMemory(event.remoteAddress, flow->remoteAddress, NETGUARD_ADDRESS_LENGTH);
+        event.localPort = flow->localPort;
+        event.remotePort = flow->remotePort;
+        event.pathHash = flow->pathHash;
+        PublishEvent(&event);
+
+        if (flow->appIndex != TRAFFIC_APP_NONE) {
+            InterlockedIncrement64(&GetAppBytes(flow->appIndex)->flows);
+        }
     }
 
-    KeReleaseSpinLock(&g_Context.PendingLock, oldIrql);
-    return connectionId;
+    ReleaseFlowContext(flow);
+}
+
+// WFP Flow Established functions, one per address family
+void NTAPI NetGuardFlowEstablishedFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(layerData);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+    UNREFERENCED_PARAMETER(flowContext);
+
+    FlowEstablished(FLOW_FAMILY_V4, inFixedValues, inMetaValues, classifyOut);
 }
 
-// WFP Classify function - called for each connection
-void NTAPI NetGuardClassifyFn(
+void NTAPI NetGuardFlowEstablished6Fn(
     const FWPS_INCOMING_VALUES0* inFixedValues,
     const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
     void* layerData,
@@ -184,91 +1603,321 @@ void NTAPI NetGuardClassifyFn(
     UNREFERENCED_PARAMETER(filter);
     UNREFERENCED_PARAMETER(flowContext);
 
-    // Default: permit
-    classifyOut->actionType = FWP_ACTION_PERMIT;
+    FlowEstablished(FLOW_FAMILY_V6, inFixedValues, inMetaValues, classifyOut);
+}
+
+// WFP Stream classify function - counts TCP payload per flow, and holds
+// back the data of apps over their rate limit
+void NTAPI NetGuardStreamClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(inFixedValues);
+    UNREFERENCED_PARAMETER(inMetaValues);
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    // Data passes untouched unless ShapeStreamData says otherwise
+    classifyOut->actionType = FWP_ACTION_CONTINUE;
 
-    if (!g_Context.Enabled) {
+    FWPS_STREAM_CALLOUT_IO_PACKET0* packet = (FWPS_STREAM_CALLOUT_IO_PACKET0*)layerData;
+    if (!packet) {
         return;
     }
+    packet->streamAction = FWPS_STREAM_ACTION_NONE;
 
-    // Get process ID
-    UINT32 processId = 0;
-    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
-        processId = (UINT32)inMetaValues->processId;
+    PFLOW_CONTEXT flow = (PFLOW_CONTEXT)flowContext;
+    if (!flow || !packet->streamData || !ShapeStreamData(flow, packet, classifyOut)) {
+        return;
     }
 
-    // Get remote IP and port
-    UINT32 remoteIp = inFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_ADDRESS].value.uint32;
-    UINT16 remotePort = inFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT].value.uint16;
+    SIZE_T bytes = packet->streamData->dataLength;
+    if (packet->streamData->flags & FWPS_STREAM_FLAG_SEND) {
+        ChargeFlowBytes(flow, bytes, 0);
+    } else if (packet->streamData->flags & FWPS_STREAM_FLAG_RECEIVE) {
+        ChargeFlowBytes(flow, 0, bytes);
+    }
+}
 
-    // Get process path
-    WCHAR processPath[MAX_PATH_LENGTH] = {0};
-    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_PROCESS_PATH)) {
-        if (inMetaValues->processPath && inMetaValues->processPath->size > 0) {
-            UINT32 copyLen = min(inMetaValues->processPath->size, (MAX_PATH_LENGTH - 1) * sizeof(WCHAR));
-            RtlCopyMemory(processPath, inMetaValues->processPath->data, copyLen);
-        }
+// Helper: Hand an inbound DNS response to the name cache. The datagram
+// starts at the UDP header, headerSize bytes long; only the first
+// DNS_MAX_MESSAGE bytes of the message are looked at.
+void InspectDnsResponse(PNET_BUFFER_LIST nbl, ULONG headerSize) {
+    UCHAR storage[DNS_MAX_MESSAGE + 8];
+    PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+
+    ULONG length = NET_BUFFER_DATA_LENGTH(nb);
+    if (headerSize > 8 || length <= headerSize) {
+        return;
     }
+    length = min(length, headerSize + DNS_MAX_MESSAGE);
 
-    // Skip system processes
-    if (processId == 0 || processId == 4) {
+    PUCHAR data = (PUCHAR)NdisGetDataBuffer(nb, length, storage, 1, 0);
+    if (data) {
+        ParseDnsResponse(data + headerSize, length - headerSize);
+    }
+}
+
+// Helper: Count the UDP (and other non-TCP) payload of a flow at one
+// DATAGRAM_DATA layer, drop datagrams of apps over their rate limit, and
+// feed inbound DNS responses to the name cache
+FORCEINLINE void ClassifyDatagram(
+    UINT8 family,
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    const FLOW_LAYER* layer = &FlowLayers[family];
+
+    classifyOut->actionType = FWP_ACTION_CONTINUE;
+
+    PFLOW_CONTEXT flow = (PFLOW_CONTEXT)flowContext;
+    if (!layerData) {
         return;
     }
 
-    // Check if app is in allowed/blocked list
-    BOOLEAN isBlocked = FALSE;
-    if (IsAppInList(processPath, &isBlocked)) {
-        if (isBlocked) {
-            classifyOut->actionType = FWP_ACTION_BLOCK;
-            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-            InterlockedIncrement64((PLONG64)&g_Context.BlockedConnections);
-        } else {
-            InterlockedIncrement64((PLONG64)&g_Context.AllowedConnections);
+    // Inbound data starts at the transport header, outbound at the payload
+    BOOLEAN inbound = inFixedValues->incomingValue[layer->datagramDirection].value.uint32 ==
+                      FWP_DIRECTION_INBOUND;
+    ULONG headerSize = 0;
+    if (inbound && FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE)) {
+        headerSize = inMetaValues->transportHeaderSize;
+    }
+
+    if (inbound && headerSize > 0 &&
+        inFixedValues->incomingValue[layer->datagramRemotePort].value.uint16 == 53 &&
+        inFixedValues->incomingValue[layer->datagramProtocol].value.uint8 == IPPROTO_UDP) {
+        InspectDnsResponse((PNET_BUFFER_LIST)layerData, headerSize);
+    }
+
+    if (!flow) {
+        return;
+    }
+
+    SIZE_T bytes = 0;
+    for (PNET_BUFFER_LIST nbl = (PNET_BUFFER_LIST)layerData; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+        for (PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb)) {
+            ULONG length = NET_BUFFER_DATA_LENGTH(nb);
+            bytes += length > headerSize ? length - headerSize : 0;
         }
+    }
+
+    // Over the app's limit: drop it silently, as a congested link would
+    if ((classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) &&
+        !ConsumeAppTokens(flow->appIndex, inbound ? RATE_RECEIVE : RATE_SEND, bytes)) {
+        classifyOut->actionType = FWP_ACTION_BLOCK;
+        classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
+        classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+        COUNT_STAT(RateDroppedDatagrams);
+        InterlockedAdd64(&g_Context.CpuStats[KeGetCurrentProcessorIndex()].RateDroppedBytes, (LONG64)bytes);
         return;
     }
 
-    // Unknown app - add to pending and block temporarily
-    UINT64 connId = AddPendingConnection(processId, processPath, remoteIp, remotePort);
-    if (connId > 0) {
-        // Block the connection until user responds
-        classifyOut->actionType = FWP_ACTION_BLOCK;
-        classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    if (inbound) {
+        ChargeFlowBytes(flow, 0, bytes);
+    } else {
+        ChargeFlowBytes(flow, bytes, 0);
+    }
+}
+
+// WFP Datagram classify functions, one per address family
+void NTAPI NetGuardDatagramClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyDatagram(FLOW_FAMILY_V4, inFixedValues, inMetaValues, layerData, flowContext, classifyOut);
+}
+
+void NTAPI NetGuardDatagram6ClassifyFn(
+    const FWPS_INCOMING_VALUES0* inFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* inMetaValues,
+    void* layerData,
+    const void* classifyContext,
+    const FWPS_FILTER1* filter,
+    UINT64 flowContext,
+    FWPS_CLASSIFY_OUT0* classifyOut
+) {
+    UNREFERENCED_PARAMETER(classifyContext);
+    UNREFERENCED_PARAMETER(filter);
+
+    ClassifyDatagram(FLOW_FAMILY_V6, inFixedValues, inMetaValues, layerData, flowContext, classifyOut);
+}
+
+// Helper: Detach every flow context so the callouts can be unregistered.
+// FwpsFlowRemoveContext0 calls NetGuardFlowDeleteFn for each layer, and the
+// last reference unlinks and frees.
+void RemoveAllFlowContexts(void) {
+    for (;;) {
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&g_Context.FlowLock, &oldIrql);
+
+        if (IsListEmpty(&g_Context.FlowList)) {
+            KeReleaseSpinLock(&g_Context.FlowLock, oldIrql);
+            break;
+        }
+
+        PFLOW_CONTEXT flow = CONTAINING_RECORD(RemoveHeadList(&g_Context.FlowList), FLOW_CONTEXT, listEntry);
+        InitializeListHead(&flow->listEntry);
+        if (!TryReferenceFlowContext(flow)) {
+            // Already being freed; its unlink is now a no-op
+            KeReleaseSpinLock(&g_Context.FlowLock, oldIrql);
+            continue;
+        }
+        UINT64 flowHandle = flow->flowHandle;
+        LONG associations = ReadNoFence(&flow->associations);
+
+        KeReleaseSpinLock(&g_Context.FlowLock, oldIrql);
+
+        for (LONG association = FLOW_ASSOC_CONNECT; association <= FLOW_ASSOC_DATAGRAM; association <<= 1) {
+            if (associations & association) {
+                UINT16 layerId;
+                UINT32 calloutId;
+                GetFlowAssociationTarget(flow, association, &layerId, &calloutId);
+                FwpsFlowRemoveContext0(flowHandle, layerId, calloutId);
+            }
+        }
+
+        ReleaseFlowContext(flow);
+    }
+}
+
+// Helper: Register a callout with the filter engine, add it to its layer and
+// add a single match-all filter in the NetGuard sublayer that invokes it.
+// Filters with a higher weight are evaluated first.
+NTSTATUS AddCalloutAndFilter(
+    const GUID* calloutKey,
+    const GUID* layerKey,
+    FWPS_CALLOUT_CLASSIFY_FN1 classifyFn,
+    FWP_ACTION_TYPE filterAction,
+    UINT8 weight,
+    PWCHAR name,
+    UINT32* calloutId,
+    UINT64* filterId
+) {
+    NTSTATUS status;
+    FWPS_CALLOUT1 callout = {0};
+    FWPM_CALLOUT0 mCallout = {0};
+    FWPM_FILTER0 filter = {0};
+
+    // Register callout with WFP kernel
+    callout.calloutKey = *calloutKey;
+    callout.classifyFn = classifyFn;
+    callout.notifyFn = NetGuardNotifyFn;
+    callout.flowDeleteFn = NetGuardFlowDeleteFn;
+
+    status = FwpsCalloutRegister1(g_Context.DeviceObject, &callout, calloutId);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Add callout to management layer
+    mCallout.calloutKey = *calloutKey;
+    mCallout.displayData.name = name;
+    mCallout.displayData.description = L"Callout for NetGuard connection filtering";
+    mCallout.applicableLayer = *layerKey;
+
+    status = FwpmCalloutAdd0(g_Context.EngineHandle, &mCallout, NULL, NULL);
+    if (!NT_SUCCESS(status) && status != STATUS_FWP_ALREADY_EXISTS) {
+        FwpsCalloutUnregisterById0(*calloutId);
+        *calloutId = 0;
+        return status;
+    }
+
+    // Add filter
+    filter.layerKey = *layerKey;
+    filter.subLayerKey = NETGUARD_SUBLAYER_GUID;
+    filter.displayData.name = name;
+    filter.displayData.description = L"Filter for NetGuard connection control";
+    filter.action.type = filterAction;
+    filter.action.calloutKey = *calloutKey;
+    filter.weight.type = FWP_UINT8;
+    filter.weight.uint8 = weight;
+    filter.numFilterConditions = 0; // Match all connections
+
+    status = FwpmFilterAdd0(g_Context.EngineHandle, &filter, NULL, filterId);
+    if (!NT_SUCCESS(status)) {
+        FwpsCalloutUnregisterById0(*calloutId);
+        *calloutId = 0;
+        return status;
     }
-}
 
-// WFP Notify function
-NTSTATUS NTAPI NetGuardNotifyFn(
-    FWPS_CALLOUT_NOTIFY_TYPE notifyType,
-    const GUID* filterKey,
-    FWPS_FILTER1* filter
-) {
-    UNREFERENCED_PARAMETER(notifyType);
-    UNREFERENCED_PARAMETER(filterKey);
-    UNREFERENCED_PARAMETER(filter);
     return STATUS_SUCCESS;
 }
 
-// WFP Flow Delete function
-void NTAPI NetGuardFlowDeleteFn(
-    UINT16 layerId,
-    UINT32 calloutId,
-    UINT64 flowContext
-) {
-    UNREFERENCED_PARAMETER(layerId);
-    UNREFERENCED_PARAMETER(calloutId);
-    UNREFERENCED_PARAMETER(flowContext);
-}
+// The ALE authorization layers the decision and address callouts cover,
+// indexed by CLASSIFY_*
+typedef struct _CLASSIFY_REGISTRATION {
+    const GUID* layerKey;
+    const GUID* calloutKey;
+    const GUID* addressCalloutKey;
+    FWPS_CALLOUT_CLASSIFY_FN1 classifyFn;
+    FWPS_CALLOUT_CLASSIFY_FN1 addressClassifyFn;
+} CLASSIFY_REGISTRATION;
+
+static const CLASSIFY_REGISTRATION ClassifyRegistrations[CLASSIFY_LAYER_COUNT] = {
+    { &FWPM_LAYER_ALE_AUTH_CONNECT_V4, &NETGUARD_CALLOUT_GUID, &NETGUARD_ADDRESS_CALLOUT_GUID,
+      NetGuardClassifyFn, NetGuardAddressClassifyFn },
+    { &FWPM_LAYER_ALE_AUTH_CONNECT_V6, &NETGUARD_CONNECT6_CALLOUT_GUID, &NETGUARD_ADDRESS_CONNECT6_CALLOUT_GUID,
+      NetGuardClassifyConnect6Fn, NetGuardAddressConnect6Fn },
+    { &FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4, &NETGUARD_ACCEPT4_CALLOUT_GUID, &NETGUARD_ADDRESS_ACCEPT4_CALLOUT_GUID,
+      NetGuardClassifyAccept4Fn, NetGuardAddressAccept4Fn },
+    { &FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V6, &NETGUARD_ACCEPT6_CALLOUT_GUID, &NETGUARD_ADDRESS_ACCEPT6_CALLOUT_GUID,
+      NetGuardClassifyAccept6Fn, NetGuardAddressAccept6Fn },
+};
+
+// The listen callouts, indexed like ListenCalloutIds
+typedef struct _LISTEN_REGISTRATION {
+    const GUID* layerKey;
+    const GUID* calloutKey;
+    FWPS_CALLOUT_CLASSIFY_FN1 classifyFn;
+} LISTEN_REGISTRATION;
+
+static const LISTEN_REGISTRATION ListenRegistrations[LISTEN_LAYER_COUNT] = {
+    { &FWPM_LAYER_ALE_AUTH_LISTEN_V4, &NETGUARD_LISTEN4_CALLOUT_GUID, NetGuardListen4Fn },
+    { &FWPM_LAYER_ALE_AUTH_LISTEN_V6, &NETGUARD_LISTEN6_CALLOUT_GUID, NetGuardListen6Fn },
+};
+
+// The flow-established and data layer callouts, indexed by FLOW_FAMILY_*
+typedef struct _FLOW_REGISTRATION {
+    const GUID* flowLayerKey;
+    const GUID* flowCalloutKey;
+    FWPS_CALLOUT_CLASSIFY_FN1 flowClassifyFn;
+    const GUID* streamLayerKey;
+    const GUID* streamCalloutKey;
+    const GUID* datagramLayerKey;
+    const GUID* datagramCalloutKey;
+    FWPS_CALLOUT_CLASSIFY_FN1 datagramClassifyFn;
+} FLOW_REGISTRATION;
+
+static const FLOW_REGISTRATION FlowRegistrations[FLOW_FAMILY_COUNT] = {
+    { &FWPM_LAYER_ALE_FLOW_ESTABLISHED_V4, &NETGUARD_FLOW_CALLOUT_GUID, NetGuardFlowEstablishedFn,
+      &FWPM_LAYER_STREAM_V4, &NETGUARD_STREAM_CALLOUT_GUID,
+      &FWPM_LAYER_DATAGRAM_DATA_V4, &NETGUARD_DATAGRAM_CALLOUT_GUID, NetGuardDatagramClassifyFn },
+    { &FWPM_LAYER_ALE_FLOW_ESTABLISHED_V6, &NETGUARD_FLOW6_CALLOUT_GUID, NetGuardFlowEstablished6Fn,
+      &FWPM_LAYER_STREAM_V6, &NETGUARD_STREAM6_CALLOUT_GUID,
+      &FWPM_LAYER_DATAGRAM_DATA_V6, &NETGUARD_DATAGRAM6_CALLOUT_GUID, NetGuardDatagram6ClassifyFn },
+};
 
 // Register WFP callout
 NTSTATUS RegisterWfpCallout(void) {
     NTSTATUS status;
     FWPM_SESSION0 session = {0};
     FWPM_SUBLAYER0 sublayer = {0};
-    FWPS_CALLOUT1 callout = {0};
-    FWPM_CALLOUT0 mCallout = {0};
-    FWPM_FILTER0 filter = {0};
-    FWPM_FILTER_CONDITION0 condition = {0};
 
     // Open WFP engine
     session.flags = FWPM_SESSION_FLAG_DYNAMIC;
@@ -287,51 +1936,96 @@ NTSTATUS RegisterWfpCallout(void) {
     status = FwpmSubLayerAdd0(g_Context.EngineHandle, &sublayer, NULL);
     if (!NT_SUCCESS(status) && status != STATUS_FWP_ALREADY_EXISTS) {
         FwpmEngineClose0(g_Context.EngineHandle);
+        g_Context.EngineHandle = NULL;
         return status;
     }
 
-    // Register callout with WFP kernel
-    callout.calloutKey = NETGUARD_CALLOUT_GUID;
-    callout.classifyFn = NetGuardClassifyFn;
-    callout.notifyFn = NetGuardNotifyFn;
-    callout.flowDeleteFn = NetGuardFlowDeleteFn;
+    // Loopback traffic never needs a decision; keep it away from the callouts
+    FWPM_FILTER_CONDITION0 loopback = {0};
+    loopback.fieldKey = FWPM_CONDITION_FLAGS;
+    loopback.matchType = FWP_MATCH_FLAGS_ALL_SET;
+    loopback.conditionValue.type = FWP_UINT32;
+    loopback.conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
+
+    for (UINT32 i = 0; i < CLASSIFY_LAYER_COUNT; i++) {
+        const CLASSIFY_REGISTRATION* layer = &ClassifyRegistrations[i];
+
+        // Connect or accept authorization: the allow/block/ask decision
+        status = AddCalloutAndFilter(layer->calloutKey, layer->layerKey,
+                                     layer->classifyFn, FWP_ACTION_CALLOUT_TERMINATING, 0x1,
+                                     L"NetGuard Filter", &g_Context.CalloutIds[i], &g_Context.FilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
 
-    status = FwpsCalloutRegister1(g_Context.DeviceObject, &callout, &g_Context.CalloutId);
-    if (!NT_SUCCESS(status)) {
-        FwpmEngineClose0(g_Context.EngineHandle);
-        return status;
+        // Remote address rules, between the loopback filter and the app rule
+        // filters (weights 0xF, 0xE, 0xD; the decision callout is 0x1)
+        status = AddCalloutAndFilter(layer->addressCalloutKey, layer->layerKey,
+                                     layer->addressClassifyFn, FWP_ACTION_CALLOUT_TERMINATING, 0xE,
+                                     L"NetGuard Address Filter", &g_Context.AddressCalloutIds[i],
+                                     &g_Context.AddressFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
+
+        status = AddConditionFilter(layer->layerKey, FWP_ACTION_PERMIT, 0xF, FWPM_FILTER_FLAG_NONE, &loopback,
+                                    L"NetGuard Loopback Filter", &g_Context.LoopbackFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
     }
 
-    // Add callout to management layer
-    mCallout.calloutKey = NETGUARD_CALLOUT_GUID;
-    mCallout.displayData.name = L"NetGuard Callout";
-    mCallout.displayData.description = L"Callout for NetGuard connection filtering";
-    mCallout.applicableLayer = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
+    // Flow established: attaches per-flow verdict records
+    for (UINT32 i = 0; i < FLOW_FAMILY_COUNT; i++) {
+        const FLOW_REGISTRATION* layer = &FlowRegistrations[i];
+        status = AddCalloutAndFilter(layer->flowCalloutKey, layer->flowLayerKey,
+                                     layer->flowClassifyFn, FWP_ACTION_CALLOUT_INSPECTION, 0x1,
+                                     L"NetGuard Flow Filter", &g_Context.FlowCalloutIds[i],
+                                     &g_Context.FlowFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
+    }
 
-    status = FwpmCalloutAdd0(g_Context.EngineHandle, &mCallout, NULL, NULL);
-    if (!NT_SUCCESS(status) && status != STATUS_FWP_ALREADY_EXISTS) {
-        FwpsCalloutUnregisterById0(g_Context.CalloutId);
-        FwpmEngineClose0(g_Context.EngineHandle);
-        return status;
+    // Listen authorization: LISTEN events only, so listeners on watched
+    // ports are reported without polling the TCP table
+    for (UINT32 i = 0; i < LISTEN_LAYER_COUNT; i++) {
+        const LISTEN_REGISTRATION* layer = &ListenRegistrations[i];
+        status = AddCalloutAndFilter(layer->calloutKey, layer->layerKey,
+                                     layer->classifyFn, FWP_ACTION_CALLOUT_INSPECTION, 0x1,
+                                     L"NetGuard Listen Filter", &g_Context.ListenCalloutIds[i],
+                                     &g_Context.ListenFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
     }
 
-    // Add filter
-    filter.filterKey = {0};
-    filter.layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-    filter.subLayerKey = NETGUARD_SUBLAYER_GUID;
-    filter.displayData.name = L"NetGuard Filter";
-    filter.displayData.description = L"Filter for NetGuard connection control";
-    filter.action.type = FWP_ACTION_CALLOUT_TERMINATING;
-    filter.action.calloutKey = NETGUARD_CALLOUT_GUID;
-    filter.weight.type = FWP_UINT8;
-    filter.weight.uint8 = 0xF;
-    filter.numFilterConditions = 0; // Match all connections
+    // Data layers: per-flow byte counts for flows carrying a context, and
+    // rate limits, which need to block and absorb
+    for (UINT32 i = 0; i < FLOW_FAMILY_COUNT; i++) {
+        const FLOW_REGISTRATION* layer = &FlowRegistrations[i];
+        status = AddCalloutAndFilter(layer->streamCalloutKey, layer->streamLayerKey,
+                                     NetGuardStreamClassifyFn, FWP_ACTION_CALLOUT_UNKNOWN, 0x1,
+                                     L"NetGuard Stream Filter", &g_Context.StreamCalloutIds[i],
+                                     &g_Context.StreamFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
 
-    status = FwpmFilterAdd0(g_Context.EngineHandle, &filter, NULL, &g_Context.FilterId);
-    if (!NT_SUCCESS(status)) {
-        FwpsCalloutUnregisterById0(g_Context.CalloutId);
-        FwpmEngineClose0(g_Context.EngineHandle);
-        return status;
+        status = AddCalloutAndFilter(layer->datagramCalloutKey, layer->datagramLayerKey,
+                                     layer->datagramClassifyFn, FWP_ACTION_CALLOUT_UNKNOWN, 0x1,
+                                     L"NetGuard Datagram Filter", &g_Context.DatagramCalloutIds[i],
+                                     &g_Context.DatagramFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            UnregisterWfpCallout();
+            return status;
+        }
     }
 
     return STATUS_SUCCESS;
@@ -339,30 +2033,169 @@ NTSTATUS RegisterWfpCallout(void) {
 
 // Unregister WFP callout
 NTSTATUS UnregisterWfpCallout(void) {
-    if (g_Context.FilterId) {
-        FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.FilterId);
+    AcquireRuleLock();
+    SyncAppFilters(FALSE);
+    ReleaseRuleLock();
+
+    for (UINT32 i = 0; i < CLASSIFY_LAYER_COUNT; i++) {
+        if (g_Context.LoopbackFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.LoopbackFilterIds[i]);
+            g_Context.LoopbackFilterIds[i] = 0;
+        }
+        if (g_Context.AddressFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.AddressFilterIds[i]);
+            g_Context.AddressFilterIds[i] = 0;
+        }
+        if (g_Context.FilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.FilterIds[i]);
+            g_Context.FilterIds[i] = 0;
+        }
+    }
+    for (UINT32 i = 0; i < LISTEN_LAYER_COUNT; i++) {
+        if (g_Context.ListenFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.ListenFilterIds[i]);
+            g_Context.ListenFilterIds[i] = 0;
+        }
+    }
+    for (UINT32 i = 0; i < FLOW_FAMILY_COUNT; i++) {
+        if (g_Context.DatagramFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.DatagramFilterIds[i]);
+            g_Context.DatagramFilterIds[i] = 0;
+        }
+        if (g_Context.StreamFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.StreamFilterIds[i]);
+            g_Context.StreamFilterIds[i] = 0;
+        }
+        if (g_Context.FlowFilterIds[i]) {
+            FwpmFilterDeleteById0(g_Context.EngineHandle, g_Context.FlowFilterIds[i]);
+            g_Context.FlowFilterIds[i] = 0;
+        }
+    }
+
+    // No new flows get contexts once the filters are gone, and no held data
+    // is retried once the timer is stopped
+    StopRateLimits();
+    RemoveAllFlowContexts();
+
+    for (UINT32 i = 0; i < FLOW_FAMILY_COUNT; i++) {
+        if (g_Context.DatagramCalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.DatagramCalloutIds[i]);
+            g_Context.DatagramCalloutIds[i] = 0;
+        }
+        if (g_Context.StreamCalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.StreamCalloutIds[i]);
+            g_Context.StreamCalloutIds[i] = 0;
+        }
+        if (g_Context.FlowCalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.FlowCalloutIds[i]);
+            g_Context.FlowCalloutIds[i] = 0;
+        }
+    }
+    for (UINT32 i = 0; i < LISTEN_LAYER_COUNT; i++) {
+        if (g_Context.ListenCalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.ListenCalloutIds[i]);
+            g_Context.ListenCalloutIds[i] = 0;
+        }
     }
-    if (g_Context.CalloutId) {
-        FwpsCalloutUnregisterById0(g_Context.CalloutId);
+    for (UINT32 i = 0; i < CLASSIFY_LAYER_COUNT; i++) {
+        if (g_Context.AddressCalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.AddressCalloutIds[i]);
+            g_Context.AddressCalloutIds[i] = 0;
+        }
+        if (g_Context.CalloutIds[i]) {
+            FwpsCalloutUnregisterById0(g_Context.CalloutIds[i]);
+            g_Context.CalloutIds[i] = 0;
+        }
     }
     if (g_Context.EngineHandle) {
         FwpmEngineClose0(g_Context.EngineHandle);
+        g_Context.EngineHandle = NULL;
+    }
+    return STATUS_SUCCESS;
+}
+
+// Helper: Register the callouts, once, and install the boot policy's app
+// filters if it enabled filtering. Called by DriverEntry and by the BFE
+// state callback, whichever sees BFE running first.
+NTSTATUS StartWfp(void) {
+    if (InterlockedCompareExchange(&g_Context.WfpRegistered, 1, 0) != 0) {
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS status = RegisterWfpCallout();
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&g_Context.WfpRegistered, 0);
+        return status;
+    }
+
+    if (g_Context.Enabled) {
+        AcquireRuleLock();
+        SyncAppFilters(TRUE);
+        ReleaseRuleLock();
     }
     return STATUS_SUCCESS;
 }
 
-// Device Create handler
+// BFE state callback: a driver that starts before BFE (start=auto) cannot
+// open the engine yet, so it registers its callouts here once BFE is running
+void NetGuardBfeStateChange(void* context, FWPM_SERVICE_STATE newState) {
+    UNREFERENCED_PARAMETER(context);
+
+    if (newState == FWPM_SERVICE_RUNNING) {
+        StartWfp();
+    }
+}
+
+// Device Create handler - gives the new handle its event subscriber state
 NTSTATUS NetGuardCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     UNREFERENCED_PARAMETER(DeviceObject);
+
+    PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    fileObject->FsContext = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(EVENT_SUBSCRIBER), NETGUARD_POOL_TAG);
+    if (!fileObject->FsContext) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return status;
+}
+
+// Device Close handler - last reference to the handle gone; free its state
+NTSTATUS NetGuardClose(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+    if (fileObject->FsContext) {
+        FreeEventSubscriber((PEVENT_SUBSCRIBER)fileObject->FsContext);
+        fileObject->FsContext = NULL;
+    }
+
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     return STATUS_SUCCESS;
 }
 
-// Device Close handler
-NTSTATUS NetGuardClose(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+// Device Cleanup handler - last user handle closed; cancel its parked IRPs
+// and stop publishing events to it
+NTSTATUS NetGuardCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     UNREFERENCED_PARAMETER(DeviceObject);
+
+    PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+    PIRP parked;
+
+    while ((parked = IoCsqRemoveNextIrp(&g_Context.PendingIrpQueue, fileObject)) != NULL) {
+        parked->IoStatus.Status = STATUS_CANCELLED;
+        parked->IoStatus.Information = 0;
+        IoCompleteRequest(parked, IO_NO_INCREMENT);
+    }
+
+    UnmapEventSection((PEVENT_SUBSCRIBER)fileObject->FsContext);
+
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -383,74 +2216,385 @@ NTSTATUS NetGuardDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     ULONG outputLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
 
     switch (irpSp->Parameters.DeviceIoControl.IoControlCode) {
-        case IOCTL_NETGUARD_ENABLE:
+        case IOCTL_NETGUARD_ENABLE: {
+            // Without an ENABLE_REQUEST unknown apps are pended, as before
+            BOOLEAN permitUnknown = inputLength >= sizeof(ENABLE_REQUEST) &&
+                (((PENABLE_REQUEST)inputBuffer)->flags & ENABLE_FLAG_PERMIT_UNKNOWN);
+            BOOLEAN modeChanged = (permitUnknown != g_Context.PermitUnknown);
+            g_Context.PermitUnknown = permitUnknown;
             g_Context.Enabled = TRUE;
+
+            // Hand known apps to BFE; failing that the callout still decides
+            AcquireRuleLock();
+            SyncAppFilters(TRUE);
+            ReleaseRuleLock();
+
+            if (modeChanged) {
+                InterlockedIncrement(&g_Context.PendingAnswers); // Retires memoized blocks
+            }
+            if (permitUnknown) {
+                // Nobody will answer these; their reauthorizations now permit
+                CompleteAllPending();
+            }
             break;
+        }
 
         case IOCTL_NETGUARD_DISABLE:
             g_Context.Enabled = FALSE;
+
+            AcquireRuleLock();
+            SyncAppFilters(FALSE);
+            ReleaseRuleLock();
+
+            CompleteAllPending();
+            break;
+
+        case IOCTL_NETGUARD_SET_TIMEOUT:
+            if (inputLength >= sizeof(PENDING_TIMEOUT_CONFIG)) {
+                PPENDING_TIMEOUT_CONFIG config = (PPENDING_TIMEOUT_CONFIG)inputBuffer;
+                g_Context.PendingTimeout = (LONGLONG)max(config->timeoutMs, 1000) * 10000;
+                g_Context.PendingTimeoutAllow = config->allowOnTimeout;
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_NETGUARD_SET_OVERFLOW_POLICY:
+            if (inputLength >= sizeof(PENDING_OVERFLOW_CONFIG) &&
+                ((PPENDING_OVERFLOW_CONFIG)inputBuffer)->policy <= PENDING_OVERFLOW_DROP_OLDEST) {
+                g_Context.PendingOverflowPolicy = ((PPENDING_OVERFLOW_CONFIG)inputBuffer)->policy;
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_NETGUARD_SAVE_POLICY:
+            // Persist the current rules and settings for the next load
+            status = SaveBootPolicy();
             break;
 
         case IOCTL_NETGUARD_GET_PENDING: {
-            // Return pending connections to user-mode
-            KIRQL oldIrql;
-            KeAcquireSpinLock(&g_Context.PendingLock, &oldIrql);
+            // Return pending connections to user-mode. With nothing to report
+            // the IRP is parked and completed when the next connection is
+            // pended, so overlapped callers never have to poll.
+            // A query with a non-zero cursor continues a chunked read and
+            // is never parked.
+            ExpireStalePending();
+
+            if (outputLength < PENDING_MIN_OUTPUT || !outputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            UINT32 cursor = 0;
+            UINT64 afterId = 0;
+            if (inputLength >= FIELD_OFFSET(PENDING_QUERY, afterId)) {
+                PPENDING_QUERY query = (PPENDING_QUERY)inputBuffer;
+                if (query->version != PENDING_RECORD_VERSION) {
+                    status = STATUS_REVISION_MISMATCH;
+                    break;
+                }
+                cursor = query->cursor;
+                if (inputLength >= sizeof(PENDING_QUERY)) {
+                    afterId = query->afterId;
+                }
+            }
 
-            ULONG copySize = min(outputLength, g_Context.PendingCount * sizeof(PENDING_CONNECTION));
-            if (copySize > 0 && outputBuffer) {
-                RtlCopyMemory(outputBuffer, g_Context.PendingConnections, copySize);
-                bytesReturned = copySize;
+            if (cursor == 0 && NT_SUCCESS(IoCsqInsertIrpEx(&g_Context.PendingIrpQueue, Irp, NULL, &afterId))) {
+                return STATUS_PENDING;
             }
 
-            KeReleaseSpinLock(&g_Context.PendingLock, oldIrql);
+            bytesReturned = CopyPendingToBuffer(outputBuffer, outputLength, cursor, afterId);
             break;
         }
 
         case IOCTL_NETGUARD_RESPOND: {
-            // User responded to a pending connection
-            if (inputLength >= sizeof(UINT64) + sizeof(BOOLEAN)) {
-                UINT64 connId = *(PUINT64)inputBuffer;
-                BOOLEAN allowed = *((PBOOLEAN)((PUCHAR)inputBuffer + sizeof(UINT64)));
+            // User responded to one or more pending connections
+            PPENDING_RESPONSE responses = (PPENDING_RESPONSE)inputBuffer;
+            for (ULONG r = 0; r < inputLength / sizeof(PENDING_RESPONSE); r++) {
+                UINT64 connId = responses[r].connectionId;
+                BOOLEAN allowed = responses[r].allowed;
+
+                HANDLE completions[MAX_PENDING_ENDPOINTS];
+                UINT32 count = 0;
 
                 KIRQL oldIrql;
-                KeAcquireSpinLock(&g_Context.PendingLock, &oldIrql);
-
-                for (UINT32 i = 0; i < g_Context.PendingCount; i++) {
-                    if (g_Context.PendingConnections[i].connectionId == connId) {
-                        g_Context.PendingConnections[i].responded = TRUE;
-                        g_Context.PendingConnections[i].allowed = allowed;
-
-                        // Remove from pending list
-                        if (i < g_Context.PendingCount - 1) {
-                            RtlMoveMemory(&g_Context.PendingConnections[i],
-                                         &g_Context.PendingConnections[i + 1],
-                                         (g_Context.PendingCount - i - 1) * sizeof(PENDING_CONNECTION));
-                        }
-                        g_Context.PendingCount--;
-                        break;
-                    }
+                AcquirePendingLock(&oldIrql);
+
+                PPENDING_ENTRY entry = g_Context.PendingConnections[PENDING_SLOT(connId)];
+                if (entry && entry->info.connectionId == connId && !entry->info.responded) {
+                    // The entry stays until its reauthorizations pick up the verdict
+                    count = ResolvePendingEntry(entry, allowed, completions);
                 }
 
-                KeReleaseSpinLock(&g_Context.PendingLock, oldIrql);
+                ReleasePendingLock(oldIrql);
+
+                // Releases the original connects, which are reauthorized immediately
+                for (UINT32 i = 0; i < count; i++) {
+                    FwpsCompleteOperation0(completions[i], NULL);
+                }
             }
             break;
         }
 
         case IOCTL_NETGUARD_ADD_ALLOWED: {
-            // Add app to allowed/blocked list
+            // Add app to allowed/blocked list, or change its verdict; an
+            // existing rule keeps its rate limit
             if (inputLength >= sizeof(ALLOWED_APP)) {
                 PALLOWED_APP newApp = (PALLOWED_APP)inputBuffer;
+                newApp->processPath[MAX_PATH_LENGTH - 1] = L'\0';
+                SIZE_T pathLength = wcsnlen(newApp->processPath, MAX_PATH_LENGTH);
+                UINT64 pathHash = HashProcessPath(newApp->processPath, pathLength);
 
-                KIRQL oldIrql;
-                KeAcquireSpinLock(&g_Context.AllowedLock, &oldIrql);
+                AcquireRuleLock();
+
+                status = SyncStandbyRules();
+                if (NT_SUCCESS(status)) {
+                    status = UpsertAllowedApp(StandbyRules(), newApp->processPath, pathLength,
+                                              newApp->blocked, RATE_LIMIT_KEEP, pathHash);
+                }
+                if (NT_SUCCESS(status)) {
+                    // If the replay cannot allocate, the next write resyncs it
+                    if (!NT_SUCCESS(UpsertAllowedApp(PublishRules(StandbyRules()), newApp->processPath,
+                                                     pathLength, newApp->blocked, RATE_LIMIT_KEEP, pathHash))) {
+                        g_Context.RulesDiverged = TRUE;
+                    }
+                    RefreshAppRates();
+
+                    // Replace the rule's filter; the callout covers it if this fails
+                    if (g_Context.AppFiltersInstalled) {
+                        UINT32 slot = FindAllowedApp(g_Context.ActiveRules, newApp->processPath,
+                                                     pathLength, pathHash);
+                        UINT32 appIndex = g_Context.ActiveRules->Slots[slot].appIndex;
+                        RemoveAppFilter(appIndex);
+                        AddAppFilter(appIndex);
+                    }
+                }
+
+                ReleaseRuleLock();
+            }
+            break;
+        }
+
+        case IOCTL_NETGUARD_REMOVE_ALLOWED: {
+            // Remove app from list; its next connect is treated as unknown
+            if (inputLength >= sizeof(ALLOWED_APP)) {
+                PALLOWED_APP app = (PALLOWED_APP)inputBuffer;
+                app->processPath[MAX_PATH_LENGTH - 1] = L'\0';
+                SIZE_T pathLength = wcsnlen(app->processPath, MAX_PATH_LENGTH);
+                UINT64 pathHash = HashProcessPath(app->processPath, pathLength);
+
+                AcquireRuleLock();
+
+                status = SyncStandbyRules();
+                if (!NT_SUCCESS(status)) {
+                    ReleaseRuleLock();
+                    break;
+                }
+
+                // Drop the rule's filter first, following the record RemoveAllowedApp
+                // moves into the freed index
+                UINT32 slot = FindAllowedApp(g_Context.ActiveRules, app->processPath, pathLength, pathHash);
+                if (slot != RULE_SLOT_EMPTY) {
+                    UINT32 appIndex = g_Context.ActiveRules->Slots[slot].appIndex;
+                    UINT32 last = g_Context.ActiveRules->Count - 1;
+                    RemoveAppFilter(appIndex);
+                    if (last < g_Context.AppFilterCapacity) {
+                        g_Context.AppFilterIds[appIndex] = g_Context.AppFilterIds[last];
+                        g_Context.AppFilterIds[last] = 0;
+                    }
+                }
+
+                status = RemoveAllowedApp(StandbyRules(), app->processPath, pathLength, pathHash);
+                if (NT_SUCCESS(status)) {
+                    RemoveAllowedApp(PublishRules(StandbyRules()), app->processPath, pathLength, pathHash);
+                    RefreshAppRates();
+                }
+
+                ReleaseRuleLock();
+            }
+            break;
+        }
+
+        case IOCTL_NETGUARD_SET_RULES: {
+            // Replace or merge a whole rule set in one swap
+            AcquireRuleLock();
+
+            PRULE_TABLE standby = StandbyRules();
+            status = SyncStandbyRules();
+            if (NT_SUCCESS(status)) {
+                status = ApplyRuleSet(standby, inputBuffer, inputLength);
+            }
+            if (NT_SUCCESS(status)) {
+                // Rebuild the filters around the swap. Between the two steps
+                // the callout enforces the rules on its own.
+                BOOLEAN refilter = g_Context.AppFiltersInstalled;
+                SyncAppFilters(FALSE);
+
+                PRULE_TABLE previous = PublishRules(standby);
+                if (!NT_SUCCESS(CopyRuleTable(previous, standby))) {
+                    g_Context.RulesDiverged = TRUE;
+                }
+                RefreshAppRates();
+
+                if (refilter) {
+                    SyncAppFilters(TRUE);
+                }
+            } else {
+                // Roll the standby copy back so both copies stay identical,
+                // or have the next write do it if that cannot allocate
+                if (!NT_SUCCESS(CopyRuleTable(standby, g_Context.ActiveRules))) {
+                    g_Context.RulesDiverged = TRUE;
+                }
+            }
 
-                if (g_Context.AllowedCount < MAX_ALLOWED_APPS) {
-                    RtlCopyMemory(&g_Context.AllowedApps[g_Context.AllowedCount], newApp, sizeof(ALLOWED_APP));
-                    g_Context.AllowedCount++;
+            ReleaseRuleLock();
+            break;
+        }
+
+        case IOCTL_NETGUARD_GET_STATS: {
+            // Callers built against an older NETGUARD_STATS get its prefix
+            if (outputLength < NETGUARD_STATS_V3_SIZE || !outputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            // Too big for the stack with the histograms
+            PNETGUARD_STATS stats = (PNETGUARD_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                sizeof(NETGUARD_STATS), NETGUARD_POOL_TAG);
+            if (!stats) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            ULONG statsLength = min(outputLength, (ULONG)sizeof(NETGUARD_STATS));
+            stats->version = NETGUARD_STATS_VERSION;
+            stats->size = (UINT16)statsLength;
+            stats->latencyBuckets = LATENCY_BUCKETS;
+
+            for (ULONG i = 0; i < g_Context.CpuStatsCount; i++) {
+                PCPU_STATS cpu = &g_Context.CpuStats[i];
+                stats->totalConnections += ReadNoFence64(&cpu->TotalConnections);
+                stats->allowedConnections += ReadNoFence64(&cpu->AllowedConnections);
+                stats->blockedConnections += ReadNoFence64(&cpu->BlockedConnections);
+                stats->pendedConnections += ReadNoFence64(&cpu->PendedConnections);
+                stats->timedOutConnections += ReadNoFence64(&cpu->TimedOutConnections);
+                stats->droppedConnections += ReadNoFence64(&cpu->DroppedConnections);
+                stats->pidCacheHits += ReadNoFence64(&cpu->PidCacheHits);
+                stats->pidCacheMisses += ReadNoFence64(&cpu->PidCacheMisses);
+                stats->addressBlockedConnections += ReadNoFence64(&cpu->AddressBlockedConnections);
+                stats->evictedEntries += ReadNoFence64(&cpu->EvictedEntries);
+                stats->endpointMemoHits += ReadNoFence64(&cpu->EndpointMemoHits);
+                stats->rateHeldSends += ReadNoFence64(&cpu->RateHeldSends);
+                stats->rateDeferredReceives += ReadNoFence64(&cpu->RateDeferredReceives);
+                stats->rateDroppedDatagrams += ReadNoFence64(&cpu->RateDroppedDatagrams);
+                stats->rateDroppedBytes += ReadNoFence64(&cpu->RateDroppedBytes);
+                for (ULONG bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                    stats->classifyLatency[bucket] += ReadNoFence64(&cpu->ClassifyLatency[bucket]);
+                    stats->pendingLockHold[bucket] += ReadNoFence64(&cpu->PendingLockHold[bucket]);
+                    stats->ruleLockHold[bucket] += ReadNoFence64(&cpu->RuleLockHold[bucket]);
                 }
+            }
+
+            KIRQL oldIrql;
+            AcquirePendingLock(&oldIrql);
+            stats->pendingCount = g_Context.PendingCount;
+            stats->pendingHighWater = g_Context.PendingHighWater;
+            ReleasePendingLock(oldIrql);
+            stats->rateHeldBytes = (UINT64)ReadNoFence64(&g_Context.RateHeldBytes);
+
+            RtlCopyMemory(outputBuffer, stats, statsLength);
+            ExFreePoolWithTag(stats, NETGUARD_POOL_TAG);
+            bytesReturned = statsLength;
+            break;
+        }
+
+        case IOCTL_NETGUARD_MAP_EVENTS: {
+            // Map the connection event rings into the caller
+            if (outputLength < sizeof(EVENT_MAP_RESULT) || !outputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            EVENT_MAP_REQUEST request = {0};
+            if (inputLength >= sizeof(EVENT_MAP_REQUEST)) {
+                request = *(PEVENT_MAP_REQUEST)inputBuffer;
+            }
+
+            status = MapEventSection((PEVENT_SUBSCRIBER)irpSp->FileObject->FsContext, &request,
+                                     (PEVENT_MAP_RESULT)outputBuffer);
+            if (NT_SUCCESS(status)) {
+                bytesReturned = sizeof(EVENT_MAP_RESULT);
+            }
+            break;
+        }
+
+        case IOCTL_NETGUARD_SET_EVENT_FILTER: {
+            // Choose which events this handle's rings receive
+            PEVENT_FILTER eventFilter;
+            if (!inputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = BuildEventFilter((const UCHAR*)inputBuffer, inputLength, &eventFilter);
+            if (NT_SUCCESS(status)) {
+                SetEventFilter((PEVENT_SUBSCRIBER)irpSp->FileObject->FsContext, eventFilter);
+            }
+            break;
+        }
+
+        case IOCTL_NETGUARD_SET_ADDRESS_RULES: {
+            // Stage a chunk of remote address prefixes, and build and swap
+            // them in on ADDRESS_RULE_FLAG_COMMIT
+            if (inputLength < sizeof(ADDRESS_RULE_HEADER) || !inputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            PADDRESS_RULE_HEADER header = (PADDRESS_RULE_HEADER)inputBuffer;
+            if (header->version != ADDRESS_RULE_VERSION) {
+                status = STATUS_REVISION_MISMATCH;
+                break;
+            }
+
+            ExAcquireFastMutex(&g_Context.AddressStagingLock);
+            if (header->flags & ADDRESS_RULE_FLAG_BEGIN) {
+                ClearAddressStaging();
+            }
+            status = StageAddressRules(header, inputLength);
+            if (!NT_SUCCESS(status)) {
+                // A partial set must never be committed
+                ClearAddressStaging();
+            } else if (header->flags & ADDRESS_RULE_FLAG_COMMIT) {
+                status = CommitAddressRules();
+            }
+            ExReleaseFastMutex(&g_Context.AddressStagingLock);
+            break;
+        }
+
+        case IOCTL_NETGUARD_SET_PATTERN_RULES: {
+            // Replace the pattern rules with a newly compiled set
+            PPATTERN_TABLE patterns;
+            if (!inputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = BuildPatternTable((const UCHAR*)inputBuffer, inputLength, &patterns);
+            if (NT_SUCCESS(status)) {
+                CommitPatternRules(patterns);
+            }
+            break;
+        }
 
-                KeReleaseSpinLock(&g_Context.AllowedLock, oldIrql);
+        case IOCTL_NETGUARD_GET_TRAFFIC: {
+            // Per-app byte counts since the previous call
+            if (outputLength < TRAFFIC_MIN_OUTPUT || !outputBuffer) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
             }
+
+            bytesReturned = CopyTrafficToBuffer(outputBuffer, outputLength);
             break;
         }
 
@@ -465,14 +2609,110 @@ NTSTATUS NetGuardDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     return status;
 }
 
+// Helper: Allocate the per-processor statistics and traffic blocks. Sized
+// for every processor that could ever be added, since
+// KeGetCurrentProcessorIndex can return indexes beyond the processors active
+// at load time.
+NTSTATUS InitializeStatistics(void) {
+    g_Context.CpuStatsCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    g_Context.CpuStats = (PCPU_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        g_Context.CpuStatsCount * sizeof(CPU_STATS), NETGUARD_POOL_TAG);
+    if (!g_Context.CpuStats) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    g_Context.LatencyFrequency = frequency.QuadPart;
+    g_Context.LatencyNsPerTick = (1000000000ULL << 32) / (ULONG64)frequency.QuadPart;
+
+    g_Context.TrafficApps = (PTRAFFIC_APP)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        TRAFFIC_APP_SLOTS * sizeof(TRAFFIC_APP), NETGUARD_POOL_TAG);
+    g_Context.CpuAppBytes = (PAPP_BYTES)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        (SIZE_T)g_Context.CpuStatsCount * TRAFFIC_APP_SLOTS * sizeof(APP_BYTES), NETGUARD_POOL_TAG);
+    g_Context.TrafficReported = (PAPP_BYTES)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        TRAFFIC_APP_SLOTS * sizeof(APP_BYTES), NETGUARD_POOL_TAG);
+    if (!g_Context.TrafficApps || !g_Context.CpuAppBytes || !g_Context.TrafficReported) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return STATUS_SUCCESS;
+}
+
+// Helper: Free the rule tables, pending entry lookaside list, boot policy
+// key path, address and pattern rules, DNS cache, rate limits, statistics,
+// traffic blocks and event section. Only called once no classify can be running and no
+// handle is open.
+void FreeRuleTables(void) {
+    for (int i = 0; i < 2; i++) {
+        if (g_Context.RuleTables[i]) {
+            FreeRuleTable(g_Context.RuleTables[i]);
+            ExFreePoolWithTag(g_Context.RuleTables[i], NETGUARD_POOL_TAG);
+            g_Context.RuleTables[i] = NULL;
+        }
+    }
+    g_Context.ActiveRules = NULL;
+    if (g_Context.RulePathLookasideReady) {
+        ExDeleteLookasideListEx(&g_Context.RulePathLookaside);
+        g_Context.RulePathLookasideReady = FALSE;
+    }
+
+    if (g_Context.AppFilterIds) {
+        ExFreePoolWithTag(g_Context.AppFilterIds, NETGUARD_POOL_TAG);
+        g_Context.AppFilterIds = NULL;
+        g_Context.AppFilterCapacity = 0;
+    }
+    DeletePendingQueue();
+    FreeBootPolicy();
+
+    if (g_Context.GraceDpcs) {
+        ExFreePoolWithTag(g_Context.GraceDpcs, NETGUARD_POOL_TAG);
+        g_Context.GraceDpcs = NULL;
+    }
+
+    if (g_Context.CpuStats) {
+        ExFreePoolWithTag(g_Context.CpuStats, NETGUARD_POOL_TAG);
+        g_Context.CpuStats = NULL;
+    }
+    if (g_Context.ActiveAddressRules) {
+        ExFreePoolWithTag(g_Context.ActiveAddressRules, NETGUARD_POOL_TAG);
+        g_Context.ActiveAddressRules = NULL;
+    }
+    ClearAddressStaging();
+    if (g_Context.ActivePatterns) {
+        ExFreePoolWithTag(g_Context.ActivePatterns, NETGUARD_POOL_TAG);
+        g_Context.ActivePatterns = NULL;
+    }
+    FreeDnsCache();
+    FreeRateLimits();
+
+    if (g_Context.TrafficApps) {
+        ExFreePoolWithTag(g_Context.TrafficApps, NETGUARD_POOL_TAG);
+        g_Context.TrafficApps = NULL;
+    }
+    if (g_Context.CpuAppBytes) {
+        ExFreePoolWithTag(g_Context.CpuAppBytes, NETGUARD_POOL_TAG);
+        g_Context.CpuAppBytes = NULL;
+    }
+    if (g_Context.TrafficReported) {
+        ExFreePoolWithTag(g_Context.TrafficReported, NETGUARD_POOL_TAG);
+        g_Context.TrafficReported = NULL;
+    }
+}
+
 // Driver unload
 void DriverUnload(PDRIVER_OBJECT DriverObject) {
     UNICODE_STRING symLink;
 
-    // Disable filtering
+    // Disable filtering and release anything still pended
     g_Context.Enabled = FALSE;
+    StopPendingSweeper();
+    CompleteAllPending();
 
-    // Unregister WFP
+    // Unregister WFP; once unsubscribed no BFE callback can register again
+    if (g_Context.BfeStateHandle) {
+        FwpmBfeStateUnsubscribeChanges0(g_Context.BfeStateHandle);
+        g_Context.BfeStateHandle = NULL;
+    }
     UnregisterWfpCallout();
 
     // Delete symbolic link and device
@@ -482,26 +2722,54 @@ void DriverUnload(PDRIVER_OBJECT DriverObject) {
     if (g_Context.DeviceObject) {
         IoDeleteDevice(g_Context.DeviceObject);
     }
+
+    if (g_Context.PidCacheEnabled) {
+        PsSetCreateProcessNotifyRoutineEx(NetGuardProcessNotify, TRUE);
+        g_Context.PidCacheEnabled = FALSE;
+    }
+
+    FreeRuleTables();
+    TraceLoggingUnregister(g_NetGuardTraceProvider);
 }
 
 // Driver entry point
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath) {
-    UNREFERENCED_PARAMETER(RegistryPath);
-
     NTSTATUS status;
     UNICODE_STRING deviceName, symLink;
 
     // Initialize context
     RtlZeroMemory(&g_Context, sizeof(g_Context));
-    KeInitializeSpinLock(&g_Context.PendingLock);
-    KeInitializeSpinLock(&g_Context.AllowedLock);
-    KeInitializeEvent(&g_Context.PendingEvent, NotificationEvent, FALSE);
+    ExInitializeFastMutex(&g_Context.AddressStagingLock);
+    InitializeListHead(&g_Context.FlowList);
+    KeInitializeSpinLock(&g_Context.FlowLock);
+    KeInitializeSpinLock(&g_Context.TrafficLock);
+
+    status = InitializePendingQueue();
+    if (NT_SUCCESS(status)) {
+        status = InitializeRuleTables();
+    }
+    if (NT_SUCCESS(status)) {
+        status = InitializeStatistics();
+    }
+    if (NT_SUCCESS(status)) {
+        status = InitializeDnsCache();
+    }
+    if (NT_SUCCESS(status)) {
+        status = InitializeRateLimits();
+    }
+    if (!NT_SUCCESS(status)) {
+        FreeRuleTables();
+        return status;
+    }
 
-    // Create device
+    // Create device. Only SYSTEM and Administrators may open it: a handle
+    // can change the policy and read every connection the machine makes.
     RtlInitUnicodeString(&deviceName, NETGUARD_DEVICE_NAME);
-    status = IoCreateDevice(DriverObject, 0, &deviceName, FILE_DEVICE_UNKNOWN,
-                           FILE_DEVICE_SECURE_OPEN, FALSE, &g_Context.DeviceObject);
+    status = IoCreateDeviceSecure(DriverObject, 0, &deviceName, FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN, FALSE, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  &NETGUARD_DEVICE_CLASS_GUID, &g_Context.DeviceObject);
     if (!NT_SUCCESS(status)) {
+        FreeRuleTables();
         return status;
     }
 
@@ -510,22 +2778,53 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
     status = IoCreateSymbolicLink(&symLink, &deviceName);
     if (!NT_SUCCESS(status)) {
         IoDeleteDevice(g_Context.DeviceObject);
+        FreeRuleTables();
         return status;
     }
 
     // Set up dispatch routines
     DriverObject->MajorFunction[IRP_MJ_CREATE] = NetGuardCreate;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = NetGuardClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = NetGuardCleanup;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = NetGuardDeviceControl;
     DriverObject->DriverUnload = DriverUnload;
 
-    // Register WFP callout
-    status = RegisterWfpCallout();
+    // The process verdict cache depends on exit notifications; without
+    // them classify simply goes to the rule table every time
+    g_Context.PidCacheEnabled = NT_SUCCESS(PsSetCreateProcessNotifyRoutineEx(NetGuardProcessNotify, FALSE));
+
+    // Tracing is optional; without the provider every event is a no-op
+    TraceLoggingRegister(g_NetGuardTraceProvider);
+
+    // Enforce the saved policy from the first classify. Without one the
+    // driver starts empty and disabled until the service configures it.
+    LoadBootPolicy(RegistryPath);
+
+    // Register WFP callouts. BFE may not be running yet this early in boot;
+    // then they are registered from the state callback once it is, and
+    // connections pass unfiltered until then. Subscribing first means BFE
+    // cannot start unseen between the check and the subscription.
+    status = FwpmBfeStateSubscribeChanges0(g_Context.DeviceObject, NetGuardBfeStateChange, NULL,
+                                           &g_Context.BfeStateHandle);
+    if (NT_SUCCESS(status) && FwpmBfeStateGet0() == FWPM_SERVICE_RUNNING) {
+        status = StartWfp();
+    }
     if (!NT_SUCCESS(status)) {
+        if (g_Context.BfeStateHandle) {
+            FwpmBfeStateUnsubscribeChanges0(g_Context.BfeStateHandle);
+            g_Context.BfeStateHandle = NULL;
+        }
+        TraceLoggingUnregister(g_NetGuardTraceProvider);
+        if (g_Context.PidCacheEnabled) {
+            PsSetCreateProcessNotifyRoutineEx(NetGuardProcessNotify, TRUE);
+        }
         IoDeleteSymbolicLink(&symLink);
         IoDeleteDevice(g_Context.DeviceObject);
+        FreeRuleTables();
         return status;
     }
 
+    StartPendingSweeper();
+
     return STATUS_SUCCESS;
 }